@@ -20,6 +20,8 @@
 #include "datamanager.h"
 #include "convar.h"
 #include "tier0/tslist.h"
+#include "utlmap.h"
+#include "generichash.h"
 #include "vphysics_interface.h"
 #ifdef CLIENT_DLL
 	#include "posedebugger.h"
@@ -547,6 +549,529 @@ inline void CalcBonePosition( int frame, float s,
 }
 
 
+//-----------------------------------------------------------------------------
+// SIMD decode and blend. Bones are gathered four at a time into structure of
+// arrays form, one fltx4 per component, converted and blended together and
+// then scattered back into the Vector/Quaternion pose. The results match the
+// scalar code to within float rounding.
+//-----------------------------------------------------------------------------
+ConVar anim_simd( "anim_simd", "1", FCVAR_REPLICATED, "Decode and blend animation four bones at a time." );
+
+// Set by benchmarks to pick a path without touching the replicated convar, -1 when unused
+static int s_nAnimSIMDOverride = -1;
+
+void Studio_SetAnimSIMDOverride( int nOverride )
+{
+	s_nAnimSIMDOverride = nOverride;
+}
+
+static inline bool UseAnimSIMD()
+{
+	return ( s_nAnimSIMDOverride >= 0 ) ? ( s_nAnimSIMDOverride != 0 ) : anim_simd.GetBool();
+}
+
+// sin and cos of four angles. Range reduced to [-pi/2,pi/2], then a Taylor
+// series that's good to a few ulps there.
+static FORCEINLINE void AnimSinCosSIMD( fltx4 &sine, fltx4 &cosine, const fltx4 &radians )
+{
+	fltx4 fl4Pi = ReplicateX4( M_PI );
+	fltx4 fl4HalfPi = ReplicateX4( M_PI * 0.5f );
+
+	// work on |radians| and flip the sine back at the end, FloorSIMD() on SSE
+	// rounds negative numbers towards zero
+	fltx4 bNegative = CmpLtSIMD( radians, Four_Zeros );
+	fltx4 x = MaxSIMD( radians, NegSIMD( radians ) );
+
+	// wrap into [-pi,pi]
+	fltx4 fl4Turns = FloorSIMD( MaddSIMD( x, ReplicateX4( 0.5f / M_PI ), Four_PointFives ) );
+	x = SubSIMD( x, MulSIMD( fl4Turns, ReplicateX4( 2.0f * M_PI ) ) );
+
+	// fold into [-pi/2,pi/2], which keeps the sine and flips the cosine
+	fltx4 bHigh = CmpGtSIMD( x, fl4HalfPi );
+	fltx4 bLow = CmpLtSIMD( x, NegSIMD( fl4HalfPi ) );
+	x = MaskedAssign( bHigh, SubSIMD( fl4Pi, x ), x );
+	x = MaskedAssign( bLow, SubSIMD( NegSIMD( fl4Pi ), x ), x );
+	fltx4 fl4CosSign = MaskedAssign( OrSIMD( bHigh, bLow ), NegSIMD( Four_Ones ), Four_Ones );
+
+	fltx4 x2 = MulSIMD( x, x );
+
+	fltx4 s = ReplicateX4( -1.0f / 39916800.0f );
+	s = MaddSIMD( s, x2, ReplicateX4( 1.0f / 362880.0f ) );
+	s = MaddSIMD( s, x2, ReplicateX4( -1.0f / 5040.0f ) );
+	s = MaddSIMD( s, x2, ReplicateX4( 1.0f / 120.0f ) );
+	s = MaddSIMD( s, x2, ReplicateX4( -1.0f / 6.0f ) );
+	s = MaddSIMD( s, x2, Four_Ones );
+	s = MulSIMD( s, x );
+	sine = MaskedAssign( bNegative, NegSIMD( s ), s );
+
+	fltx4 c = ReplicateX4( 1.0f / 479001600.0f );
+	c = MaddSIMD( c, x2, ReplicateX4( -1.0f / 3628800.0f ) );
+	c = MaddSIMD( c, x2, ReplicateX4( 1.0f / 40320.0f ) );
+	c = MaddSIMD( c, x2, ReplicateX4( -1.0f / 720.0f ) );
+	c = MaddSIMD( c, x2, ReplicateX4( 1.0f / 24.0f ) );
+	c = MaddSIMD( c, x2, ReplicateX4( -0.5f ) );
+	c = MaddSIMD( c, x2, Four_Ones );
+	cosine = MulSIMD( c, fl4CosSign );
+}
+
+
+//-----------------------------------------------------------------------------
+// Four quaternions in structure of arrays form
+//-----------------------------------------------------------------------------
+class ALIGN16 FourQuaternions
+{
+public:
+	fltx4 x, y, z, w;
+
+	FORCEINLINE void SetLane( int i, const Quaternion &q )
+	{
+		SubFloat( x, i ) = q.x;
+		SubFloat( y, i ) = q.y;
+		SubFloat( z, i ) = q.z;
+		SubFloat( w, i ) = q.w;
+	}
+
+	FORCEINLINE Quaternion Lane( int i ) const
+	{
+		return Quaternion( SubFloat( x, i ), SubFloat( y, i ), SubFloat( z, i ), SubFloat( w, i ) );
+	}
+
+	FORCEINLINE fltx4 Dot( const FourQuaternions &b ) const
+	{
+		return MaddSIMD( x, b.x, MaddSIMD( y, b.y, MaddSIMD( z, b.z, MulSIMD( w, b.w ) ) ) );
+	}
+
+	// lanes set in mask take the value from a
+	FORCEINLINE void Select( const fltx4 &mask, const FourQuaternions &a )
+	{
+		x = MaskedAssign( mask, a.x, x );
+		y = MaskedAssign( mask, a.y, y );
+		z = MaskedAssign( mask, a.z, z );
+		w = MaskedAssign( mask, a.w, w );
+	}
+
+	FORCEINLINE void NegateMasked( const fltx4 &mask )
+	{
+		x = MaskedAssign( mask, NegSIMD( x ), x );
+		y = MaskedAssign( mask, NegSIMD( y ), y );
+		z = MaskedAssign( mask, NegSIMD( z ), z );
+		w = MaskedAssign( mask, NegSIMD( w ), w );
+	}
+
+	// Lanes QuaternionAlign() would flip to bring this within 180 degrees of p.
+	// Same test as QuaternionAlign() rather than the sign of the dot product,
+	// so the two agree on quaternions that are nearly 90 degrees apart.
+	FORCEINLINE fltx4 IsBackwards( const FourQuaternions &p ) const
+	{
+		fltx4 d, a, b;
+		d = SubSIMD( p.x, x );	a = MulSIMD( d, d );
+		d = SubSIMD( p.y, y );	a = MaddSIMD( d, d, a );
+		d = SubSIMD( p.z, z );	a = MaddSIMD( d, d, a );
+		d = SubSIMD( p.w, w );	a = MaddSIMD( d, d, a );
+		d = AddSIMD( p.x, x );	b = MulSIMD( d, d );
+		d = AddSIMD( p.y, y );	b = MaddSIMD( d, d, b );
+		d = AddSIMD( p.z, z );	b = MaddSIMD( d, d, b );
+		d = AddSIMD( p.w, w );	b = MaddSIMD( d, d, b );
+		return CmpGtSIMD( a, b );
+	}
+
+	// QuaternionAlign() with p
+	FORCEINLINE void Align( const FourQuaternions &p )
+	{
+		NegateMasked( IsBackwards( p ) );
+	}
+
+	// QuaternionAlign() with p, for the lanes set in mask
+	FORCEINLINE void AlignMasked( const FourQuaternions &p, const fltx4 &mask )
+	{
+		NegateMasked( AndSIMD( mask, IsBackwards( p ) ) );
+	}
+
+	// this = a * sa + b * sb
+	FORCEINLINE void Lerp( const FourQuaternions &a, const fltx4 &sa, const FourQuaternions &b, const fltx4 &sb )
+	{
+		x = MaddSIMD( a.x, sa, MulSIMD( b.x, sb ) );
+		y = MaddSIMD( a.y, sa, MulSIMD( b.y, sb ) );
+		z = MaddSIMD( a.z, sa, MulSIMD( b.z, sb ) );
+		w = MaddSIMD( a.w, sa, MulSIMD( b.w, sb ) );
+	}
+
+	FORCEINLINE void Normalize()
+	{
+		// the floor only keeps a zero quaternion zero, like QuaternionNormalize()
+		fltx4 fl4InvLength = ReciprocalSqrtSIMD( MaxSIMD( Dot( *this ), ReplicateX4( 1e-30f ) ) );
+		x = MulSIMD( x, fl4InvLength );
+		y = MulSIMD( y, fl4InvLength );
+		z = MulSIMD( z, fl4InvLength );
+		w = MulSIMD( w, fl4InvLength );
+	}
+
+	// AngleQuaternion() for four RadianEulers
+	FORCEINLINE void FromAngles( const FourVectors &angles )
+	{
+		fltx4 sr, cr, sp, cp, sy, cy;
+		AnimSinCosSIMD( sr, cr, MulSIMD( angles.x, Four_PointFives ) );
+		AnimSinCosSIMD( sp, cp, MulSIMD( angles.y, Four_PointFives ) );
+		AnimSinCosSIMD( sy, cy, MulSIMD( angles.z, Four_PointFives ) );
+
+		fltx4 srXcp = MulSIMD( sr, cp ), crXsp = MulSIMD( cr, sp );
+		x = SubSIMD( MulSIMD( srXcp, cy ), MulSIMD( crXsp, sy ) );
+		y = MaddSIMD( crXsp, cy, MulSIMD( srXcp, sy ) );
+
+		fltx4 crXcp = MulSIMD( cr, cp ), srXsp = MulSIMD( sr, sp );
+		z = SubSIMD( MulSIMD( crXcp, sy ), MulSIMD( srXsp, cy ) );
+		w = MaddSIMD( crXcp, cy, MulSIMD( srXsp, sy ) );
+	}
+
+	// Writes the first nCount lanes out
+	FORCEINLINE void Store( Quaternion * const *ppDest, int nCount ) const
+	{
+		fltx4 lanes[4] = { x, y, z, w };
+		TransposeSIMD( lanes[0], lanes[1], lanes[2], lanes[3] );
+		for ( int i = 0; i < nCount; i++ )
+		{
+			StoreUnalignedSIMD( ppDest[i]->Base(), lanes[i] );
+		}
+	}
+};
+
+
+//-----------------------------------------------------------------------------
+// Decodes animated bones four at a time. The RLE streams are still walked a
+// channel at a time, straight into the lanes, but the euler to quaternion
+// conversion, the frame blend, the alignment and the position blend run four
+// wide. Raw and constant channels are written right away.
+//-----------------------------------------------------------------------------
+class CAnimDecodeBatch
+{
+public:
+	CAnimDecodeBatch( int frame, float s );
+
+	// Same as CalcBoneQuaternion() and CalcBonePosition(), except animated
+	// channels aren't written until four are queued or Flush() is called
+	void	AddBone( const mstudiobone_t *pBone, const mstudiolinearbone_t *pLinearBones, const mstudioanim_t *panim, Quaternion &q, Vector &pos );
+	void	Flush();
+
+private:
+	void	AddRotation( const RadianEuler &baseRot, const Vector &baseRotScale, int iBaseFlags, const Quaternion &baseAlignment, const mstudioanim_t *panim, Quaternion &q );
+	void	AddPosition( const Vector &basePos, const Vector &baseBoneScale, const mstudioanim_t *panim, Vector &pos );
+	void	FlushRotations();
+	void	FlushPositions();
+
+	FourVectors		m_Angle1;
+	FourVectors		m_Angle2;
+	FourQuaternions	m_Alignment;
+	fltx4			m_AlignMask;
+
+	FourVectors		m_Pos1;
+	FourVectors		m_Pos2;
+	FourVectors		m_PosBase;
+
+	Quaternion		*m_pRotDest[4];
+	Vector			*m_pPosDest[4];
+	int				m_nRotations;
+	int				m_nPositions;
+
+	int				m_nFrame;
+	float			m_flS;
+	bool			m_bBlend;		// decode two frames and blend between them
+};
+
+CAnimDecodeBatch::CAnimDecodeBatch( int frame, float s )
+{
+	m_nFrame = frame;
+	m_flS = s;
+	m_bBlend = ( s > 0.001f );
+	m_nRotations = 0;
+	m_nPositions = 0;
+}
+
+void CAnimDecodeBatch::AddBone( const mstudiobone_t *pBone, const mstudiolinearbone_t *pLinearBones, const mstudioanim_t *panim, Quaternion &q, Vector &pos )
+{
+	if ( !( panim->flags & ( STUDIO_ANIM_RAWROT | STUDIO_ANIM_RAWROT2 ) ) && ( panim->flags & STUDIO_ANIM_ANIMROT ) )
+	{
+		if ( pLinearBones )
+		{
+			AddRotation( pLinearBones->rot(panim->bone), pLinearBones->rotscale(panim->bone), pLinearBones->flags(panim->bone), pLinearBones->qalignment(panim->bone), panim, q );
+		}
+		else
+		{
+			AddRotation( pBone->rot, pBone->rotscale, pBone->flags, pBone->qAlignment, panim, q );
+		}
+	}
+	else
+	{
+		CalcBoneQuaternion( m_nFrame, m_flS, pBone, pLinearBones, panim, q );
+	}
+
+	if ( !( panim->flags & STUDIO_ANIM_RAWPOS ) && ( panim->flags & STUDIO_ANIM_ANIMPOS ) )
+	{
+		if ( pLinearBones )
+		{
+			AddPosition( pLinearBones->pos(panim->bone), pLinearBones->posscale(panim->bone), panim, pos );
+		}
+		else
+		{
+			AddPosition( pBone->pos, pBone->posscale, panim, pos );
+		}
+	}
+	else
+	{
+		CalcBonePosition( m_nFrame, m_flS, pBone, pLinearBones, panim, pos );
+	}
+}
+
+void CAnimDecodeBatch::AddRotation( const RadianEuler &baseRot, const Vector &baseRotScale, int iBaseFlags, const Quaternion &baseAlignment, const mstudioanim_t *panim, Quaternion &q )
+{
+	int i = m_nRotations;
+	mstudioanim_valueptr_t *pValuesPtr = panim->pRotV();
+	bool bDelta = ( panim->flags & STUDIO_ANIM_DELTA ) != 0;
+
+	if ( m_bBlend )
+	{
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 0 ), baseRotScale.x, m_Angle1.X(i), m_Angle2.X(i) );
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 1 ), baseRotScale.y, m_Angle1.Y(i), m_Angle2.Y(i) );
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 2 ), baseRotScale.z, m_Angle1.Z(i), m_Angle2.Z(i) );
+		if ( !bDelta )
+		{
+			m_Angle2.X(i) += baseRot.x;
+			m_Angle2.Y(i) += baseRot.y;
+			m_Angle2.Z(i) += baseRot.z;
+		}
+	}
+	else
+	{
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 0 ), baseRotScale.x, m_Angle1.X(i) );
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 1 ), baseRotScale.y, m_Angle1.Y(i) );
+		ExtractAnimValue( m_nFrame, pValuesPtr->pAnimvalue( 2 ), baseRotScale.z, m_Angle1.Z(i) );
+	}
+
+	if ( !bDelta )
+	{
+		m_Angle1.X(i) += baseRot.x;
+		m_Angle1.Y(i) += baseRot.y;
+		m_Angle1.Z(i) += baseRot.z;
+	}
+
+	// align to unified bone
+	SubInt( m_AlignMask, i ) = ( !bDelta && ( iBaseFlags & BONE_FIXED_ALIGNMENT ) ) ? ~0 : 0;
+	m_Alignment.SetLane( i, baseAlignment );
+
+	m_pRotDest[i] = &q;
+	if ( ++m_nRotations == 4 )
+	{
+		FlushRotations();
+	}
+}
+
+void CAnimDecodeBatch::AddPosition( const Vector &basePos, const Vector &baseBoneScale, const mstudioanim_t *panim, Vector &pos )
+{
+	int i = m_nPositions;
+	mstudioanim_valueptr_t *pPosV = panim->pPosV();
+
+	if ( m_bBlend )
+	{
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 0 ), baseBoneScale.x, m_Pos1.X(i), m_Pos2.X(i) );
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 1 ), baseBoneScale.y, m_Pos1.Y(i), m_Pos2.Y(i) );
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 2 ), baseBoneScale.z, m_Pos1.Z(i), m_Pos2.Z(i) );
+	}
+	else
+	{
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 0 ), baseBoneScale.x, m_Pos1.X(i) );
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 1 ), baseBoneScale.y, m_Pos1.Y(i) );
+		ExtractAnimValue( m_nFrame, pPosV->pAnimvalue( 2 ), baseBoneScale.z, m_Pos1.Z(i) );
+	}
+
+	if ( panim->flags & STUDIO_ANIM_DELTA )
+	{
+		m_PosBase.X(i) = m_PosBase.Y(i) = m_PosBase.Z(i) = 0.0f;
+	}
+	else
+	{
+		m_PosBase.X(i) = basePos.x;
+		m_PosBase.Y(i) = basePos.y;
+		m_PosBase.Z(i) = basePos.z;
+	}
+
+	m_pPosDest[i] = &pos;
+	if ( ++m_nPositions == 4 )
+	{
+		FlushPositions();
+	}
+}
+
+void CAnimDecodeBatch::FlushRotations()
+{
+	// unused lanes still go through the math, keep them well formed
+	for ( int i = m_nRotations; i < 4; i++ )
+	{
+		m_Angle1.X(i) = m_Angle1.Y(i) = m_Angle1.Z(i) = 0.0f;
+		m_Angle2.X(i) = m_Angle2.Y(i) = m_Angle2.Z(i) = 0.0f;
+		SubInt( m_AlignMask, i ) = 0;
+	}
+
+	FourQuaternions q;
+	q.FromAngles( m_Angle1 );
+
+	if ( m_bBlend )
+	{
+		// QuaternionBlend() between the two frames, except where they're the same
+		fltx4 bSame = AndSIMD( AndSIMD( CmpEqSIMD( m_Angle1.x, m_Angle2.x ), CmpEqSIMD( m_Angle1.y, m_Angle2.y ) ), CmpEqSIMD( m_Angle1.z, m_Angle2.z ) );
+		if ( TestSignSIMD( bSame ) != 0xF )
+		{
+			FourQuaternions q1 = q;
+			FourQuaternions q2;
+			q2.FromAngles( m_Angle2 );
+			q2.Align( q1 );
+
+			fltx4 fl4S = ReplicateX4( m_flS );
+			q.Lerp( q1, SubSIMD( Four_Ones, fl4S ), q2, fl4S );
+			q.Normalize();
+			q.Select( bSame, q1 );
+		}
+	}
+
+	q.AlignMasked( m_Alignment, m_AlignMask );
+	q.Store( m_pRotDest, m_nRotations );
+	m_nRotations = 0;
+}
+
+void CAnimDecodeBatch::FlushPositions()
+{
+	FourVectors pos = m_Pos1;
+	if ( m_bBlend )
+	{
+		fltx4 fl4S = ReplicateX4( m_flS );
+		fltx4 fl4OneMinusS = SubSIMD( Four_Ones, fl4S );
+		pos.x = MaddSIMD( m_Pos1.x, fl4OneMinusS, MulSIMD( m_Pos2.x, fl4S ) );
+		pos.y = MaddSIMD( m_Pos1.y, fl4OneMinusS, MulSIMD( m_Pos2.y, fl4S ) );
+		pos.z = MaddSIMD( m_Pos1.z, fl4OneMinusS, MulSIMD( m_Pos2.z, fl4S ) );
+	}
+	pos += m_PosBase;
+
+	for ( int i = 0; i < m_nPositions; i++ )
+	{
+		*m_pPosDest[i] = pos.Vec( i );
+	}
+	m_nPositions = 0;
+}
+
+void CAnimDecodeBatch::Flush()
+{
+	if ( m_nRotations )
+	{
+		FlushRotations();
+	}
+	if ( m_nPositions )
+	{
+		FlushPositions();
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Blends or slerps pairs of quaternions four at a time:
+//	*pDest = QuaternionBlend( p, q, t ) or QuaternionSlerp( p, q, t ),
+// or the NoAlign versions. Inputs are copied when added, so pDest may alias
+// them, but it isn't written until four are queued or Flush() is called.
+//-----------------------------------------------------------------------------
+class CQuaternionBlendBatch
+{
+public:
+	CQuaternionBlendBatch( bool bSlerp ) : m_bSlerp( bSlerp ), m_nCount( 0 ) {}
+
+	FORCEINLINE void Add( Quaternion *pDest, const Quaternion &p, const Quaternion &q, float t, bool bAlign )
+	{
+		int i = m_nCount;
+		m_P.SetLane( i, p );
+		m_Q.SetLane( i, q );
+		SubFloat( m_T, i ) = t;
+		SubInt( m_AlignMask, i ) = bAlign ? ~0 : 0;
+		m_pDest[i] = pDest;
+		if ( ++m_nCount == 4 )
+		{
+			Flush();
+		}
+	}
+
+	void	Flush();
+
+private:
+	FourQuaternions	m_P;
+	FourQuaternions	m_Q;
+	fltx4			m_T;
+	fltx4			m_AlignMask;
+	Quaternion		*m_pDest[4];
+	bool			m_bSlerp;
+	int				m_nCount;
+};
+
+void CQuaternionBlendBatch::Flush()
+{
+	if ( !m_nCount )
+		return;
+
+	Quaternion identity( 0.0f, 0.0f, 0.0f, 1.0f );
+	for ( int i = m_nCount; i < 4; i++ )
+	{
+		m_P.SetLane( i, identity );
+		m_Q.SetLane( i, identity );
+		SubFloat( m_T, i ) = 0.0f;
+		SubInt( m_AlignMask, i ) = 0;
+	}
+
+	FourQuaternions q2 = m_Q;
+	q2.AlignMasked( m_P, m_AlignMask );
+
+	FourQuaternions result;
+	if ( !m_bSlerp )
+	{
+		result.Lerp( m_P, SubSIMD( Four_Ones, m_T ), q2, m_T );
+		result.Normalize();
+		result.Store( m_pDest, m_nCount );
+		m_nCount = 0;
+		return;
+	}
+
+	// QuaternionSlerpNoAlign(). omega is 2 asin( sqrt( (1 - cosom) / 2 ) ) rather than
+	// acos( cosom ), which holds its precision as cosom nears 1
+	fltx4 fl4Cos = m_P.Dot( q2 );
+	fltx4 fl4OneMinusCos = SubSIMD( Four_Ones, fl4Cos );
+	fltx4 fl4OnePlusCos = AddSIMD( Four_Ones, fl4Cos );
+	fltx4 fl4Epsilon = ReplicateX4( 0.000001f );
+	fltx4 bLinear = CmpLeSIMD( fl4OneMinusCos, fl4Epsilon );
+	fltx4 bOpposite = CmpLeSIMD( fl4OnePlusCos, fl4Epsilon );
+
+	fltx4 fl4Omega = ArcSinSIMD( SqrtSIMD( MulSIMD( MaxSIMD( fl4OneMinusCos, Four_Zeros ), Four_PointFives ) ) );
+	fl4Omega = AddSIMD( fl4Omega, fl4Omega );
+	fltx4 fl4SinOm = SqrtSIMD( MaxSIMD( MulSIMD( fl4OneMinusCos, fl4OnePlusCos ), Four_Zeros ) );
+	fl4SinOm = MaskedAssign( OrSIMD( bLinear, bOpposite ), Four_Ones, fl4SinOm );
+	fltx4 fl4InvSinOm = ReciprocalSIMD( fl4SinOm );
+
+	fltx4 fl4OneMinusT = SubSIMD( Four_Ones, m_T );
+	fltx4 fl4SinP, fl4SinQ, fl4Unused;
+	AnimSinCosSIMD( fl4SinP, fl4Unused, MulSIMD( fl4OneMinusT, fl4Omega ) );
+	AnimSinCosSIMD( fl4SinQ, fl4Unused, MulSIMD( m_T, fl4Omega ) );
+
+	fltx4 fl4SclP = MaskedAssign( bLinear, fl4OneMinusT, MulSIMD( fl4SinP, fl4InvSinOm ) );
+	fltx4 fl4SclQ = MaskedAssign( bLinear, m_T, MulSIMD( fl4SinQ, fl4InvSinOm ) );
+	result.Lerp( m_P, fl4SclP, q2, fl4SclQ );
+	result.Store( m_pDest, m_nCount );
+
+	// nearly opposite quaternions (only possible without alignment) take the scalar path
+	int nOpposite = TestSignSIMD( bOpposite );
+	for ( int i = 0; nOpposite && i < m_nCount; i++ )
+	{
+		if ( nOpposite & ( 1 << i ) )
+		{
+			QuaternionSlerpNoAlign( m_P.Lane( i ), q2.Lane( i ), SubFloat( m_T, i ), *m_pDest[i] );
+		}
+	}
+
+	m_nCount = 0;
+}
+
+
 
 void SetupSingleBoneMatrix( 
 	CStudioHdr *pOwnerHdr, 
@@ -755,6 +1280,9 @@ static void CalcZeroframeData( const CStudioHdr *pStudioHdr, const studiohdr_t *
 
 	int i, j;
 
+	CQuaternionBlendBatch batch( false );
+	CQuaternionBlendBatch *pBatch = UseAnimSIMD() ? &batch : NULL;
+
 	// Msg("zeroframe %s\n", animdesc.pszName() );
 	if (animdesc.zeroframecount == 1)
 	{
@@ -780,8 +1308,15 @@ static void CalcZeroframeData( const CStudioHdr *pStudioHdr, const studiohdr_t *
 				if ((i >= 0) && (pStudioHdr->boneFlags(i) & boneMask))
 				{
 					Quaternion q0 = *(Quaternion64 *)pData;
-					QuaternionBlend( q[i], q0, flWeight, q[i] );
-					Assert( q[i].IsValid() );
+					if ( pBatch )
+					{
+						pBatch->Add( &q[i], q[i], q0, flWeight, true );
+					}
+					else
+					{
+						QuaternionBlend( q[i], q0, flWeight, q[i] );
+						Assert( q[i].IsValid() );
+					}
 				}
 				pData += sizeof( Quaternion64 );
 			}
@@ -839,17 +1374,31 @@ static void CalcZeroframeData( const CStudioHdr *pStudioHdr, const studiohdr_t *
 					{
 						Quaternion q3;
 						Hermite_Spline( q0, q1, q2, s1, q3 );
-						QuaternionBlend( q[i], q3, flWeight, q[i] );
+						if ( pBatch )
+						{
+							pBatch->Add( &q[i], q[i], q3, flWeight, true );
+						}
+						else
+						{
+							QuaternionBlend( q[i], q3, flWeight, q[i] );
+						}
 					}
-					Assert( q[i].IsValid() );
+					Assert( pBatch || q[i].IsValid() );
 				}
 				pData += sizeof( Quaternion64 ) * animdesc.zeroframecount;
 			}
 		}
 	}
+
+	if ( pBatch )
+	{
+		pBatch->Flush();
+	}
 }
 
 
+// counts decodes that had to fall back to zero frame data while the animation streams in
+static CThreadLocalInt<> g_nAnimStandInDecodes;
 
 //-----------------------------------------------------------------------------
 // Purpose: Find and decode a sub-frame of animation, remapping the skeleton bone indexes
@@ -893,6 +1442,10 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 	int iLocalFrame = iFrame;
 	float flStall;
 	panim = animdesc.pAnim( &iLocalFrame, flStall );
+	if ( !panim || flStall > 0.0f )
+	{
+		g_nAnimStandInDecodes++;
+	}
 
 	float *pweight = seqdesc.pBoneweight( 0 );
 	pbone = pStudioHdr->pBone( 0 );
@@ -933,6 +1486,9 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		return;
 	}
 
+	CAnimDecodeBatch batch( iLocalFrame, s );
+	CAnimDecodeBatch *pBatch = UseAnimSIMD() ? &batch : NULL;
+
 	// FIXME: change encoding so that bone -1 is never the case
 	while (panim && panim->bone < 255)
 	{
@@ -943,8 +1499,15 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 
 			if (k >= 0 && pweight[k] > 0.0f)
 			{
-				CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
-				CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				if ( pBatch )
+				{
+					pBatch->AddBone( &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j], pos[j] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, q[j] );
+					CalcBonePosition  ( iLocalFrame, s, &pAnimbone[panim->bone], pAnimLinearBones, panim, pos[j] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 #endif
@@ -953,6 +1516,11 @@ static void CalcVirtualAnimation( virtualmodel_t *pVModel, const CStudioHdr *pSt
 		panim = panim->pNext();
 	}
 
+	if ( pBatch )
+	{
+		pBatch->Flush();
+	}
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
@@ -1027,6 +1595,10 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 	int iLocalFrame = iFrame;
 	float flStall;
 	mstudioanim_t *panim = animdesc.pAnim( &iLocalFrame, flStall );
+	if ( !panim || flStall > 0.0f )
+	{
+		g_nAnimStandInDecodes++;
+	}
 
 	float *pweight = seqdesc.pBoneweight( 0 );
 
@@ -1057,6 +1629,9 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		return;
 	}
 
+	CAnimDecodeBatch batch( iLocalFrame, s );
+	CAnimDecodeBatch *pBatch = UseAnimSIMD() ? &batch : NULL;
+
 	// BUGBUG: the sequence, the anim, and the model can have all different bone mappings.
 	for (i = 0; i < pStudioHdr->numbones(); i++, pbone++, pweight++)
 	{
@@ -1064,8 +1639,15 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		{
 			if (*pweight > 0 && (pStudioHdr->boneFlags(i) & boneMask))
 			{
-				CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
-				CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				if ( pBatch )
+				{
+					pBatch->AddBone( pbone, pLinearBones, panim, q[i], pos[i] );
+				}
+				else
+				{
+					CalcBoneQuaternion( iLocalFrame, s, pbone, pLinearBones, panim, q[i] );
+					CalcBonePosition  ( iLocalFrame, s, pbone, pLinearBones, panim, pos[i] );
+				}
 #ifdef STUDIO_ENABLE_PERF_COUNTERS
 				pStudioHdr->m_nPerfAnimatedBones++;
 				pStudioHdr->m_nPerfUsedBones++;
@@ -1091,6 +1673,11 @@ static void CalcAnimation( const CStudioHdr *pStudioHdr,	Vector *pos, Quaternion
 		}
 	}
 
+	if ( pBatch )
+	{
+		pBatch->Flush();
+	}
+
 	// cross fade in previous zeroframe data
 	if (flStall > 0.0f)
 	{
@@ -1442,6 +2029,27 @@ void SlerpBones(
 		return;
 	}
 
+	if ( UseAnimSIMD() )
+	{
+		CQuaternionBlendBatch batch( true );
+		for (i = 0; i < nBoneCount; i++)
+		{
+			s2 = pS2[i];
+			if ( s2 <= 0.0f )
+				continue;
+
+			s1 = 1.0 - s2;
+
+			batch.Add( &q1[i], q2[i], q1[i], s1, !(pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT) );
+
+			pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
+			pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
+			pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
+		}
+		batch.Flush();
+		return;
+	}
+
 	QuaternionAligned q3;
 	for (i = 0; i < nBoneCount; i++)
 	{
@@ -1553,6 +2161,9 @@ void BlendBones(
 	float s2 = s;
 	float s1 = 1.0 - s2;
 
+	CQuaternionBlendBatch batch( false );
+	CQuaternionBlendBatch *pBatch = UseAnimSIMD() ? &batch : NULL;
+
 	for (i = 0; i < pStudioHdr->numbones(); i++)
 	{
 		// skip unused bones
@@ -1572,23 +2183,35 @@ void BlendBones(
 
 		if (j >= 0 && seqdesc.weight( j ) > 0.0)
 		{
-			if (pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT)
+			if ( pBatch )
 			{
-				QuaternionBlendNoAlign( q2[i], q1[i], s1, q3 );
+				pBatch->Add( &q1[i], q2[i], q1[i], s1, !(pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT) );
 			}
 			else
 			{
-				QuaternionBlend( q2[i], q1[i], s1, q3 );
+				if (pStudioHdr->boneFlags(i) & BONE_FIXED_ALIGNMENT)
+				{
+					QuaternionBlendNoAlign( q2[i], q1[i], s1, q3 );
+				}
+				else
+				{
+					QuaternionBlend( q2[i], q1[i], s1, q3 );
+				}
+				q1[i][0] = q3[0];
+				q1[i][1] = q3[1];
+				q1[i][2] = q3[2];
+				q1[i][3] = q3[3];
 			}
-			q1[i][0] = q3[0];
-			q1[i][1] = q3[1];
-			q1[i][2] = q3[2];
-			q1[i][3] = q3[3];
 			pos1[i][0] = pos1[i][0] * s1 + pos2[i][0] * s2;
 			pos1[i][1] = pos1[i][1] * s1 + pos2[i][1] * s2;
 			pos1[i][2] = pos1[i][2] * s1 + pos2[i][2] * s2;
 		}
 	}
+
+	if ( pBatch )
+	{
+		pBatch->Flush();
+	}
 }
 
 
@@ -1878,18 +2501,21 @@ void Calc3WayBlendIndices( int i0, int i1, float s0, float s1, const mstudioseqd
 
 
 //-----------------------------------------------------------------------------
-// Purpose: calculate a pose for a single sequence
+// Purpose: decode and blend the (up to) four animations of a sequence's blend
+//			grid, once the pose parameters have been resolved to cells
 //-----------------------------------------------------------------------------
-bool CalcPoseSingle(
+static bool CalcPoseSingleDecode(
 	const CStudioHdr *pStudioHdr,
 	Vector pos[], 
 	Quaternion q[], 
 	mstudioseqdesc_t &seqdesc,
 	int sequence, 
 	float cycle,
-	const float poseParameter[],
-	int boneMask,
-	float flTime
+	int i0,
+	float s0,
+	int i1,
+	float s1,
+	int boneMask
 	)
 {
 	bool bResult = true;
@@ -1899,55 +2525,6 @@ bool CalcPoseSingle(
 	Vector		*pos3= g_VectorPool.Alloc();
 	Quaternion	*q3 = g_QaternionPool.Alloc();
 
-	if (sequence >= pStudioHdr->GetNumSeq()) 
-	{
-		sequence = 0;
-		seqdesc = pStudioHdr->pSeqdesc( sequence );
-	}
-
-
-	int i0 = 0, i1 = 0;
-	float s0 = 0, s1 = 0;
-
-	Studio_LocalPoseParameter( pStudioHdr, poseParameter, seqdesc, sequence, 0, s0, i0 );
-	Studio_LocalPoseParameter( pStudioHdr, poseParameter, seqdesc, sequence, 1, s1, i1 );
-
-
-	if (seqdesc.flags & STUDIO_REALTIME)
-	{
-		float cps = Studio_CPS( pStudioHdr, seqdesc, sequence, poseParameter );
-		cycle = flTime * cps;
-		cycle = cycle - (int)cycle;
-	}
-	else if (seqdesc.flags & STUDIO_CYCLEPOSE)
-	{
-		int iPose = pStudioHdr->GetSharedPoseParameter( sequence, seqdesc.cycleposeindex );
-		if (iPose != -1)
-		{
-			/*
-			const mstudioposeparamdesc_t &Pose = pStudioHdr->pPoseParameter( iPose );
-			cycle = poseParameter[ iPose ] * (Pose.end - Pose.start) + Pose.start;
-			*/
-			cycle = poseParameter[ iPose ];
-		}
-		else
-		{
-			cycle = 0.0f;
-		}
-	}
-	else if (cycle < 0 || cycle >= 1)
-	{
-		if (seqdesc.flags & STUDIO_LOOPING)
-		{
-			cycle = cycle - (int)cycle;
-			if (cycle < 0) cycle += 1;
-		}
-		else
-		{
-			cycle = clamp( cycle, 0.0f, 1.0f );
-		}
-	}
-
 	if (s0 < 0.001)
 	{
 		if (s1 < 0.001)
@@ -2077,6 +2654,360 @@ bool CalcPoseSingle(
 }
 
 
+//-----------------------------------------------------------------------------
+// Shared pose cache. Entities playing the same sequence of the same model at the
+// same cycle and blend position decode to the same local space pose, so the
+// result of CalcPoseSingleDecode is kept in an LRU keyed on everything it reads.
+// Only poses that sit on the blend grid are cached, and a pose only gets an entry
+// the second time it misses, so one-off poses don't churn the LRU.
+//-----------------------------------------------------------------------------
+static ConVar anim_posecache( "anim_posecache", "1", FCVAR_REPLICATED, "Share decoded sequence poses between entities playing the same sequence." );
+static ConVar anim_posecache_rate( "anim_posecache_rate", "60", FCVAR_REPLICATED, "Cycle resolution of the shared pose cache, in steps per second of animation." );
+
+// Set by benchmarks to turn the cache on or off without touching the replicated convar, -1 when unused
+static int s_nPoseCacheOverride = -1;
+
+void Studio_SetPoseCacheOverride( int nOverride )
+{
+	s_nPoseCacheOverride = nOverride;
+}
+
+static inline bool UsePoseCache()
+{
+	// forcing an animation path has to really decode every pose
+	if ( s_nAnimSIMDOverride >= 0 )
+		return false;
+	return ( s_nPoseCacheOverride >= 0 ) ? ( s_nPoseCacheOverride != 0 ) : anim_posecache.GetBool();
+}
+
+struct posecachekey_t
+{
+	const studiohdr_t	*pStudioHdr;
+	long				checksum;
+	int					sequence;
+	int					boneMask;
+	int					cycle;		// in anim_posecache_rate steps
+	int					i0;
+	int					i1;
+	float				s0;
+	float				s1;
+	int					flags;
+};
+
+struct posecacheparams_t
+{
+	const posecachekey_t	*pKey;
+	const CStudioHdr		*pStudioHdr;
+	mstudioseqdesc_t		*pSeqdesc;
+	const Vector			*pos;
+	const Quaternion		*q;
+	bool					bResult;
+};
+
+class CPoseCacheEntry
+{
+public:
+
+	// you must implement these static functions for the ResourceManager
+	// -----------------------------------------------------------
+	static CPoseCacheEntry *CreateResource( const posecacheparams_t &params );
+	static unsigned int EstimatedSize( const posecacheparams_t &params );
+	// -----------------------------------------------------------
+	// member functions that must be present for the ResourceManager
+	void			DestroyResource();
+	CPoseCacheEntry	*GetData() { return this; }
+	unsigned int	Size() { return m_size; }
+	// -----------------------------------------------------------
+
+	bool			ReadPose( Vector pos[], Quaternion q[] );
+
+	posecachekey_t	m_key;
+
+private:
+	Quaternion		*QuatArray() { return (Quaternion *)( this + 1 ); }
+	Vector			*PosArray() { return (Vector *)( QuatArray() + m_boneCount ); }
+	short			*BoneArray() { return (short *)( PosArray() + m_boneCount ); }
+
+	unsigned int	m_size;
+	unsigned short	m_boneCount;
+	bool			m_bResult;
+};
+
+static bool PoseCacheKeyLessFunc( const posecachekey_t &lhs, const posecachekey_t &rhs )
+{
+	return memcmp( &lhs, &rhs, sizeof(posecachekey_t) ) < 0;
+}
+
+// NOTE: the map must outlive the manager, which removes entries as it frees them
+static CUtlMap<posecachekey_t, memhandle_t> g_PoseCacheMap( PoseCacheKeyLessFunc );
+static CDataManager<CPoseCacheEntry, posecacheparams_t, CPoseCacheEntry *, CThreadFastMutex> g_PoseCache( 512 * 1024L );
+static int g_nPoseCacheHits;
+static int g_nPoseCacheMisses;
+
+// Hashes of keys that missed once; a key is only cached when it misses again
+#define POSECACHE_SEEN_SLOTS	1024
+static unsigned g_PoseCacheSeen[POSECACHE_SEEN_SLOTS];
+
+//-----------------------------------------------------------------------------
+// Purpose: the bones CalcPoseSingleDecode writes, the rest are left untouched
+//-----------------------------------------------------------------------------
+static int PoseWeightedBones( const CStudioHdr *pStudioHdr, mstudioseqdesc_t &seqdesc, int sequence, int boneMask, short *pBones )
+{
+	virtualmodel_t *pVModel = pStudioHdr->GetVirtualModel();
+	const virtualgroup_t *pSeqGroup = pVModel ? pVModel->pSeqGroup( sequence ) : NULL;
+
+	int count = 0;
+	for (int i = 0; i < pStudioHdr->numbones(); i++)
+	{
+		if (!(pStudioHdr->boneFlags(i) & boneMask))
+			continue;
+
+		int j = pSeqGroup ? pSeqGroup->boneMap[i] : i;
+		if (j >= 0 && seqdesc.weight( j ) > 0.0f)
+		{
+			pBones[count++] = i;
+		}
+	}
+	return count;
+}
+
+CPoseCacheEntry *CPoseCacheEntry::CreateResource( const posecacheparams_t &params )
+{
+	short bones[MAXSTUDIOBONES];
+	int boneCount = 0;
+	if ( params.bResult )
+	{
+		boneCount = PoseWeightedBones( params.pStudioHdr, *params.pSeqdesc, params.pKey->sequence, params.pKey->boneMask, bones );
+	}
+
+	int size = ( sizeof(CPoseCacheEntry) + boneCount * (sizeof(Quaternion) + sizeof(Vector) + sizeof(short)) + 3 ) & ~3;
+
+	CPoseCacheEntry *pMem = (CPoseCacheEntry *)malloc( size );
+	pMem->m_key = *params.pKey;
+	pMem->m_size = size;
+	pMem->m_boneCount = boneCount;
+	pMem->m_bResult = params.bResult;
+
+	Quaternion *pQuats = pMem->QuatArray();
+	Vector *pPos = pMem->PosArray();
+	short *pBones = pMem->BoneArray();
+	for ( int i = 0; i < boneCount; i++ )
+	{
+		pQuats[i] = params.q[bones[i]];
+		pPos[i] = params.pos[bones[i]];
+		pBones[i] = bones[i];
+	}
+	return pMem;
+}
+
+unsigned int CPoseCacheEntry::EstimatedSize( const posecacheparams_t &params )
+{
+	// conservative estimate - max size
+	return ( sizeof(CPoseCacheEntry) + params.pStudioHdr->numbones() * (sizeof(Quaternion) + sizeof(Vector) + sizeof(short)) + 3 ) & ~3;
+}
+
+void CPoseCacheEntry::DestroyResource()
+{
+	g_PoseCacheMap.Remove( m_key );
+	free( this );
+}
+
+bool CPoseCacheEntry::ReadPose( Vector pos[], Quaternion q[] )
+{
+	const Quaternion *pQuats = QuatArray();
+	const Vector *pPos = PosArray();
+	const short *pBones = BoneArray();
+	for ( int i = 0; i < m_boneCount; i++ )
+	{
+		q[pBones[i]] = pQuats[i];
+		pos[pBones[i]] = pPos[i];
+	}
+	return m_bResult;
+}
+
+void Studio_FlushPoseCache()
+{
+	AUTO_LOCK( g_PoseCache.AccessMutex() );
+	g_PoseCache.FlushAll();
+	memset( g_PoseCacheSeen, 0, sizeof(g_PoseCacheSeen) );
+	g_nPoseCacheHits = 0;
+	g_nPoseCacheMisses = 0;
+}
+
+void Studio_GetPoseCacheStats( int &nHits, int &nMisses )
+{
+	AUTO_LOCK( g_PoseCache.AccessMutex() );
+	nHits = g_nPoseCacheHits;
+	nMisses = g_nPoseCacheMisses;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: CalcPoseSingleDecode through the shared pose cache. The cycle is
+//			snapped to a fixed step of animation time on hits and misses alike
+//			so an entity's pose doesn't depend on who else happens to be playing
+//			the sequence. The step is never coarser than one frame.
+//-----------------------------------------------------------------------------
+static bool CalcPoseSingleCached(
+	const CStudioHdr *pStudioHdr,
+	Vector pos[], 
+	Quaternion q[], 
+	mstudioseqdesc_t &seqdesc,
+	int sequence, 
+	float cycle,
+	int i0,
+	float s0,
+	int i1,
+	float s1,
+	int boneMask
+	)
+{
+	mstudioanimdesc_t &animdesc = pStudioHdr->pAnimdesc( pStudioHdr->iRelativeAnim( sequence, seqdesc.anim( i0, i1 ) ) );
+	int nFrameSteps = max( animdesc.numframes - 1, 1 );
+	int nSteps = nFrameSteps;
+	if ( animdesc.fps > 0.0f )
+	{
+		nSteps = max( (int)( nFrameSteps / animdesc.fps * anim_posecache_rate.GetFloat() + 0.5f ), nFrameSteps );
+	}
+	int iCycle = (int)( cycle * nSteps + 0.5f );
+	cycle = (float)iCycle / nSteps;
+
+	posecachekey_t key;
+	memset( &key, 0, sizeof(key) );
+	key.pStudioHdr = pStudioHdr->GetRenderHdr();
+	key.checksum = key.pStudioHdr->checksum;
+	key.sequence = sequence;
+	key.boneMask = boneMask;
+	key.cycle = iCycle;
+	key.i0 = i0;
+	key.i1 = i1;
+	key.s0 = s0;
+	key.s1 = s1;
+	key.flags = anim_3wayblend.GetBool() ? 1 : 0;
+
+	{
+		AUTO_LOCK( g_PoseCache.AccessMutex() );
+		unsigned short iEntry = g_PoseCacheMap.Find( key );
+		if ( iEntry != g_PoseCacheMap.InvalidIndex() )
+		{
+			CPoseCacheEntry *pEntry = g_PoseCache.GetResource_NoLock( g_PoseCacheMap[iEntry] );
+			if ( pEntry )
+			{
+				g_nPoseCacheHits++;
+				VPROF_INCREMENT_COUNTER( "Pose cache hits", 1 );
+				return pEntry->ReadPose( pos, q );
+			}
+		}
+	}
+
+	VPROF_INCREMENT_COUNTER( "Pose cache misses", 1 );
+
+	int nStandIns = g_nAnimStandInDecodes;
+	bool bResult = CalcPoseSingleDecode( pStudioHdr, pos, q, seqdesc, sequence, cycle, i0, s0, i1, s1, boneMask );
+
+	AUTO_LOCK( g_PoseCache.AccessMutex() );
+	g_nPoseCacheMisses++;
+
+	// a key that has only missed once might never come up again
+	unsigned nHash = HashBlock( &key, sizeof(key) );
+	unsigned &nSeen = g_PoseCacheSeen[ nHash & ( POSECACHE_SEEN_SLOTS - 1 ) ];
+	bool bSeen = ( nSeen == nHash );
+	nSeen = nHash;
+
+	// don't share a pose that was patched up from zero frame data while the animation streams in
+	if ( bSeen && g_nAnimStandInDecodes == nStandIns && g_PoseCacheMap.Find( key ) == g_PoseCacheMap.InvalidIndex() )
+	{
+		posecacheparams_t params;
+		params.pKey = &key;
+		params.pStudioHdr = pStudioHdr;
+		params.pSeqdesc = &seqdesc;
+		params.pos = pos;
+		params.q = q;
+		params.bResult = bResult;
+
+		memhandle_t hEntry = g_PoseCache.CreateResource( params );
+		g_PoseCacheMap.Insert( key, hEntry );
+	}
+
+	return bResult;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: calculate a pose for a single sequence
+//-----------------------------------------------------------------------------
+bool CalcPoseSingle(
+	const CStudioHdr *pStudioHdr,
+	Vector pos[], 
+	Quaternion q[], 
+	mstudioseqdesc_t &seqdesc,
+	int sequence, 
+	float cycle,
+	const float poseParameter[],
+	int boneMask,
+	float flTime
+	)
+{
+	if (sequence >= pStudioHdr->GetNumSeq()) 
+	{
+		sequence = 0;
+		seqdesc = pStudioHdr->pSeqdesc( sequence );
+	}
+
+
+	int i0 = 0, i1 = 0;
+	float s0 = 0, s1 = 0;
+
+	Studio_LocalPoseParameter( pStudioHdr, poseParameter, seqdesc, sequence, 0, s0, i0 );
+	Studio_LocalPoseParameter( pStudioHdr, poseParameter, seqdesc, sequence, 1, s1, i1 );
+
+
+	if (seqdesc.flags & STUDIO_REALTIME)
+	{
+		float cps = Studio_CPS( pStudioHdr, seqdesc, sequence, poseParameter );
+		cycle = flTime * cps;
+		cycle = cycle - (int)cycle;
+	}
+	else if (seqdesc.flags & STUDIO_CYCLEPOSE)
+	{
+		int iPose = pStudioHdr->GetSharedPoseParameter( sequence, seqdesc.cycleposeindex );
+		if (iPose != -1)
+		{
+			/*
+			const mstudioposeparamdesc_t &Pose = pStudioHdr->pPoseParameter( iPose );
+			cycle = poseParameter[ iPose ] * (Pose.end - Pose.start) + Pose.start;
+			*/
+			cycle = poseParameter[ iPose ];
+		}
+		else
+		{
+			cycle = 0.0f;
+		}
+	}
+	else if (cycle < 0 || cycle >= 1)
+	{
+		if (seqdesc.flags & STUDIO_LOOPING)
+		{
+			cycle = cycle - (int)cycle;
+			if (cycle < 0) cycle += 1;
+		}
+		else
+		{
+			cycle = clamp( cycle, 0.0f, 1.0f );
+		}
+	}
+
+	// Cycleposes take their cycle straight from a pose parameter, so snapping it would show.
+	// Blend positions between grid points change continuously and would hardly ever repeat.
+	if ( UsePoseCache() && !(seqdesc.flags & (STUDIO_REALTIME | STUDIO_CYCLEPOSE)) &&
+		 ( s0 == 0.0f || s0 == 1.0f ) && ( s1 == 0.0f || s1 == 1.0f ) )
+	{
+		return CalcPoseSingleCached( pStudioHdr, pos, q, seqdesc, sequence, cycle, i0, s0, i1, s1, boneMask );
+	}
+
+	return CalcPoseSingleDecode( pStudioHdr, pos, q, seqdesc, sequence, cycle, i0, s0, i1, s1, boneMask );
+}
+
+
 
 
 //-----------------------------------------------------------------------------
@@ -488,6 +488,18 @@ memhandle_t Studio_CreateBoneCache( bonecacheparams_t &params );
 void Studio_DestroyBoneCache( memhandle_t cacheHandle );
 void Studio_InvalidateBoneCache( memhandle_t cacheHandle );
 
+// Shared cache of decoded sequence poses, see CalcPoseSingle
+void Studio_FlushPoseCache();
+void Studio_GetPoseCacheStats( int &nHits, int &nMisses );
+
+// Turns the shared pose cache on (1) or off (0) regardless of anim_posecache, -1 goes
+// back to the convar. For benchmarking.
+void Studio_SetPoseCacheOverride( int nOverride );
+
+// Forces the scalar (0) or SIMD (1) animation decode and blend, bypassing the shared
+// pose cache so every pose is really decoded. -1 goes back to anim_simd.
+void Studio_SetAnimSIMDOverride( int nOverride );
+
 // Given a ray, trace for an intersection with this studiomodel.  Get the array of bones from StudioSetupHitboxBones
 bool TraceToStudio( class IPhysicsSurfaceProps *pProps, const Ray_t& ray, CStudioHdr *pStudioHdr, mstudiohitboxset_t *set, matrix3x4_t **hitboxbones, int fContentsMask, trace_t &trace );
 
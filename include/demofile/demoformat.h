@@ -16,6 +16,7 @@
 
 #define DEMO_HEADER_ID		"HL2DEMO"
 #define DEMO_PROTOCOL		3
+#define DEMO_PROTOCOL_KEYFRAMES	4	// DEMO_PROTOCOL plus dem_keyframe commands and a keyframe index at the end
 
 #if !defined( MAX_OSPATH )
 #define	MAX_OSPATH		260			// max length of a filesystem pathname
@@ -38,9 +39,11 @@ enum
 	dem_datatables,
 	// end of time.
 	dem_stop,
+	// full entity and stringtable state, only read when seeking
+	dem_keyframe,
 
 	// Last command
-	dem_lastcmd		= dem_stop
+	dem_lastcmd		= dem_keyframe
 };
 
 struct demoheader_t
@@ -58,6 +61,23 @@ struct demoheader_t
 	int		signonlength;					// lenght of sigondata in bytes
 };
 
+#define DEMO_INDEX_ID		"HL2DIDX"
+
+// keyframe index, written after dem_stop by DEMO_PROTOCOL_KEYFRAMES demos
+struct demoindexentry_t
+{
+	int		tick;							// recording tick of the keyframe
+	int		fileoffset;						// file position of its dem_keyframe command
+};
+
+// last bytes of the file
+struct demoindextrailer_t
+{
+	char	indexfilestamp[8];				// Should be HL2DIDX
+	int		numentries;						// # of demoindexentry_t
+	int		indexoffset;					// file position of the first demoindexentry_t
+};
+
 #define FDEMO_NORMAL		0
 #define FDEMO_USE_ORIGIN2	(1<<0)
 #define FDEMO_USE_ANGLES2	(1<<1)
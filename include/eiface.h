@@ -483,7 +483,7 @@ public:
 //-----------------------------------------------------------------------------
 #define VENGINE_SERVER_RANDOM_INTERFACE_VERSION	"VEngineRandom001"
 
-#define INTERFACEVERSION_SERVERGAMEENTS			"ServerGameEnts001"
+#define INTERFACEVERSION_SERVERGAMEENTS			"ServerGameEnts002"
 //-----------------------------------------------------------------------------
 // Purpose: Interface to get at server entities
 //-----------------------------------------------------------------------------
@@ -510,7 +510,20 @@ public:
 	//
 	// This is also where an entity can force other entities to be transmitted if it refers to them
 	// with ehandles.
+	//
+	// Threading: if PrepareParallelCheckTransmit returned true for this frame, the engine may call
+	// CheckTransmit for different clients at the same time from its worker threads. Each call may
+	// only write to the transmit bits of its own pInfo; everything else (entities, edict flags,
+	// PVS info, globals) must be treated as read only until the last call returns.
 	virtual void			CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts ) = 0;
+
+	// * This function is new with version 2 of the interface.
+	//
+	// Called once per frame from the main thread before any CheckTransmit call for that frame, with
+	// the same edict list. Bring any lazily computed per-entity state CheckTransmit depends on up to
+	// date here, then return true if CheckTransmit honors the threading contract above. Returning
+	// false makes the engine run CheckTransmit for every client serially on the main thread.
+	virtual bool			PrepareParallelCheckTransmit( const unsigned short *pEdictIndices, int nEdicts ) = 0;
 };
 
 #define INTERFACEVERSION_SERVERGAMECLIENTS		"ServerGameClients003"
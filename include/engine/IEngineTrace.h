@@ -120,11 +120,20 @@ public:
 };
 
 
+//-----------------------------------------------------------------------------
+// Flags for IEngineTrace::TraceRays
+//-----------------------------------------------------------------------------
+enum
+{
+	TRACE_RAYS_ALLOW_THREADS = 0x1,		// Large batches may trace the world on the thread pool. The filter is only ever called on the calling thread.
+};
+
+
 //-----------------------------------------------------------------------------
 // Interface the engine exposes to the game DLL
 //-----------------------------------------------------------------------------
-#define INTERFACEVERSION_ENGINETRACE_SERVER	"EngineTraceServer003"
-#define INTERFACEVERSION_ENGINETRACE_CLIENT	"EngineTraceClient003"
+#define INTERFACEVERSION_ENGINETRACE_SERVER	"EngineTraceServer004"
+#define INTERFACEVERSION_ENGINETRACE_CLIENT	"EngineTraceClient004"
 abstract_class IEngineTrace
 {
 public:
@@ -185,6 +194,10 @@ public:
 
 	// Walks bsp to find the leaf containing the specified point
 	virtual int GetLeafContainingPoint( const Vector &ptTest ) = 0;
+
+	// Traces a batch of rays that share a mask + filter. The results are identical to calling 
+	// TraceRay on each ray in turn; rays that are close together share the entity enumeration.
+	virtual void	TraceRays( const Ray_t *pRays, int nRays, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces, int nFlags = 0 ) = 0;
 };
 
 
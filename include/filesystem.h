@@ -292,6 +292,7 @@ enum FSAsyncFlags_t
 	FSASYNC_FLAGS_FREEDATAPTR		= ( 1 << 1 ),	// free the memory for the dataPtr post callback
 	FSASYNC_FLAGS_SYNC				= ( 1 << 2 ),	// Actually perform the operation synchronously. Used to simplify client code paths
 	FSASYNC_FLAGS_NULLTERMINATE		= ( 1 << 3 ),	// allocate an extra byte and null terminate the buffer read in
+	FSASYNC_FLAGS_READONLY			= ( 1 << 4 ),	// dataPtr may point into a memory mapped pack file. Don't write to it, release with ReleaseReadOnlyBuffer()
 };
 
 //---------------------------------------------------------
@@ -401,7 +402,7 @@ public:
 // Main file system interface
 //-----------------------------------------------------------------------------
 
-#define FILESYSTEM_INTERFACE_VERSION			"VFileSystem017"
+#define FILESYSTEM_INTERFACE_VERSION			"VFileSystem018"
 
 abstract_class IFileSystem : public IAppSystem, public IBaseFileSystem
 {
@@ -736,6 +737,16 @@ public:
 
 	// Installs a callback used to display a dirty disk dialog
 	virtual void			InstallDirtyDiskReportFunc( FSDirtyDiskReportFunc_t func ) = 0;
+
+	//--------------------------------------------------------
+	// Read only file access
+	//--------------------------------------------------------
+
+	// Files inside memory mapped pack files come back as a pointer straight into the mapping,
+	// anything else is read into a buffer. Either way the data must not be written to and
+	// has to be handed back to ReleaseReadOnlyBuffer(). Returns the number of bytes.
+	virtual int				ReadFileReadOnly( const char *pFileName, const char *pPath, const void **ppBuf, int nMaxBytes = 0, int nStartingByte = 0 ) = 0;
+	virtual void			ReleaseReadOnlyBuffer( const void *pBuf ) = 0;
 };
 
 //-----------------------------------------------------------------------------
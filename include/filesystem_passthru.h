@@ -230,6 +230,9 @@ public:
 		{ m_pFileSystemPassThru->SetWhitelistSpewFlags( spewFlags ); }
 	virtual void InstallDirtyDiskReportFunc( FSDirtyDiskReportFunc_t func ) { m_pFileSystemPassThru->InstallDirtyDiskReportFunc( func ); }
 
+	virtual int ReadFileReadOnly( const char *pFileName, const char *pPath, const void **ppBuf, int nMaxBytes = 0, int nStartingByte = 0 ) { return m_pFileSystemPassThru->ReadFileReadOnly( pFileName, pPath, ppBuf, nMaxBytes, nStartingByte ); }
+	virtual void ReleaseReadOnlyBuffer( const void *pBuf ) { m_pFileSystemPassThru->ReleaseReadOnlyBuffer( pBuf ); }
+
 protected:
 	IFileSystem *m_pFileSystemPassThru;
 };
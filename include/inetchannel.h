@@ -21,6 +21,17 @@ class	INetChannelInfo;
 typedef struct netpacket_s netpacket_t;
 typedef struct netadr_s	netadr_t;
 
+// Codecs used for compressed packets + fragments. Every peer understands LZSS, the
+// others are only used once the remote side has said it can decode them.
+enum
+{
+	NET_COMPRESSOR_LZSS = 0,
+	NET_COMPRESSOR_LZFAST,			// CLZFast
+	NET_COMPRESSOR_LZFAST_DICT,		// CLZFast primed with the dictionary shipped with the game
+
+	NET_COMPRESSOR_COUNT,
+};
+
 abstract_class INetChannel : public INetChannelInfo
 {
 public:
@@ -83,6 +94,10 @@ public:
 	// Max # of payload bytes before we must split/fragment the packet
 	virtual void	SetMaxRoutablePayloadSize( int nSplitSize ) = 0;
 	virtual int		GetMaxRoutablePayloadSize() = 0;
+
+	// Codec used for data we send (NET_COMPRESSOR_*)
+	virtual void	SetCompressor( int nCompressor ) = 0;
+	virtual int		GetCompressor() = 0;
 };
 
 
@@ -339,6 +339,11 @@ public:
 
 	void DumpProfileInformation( void );					// write particle_profile.csv
 
+	// Simulates nCollections instances of a particle system for nFrames frames against a
+	// stand-in collision world, no renderer or map needed, and reports the ns per particle
+	// spent in each operator
+	void BenchmarkParticleSystem( const char *pParticleSystemName, int nCollections, int nFrames, float flFrameTime );
+
 	// Cache/uncache materials used by particle systems
 	void PrecacheParticleSystem( const char *pName );
 	void UncacheAllParticleSystems();
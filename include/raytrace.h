@@ -192,6 +192,49 @@ protected:
 };
 
 
+// 4 wide bounding volume hierarchy, used instead of the kd-tree when RTE_FLAGS_BVH is set. The
+// bounds of the 4 children are stored by axis so one ray can be tested against all of them with a
+// few simd ops. A child with BVHNODE_LEAF set is a run of triangles in BVHTriangleList instead of
+// a node index. Unused children are at the end, after m_nNumChildren.
+#define BVH_NODE_WIDTH 4
+#define BVHNODE_LEAF 0x80000000
+#define BVHNODE_LEAF_COUNT_BITS 5
+#define BVH_MAX_LEAF_TRIS ( ( 1 << BVHNODE_LEAF_COUNT_BITS ) - 1 )
+
+struct ALIGN16 CacheOptimizedBVHNode
+{
+	// 128 bytes, 2 cache lines
+	float m_flMins[3][BVH_NODE_WIDTH];						// [axis][child]
+	float m_flMaxs[3][BVH_NODE_WIDTH];
+	int32 m_nChildren[BVH_NODE_WIDTH];						// node index or leaf, see below
+	int32 m_nNumChildren;
+	int32 m_nUnused[3];
+
+	static inline int32 MakeLeaf( int first_tri, int ntris )
+	{
+		assert( ntris <= BVH_MAX_LEAF_TRIS );
+		return BVHNODE_LEAF | ( first_tri << BVHNODE_LEAF_COUNT_BITS ) | ntris;
+	}
+
+	static inline bool IsLeaf( int32 child )
+	{
+		return ( child & BVHNODE_LEAF ) != 0;
+	}
+
+	static inline int TriangleIndexStart( int32 child )
+	{
+		assert( IsLeaf( child ) );
+		return ( child & ~BVHNODE_LEAF ) >> BVHNODE_LEAF_COUNT_BITS;
+	}
+
+	static inline int NumberOfTrianglesInLeaf( int32 child )
+	{
+		assert( IsLeaf( child ) );
+		return child & BVH_MAX_LEAF_TRIS;
+	}
+};
+
+
 struct RayTracingSingleResult
 {
 	Vector surface_normal;									// surface normal at intersection
@@ -219,6 +262,7 @@ public:
 #define RTE_FLAGS_FAST_TREE_GENERATION 1
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_COLORS 2				// saves memory if not needed
 #define RTE_FLAGS_DONT_STORE_TRIANGLE_MATERIALS 4
+#define RTE_FLAGS_BVH 8										// trace against a bvh instead of the kd-tree
 
 enum RayTraceLightingMode_t {
 	DIRECT_LIGHTING,										// just dot product lighting
@@ -263,6 +307,9 @@ public:
 	CUtlVector<CacheOptimizedKDNode> OptimizedKDTree;		//< the packed kdtree. root is 0
 	CUtlBlockVector<CacheOptimizedTriangle> OptimizedTriangleList; //< the packed triangles
 	CUtlVector<int32> TriangleIndexList;					//< the list of triangle indices.
+	CUtlVector<CacheOptimizedBVHNode, CUtlMemoryAligned<CacheOptimizedBVHNode, 16> > OptimizedBVH; //< the 4 wide bvh. root is 0
+	CUtlVector<TriIntersectData_t> BVHTriangleList;			//< triangles copied in bvh leaf order
+	CUtlVector<int32> BVHTriangleIndexList;					//< OptimizedTriangleList index of each
 	CUtlVector<LightDesc_t> LightList;						//< the list of lights
 	CUtlVector<Vector> TriangleColors;						//< color of tries
 	CUtlVector<int32> TriangleMaterials;					//< material index of tries
@@ -296,6 +343,11 @@ public:
 	// SetupAccelerationStructure to prepare for tracing
 	void SetupAccelerationStructure(void);
 
+	// use instead of SetupAccelerationStructure to build both the kd-tree and the bvh, and
+	// print how long each took to build and how fast each traces nrays random rays. Tracing
+	// afterwards uses whichever structure Flags selects.
+	void BenchmarkAccelerationStructures( int nrays );
+
 
 	// lowest level intersection routine - fire 4 rays through the scene. all 4 rays must pass the
 	// Check() function, and t extents must be initialized. skipid can be set to exclude a
@@ -309,6 +361,11 @@ public:
 					RayTracingResult *rslt_out,
 					int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
 
+	// bvh version of the above. The rays don't need to match in direction sign.
+	void Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+					   RayTracingResult *rslt_out,
+					   int32 skip_id=-1, ITransparentTriangleCallback *pCallback = NULL);
+
 	// compute virtual light sources to model inter-reflection
 	void ComputeVirtualLightSources(void);
 
@@ -355,6 +412,13 @@ public:
 	void CalculateTriangleListBounds(int32 const *tris,int ntris,
 									 Vector &minout, Vector &maxout);
 
+	// these must be called while the triangles are still in geometry format
+	void BuildKDTree(void);
+	void BuildBVH(void);
+
+	// called after the triangles are in intersection format
+	void CopyBVHTriangles(void);
+
 	void AddInfinitePointLight(Vector position,				// light center
 							   Vector intensity);			// rgb amount
 
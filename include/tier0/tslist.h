@@ -169,6 +169,36 @@ public:
 #endif
 	}
 
+	// Pushes an already linked chain of nodes with a single swap of the head
+	void PushChain( TSLNodeBase_t *pFirst, TSLNodeBase_t *pLast, int nNodes )
+	{
+#ifdef USE_NATIVE_SLIST
+		while ( pFirst )
+		{
+			TSLNodeBase_t *pNext = ( pFirst != pLast ) ? pFirst->Next : NULL;
+			Push( pFirst );
+			pFirst = pNext;
+		}
+#else
+		TSLHead_t oldHead;
+		TSLHead_t newHead;
+
+		for (;;)
+		{
+			oldHead.value64 = m_Head.value64;
+			pLast->Next = oldHead.value.Next;
+			newHead.value.Next = pFirst;
+			*((uint32 *)&newHead.value.Depth) = *((uint32 *)&oldHead.value.Depth) + 0x10000 + nNodes;
+
+			if ( ThreadInterlockedAssignIf64( &m_Head.value64, newHead.value64, oldHead.value64 ) )
+			{
+				break;
+			}
+			ThreadPause();
+		};
+#endif
+	}
+
 	TSLNodeBase_t *Detach()
 	{
 #ifdef USE_NATIVE_SLIST
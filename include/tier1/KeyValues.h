@@ -183,6 +183,16 @@ public:
 	bool WriteAsBinary( CUtlBuffer &buffer );
 	bool ReadAsBinary( CUtlBuffer &buffer );
 
+	// Compiled form of this key and its peers, for on-disk caches of parsed files.
+	// Reading keeps this node and puts everything below and after it into a single
+	// arena block, which is freed when the last of its nodes is deleted. Pointer and
+	// wide string values and chained keys can't be compiled.
+	bool WriteAsCompiled( CUtlBuffer &buffer );
+	bool ReadAsCompiled( const void *pData, int nSize );
+
+	// Number of heap blocks held by this key, its subkeys and its peers (an arena counts once)
+	int GetAllocationCount();
+
 	// Allocate & create a new copy of the keys
 	KeyValues *MakeCopy( void ) const;
 
@@ -228,6 +238,7 @@ private:
 	
 	void RecursiveCopyKeyValues( KeyValues& src );
 	void RemoveEverything();
+	static void DeleteKey( KeyValues *pKey );
 //	void RecursiveSaveToFile( IBaseFileSystem *filesystem, CUtlBuffer &buffer, int indentLevel );
 //	void WriteConvertedString( CUtlBuffer &buffer, const char *pszString );
 	
@@ -275,7 +286,8 @@ private:
 	
 	char	   m_iDataType;
 	char	   m_bHasEscapeSequences; // true, if while parsing this KeyValue, Escape Sequences are used (default false)
-	char	   unused[2];
+	char	   m_nArenaFlags;	// KV_ARENA_NODE and KV_ARENA_VALUE, set by ReadAsCompiled
+	char	   unused[1];
 
 	KeyValues *m_pPeer;	// pointer to next key in list
 	KeyValues *m_pSub;	// pointer to Start of a new sub key list
@@ -0,0 +1,81 @@
+//========= Copyright  1996-2007, Valve Corporation, All rights reserved. ============//
+//
+//	LZFast Codec. Byte oriented LZ77 (LZ4 style sequences) with a single probe hash
+//	match finder. Several times faster than LZSS to encode and decode, at a similar or
+//	better ratio. Both ends may share a preset dictionary, which makes a big difference
+//	on small buffers that look alike such as network packets.
+//
+//=====================================================================================//
+
+#ifndef _LZFAST_H
+#define _LZFAST_H
+#pragma once
+
+#if !defined( _X360 )
+#define LZFAST_ID			(('T'<<24)|('F'<<16)|('Z'<<8)|('L'))
+#else
+#define LZFAST_ID			(('L'<<24)|('Z'<<16)|('F'<<8)|('T'))
+#endif
+
+// bind the buffer for correct identification
+struct lzfast_header_t
+{
+	unsigned int	id;
+	unsigned int	actualSize;		// always little endian
+	unsigned int	dictionaryId;	// always little endian, 0 if no dictionary was used
+};
+
+#define LZFAST_HASH_BITS		12
+#define LZFAST_HASH_SIZE		( 1 << LZFAST_HASH_BITS )
+#define LZFAST_MAX_OFFSET		65535
+#define LZFAST_MAX_DICTIONARY	LZFAST_MAX_OFFSET
+
+//-----------------------------------------------------------------------------
+// A preset dictionary. Matches may reference the dictionary as if it
+// immediately preceded the data being compressed.
+//-----------------------------------------------------------------------------
+class CLZFastDictionary
+{
+public:
+	CLZFastDictionary();
+	~CLZFastDictionary();
+
+	// Copies the data; only the last LZFAST_MAX_DICTIONARY bytes can be referenced
+	void			Init( const unsigned char *pData, int nSize );
+	void			Shutdown();
+
+	bool			IsValid() const			{ return m_nSize > 0; }
+	unsigned int	GetId() const			{ return m_nId; }
+	const unsigned char *GetData() const	{ return m_pData; }
+	int				GetSize() const			{ return m_nSize; }
+
+	// Builds a dictionary out of the byte sequences that repeat most across a set of
+	// sample buffers (stored back to back in pSamples). Returns the dictionary size.
+	static int		Train( const unsigned char *pSamples, const int *pSampleSizes, int nSamples, unsigned char *pDictionary, int nMaxSize );
+
+private:
+	friend class CLZFast;
+
+	unsigned char	*m_pData;
+	int				m_nSize;
+	unsigned int	m_nId;
+	int				*m_pHashTable;	// match finder state after hashing the whole dictionary
+};
+
+class CLZFast
+{
+public:
+	unsigned char*	Compress( const unsigned char *pInput, int inputlen, unsigned int *pOutputSize, const CLZFastDictionary *pDictionary = NULL );
+	// pOutput must hold inputlen bytes; returns NULL if the data doesn't get smaller
+	unsigned char*	CompressNoAlloc( const unsigned char *pInput, int inputlen, unsigned char *pOutput, unsigned int *pOutputSize, const CLZFastDictionary *pDictionary = NULL );
+
+	// Returns the uncompressed size, or 0 if the input is corrupt, doesn't fit
+	// in outputlen bytes or needs a dictionary we don't have
+	unsigned int	Uncompress( const unsigned char *pInput, int inputlen, unsigned char *pOutput, unsigned int outputlen, const CLZFastDictionary *pDictionary = NULL );
+
+	bool			IsCompressed( const unsigned char *pInput );
+	unsigned int	GetActualSize( const unsigned char *pInput );
+	unsigned int	GetDictionaryId( const unsigned char *pInput );
+};
+
+#endif
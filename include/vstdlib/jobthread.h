@@ -98,7 +98,7 @@ enum JobPriority_t
 struct ThreadPoolStartParams_t
 {
 	ThreadPoolStartParams_t( bool bIOThreads = false, unsigned nThreads = -1, int *pAffinities = NULL, ThreeState_t fDistribute = TRS_NONE, unsigned nStackSize = -1, int iThreadPriority = SHRT_MIN )
-		: bIOThreads( bIOThreads ), nThreads( nThreads ), fDistribute( fDistribute ), nStackSize( nStackSize ), iThreadPriority( iThreadPriority )
+		: bIOThreads( bIOThreads ), nThreads( nThreads ), fDistribute( fDistribute ), nStackSize( nStackSize ), iThreadPriority( iThreadPriority ), bWorkStealing( false )
 	{
 		bUseAffinityTable = ( pAffinities != NULL ) && ( fDistribute == TRS_TRUE ) && ( nThreads != -1 );
 		if ( bUseAffinityTable )
@@ -120,6 +120,7 @@ struct ThreadPoolStartParams_t
 
 	bool			bIOThreads : 1;
 	bool			bUseAffinityTable : 1;
+	bool			bWorkStealing : 1;		// per thread queues with stealing instead of one shared queue
 };
 
 //-----------------------------------------------------------------------------
@@ -412,6 +413,7 @@ JOB_INTERFACE void DestroyThreadPool( IThreadPool *pPool );
 //-------------------------------------
 
 JOB_INTERFACE void RunThreadPoolTests();
+JOB_INTERFACE void RunThreadPoolSchedulerTests();
 
 //-----------------------------------------------------------------------------
 
@@ -821,6 +823,8 @@ public:
 	CParallelProcessor()
 	{
 		m_pItems = m_pLimit= 0;
+		m_iNextItem = 0;
+		m_nChunkItems = 1;
 	}
 
 	void Run( ITEM_TYPE *pItems, unsigned nItems, int nMaxParallel = INT_MAX, IThreadPool *pThreadPool = NULL )
@@ -835,6 +839,8 @@ public:
 
 		m_pItems = pItems;
 		m_pLimit = pItems + nItems;
+		m_iNextItem = 0;
+		m_nChunkItems = 1;
 
 		int nJobs = nItems - 1;
 
@@ -857,6 +863,10 @@ public:
 
 		if ( nJobs > 1 )
 		{
+			// Hand out items in chunks so threads don't fight over m_iNextItem for
+			// every tiny item, but keep enough chunks around to balance uneven items
+			m_nChunkItems = max( 1, (int)nItems / ( ( nJobs + 1 ) * PARALLEL_PROCESS_CHUNKS_PER_THREAD ) );
+
 			CJob **jobs = (CJob **)stackalloc( nJobs * sizeof(CJob **) );
 			int i = nJobs;
 
@@ -882,32 +892,42 @@ public:
 	ITEM_PROCESSOR_TYPE m_ItemProcessor;
 
 private:
+	enum
+	{
+		PARALLEL_PROCESS_CHUNKS_PER_THREAD = 8,
+	};
+
 	void DoExecute()
 	{
-		if ( m_pItems < m_pLimit )
+		long nItems = m_pLimit - m_pItems;
+
+		if ( m_iNextItem < nItems )
 		{
 			m_ItemProcessor.Begin();
 
-			ITEM_TYPE *pLimit = m_pLimit;
-
 			for (;;)
 			{
-				ITEM_TYPE *pCurrent = m_pItems++;
-				if ( pCurrent < pLimit )
+				long iFirst = ThreadInterlockedExchangeAdd( &m_iNextItem, m_nChunkItems );
+				if ( iFirst >= nItems )
 				{
-					m_ItemProcessor.Process( *pCurrent );
+					break;
 				}
-				else
+
+				ITEM_TYPE *pCurrent = m_pItems + iFirst;
+				ITEM_TYPE *pLimit = pCurrent + min( (long)m_nChunkItems, nItems - iFirst );
+				for ( ; pCurrent < pLimit; ++pCurrent )
 				{
-					break;
+					m_ItemProcessor.Process( *pCurrent );
 				}
 			}
 
 			m_ItemProcessor.End();
 		}
 	}
-	CInterlockedPtr<ITEM_TYPE>	m_pItems;
+	ITEM_TYPE *					m_pItems;
 	ITEM_TYPE *					m_pLimit;
+	volatile long				m_iNextItem;
+	int							m_nChunkItems;
 };
 
 template <typename ITEM_TYPE> 
@@ -190,6 +190,7 @@ void CBaseClient::FreeBaselines()
 	m_nBaselineUpdateTick = -1;
 	m_nBaselineUsed = 0;
 	m_BaselinesSent.ClearAll();
+	Q_memset( m_BaselineSignature, 0, sizeof( m_BaselineSignature ) );
 }
 
 void CBaseClient::Clear()
@@ -811,6 +812,14 @@ bool CBaseClient::ProcessBaselineAck( CLC_BaselineAck *msg )
 
 	m_pBaseline->m_nTickCount = m_nBaselineUpdateTick;
 
+	// The baseline now also holds these entities from the snapshot at m_nBaselineUpdateTick
+	MD5Context_t ctx;
+	MD5Init( &ctx );
+	MD5Update( &ctx, m_BaselineSignature, sizeof( m_BaselineSignature ) );
+	MD5Update( &ctx, (unsigned char const *)&m_nBaselineUpdateTick, sizeof( m_nBaselineUpdateTick ) );
+	MD5Update( &ctx, (unsigned char const *)m_BaselinesSent.Base(), m_BaselinesSent.GetNumDWords() * sizeof( uint32 ) );
+	MD5Final( m_BaselineSignature, &ctx );
+
 	// flip used baseline flag
 	m_nBaselineUsed = (m_nBaselineUsed==1)?0:1;
 
@@ -1177,6 +1186,12 @@ void CBaseClient::UpdateUserSettings()
 
 	SetMaxRoutablePayloadSize( m_ConVars->GetInt( "net_maxroutable", MAX_ROUTABLE_PAYLOAD ) );
 
+	// clients that don't advertise a codec stay on LZSS
+	if ( m_NetChannel )
+	{
+		m_NetChannel->SetCompressor( NET_NegotiateCompressor( m_ConVars->GetInt( "net_compressor", NET_COMPRESSOR_LZSS ), m_ConVars->GetString( "net_compressor_dict", "" ) ) );
+	}
+
 	m_Server->UserInfoChanged( m_nClientSlot );
 
 	m_bConVarsChanged = false;
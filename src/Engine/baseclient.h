@@ -12,6 +12,7 @@
 
 #include <const.h>
 #include <checksum_crc.h>
+#include <checksum_md5.h>
 #include <iclient.h>
 #include <protocol.h>
 #include <iservernetworkable.h>
@@ -211,6 +212,8 @@ public:
 	int				m_nBaselineUpdateTick;	// last tick we send client a update baseline signal or -1
 	CBitVec<MAX_EDICTS>	m_BaselinesSent;	// baselines sent with last update
 	int				m_nBaselineUsed;		// 0/1 toggling flag, singaling client what baseline to use
+	unsigned char	m_BaselineSignature[MD5_DIGEST_LENGTH];	// digest of all acknowledged baseline updates, clients
+															// of the same server with equal signatures have identical baselines
 	
 		
 	// This is used when we send out a nodelta packet to put the client in a state where we wait 
@@ -9,20 +9,187 @@
 #include "changeframelist.h"
 #include "dt.h"
 #include "utlvector.h"
+#include "utlbuffer.h"
+#include "tier0/threadtools.h"
+#include "tier0/fasttimer.h"
+#include "tier1/convar.h"
+#include "tier1/strtools.h"
+#include "mathlib/mathlib.h"
+#include "vstdlib/random.h"
+#include "bitvec.h"
+#include "filesystem.h"
+#include "filesystem_engine.h"
+
+#if !defined( _X360 )
+#include <emmintrin.h>
+#endif
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
 
+//-----------------------------------------------------------------------------
+// The change ticks, shared by the lists of consecutive snapshots until one of
+// them gets a new change. Besides the tick of every prop, it remembers which
+// props changed at the most recent tick, so the usual question (what changed
+// since the client's last ack, which is one tick ago) doesn't need a scan.
+//-----------------------------------------------------------------------------
+struct ChangeFrameData_t
+{
+	CInterlockedInt	m_nRefCount;
+	int				m_nProps;
+	int				m_nLastTick;		// Most recent tick any prop changed at
+	int				m_nPrevTick;		// Props that aren't in m_pLastTickBits changed at or before this tick
+	int				*m_pTicks;			// Padded to a multiple of 4 with INT_MIN, 16 byte aligned
+	uint32			*m_pLastTickBits;	// Props that changed at m_nLastTick
+};
+
+static inline int ChangeFrameTickCount( int nProps )
+{
+	return ( nProps + 3 ) & ~3;
+}
+
+static ChangeFrameData_t *AllocChangeFrameData( int nProps )
+{
+	int nTicks = ChangeFrameTickCount( nProps );
+	int nBitInts = CalcNumIntsForBits( nProps );
+	int nHeaderSize = ( sizeof( ChangeFrameData_t ) + 15 ) & ~15;
+
+	// One allocation for the header, the ticks and the bits
+	byte *pMem = (byte*)MemAlloc_AllocAligned( nHeaderSize + ( nTicks + nBitInts ) * sizeof( int ), 16 );
+	ChangeFrameData_t *pData = new( pMem ) ChangeFrameData_t;
+	pData->m_nRefCount = 1;
+	pData->m_nProps = nProps;
+	pData->m_pTicks = (int*)( pMem + nHeaderSize );
+	pData->m_pLastTickBits = (uint32*)( pData->m_pTicks + nTicks );
+
+	for ( int i = nProps; i < nTicks; ++i )
+	{
+		pData->m_pTicks[i] = INT_MIN;
+	}
+	return pData;
+}
+
+static void FreeChangeFrameData( ChangeFrameData_t *pData )
+{
+	pData->~ChangeFrameData_t();
+	MemAlloc_FreeAligned( pData );
+}
+
+static ChangeFrameData_t *CopyChangeFrameData( const ChangeFrameData_t *pFrom )
+{
+	ChangeFrameData_t *pData = AllocChangeFrameData( pFrom->m_nProps );
+	pData->m_nLastTick = pFrom->m_nLastTick;
+	pData->m_nPrevTick = pFrom->m_nPrevTick;
+	memcpy( pData->m_pTicks, pFrom->m_pTicks, pFrom->m_nProps * sizeof( int ) );
+	memcpy( pData->m_pLastTickBits, pFrom->m_pLastTickBits, CalcNumIntsForBits( pFrom->m_nProps ) * sizeof( uint32 ) );
+	return pData;
+}
+
+
+//-----------------------------------------------------------------------------
+// Writes out the indices of the ticks that are > iTick, in order
+//-----------------------------------------------------------------------------
+static int ScanChangeTicks( const int *pTicks, int nProps, int iTick, int *iOutProps )
+{
+	int nOutProps = 0;
+	for ( int i = 0; i < nProps; i++ )
+	{
+		if ( pTicks[i] > iTick )
+		{
+			iOutProps[nOutProps] = i;
+			++nOutProps;
+		}
+	}
+	return nOutProps;
+}
+
+#if !defined( _X360 )
+// Positions of the set bits of every 4 bit mask, and how many there are
+static const int s_pMaskOffsets[16][4] = 
+{
+	{ 0, 0, 0, 0 }, { 0, 0, 0, 0 }, { 1, 0, 0, 0 }, { 0, 1, 0, 0 },
+	{ 2, 0, 0, 0 }, { 0, 2, 0, 0 }, { 1, 2, 0, 0 }, { 0, 1, 2, 0 },
+	{ 3, 0, 0, 0 }, { 0, 3, 0, 0 }, { 1, 3, 0, 0 }, { 0, 1, 3, 0 },
+	{ 2, 3, 0, 0 }, { 0, 2, 3, 0 }, { 1, 2, 3, 0 }, { 0, 1, 2, 3 },
+};
+static const int s_pMaskCounts[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+
+// Compares 16 ticks at a time and skips blocks where nothing changed, which is
+// nearly all of them. Set lanes are packed into the output with one store.
+static int ScanChangeTicksSSE2( const int *pTicks, int nProps, int iTick, int *iOutProps, int nMaxOutProps )
+{
+	const __m128i vTick = _mm_set1_epi32( iTick );
+	int nTicks = ChangeFrameTickCount( nProps );
+	int nOutProps = 0;
+
+	int i = 0;
+	for ( ; i + 16 <= nTicks; i += 16 )
+	{
+		int nMask0 = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)( pTicks + i ) ), vTick ) ) );
+		int nMask1 = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)( pTicks + i + 4 ) ), vTick ) ) );
+		int nMask2 = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)( pTicks + i + 8 ) ), vTick ) ) );
+		int nMask3 = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)( pTicks + i + 12 ) ), vTick ) ) );
+		int nMask = nMask0 | ( nMask1 << 4 ) | ( nMask2 << 8 ) | ( nMask3 << 12 );
+		if ( !nMask )
+			continue;
+
+		for ( int j = 0; j < 16; j += 4, nMask >>= 4 )
+		{
+			int nLaneMask = nMask & 0xf;
+			if ( !nLaneMask )
+				continue;
+
+			// The store may write past the last set lane, but never past nMaxOutProps
+			if ( nOutProps + 4 <= nMaxOutProps )
+			{
+				__m128i vIndices = _mm_add_epi32( _mm_loadu_si128( (const __m128i*)s_pMaskOffsets[nLaneMask] ), _mm_set1_epi32( i + j ) );
+				_mm_storeu_si128( (__m128i*)( iOutProps + nOutProps ), vIndices );
+			}
+			else
+			{
+				for ( int k = 0; k < s_pMaskCounts[nLaneMask]; ++k )
+				{
+					iOutProps[nOutProps + k] = i + j + s_pMaskOffsets[nLaneMask][k];
+				}
+			}
+			nOutProps += s_pMaskCounts[nLaneMask];
+		}
+	}
+
+	for ( ; i < nTicks; i += 4 )
+	{
+		int nLaneMask = _mm_movemask_ps( _mm_castsi128_ps( _mm_cmpgt_epi32( _mm_load_si128( (const __m128i*)( pTicks + i ) ), vTick ) ) );
+		for ( int k = 0; k < s_pMaskCounts[nLaneMask]; ++k )
+		{
+			iOutProps[nOutProps + k] = i + s_pMaskOffsets[nLaneMask][k];
+		}
+		nOutProps += s_pMaskCounts[nLaneMask];
+	}
+
+	return nOutProps;
+}
+#endif
+
+
 class CChangeFrameList : public IChangeFrameList
 {
 public:
 
 	void	Init( int nProperties, int iCurTick )
 	{
-		m_ChangeTicks.SetSize( nProperties );
+		m_pData = AllocChangeFrameData( nProperties );
 		for ( int i=0; i < nProperties; i++ )
-			m_ChangeTicks[i] = iCurTick;
+			m_pData->m_pTicks[i] = iCurTick;
+
+		// Everything changed at iCurTick
+		m_pData->m_nLastTick = iCurTick;
+		m_pData->m_nPrevTick = INT_MIN;
+		int nBitInts = CalcNumIntsForBits( nProperties );
+		for ( int i=0; i < nBitInts; i++ )
+			m_pData->m_pLastTickBits[i] = ~0u;
+		if ( nProperties & 31 )
+			m_pData->m_pLastTickBits[nBitInts-1] = ( 1u << ( nProperties & 31 ) ) - 1;
 	}
 
 
@@ -36,52 +203,90 @@ public:
 
 	virtual IChangeFrameList* Copy()
 	{
+		// Share the ticks until one of the lists changes
 		CChangeFrameList *pRet = new CChangeFrameList;
-
-		int numProps = m_ChangeTicks.Count();
-
-		pRet->m_ChangeTicks.SetSize( numProps );
-
-		for ( int i=0; i < numProps; i++ )
-		{
-			pRet->m_ChangeTicks[ i ] = m_ChangeTicks[ i ];
-		}
-
+		pRet->m_pData = m_pData;
+		++m_pData->m_nRefCount;
 		return pRet;
-
 	}
 
 	virtual int		GetNumProps()
 	{
-		return m_ChangeTicks.Count();
+		return m_pData->m_nProps;
 	}
 
 	virtual void	SetChangeTick( const int *pPropIndices, int nPropIndices, const int iTick )
 	{
-		for ( int i=0; i < nPropIndices; i++ )
+		if ( !nPropIndices )
+			return;
+
+		MakeUnique();
+
+		ChangeFrameData_t *pData = m_pData;
+		if ( iTick > pData->m_nLastTick )
 		{
-			m_ChangeTicks[ pPropIndices[i] ] = iTick;
+			// Whatever changed before is now older than the last tick
+			pData->m_nPrevTick = pData->m_nLastTick;
+			pData->m_nLastTick = iTick;
+			memset( pData->m_pLastTickBits, 0, CalcNumIntsForBits( pData->m_nProps ) * sizeof( uint32 ) );
+		}
+
+		if ( iTick == pData->m_nLastTick )
+		{
+			for ( int i=0; i < nPropIndices; i++ )
+			{
+				int iProp = pPropIndices[i];
+				pData->m_pTicks[ iProp ] = iTick;
+				pData->m_pLastTickBits[ iProp >> LOG2_BITS_PER_INT ] |= GetBitForBitnum( iProp );
+			}
+		}
+		else
+		{
+			// Going back in time, these props no longer belong to the last tick
+			pData->m_nPrevTick = max( pData->m_nPrevTick, iTick );
+			for ( int i=0; i < nPropIndices; i++ )
+			{
+				int iProp = pPropIndices[i];
+				pData->m_pTicks[ iProp ] = iTick;
+				pData->m_pLastTickBits[ iProp >> LOG2_BITS_PER_INT ] &= ~GetBitForBitnum( iProp );
+			}
 		}
 	}
 
 	virtual int		GetPropsChangedAfterTick( int iTick, int *iOutProps, int nMaxOutProps )
 	{
-		int nOutProps = 0;
-
-		int c = m_ChangeTicks.Count();
+		const ChangeFrameData_t *pData = m_pData;
+		int c = pData->m_nProps;
 		
 		Assert( c <= nMaxOutProps );
 
-		for ( int i=0; i < c; i++ )
+		if ( iTick >= pData->m_nLastTick )
+			return 0;
+
+		if ( iTick >= pData->m_nPrevTick )
 		{
-			if ( m_ChangeTicks[i] > iTick )
+			// Only the props that changed at the last tick are newer than iTick
+			int nOutProps = 0;
+			int nBitInts = CalcNumIntsForBits( c );
+			for ( int i=0; i < nBitInts; i++ )
 			{
-				iOutProps[nOutProps] = i;
-				++nOutProps;
+				uint32 nBits = pData->m_pLastTickBits[i];
+				while ( nBits )
+				{
+					int iBit = FirstBitInWord( nBits, 0 );
+					iOutProps[nOutProps] = ( i << LOG2_BITS_PER_INT ) + iBit;
+					++nOutProps;
+					nBits &= nBits - 1;
+				}
 			}
+			return nOutProps;
 		}
 
-		return nOutProps;
+#if !defined( _X360 )
+		if ( MathLib_SSE2Enabled() )
+			return ScanChangeTicksSSE2( pData->m_pTicks, c, iTick, iOutProps, nMaxOutProps );
+#endif
+		return ScanChangeTicks( pData->m_pTicks, c, iTick, iOutProps );
 	}
 
 // IChangeFrameList implementation.
@@ -89,11 +294,30 @@ protected:
 
 	virtual			~CChangeFrameList()
 	{
+		if ( --m_pData->m_nRefCount == 0 )
+		{
+			FreeChangeFrameData( m_pData );
+		}
 	}
 
 private:
-	// Change frames for each property.
-	CUtlVector<int>		m_ChangeTicks;
+	// Gives this list its own ticks before it changes them
+	void	MakeUnique()
+	{
+		if ( m_pData->m_nRefCount == 1 )
+			return;
+
+		ChangeFrameData_t *pData = CopyChangeFrameData( m_pData );
+		if ( --m_pData->m_nRefCount == 0 )
+		{
+			// The other owners let go while we were copying
+			FreeChangeFrameData( m_pData );
+		}
+		m_pData = pData;
+	}
+
+	// Change frames for each property, maybe shared with other lists.
+	ChangeFrameData_t	*m_pData;
 };
 
 
@@ -105,4 +329,505 @@ IChangeFrameList* AllocChangeFrameList( int nProperties, int iCurTick )
 }
 
 
+//-----------------------------------------------------------------------------
+// Recording of the change list traffic of a server session, so the list
+// implementation can be timed on real data with sv_changeframe_bench
+//-----------------------------------------------------------------------------
+#define CHANGEFRAME_RECORD_ID		(('R'<<24)|('F'<<16)|('H'<<8)|('C'))
+#define CHANGEFRAME_RECORD_VERSION	1
+
+enum ChangeFrameRecordOp_t
+{
+	CHANGEFRAME_RECORD_PACK = 0,	// entity, mode, tick, number of props, changed props
+	CHANGEFRAME_RECORD_DELTA,		// entity, from tick
+};
+
+class CChangeFrameRecorder
+{
+public:
+	CChangeFrameRecorder() : m_Buffer( 0, 0, 0 ), m_bRecording( false )
+	{
+		m_pFileName[0] = 0;
+	}
+
+	bool IsRecording() const
+	{
+		return m_bRecording;
+	}
+
+	// NULL file name keeps the recording in memory
+	void Start( const char *pFileName )
+	{
+		AUTO_LOCK_FM( m_Mutex );
+		Q_strncpy( m_pFileName, pFileName ? pFileName : "", sizeof( m_pFileName ) );
+		m_Buffer.Purge();
+		m_Buffer.PutInt( CHANGEFRAME_RECORD_ID );
+		m_Buffer.PutInt( CHANGEFRAME_RECORD_VERSION );
+		m_bRecording = true;
+	}
+
+	void Stop()
+	{
+		AUTO_LOCK_FM( m_Mutex );
+		if ( !m_bRecording )
+			return;
+
+		m_bRecording = false;
+		if ( m_pFileName[0] )
+		{
+			if ( g_pFileSystem->WriteFile( m_pFileName, "MOD", m_Buffer ) )
+			{
+				Msg( "Wrote %d bytes of change list traffic to %s\n", m_Buffer.TellPut(), m_pFileName );
+			}
+			else
+			{
+				Warning( "Unable to write %s\n", m_pFileName );
+			}
+			m_Buffer.Purge();
+		}
+	}
+
+	void RecordPack( int iEntity, ChangeFrameRecordMode_t mode, int iTick, int nProps, const int *pChangedProps, int nChangedProps )
+	{
+		AUTO_LOCK_FM( m_Mutex );
+		if ( !m_bRecording )
+			return;
+
+		m_Buffer.PutUnsignedChar( CHANGEFRAME_RECORD_PACK );
+		m_Buffer.PutUnsignedShort( iEntity );
+		m_Buffer.PutUnsignedChar( mode );
+		m_Buffer.PutInt( iTick );
+		m_Buffer.PutUnsignedShort( nProps );
+		m_Buffer.PutUnsignedShort( nChangedProps );
+		for ( int i = 0; i < nChangedProps; ++i )
+		{
+			m_Buffer.PutUnsignedShort( pChangedProps[i] );
+		}
+	}
+
+	void RecordDelta( int iEntity, int iFromTick )
+	{
+		AUTO_LOCK_FM( m_Mutex );
+		if ( !m_bRecording )
+			return;
+
+		m_Buffer.PutUnsignedChar( CHANGEFRAME_RECORD_DELTA );
+		m_Buffer.PutUnsignedShort( iEntity );
+		m_Buffer.PutInt( iFromTick );
+	}
+
+	CUtlBuffer &GetBuffer()
+	{
+		return m_Buffer;
+	}
+
+private:
+	CThreadFastMutex	m_Mutex;
+	CUtlBuffer			m_Buffer;
+	char				m_pFileName[MAX_PATH];
+	bool				m_bRecording;
+};
+
+static CChangeFrameRecorder s_ChangeFrameRecorder;
+
+bool ChangeFrameList_IsRecording()
+{
+	return s_ChangeFrameRecorder.IsRecording();
+}
+
+void ChangeFrameList_RecordPack( int iEntity, ChangeFrameRecordMode_t mode, int iTick, int nProps, const int *pChangedProps, int nChangedProps )
+{
+	s_ChangeFrameRecorder.RecordPack( iEntity, mode, iTick, nProps, pChangedProps, nChangedProps );
+}
+
+void ChangeFrameList_RecordDelta( int iEntity, int iFromTick )
+{
+	s_ChangeFrameRecorder.RecordDelta( iEntity, iFromTick );
+}
+
+
+//-----------------------------------------------------------------------------
+// The plain one int per prop list, deep copied. The benchmark times the
+// shared lists against it and checks they give the same answers.
+//-----------------------------------------------------------------------------
+class CSimpleChangeFrameList : public IChangeFrameList
+{
+public:
+	void	Init( int nProperties, int iCurTick )
+	{
+		m_ChangeTicks.SetSize( nProperties );
+		for ( int i=0; i < nProperties; i++ )
+			m_ChangeTicks[i] = iCurTick;
+	}
+
+	virtual void	Release()
+	{
+		delete this;
+	}
+
+	virtual IChangeFrameList* Copy()
+	{
+		CSimpleChangeFrameList *pRet = new CSimpleChangeFrameList;
+		pRet->m_ChangeTicks = m_ChangeTicks;
+		return pRet;
+	}
+
+	virtual int		GetNumProps()
+	{
+		return m_ChangeTicks.Count();
+	}
+
+	virtual void	SetChangeTick( const int *pPropIndices, int nPropIndices, const int iTick )
+	{
+		for ( int i=0; i < nPropIndices; i++ )
+		{
+			m_ChangeTicks[ pPropIndices[i] ] = iTick;
+		}
+	}
+
+	virtual int		GetPropsChangedAfterTick( int iTick, int *iOutProps, int nMaxOutProps )
+	{
+		Assert( m_ChangeTicks.Count() <= nMaxOutProps );
+		return ScanChangeTicks( m_ChangeTicks.Base(), m_ChangeTicks.Count(), iTick, iOutProps );
+	}
+
+protected:
+	virtual			~CSimpleChangeFrameList()
+	{
+	}
+
+private:
+	CUtlVector<int>		m_ChangeTicks;
+};
+
+// How many snapshots keep an entity's old lists alive during a replay
+#define CHANGEFRAME_REPLAY_HISTORY	16
+
+struct ChangeFrameReplay_t
+{
+	ChangeFrameReplay_t() : m_nPacks( 0 ), m_nDeltas( 0 ), m_nChangedProps( 0 )
+	{
+		m_PackTime.Init();
+		m_DeltaTime.Init();
+	}
+
+	CUtlVector<int>	m_Results;		// Every delta's props, back to back, with the count in front
+	int				m_nPacks;
+	int				m_nDeltas;
+	int				m_nChangedProps;
+	CCycleCount		m_PackTime;
+	CCycleCount		m_DeltaTime;
+};
+
+struct ChangeFrameReplayEntity_t
+{
+	IChangeFrameList	*m_pHistory[CHANGEFRAME_REPLAY_HISTORY];
+	int					m_nHead;
+};
+
+//-----------------------------------------------------------------------------
+// Plays a recording back with either list implementation. Snagged lists move
+// to the new snapshot, copied ones stay alive in the entity's history until it
+// rolls over, like the snapshots of a SourceTV server.
+//-----------------------------------------------------------------------------
+static bool ReplayChangeFrames( CUtlBuffer &buf, bool bSimple, bool bKeepResults, ChangeFrameReplay_t *pReplay )
+{
+	buf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	if ( ( buf.GetInt() != CHANGEFRAME_RECORD_ID ) || ( buf.GetInt() != CHANGEFRAME_RECORD_VERSION ) )
+	{
+		Warning( "Not a change list recording, or the wrong version\n" );
+		return false;
+	}
+
+	CUtlVector<ChangeFrameReplayEntity_t> entities;
+	entities.SetCount( 0x10000 );
+	memset( entities.Base(), 0, entities.Count() * sizeof( ChangeFrameReplayEntity_t ) );
+
+	int changedProps[MAX_DATATABLE_PROPS];
+	int outProps[MAX_DATATABLE_PROPS];
+	CFastTimer timer;
+	bool bOk = true;
+
+	while ( bOk && ( buf.GetBytesRemaining() > 0 ) )
+	{
+		int nOp = buf.GetUnsignedChar();
+		ChangeFrameReplayEntity_t &entity = entities[ buf.GetUnsignedShort() ];
+		IChangeFrameList *&pCurrent = entity.m_pHistory[entity.m_nHead];
+
+		if ( nOp == CHANGEFRAME_RECORD_PACK )
+		{
+			int nMode = buf.GetUnsignedChar();
+			int iTick = buf.GetInt();
+			int nProps = buf.GetUnsignedShort();
+			int nChangedProps = buf.GetUnsignedShort();
+			if ( ( nProps > MAX_DATATABLE_PROPS ) || ( nChangedProps > nProps ) )
+			{
+				bOk = false;
+				break;
+			}
+			for ( int i = 0; i < nChangedProps; ++i )
+			{
+				changedProps[i] = buf.GetUnsignedShort();
+				if ( changedProps[i] >= nProps )
+				{
+					bOk = false;
+				}
+			}
+			if ( !bOk )
+				break;
+
+			if ( ( nMode != CHANGEFRAME_RECORD_NEW ) && ( !pCurrent || ( pCurrent->GetNumProps() != nProps ) ) )
+			{
+				// Recording started after this entity was packed, start it off here
+				nMode = CHANGEFRAME_RECORD_NEW;
+			}
+
+			IChangeFrameList *pNext = NULL;
+			IChangeFrameList *pDropped = NULL;
+
+			timer.Start();
+			if ( nMode == CHANGEFRAME_RECORD_NEW )
+			{
+				if ( bSimple )
+				{
+					CSimpleChangeFrameList *pList = new CSimpleChangeFrameList;
+					pList->Init( nProps, iTick );
+					pNext = pList;
+				}
+				else
+				{
+					pNext = AllocChangeFrameList( nProps, iTick );
+				}
+			}
+			else if ( nMode == CHANGEFRAME_RECORD_COPY )
+			{
+				pNext = pCurrent->Copy();
+				pNext->SetChangeTick( changedProps, nChangedProps, iTick );
+			}
+			else
+			{
+				pNext = pCurrent;
+				pCurrent = NULL;
+				pNext->SetChangeTick( changedProps, nChangedProps, iTick );
+			}
+			timer.End();
+			pReplay->m_PackTime += timer.GetDuration();
+			++pReplay->m_nPacks;
+
+			entity.m_nHead = ( entity.m_nHead + 1 ) % CHANGEFRAME_REPLAY_HISTORY;
+			pDropped = entity.m_pHistory[entity.m_nHead];
+			entity.m_pHistory[entity.m_nHead] = pNext;
+			if ( pDropped )
+			{
+				pDropped->Release();
+			}
+		}
+		else if ( nOp == CHANGEFRAME_RECORD_DELTA )
+		{
+			int iFromTick = buf.GetInt();
+			if ( !pCurrent )
+				continue;
+
+			timer.Start();
+			int nOutProps = pCurrent->GetPropsChangedAfterTick( iFromTick, outProps, ARRAYSIZE( outProps ) );
+			timer.End();
+			pReplay->m_DeltaTime += timer.GetDuration();
+			++pReplay->m_nDeltas;
+			pReplay->m_nChangedProps += nOutProps;
+
+			if ( bKeepResults )
+			{
+				pReplay->m_Results.AddToTail( nOutProps );
+				pReplay->m_Results.AddMultipleToTail( nOutProps, outProps );
+			}
+		}
+		else
+		{
+			bOk = false;
+		}
+
+		if ( !buf.IsValid() )
+		{
+			bOk = false;
+		}
+	}
+
+	if ( !bOk )
+	{
+		Warning( "Bad or truncated change list recording\n" );
+	}
+
+	for ( int i = 0; i < entities.Count(); ++i )
+	{
+		for ( int j = 0; j < CHANGEFRAME_REPLAY_HISTORY; ++j )
+		{
+			if ( entities[i].m_pHistory[j] )
+			{
+				entities[i].m_pHistory[j]->Release();
+			}
+		}
+	}
+
+	return bOk;
+}
+
+static void CompareChangeFrameLists( CUtlBuffer &buf, int nIterations )
+{
+	ChangeFrameReplay_t simple, shared;
+	if ( !ReplayChangeFrames( buf, true, true, &simple ) || !ReplayChangeFrames( buf, false, true, &shared ) )
+		return;
+
+	Msg( "%d packs, %d deltas, %d changed props\n", simple.m_nPacks, simple.m_nDeltas, simple.m_nChangedProps );
+
+	if ( ( simple.m_Results.Count() != shared.m_Results.Count() ) ||
+		( simple.m_Results.Count() && memcmp( simple.m_Results.Base(), shared.m_Results.Base(), simple.m_Results.Count() * sizeof( int ) ) ) )
+	{
+		Warning( "The shared change lists disagree with the plain ones!\n" );
+	}
+	else
+	{
+		Msg( "Both change lists found the same props for every delta\n" );
+	}
+
+	// Alternate so neither one gets a warmer cache
+	ChangeFrameReplay_t timings[2];
+	for ( int i = 0; i < nIterations; ++i )
+	{
+		ReplayChangeFrames( buf, true, false, &timings[0] );
+		ReplayChangeFrames( buf, false, false, &timings[1] );
+	}
+
+	static const char *s_pListNames[2] = { "plain", "shared" };
+	for ( int i = 0; i < 2; ++i )
+	{
+		const ChangeFrameReplay_t &timing = timings[i];
+		Msg( "%-6s : pack %8.3f ms, delta %8.3f ms per replay (%.3f us per delta)\n", s_pListNames[i],
+			timing.m_PackTime.GetMillisecondsF() / nIterations,
+			timing.m_DeltaTime.GetMillisecondsF() / nIterations,
+			timing.m_nDeltas ? timing.m_DeltaTime.GetMicrosecondsF() / timing.m_nDeltas : 0.0 );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// A made up session for when there's no recording at hand: a few big classes
+// and many small ones, most entities changing a handful of props per tick,
+// and clients that mostly ack the last tick but sometimes fall behind
+//-----------------------------------------------------------------------------
+static void BuildRandomChangeFrameRecording( CChangeFrameRecorder *pRecorder, int nEntities, int nClients, int nTicks, bool bCopy, int nSeed )
+{
+	CUniformRandomStream random;
+	random.SetSeed( nSeed );
+
+	CUtlVector<int> numProps;
+	numProps.SetCount( nEntities );
+	for ( int i = 0; i < nEntities; ++i )
+	{
+		numProps[i] = ( random.RandomFloat() < 0.2f ) ? random.RandomInt( 300, 800 ) : random.RandomInt( 20, 200 );
+	}
+
+	int changedProps[MAX_DATATABLE_PROPS];
+	for ( int iTick = 1; iTick <= nTicks; ++iTick )
+	{
+		for ( int i = 0; i < nEntities; ++i )
+		{
+			if ( iTick == 1 )
+			{
+				pRecorder->RecordPack( i, CHANGEFRAME_RECORD_NEW, iTick, numProps[i], NULL, 0 );
+				continue;
+			}
+
+			if ( random.RandomFloat() > 0.4f )
+				continue;
+
+			// Changes cluster at the front of the prop list (origin, angles, animation)
+			int nChangedProps = ( random.RandomFloat() < 0.9f ) ? random.RandomInt( 1, 8 ) : random.RandomInt( 8, 40 );
+			nChangedProps = min( nChangedProps, numProps[i] );
+			int iProp = -1;
+			for ( int j = 0; j < nChangedProps; ++j )
+			{
+				int nRemaining = nChangedProps - j;
+				int nStep = max( 1, min( random.RandomInt( 1, 6 ), numProps[i] - iProp - nRemaining ) );
+				iProp += nStep;
+				changedProps[j] = iProp;
+			}
+			pRecorder->RecordPack( i, bCopy ? CHANGEFRAME_RECORD_COPY : CHANGEFRAME_RECORD_SNAG, iTick, numProps[i], changedProps, nChangedProps );
+		}
+
+		for ( int j = 0; j < nClients; ++j )
+		{
+			int iFromTick = iTick - ( ( random.RandomFloat() < 0.8f ) ? 1 : random.RandomInt( 2, 12 ) );
+			for ( int i = 0; i < nEntities; ++i )
+			{
+				pRecorder->RecordDelta( i, iFromTick );
+			}
+		}
+	}
+}
+
+CON_COMMAND( sv_changeframe_record, "Records the server's entity change list traffic to a file. Usage: sv_changeframe_record <filename>" )
+{
+	if ( args.ArgC() != 2 )
+	{
+		Msg( "Usage: sv_changeframe_record <filename>\n" );
+		return;
+	}
+
+	if ( s_ChangeFrameRecorder.IsRecording() )
+	{
+		Warning( "Already recording change list traffic\n" );
+		return;
+	}
+
+	char pFileName[MAX_PATH];
+	Q_strncpy( pFileName, args[1], sizeof( pFileName ) );
+	Q_DefaultExtension( pFileName, ".cfr", sizeof( pFileName ) );
 
+	s_ChangeFrameRecorder.Start( pFileName );
+	Msg( "Recording change list traffic to %s\n", pFileName );
+}
+
+CON_COMMAND( sv_changeframe_stoprecord, "Stops recording entity change list traffic." )
+{
+	if ( !s_ChangeFrameRecorder.IsRecording() )
+	{
+		Msg( "Not recording change list traffic\n" );
+		return;
+	}
+
+	s_ChangeFrameRecorder.Stop();
+}
+
+CON_COMMAND( sv_changeframe_bench, "Times entity packing and delta prop lookups with the shared change lists against plain per prop ticks. Usage: sv_changeframe_bench [filename] [iterations], or a made up session without a file" )
+{
+	int nIterations = ( args.ArgC() > 2 ) ? max( atoi( args[2] ), 1 ) : 10;
+
+	if ( args.ArgC() > 1 )
+	{
+		char pFileName[MAX_PATH];
+		Q_strncpy( pFileName, args[1], sizeof( pFileName ) );
+		Q_DefaultExtension( pFileName, ".cfr", sizeof( pFileName ) );
+
+		CUtlBuffer buf;
+		if ( !g_pFileSystem->ReadFile( pFileName, "MOD", buf ) )
+		{
+			Warning( "Unable to read %s\n", pFileName );
+			return;
+		}
+
+		CompareChangeFrameLists( buf, nIterations );
+		return;
+	}
+
+	for ( int i = 0; i < 2; ++i )
+	{
+		bool bCopy = ( i != 0 );
+		Msg( "Made up session, 1500 entities, 16 clients, %s lists:\n", bCopy ? "copied (SourceTV)" : "snagged" );
+
+		CChangeFrameRecorder recorder;
+		recorder.Start( NULL );
+		BuildRandomChangeFrameRecording( &recorder, 1500, 16, 100, bCopy, 1 );
+		recorder.Stop();
+
+		CompareChangeFrameLists( recorder.GetBuffer(), nIterations );
+	}
+}
@@ -39,7 +39,7 @@ public:
 	// Get a list of all properties with a change frame > iFrame.
 	virtual int		GetPropsChangedAfterTick( int iTick, int *iOutProps, int nMaxOutProps ) = 0;
 
-	virtual IChangeFrameList* Copy() = 0; // return a copy of itself
+	virtual IChangeFrameList* Copy() = 0; // return a copy of itself (shares the ticks until one of them changes)
 
 
 protected:
@@ -53,4 +53,17 @@ protected:
 IChangeFrameList* AllocChangeFrameList( int nProperties, int iCurFrame );
 
 
+// Recording of the change list traffic for sv_changeframe_bench.
+enum ChangeFrameRecordMode_t
+{
+	CHANGEFRAME_RECORD_NEW = 0,		// AllocChangeFrameList
+	CHANGEFRAME_RECORD_SNAG,		// Taken from the previous PackedEntity and updated
+	CHANGEFRAME_RECORD_COPY,		// Copied from the previous PackedEntity and updated
+};
+
+bool ChangeFrameList_IsRecording();
+void ChangeFrameList_RecordPack( int iEntity, ChangeFrameRecordMode_t mode, int iTick, int nProps, const int *pChangedProps, int nChangedProps );
+void ChangeFrameList_RecordDelta( int iEntity, int iFromTick );
+
+
 #endif // CHANGEFRAMELIST_H
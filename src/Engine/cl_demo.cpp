@@ -17,6 +17,7 @@
 #include "gl_matsysiface.h"
 #include "materialsystem/imaterialsystemhardwareconfig.h"
 #include "tier0/icommandline.h"
+#include "tier0/fasttimer.h"
 #include "vengineserver_impl.h"
 #include "console.h"
 #include "dt_common_eng.h"
@@ -856,7 +857,11 @@ void CDemoPlayer::SkipToTick( int tick, bool bRelative, bool bPause )
 	if ( tick < 0 )
 		return;
 
-	if ( tick < GetPlaybackTick() )
+	if ( SeekToKeyframe( tick ) )
+	{
+		// read forward from the keyframe
+	}
+	else if ( tick < GetPlaybackTick() )
 	{
 		// we have to reload the whole demo file
 		// we need to create a temp copy of the filename
@@ -877,6 +882,45 @@ void CDemoPlayer::SkipToTick( int tick, bool bRelative, bool bPause )
 		PausePlayback( -1 );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Continues reading at the last keyframe before tick, if that's
+//			backwards or further ahead than where we are now
+//-----------------------------------------------------------------------------
+bool CDemoPlayer::SeekToKeyframe( int tick )
+{
+	// a keyframe only replaces game state, we must be past signon
+	if ( !cl.IsActive() )
+		return false;
+
+	int index = m_DemoFile.FindKeyframe( tick );
+	if ( index < 0 )
+		return false;
+
+	const demoindexentry_t &keyframe = m_DemoFile.m_KeyframeIndex[index];
+
+	if ( tick >= GetPlaybackTick() && keyframe.tick <= GetPlaybackTick() )
+		return false; // just read on
+
+	if ( demo_debug.GetBool() )
+	{
+		Msg( "Seeking to keyframe at tick %d for tick %d\n", keyframe.tick, tick );
+	}
+
+	m_DemoFile.SeekTo( keyframe.fileoffset, true );
+	m_nKeyframePos = keyframe.fileoffset;
+	m_nStartTick = host_tickcount - keyframe.tick;
+
+	// the keyframe recreates all entities, drop the frames later deltas
+	// could be decoded against
+	cl.ForceFullUpdate();
+	cl.DeleteClientFrames( -1 );
+
+	m_DestCmdInfo.RemoveAll();
+	ResetDemoInterpolation();
+
+	return true;
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: Read in next demo message and send to local client over network channel, if it's time.
 // Output : bool 
@@ -941,6 +985,13 @@ bool CDemoPlayer::ParseAheadForInterval( int curtick, int intervalticks )
 					m_DemoFile.ReadUserCmd( NULL, dummy );
 				}
 				break;
+			case dem_keyframe:
+				{
+					m_DemoFile.ReadCmdInfo( nextinfo );
+					m_DemoFile.ReadSequenceInfo( dummy, dummy );
+					m_DemoFile.ReadRawData( NULL, 0 );
+				}
+				break;
 			default:
 				{
 					swallowmessages = false;
@@ -1030,6 +1081,17 @@ netpacket_t *CDemoPlayer::ReadPacket( void )
 
 		m_DemoFile.ReadCmdHeader( cmd, tick );
 
+		if ( cmd == dem_keyframe && curpos != m_nKeyframePos )
+		{
+			// keyframes are only read after seeking to them
+			democmdinfo_t info;
+			int dummy;
+			m_DemoFile.ReadCmdInfo( info );
+			m_DemoFile.ReadSequenceInfo( dummy, dummy );
+			m_DemoFile.ReadRawData( NULL, 0 );
+			continue;
+		}
+
 		// always read control commands 
 		if ( !IsControlCommand( cmd ) )
 		{
@@ -1174,7 +1236,17 @@ netpacket_t *CDemoPlayer::ReadPacket( void )
 		}
 	}
 
-	if ( cmd == dem_packet )
+	if ( cmd == dem_keyframe )
+	{
+		if ( demo_debug.GetBool() )
+		{
+			Msg( "%d dem_keyframe\n", tick );
+		}
+
+		m_nKeyframePos = -1;
+	}
+
+	if ( cmd == dem_packet || cmd == dem_keyframe )
 	{
 		// remember last frame we read a dem_packet update
 		m_nTimeDemoCurrentFrame = host_framecount;
@@ -1483,6 +1555,7 @@ CDemoPlayer::CDemoPlayer()
 	m_bPlayingBack = false;
 	m_bPlaybackPaused = false;
 	m_nSkipToTick = -1;
+	m_nKeyframePos = -1;
 	m_nSnapshotTick = 0;
 	m_SnapshotFilename[0] = 0;
 	m_bResetInterpolation = false;
@@ -1559,6 +1632,7 @@ bool CDemoPlayer::StartPlayback( const char *filename, bool bAsTimeDemo )
 	m_bTimeDemo = bAsTimeDemo;
 	m_nTimeDemoCurrentFrame = -1;
 	m_nTimeDemoStartFrame = -1;
+	m_nKeyframePos = -1;
 
 	if ( m_bTimeDemo )
 	{
@@ -1812,6 +1886,152 @@ static bool ComputeNextIncrementalDemoFilename( char *name, int namesize )
 	return false;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Reads on until the first packet at or after tick, like skipping
+//			playback does, without decoding anything
+//-----------------------------------------------------------------------------
+static void CL_DemoSeekBench_ReadToTick( CDemoFile &demofile, int tick, int &nPackets )
+{
+	bool bFirst = true;
+
+	while ( true )
+	{
+		unsigned char cmd;
+		int cmdtick, dummy;
+		democmdinfo_t info;
+
+		int curpos = demofile.GetCurPos( true );
+		demofile.ReadCmdHeader( cmd, cmdtick );
+
+		switch ( cmd )
+		{
+		case dem_stop:
+			return;
+		case dem_synctick:
+			break;
+		case dem_consolecmd:
+			demofile.ReadConsoleCommand();
+			break;
+		case dem_datatables:
+			demofile.ReadNetworkDataTables( NULL );
+			break;
+		case dem_usercmd:
+			demofile.ReadUserCmd( NULL, dummy );
+			break;
+		default:
+			{
+				// only the keyframe we started at is read, others are skipped
+				bool bRead = ( cmd != dem_keyframe ) || bFirst;
+
+				if ( bRead && cmd != dem_signon && cmdtick >= tick )
+				{
+					demofile.SeekTo( curpos, true );
+					return;
+				}
+
+				demofile.ReadCmdInfo( info );
+				demofile.ReadSequenceInfo( dummy, dummy );
+				demofile.ReadRawData( NULL, 0 );
+
+				if ( bRead )
+				{
+					nPackets++;
+				}
+			}
+			break;
+		}
+
+		bFirst = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Measures how much of a demo has to be read to seek to ticks spread
+//			over its length, from the start of the file and from the nearest
+//			keyframe. Only the file is walked, packets aren't decoded, so the
+//			packet counts are the better measure of the real playback cost.
+//-----------------------------------------------------------------------------
+void CL_DemoSeekBench_f( const CCommand &args )
+{
+	if ( cmd_source != src_command )
+		return;
+
+	if ( args.ArgC() < 2 )
+	{
+		ConMsg ("demo_seekbench <demoname> [seeks] : measures seek cost with and without keyframes\n");
+		return;
+	}
+
+	char name[MAX_OSPATH];
+	Q_strncpy( name, args[1], sizeof( name ) );
+	Q_DefaultExtension( name, ".dem", sizeof( name ) );
+
+	CDemoFile demofile;
+
+	if ( !demofile.Open( name, true ) )
+	{
+		ConMsg ("ERROR: couldn't open.\n");
+		return;
+	}
+
+	demoheader_t *header = demofile.ReadDemoHeader();
+
+	if ( !header )
+	{
+		ConMsg( "Failed reading demo header.\n" );
+		demofile.Close();
+		return;
+	}
+
+	int nSeeks = ( args.ArgC() > 2 ) ? max( 1, Q_atoi( args[2] ) ) : 8;
+	int nDataStart = demofile.GetCurPos( true );
+
+	ConMsg( "%s: %i ticks (%.1f sec), %i KB, %i keyframes\n", name, header->playback_ticks,
+		header->playback_time, demofile.GetSize() / 1024, demofile.m_KeyframeIndex.Count() );
+	ConMsg( "    tick   from start (ms, packets)   from keyframe (ms, packets)\n" );
+
+	double flStartTime = 0.0, flKeyframeTime = 0.0;
+	int nStartPackets = 0, nKeyframePackets = 0;
+	CFastTimer timer;
+
+	for ( int i = 0; i < nSeeks; i++ )
+	{
+		int tick = (int)( (int64)header->playback_ticks * ( i + 1 ) / nSeeks );
+		int nPackets = 0;
+
+		timer.Start();
+		demofile.SeekTo( nDataStart, true );
+		CL_DemoSeekBench_ReadToTick( demofile, tick, nPackets );
+		timer.End();
+
+		float flStart = timer.GetDuration().GetMillisecondsF();
+		int nStart = nPackets;
+
+		int index = demofile.FindKeyframe( tick );
+		int position = ( index >= 0 ) ? demofile.m_KeyframeIndex[index].fileoffset : nDataStart;
+		nPackets = 0;
+
+		timer.Start();
+		demofile.SeekTo( position, true );
+		CL_DemoSeekBench_ReadToTick( demofile, tick, nPackets );
+		timer.End();
+
+		float flKeyframe = timer.GetDuration().GetMillisecondsF();
+
+		ConMsg( "%8i   %8.3f %8i            %8.3f %8i\n", tick, flStart, nStart, flKeyframe, nPackets );
+
+		flStartTime += flStart;
+		flKeyframeTime += flKeyframe;
+		nStartPackets += nStart;
+		nKeyframePackets += nPackets;
+	}
+
+	ConMsg( "Average    %8.3f %8i            %8.3f %8i\n", flStartTime / nSeeks, nStartPackets / nSeeks,
+		flKeyframeTime / nSeeks, nKeyframePackets / nSeeks );
+
+	demofile.Close();
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: List the contents of a demo file.
 //-----------------------------------------------------------------------------
@@ -1864,6 +2084,11 @@ void CL_ListDemo_f( const CCommand &args )
 	ConMsg("Ticks           : %i\n", header->playback_ticks);
 	ConMsg("Frames          : %i\n", header->playback_frames);
 	ConMsg("Signon size     : %i\n", header->signonlength);
+
+	if ( demofile.m_KeyframeIndex.Count() )
+	{
+		ConMsg("Keyframes       : %i\n", demofile.m_KeyframeIndex.Count() );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -2104,6 +2329,7 @@ CON_COMMAND_AUTOCOMPLETEFILE( playdemo, CL_PlayDemo_f, "Play a recorded demo fil
 CON_COMMAND_AUTOCOMPLETEFILE( timedemo, CL_TimeDemo_f, "Play a demo and report performance info.", NULL, dem );
 CON_COMMAND_AUTOCOMPLETEFILE( timedemoquit, CL_TimeDemoQuit_f, "Play a demo, report performance info, and then exit", NULL, dem );
 CON_COMMAND_AUTOCOMPLETEFILE( listdemo, CL_ListDemo_f, "List demo file contents.", NULL, dem );
+CON_COMMAND_AUTOCOMPLETEFILE( demo_seekbench, CL_DemoSeekBench_f, "Measures demo seek cost with and without keyframes.", NULL, dem );
 CON_COMMAND_AUTOCOMPLETEFILE( benchframe, CL_BenchFrame_f, "Takes a snapshot of a particular frame in a time demo.", NULL, dem );
 
 
@@ -47,7 +47,7 @@ public: // IDemoPlayer interface implementation:
 	bool	IsPlaybackPaused( void );
 	bool	IsPlayingTimeDemo( void );
 	bool	IsSkipping( void );
-	bool	CanSkipBackwards( void ) { return false; }
+	bool	CanSkipBackwards( void ) { return m_DemoFile.m_KeyframeIndex.Count() > 0; }
 	
 	void	SetPlaybackTimeScale( float timescale );
 	void	InterpolateViewpoint(); // override viewpoint
@@ -63,6 +63,7 @@ public:	// other public functions
 	void	WriteTimeDemoResults( void );
 	bool	ParseAheadForInterval( int curtick, int intervalticks );
 	void	InterpolateDemoCommand( int targettick, DemoCommandQueue& prev, DemoCommandQueue& next );
+	bool	SeekToKeyframe( int tick );
 
 protected:
 	bool	OverrideView( democmdinfo_t& info );
@@ -78,6 +79,7 @@ public:
 	float			m_flAutoResumeTime; // how long do we pause demo playback
 	float			m_flPlaybackRateModifier;
 	int				m_nSkipToTick;	// skip to tick ASAP, -1 = off
+	int				m_nKeyframePos;	// file position of the keyframe we jumped to, -1 = none
 	
 
 	// view origin/angle interpolation:
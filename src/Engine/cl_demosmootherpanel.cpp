@@ -2565,6 +2565,14 @@ void CDemoSmootherPanel::ParseSmoothingInfo( CDemoFile &demoFile, CSmoothingCont
 					
 				}
 				break;
+			case dem_keyframe:
+				{
+					// full update for seeking, the packets around it cover the same ticks
+					demoFile.ReadCmdInfo( info );
+					demoFile.ReadSequenceInfo( dummy, dummy );
+					demoFile.ReadRawData( NULL, 0 );
+				}
+				break;
 			default:
 				{
 					swallowmessages = false;
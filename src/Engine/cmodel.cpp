@@ -2075,12 +2075,11 @@ void CM_BoxTraceAgainstLeafList( const Ray_t &ray, int *pLeafList, int nLeafCoun
 	Assert( !ray.m_IsRay || trace.allsolid || ( trace.fraction >= trace.fractionleftsolid ) );
 }
 
-void CM_BoxTrace( const Ray_t& ray, int headnode, int brushmask, bool computeEndpt, trace_t& tr )
+//-----------------------------------------------------------------------------
+// Traces a single ray using an already acquired trace info
+//-----------------------------------------------------------------------------
+static inline void CM_BoxTraceWithInfo( TraceInfo_t *pTraceInfo, const Ray_t& ray, int headnode, int brushmask, bool computeEndpt, trace_t& tr )
 {
-	VPROF("BoxTrace");
-	// for multi-check avoidance
-	TraceInfo_t *pTraceInfo = BeginTrace();		
-
 #ifdef COUNT_COLLISIONS
 	// for statistics, may be zeroed
 	g_CollisionCounts.m_Traces++;		
@@ -2095,7 +2094,6 @@ void CM_BoxTrace( const Ray_t& ray, int headnode, int brushmask, bool computeEnd
 	if (!pTraceInfo->m_pBSPData->numnodes)	
 	{
 		tr = pTraceInfo->m_trace;
-		EndTrace( pTraceInfo );
 		return;
 	}
 
@@ -2130,10 +2128,45 @@ void CM_BoxTrace( const Ray_t& ray, int headnode, int brushmask, bool computeEnd
 
 	// Copy off the results
 	tr = pTraceInfo->m_trace;
-	EndTrace( pTraceInfo );
 	Assert( !ray.m_IsRay || tr.allsolid || (tr.fraction >= tr.fractionleftsolid) );
 }
 
+void CM_BoxTrace( const Ray_t& ray, int headnode, int brushmask, bool computeEndpt, trace_t& tr )
+{
+	VPROF("BoxTrace");
+	// for multi-check avoidance
+	TraceInfo_t *pTraceInfo = BeginTrace();		
+	CM_BoxTraceWithInfo( pTraceInfo, ray, headnode, brushmask, computeEndpt, tr );
+	EndTrace( pTraceInfo );
+}
+
+
+//-----------------------------------------------------------------------------
+// Traces a batch of rays against the world. Each ray gets a fresh set of
+// brush/displacement visit counters, so the results are identical to calling
+// CM_BoxTrace on each ray; only the trace info acquisition is shared.
+//-----------------------------------------------------------------------------
+void CM_BoxTraces( const Ray_t *pRays, int nRays, int headnode, int brushmask, bool computeEndpt, trace_t *pTraces )
+{
+	VPROF("BoxTraces");
+	if ( nRays <= 0 )
+		return;
+
+	TraceInfo_t *pTraceInfo = BeginTrace();		
+	for ( int i = 0; i < nRays; ++i )
+	{
+		if ( i != 0 )
+		{
+			// Bump the visit count so brushes tested by the previous ray get tested again
+			PopTraceVisits( pTraceInfo );
+			PushTraceVisits( pTraceInfo );
+		}
+
+		CM_BoxTraceWithInfo( pTraceInfo, pRays[i], headnode, brushmask, computeEndpt, pTraces[i] );
+	}
+	EndTrace( pTraceInfo );
+}
+
 
 void CM_TransformedBoxTrace( const Ray_t& ray, int headnode, int brushmask,
 							const Vector& origin, QAngle const& angles, trace_t& tr )
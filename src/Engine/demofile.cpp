@@ -500,6 +500,8 @@ demoheader_t *CDemoFile::ReadDemoHeader()
 
 	ByteSwap_demoheader_t( m_DemoHeader );
 
+	m_KeyframeIndex.RemoveAll();
+
 	if ( !bOk )
 		return NULL;  // reading failed
 
@@ -521,7 +523,7 @@ demoheader_t *CDemoFile::ReadDemoHeader()
 		return NULL;
 	}
 
-	if ( ( m_DemoHeader.demoprotocol > DEMO_PROTOCOL) ||
+	if ( ( m_DemoHeader.demoprotocol > DEMO_PROTOCOL_KEYFRAMES ) ||
 		 ( m_DemoHeader.demoprotocol < 2 ) )
 	{
 		ConMsg ("ERROR: demo file protocol %i outdated, engine version is %i \n", 
@@ -530,9 +532,157 @@ demoheader_t *CDemoFile::ReadDemoHeader()
 		return NULL;
 	}
 
+	if ( m_DemoHeader.demoprotocol >= DEMO_PROTOCOL_KEYFRAMES )
+	{
+		// demo still plays without it, it just can't seek
+		if ( !ReadKeyframeIndex() )
+		{
+			DevMsg( "%s has no keyframe index.\n", m_szFileName );
+		}
+
+		SeekTo( sizeof(demoheader_t), true );
+	}
+
 	return &m_DemoHeader;
 }
 
+void CDemoFile::AddKeyframe( int tick, int position )
+{
+	Assert( !m_KeyframeIndex.Count() || m_KeyframeIndex.Tail().tick <= tick );
+
+	demoindexentry_t entry;
+	entry.tick = tick;
+	entry.fileoffset = position;
+	m_KeyframeIndex.AddToTail( entry );
+}
+
+int CDemoFile::FindKeyframe( int tick )
+{
+	int found = -1;
+	int lo = 0;
+	int hi = m_KeyframeIndex.Count() - 1;
+
+	while ( lo <= hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( m_KeyframeIndex[mid].tick <= tick )
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	return found;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Appends the keyframe index at the current write position, must be
+//			the last thing written to the file
+//-----------------------------------------------------------------------------
+void CDemoFile::WriteKeyframeIndex()
+{
+	demoindextrailer_t trailer;
+	Q_memset( &trailer, 0, sizeof(trailer) );
+	Q_strncpy( trailer.indexfilestamp, DEMO_INDEX_ID, sizeof(trailer.indexfilestamp) );
+	trailer.numentries = LittleDWord( m_KeyframeIndex.Count() );
+	trailer.indexoffset = LittleDWord( (int)GetCurPos( false ) );
+
+	for ( int i = 0; i < m_KeyframeIndex.Count(); i++ )
+	{
+		demoindexentry_t entry;
+		entry.tick = LittleDWord( m_KeyframeIndex[i].tick );
+		entry.fileoffset = LittleDWord( m_KeyframeIndex[i].fileoffset );
+
+#ifdef DEMO_FILE_UTLBUFFER
+		m_Buffer.Put( &entry, sizeof(entry) );
+#else
+		g_pFileSystem->Write( &entry, sizeof(entry), m_hDemoFile );
+#endif
+	}
+
+#ifdef DEMO_FILE_UTLBUFFER
+	m_Buffer.Put( &trailer, sizeof(trailer) );
+#else
+	g_pFileSystem->Write( &trailer, sizeof(trailer), m_hDemoFile );
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads the keyframe index from the end of the file. Leaves the read
+//			position undefined.
+//-----------------------------------------------------------------------------
+bool CDemoFile::ReadKeyframeIndex()
+{
+	m_KeyframeIndex.RemoveAll();
+
+	int size = GetSize();
+	if ( size < (int)( sizeof(demoheader_t) + sizeof(demoindextrailer_t) ) )
+		return false;
+
+	demoindextrailer_t trailer;
+	bool bOk;
+
+#ifdef DEMO_FILE_UTLBUFFER
+	m_Buffer.SeekGet( CUtlBuffer::SEEK_HEAD, size - sizeof(trailer) );
+	m_Buffer.Get( &trailer, sizeof(trailer) );
+	bOk = m_Buffer.IsValid();
+#else
+	g_pFileSystem->Seek( m_hDemoFile, size - sizeof(trailer), FILESYSTEM_SEEK_HEAD );
+	bOk = ( g_pFileSystem->Read( &trailer, sizeof(trailer), m_hDemoFile ) == sizeof(trailer) );
+#endif
+
+	if ( !bOk || Q_strncmp( trailer.indexfilestamp, DEMO_INDEX_ID, sizeof(trailer.indexfilestamp) ) )
+		return false; // recording didn't finish
+
+	int numentries = LittleDWord( trailer.numentries );
+	int indexoffset = LittleDWord( trailer.indexoffset );
+
+	if ( numentries < 0 || indexoffset < (int)sizeof(demoheader_t) ||
+		 indexoffset + numentries * (int)sizeof(demoindexentry_t) + (int)sizeof(trailer) != size )
+	{
+		ConMsg( "%s has a corrupt keyframe index.\n", m_szFileName );
+		return false;
+	}
+
+	m_KeyframeIndex.SetCount( numentries );
+
+#ifdef DEMO_FILE_UTLBUFFER
+	m_Buffer.SeekGet( CUtlBuffer::SEEK_HEAD, indexoffset );
+	m_Buffer.Get( m_KeyframeIndex.Base(), numentries * sizeof(demoindexentry_t) );
+	bOk = m_Buffer.IsValid();
+#else
+	g_pFileSystem->Seek( m_hDemoFile, indexoffset, FILESYSTEM_SEEK_HEAD );
+	bOk = ( g_pFileSystem->Read( m_KeyframeIndex.Base(), numentries * sizeof(demoindexentry_t), m_hDemoFile ) == numentries * (int)sizeof(demoindexentry_t) );
+#endif
+
+	if ( !bOk )
+	{
+		m_KeyframeIndex.RemoveAll();
+		return false;
+	}
+
+	for ( int i = 0; i < numentries; i++ )
+	{
+		demoindexentry_t &entry = m_KeyframeIndex[i];
+		entry.tick = LittleDWord( entry.tick );
+		entry.fileoffset = LittleDWord( entry.fileoffset );
+
+		if ( entry.fileoffset < (int)sizeof(demoheader_t) || entry.fileoffset >= indexoffset ||
+			 ( i > 0 && entry.tick < m_KeyframeIndex[i-1].tick ) )
+		{
+			ConMsg( "%s has a corrupt keyframe index.\n", m_szFileName );
+			m_KeyframeIndex.RemoveAll();
+			return false;
+		}
+	}
+
+	return true;
+}
+
 void CDemoFile::WriteFileBytes( FileHandle_t fh, int length )
 {
 #ifdef DEMO_FILE_UTLBUFFER
@@ -569,6 +719,7 @@ bool CDemoFile::Open(const char *name, bool bReadOnly)
 
 	m_szFileName[0] = 0;  // clear name
 	Q_memset( &m_DemoHeader, 0, sizeof(m_DemoHeader) ); // and demo header
+	m_KeyframeIndex.RemoveAll();
 
 	bool bOk;
 #ifdef DEMO_FILE_UTLBUFFER
@@ -67,11 +67,17 @@ public:
 	void	WriteDemoHeader();
 	demoheader_t *ReadDemoHeader();
 
+	void	AddKeyframe( int tick, int position );
+	int		FindKeyframe( int tick );	// last keyframe at or before tick, -1 if none
+	void	WriteKeyframeIndex();
+	bool	ReadKeyframeIndex();
+
 	void	WriteFileBytes( FileHandle_t fh, int length );
 
 public:
 	char			m_szFileName[MAX_PATH];	//name of current demo file
 	demoheader_t    m_DemoHeader;  //general demo info
+	CUtlVector<demoindexentry_t> m_KeyframeIndex; // sorted by tick, empty if demo has no keyframes
 
 private:
 #ifdef DEMO_FILE_UTLBUFFER
@@ -28,6 +28,8 @@
 #include "mathlib/polyhedron.h"
 #include "sys_dll.h"
 #include "vphysics/virtualmesh.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -82,6 +84,9 @@ public:
 	// A version that simply accepts a ray (can work as a traceline or tracehull)
 	virtual void	TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace );
 
+	// Traces a batch of rays with the same mask + filter; same results as calling TraceRay on each
+	virtual void	TraceRays( const Ray_t *pRays, int nRays, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces, int nFlags );
+
 	// A version that sets up the leaf and entity lists and allows you to pass those in for collision.
 	virtual void	SetupLeafAndEntityListRay( const Ray_t &ray, CTraceListData &traceData );
 	virtual void    SetupLeafAndEntityListBox( const Vector &vecBoxMin, const Vector &vecBoxMax, CTraceListData &traceData );
@@ -158,6 +163,13 @@ private:
 
 	// Clips a trace to another trace
 	bool ClipTraceToTrace( trace_t &clipTrace, trace_t *pFinalTrace );
+
+	// Shared parts of TraceRay + TraceRays. SetupEntityRay returns false if the world
+	// trace already determined the result and there's no need to look at entities.
+	bool SetupEntityRay( const Ray_t &ray, ITraceFilter *pTraceFilter, trace_t *pTrace, Ray_t &entityRay, float &flWorldFraction, float &flWorldFractionLeftSolidScale );
+	bool ShouldClipToEntity( IHandleEntity *pHandleEntity, ICollideable *pCollideable, const char *pDebugName, unsigned int fMask, ITraceFilter *pTraceFilter );
+	void ClipRayToEntitiesAlongRay( const Ray_t &entityRay, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace );
+	void FinishTraceRay( const Ray_t &ray, trace_t *pTrace, float flWorldFraction, float flWorldFractionLeftSolidScale );
 private:
 	int m_traceStatCounters[NUM_TRACE_STAT_COUNTER];
 	const matrix3x4_t *m_pRootMoveParent;
@@ -200,9 +212,16 @@ public:
 static CEngineTraceServer	s_EngineTraceServer;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CEngineTraceServer, IEngineTrace, INTERFACEVERSION_ENGINETRACE_SERVER, s_EngineTraceServer);
 
+// The 003 interface is a prefix of 004 (it just lacks TraceRays), so older game dlls can keep using it
+typedef CEngineTraceServer CEngineTraceServer003;
+EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CEngineTraceServer003, IEngineTrace, "EngineTraceServer003", s_EngineTraceServer);
+
 #ifndef SWDS
 static CEngineTraceClient	s_EngineTraceClient;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CEngineTraceClient, IEngineTrace, INTERFACEVERSION_ENGINETRACE_CLIENT, s_EngineTraceClient);
+
+typedef CEngineTraceClient CEngineTraceClient003;
+EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CEngineTraceClient003, IEngineTrace, "EngineTraceClient003", s_EngineTraceClient);
 #endif
 
 //-----------------------------------------------------------------------------
@@ -1652,37 +1671,12 @@ CON_COMMAND_EXTERN( ray_bench, RayBench, "Time the rays" )
 #endif
 
 //-----------------------------------------------------------------------------
-// A version that simply accepts a ray (can work as a traceline or tracehull)
+// Deals with the world trace result + builds the ray used to test entities.
+// Returns false if there's no need to trace against entities
 //-----------------------------------------------------------------------------
-void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
-{	
-#if defined _DEBUG && !defined SWDS
-	if( debugrayenable.GetBool() )
-	{
-		s_FrameRays.AddToTail( ray );
-	}
-#endif
-
-#if BENCHMARK_RAY_TEST
-	if( s_BenchmarkRays.Count() < 15000 )
-	{
-		s_BenchmarkRays.EnsureCapacity(15000);
-		s_BenchmarkRays.AddToTail( ray );
-	}
-#endif
-
-	VPROF_INCREMENT_COUNTER( "TraceRay", 1 );
-	m_traceStatCounters[TRACE_STAT_COUNTER_TRACERAY]++;
-//	VPROF_BUDGET( "CEngineTrace::TraceRay", "Ray/Hull Trace" );
-	
-	CTraceFilterHitAll traceFilter;
-	if ( !pTraceFilter )
-	{
-		pTraceFilter = &traceFilter;
-	}
-
-	CM_ClearTrace( pTrace );
-
+bool CEngineTrace::SetupEntityRay( const Ray_t &ray, ITraceFilter *pTraceFilter, trace_t *pTrace, 
+	Ray_t &entityRay, float &flWorldFraction, float &flWorldFractionLeftSolidScale )
+{
 	// Collide with the world.
 	if ( pTraceFilter->GetTraceType() != TRACE_ENTITIES_ONLY )
 	{
@@ -1696,16 +1690,15 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		Assert(!pCollide || pCollide->GetCollisionOrigin() == vec3_origin );
 		Assert(!pCollide || pCollide->GetCollisionAngles() == vec3_angle );
 
-		CM_BoxTrace( ray, 0, fMask, true, *pTrace );
 		SetTraceEntity( pCollide, pTrace );
 
 		// inside world, no need to check being inside anything else
 		if ( pTrace->startsolid )
-			return;
+			return false;
 
 		// Early out if we only trace against the world
 		if ( pTraceFilter->GetTraceType() == TRACE_WORLD_ONLY )
-			return;
+			return false;
 	}
 	else
 	{
@@ -1716,12 +1709,12 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 	}
 
 	// Save the world collision fraction.
-	float flWorldFraction = pTrace->fraction;
-	float flWorldFractionLeftSolidScale = flWorldFraction;
+	flWorldFraction = pTrace->fraction;
+	flWorldFractionLeftSolidScale = flWorldFraction;
 
 	// Create a ray that extends only until we hit the world
 	// and adjust the trace accordingly
-	Ray_t entityRay = ray;
+	entityRay = ray;
 
 	if ( pTrace->fraction == 0 )
 	{
@@ -1745,6 +1738,45 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		pTrace->fraction = 1.0;
 	}
 
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Applies the trace filter to an entity found along a ray
+//-----------------------------------------------------------------------------
+inline bool CEngineTrace::ShouldClipToEntity( IHandleEntity *pHandleEntity, ICollideable *pCollideable, 
+	const char *pDebugName, unsigned int fMask, ITraceFilter *pTraceFilter )
+{
+	// Check for error condition
+	if ( IsPC() && IsDebug() && !IsSolid( pCollideable->GetSolid(), pCollideable->GetSolidFlags() ) )
+	{
+		Assert( 0 );
+		Msg( "%s in solid list (not solid)\n", pDebugName );
+		return false;
+	}
+
+	if ( !StaticPropMgr()->IsStaticProp( pHandleEntity ) )
+		return pTraceFilter->ShouldHitEntity( pHandleEntity, fMask );
+
+	// FIXME: Could remove this check here by
+	// using a different spatial partition mask. Look into it
+	// if we want more speedups here.
+	if ( pTraceFilter->GetTraceType() == TRACE_ENTITIES_ONLY )
+		return false;
+
+	if ( pTraceFilter->GetTraceType() == TRACE_EVERYTHING_FILTER_PROPS )
+		return pTraceFilter->ShouldHitEntity( pHandleEntity, fMask );
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Clips the trace to all entities along the (world clipped) entity ray
+//-----------------------------------------------------------------------------
+void CEngineTrace::ClipRayToEntitiesAlongRay( const Ray_t &entityRay, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
+{
 	// Collide with entities along the ray
 	// FIXME: Hitbox code causes this to be re-entrant for the IK stuff.
 	// If we could eliminate that, this could be static and therefore
@@ -1753,9 +1785,6 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 	enumerator.Reset();
 	SpatialPartition()->EnumerateElementsAlongRay( SpatialPartitionMask(), entityRay, false, &enumerator );
 
-	bool bNoStaticProps = pTraceFilter->GetTraceType() == TRACE_ENTITIES_ONLY;
-	bool bFilterStaticProps = pTraceFilter->GetTraceType() == TRACE_EVERYTHING_FILTER_PROPS;
-
 	trace_t tr;
 	ICollideable *pCollideable;
 	const char *pDebugName;
@@ -1766,33 +1795,8 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		IHandleEntity *pHandleEntity = enumerator.m_EntityHandles[i];
 		HandleEntityToCollideable( pHandleEntity, &pCollideable, &pDebugName );
 
-		// Check for error condition
-		if ( IsPC() && IsDebug() && !IsSolid( pCollideable->GetSolid(), pCollideable->GetSolidFlags() ) )
-		{
-			Assert( 0 );
-			Msg( "%s in solid list (not solid)\n", pDebugName );
+		if ( !ShouldClipToEntity( pHandleEntity, pCollideable, pDebugName, fMask, pTraceFilter ) )
 			continue;
-		}
-
-		if ( !StaticPropMgr()->IsStaticProp( pHandleEntity ) )
-		{
-			if ( !pTraceFilter->ShouldHitEntity( pHandleEntity, fMask ) )
-				continue;
-		}
-		else
-		{
-			// FIXME: Could remove this check here by
-			// using a different spatial partition mask. Look into it
-			// if we want more speedups here.
-			if ( bNoStaticProps )
-				continue;
-
-			if ( bFilterStaticProps )
-			{
-				if ( !pTraceFilter->ShouldHitEntity( pHandleEntity, fMask ) )
-					continue;
-			}
-		}
 
 		ClipRayToCollideable( entityRay, fMask, pCollideable, &tr );
 
@@ -1803,7 +1807,14 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 		if (pTrace->allsolid)
 			break;
 	}
+}
 
+
+//-----------------------------------------------------------------------------
+// Converts the entity ray trace back to the original ray
+//-----------------------------------------------------------------------------
+void CEngineTrace::FinishTraceRay( const Ray_t &ray, trace_t *pTrace, float flWorldFraction, float flWorldFractionLeftSolidScale )
+{
 	// Fix up the fractions so they are appropriate given the original
 	// unclipped-to-world ray
 	pTrace->fraction *= flWorldFraction;
@@ -1832,6 +1843,443 @@ void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter
 }
 
 
+//-----------------------------------------------------------------------------
+// A version that simply accepts a ray (can work as a traceline or tracehull)
+//-----------------------------------------------------------------------------
+void CEngineTrace::TraceRay( const Ray_t &ray, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTrace )
+{	
+#if defined _DEBUG && !defined SWDS
+	if( debugrayenable.GetBool() )
+	{
+		s_FrameRays.AddToTail( ray );
+	}
+#endif
+
+#if BENCHMARK_RAY_TEST
+	if( s_BenchmarkRays.Count() < 15000 )
+	{
+		s_BenchmarkRays.EnsureCapacity(15000);
+		s_BenchmarkRays.AddToTail( ray );
+	}
+#endif
+
+	VPROF_INCREMENT_COUNTER( "TraceRay", 1 );
+	m_traceStatCounters[TRACE_STAT_COUNTER_TRACERAY]++;
+//	VPROF_BUDGET( "CEngineTrace::TraceRay", "Ray/Hull Trace" );
+	
+	CTraceFilterHitAll traceFilter;
+	if ( !pTraceFilter )
+	{
+		pTraceFilter = &traceFilter;
+	}
+
+	CM_ClearTrace( pTrace );
+
+	// Collide with the world.
+	if ( pTraceFilter->GetTraceType() != TRACE_ENTITIES_ONLY )
+	{
+		CM_BoxTrace( ray, 0, fMask, true, *pTrace );
+	}
+
+	Ray_t entityRay;
+	float flWorldFraction, flWorldFractionLeftSolidScale;
+	if ( !SetupEntityRay( ray, pTraceFilter, pTrace, entityRay, flWorldFraction, flWorldFractionLeftSolidScale ) )
+		return;
+
+	ClipRayToEntitiesAlongRay( entityRay, fMask, pTraceFilter, pTrace );
+
+	FinishTraceRay( ray, pTrace, flWorldFraction, flWorldFractionLeftSolidScale );
+}
+
+
+//-----------------------------------------------------------------------------
+// Batched traces
+//-----------------------------------------------------------------------------
+
+// Batches whose entity rays span more than this on any axis aren't worth enumerating 
+// as a group; each ray enumerates the spatial partition on its own instead
+#define TRACE_BATCH_MAX_EXTENT		4096.0f
+
+// Rays that pass within this distance of an entity's surrounding bounds get clipped against it
+#define TRACE_BATCH_BOUNDS_BLOAT	1.0f
+
+// Number of rays traced through the world per job when the batch is threaded
+#define TRACE_BATCH_RAYS_PER_JOB	32
+
+struct BoxTraceWork_t
+{
+	const Ray_t *m_pRays;
+	trace_t *m_pTraces;
+	int m_nRays;
+	unsigned int m_fMask;
+
+	static void Process( BoxTraceWork_t &item )
+	{
+		CM_BoxTraces( item.m_pRays, item.m_nRays, 0, item.m_fMask, true, item.m_pTraces );
+	}
+};
+
+// Surrounding bounds of four entities, in SOA form
+struct EntityBounds4_t
+{
+	fltx4 m_Mins[3];
+	fltx4 m_Maxs[3];
+};
+
+//-----------------------------------------------------------------------------
+// Returns a mask of which of the 4 boxes the swept box may touch
+//-----------------------------------------------------------------------------
+static inline int RayIntersectsBounds4( const fltx4 *pStartLo, const fltx4 *pStartHi, const fltx4 *pInvDelta, const EntityBounds4_t &bounds )
+{
+	// Slab test against the boxes grown by the ray extents; pStartLo/pStartHi already
+	// have the extents + bloat folded in
+	fltx4 tNear = Four_Zeros;
+	fltx4 tFar = Four_Ones;
+	for ( int i = 0; i < 3; ++i )
+	{
+		fltx4 t1 = MulSIMD( SubSIMD( bounds.m_Mins[i], pStartLo[i] ), pInvDelta[i] );
+		fltx4 t2 = MulSIMD( SubSIMD( bounds.m_Maxs[i], pStartHi[i] ), pInvDelta[i] );
+		tNear = MaxSIMD( tNear, MinSIMD( t1, t2 ) );
+		tFar = MinSIMD( tFar, MaxSIMD( t1, t2 ) );
+	}
+
+	return TestSignSIMD( CmpLeSIMD( tNear, tFar ) );
+}
+
+//-----------------------------------------------------------------------------
+// Traces a batch of rays. The results are the same as calling TraceRay on each 
+// ray: the world part just shares the trace setup (and optionally runs on the
+// thread pool), and coherent batches enumerate the spatial partition once and use
+// a SIMD ray vs. bounds test to decide which entities each ray has to be clipped to.
+//-----------------------------------------------------------------------------
+void CEngineTrace::TraceRays( const Ray_t *pRays, int nRays, unsigned int fMask, ITraceFilter *pTraceFilter, trace_t *pTraces, int nFlags )
+{
+	if ( nRays <= 0 )
+		return;
+
+#if defined _DEBUG && !defined SWDS
+	if( debugrayenable.GetBool() )
+	{
+		for ( int i = 0; i < nRays; ++i )
+		{
+			s_FrameRays.AddToTail( pRays[i] );
+		}
+	}
+#endif
+
+	VPROF_BUDGET( "CEngineTrace::TraceRays", "Ray/Hull Trace" );
+	VPROF_INCREMENT_COUNTER( "TraceRay", nRays );
+	m_traceStatCounters[TRACE_STAT_COUNTER_TRACERAY] += nRays;
+
+	CTraceFilterHitAll traceFilter;
+	if ( !pTraceFilter )
+	{
+		pTraceFilter = &traceFilter;
+	}
+
+	for ( int i = 0; i < nRays; ++i )
+	{
+		CM_ClearTrace( &pTraces[i] );
+	}
+
+	// Collide with the world.
+	if ( pTraceFilter->GetTraceType() != TRACE_ENTITIES_ONLY )
+	{
+		if ( ( nFlags & TRACE_RAYS_ALLOW_THREADS ) && ( nRays > TRACE_BATCH_RAYS_PER_JOB ) )
+		{
+			CUtlVector< BoxTraceWork_t > workItems;
+			workItems.EnsureCapacity( ( nRays + TRACE_BATCH_RAYS_PER_JOB - 1 ) / TRACE_BATCH_RAYS_PER_JOB );
+			for ( int i = 0; i < nRays; i += TRACE_BATCH_RAYS_PER_JOB )
+			{
+				BoxTraceWork_t w;
+				w.m_pRays = pRays + i;
+				w.m_pTraces = pTraces + i;
+				w.m_nRays = min( TRACE_BATCH_RAYS_PER_JOB, nRays - i );
+				w.m_fMask = fMask;
+				workItems.AddToTail( w );
+			}
+
+			ParallelProcess( workItems.Base(), workItems.Count(), &BoxTraceWork_t::Process );
+		}
+		else
+		{
+			CM_BoxTraces( pRays, nRays, 0, fMask, true, pTraces );
+		}
+	}
+
+	// Build the entity rays
+	CUtlVector< Ray_t, CUtlMemoryAligned< Ray_t, 16 > > entityRays;
+	CUtlVector< float > worldFractions;
+	CUtlVector< int > rayIndices;
+	entityRays.EnsureCapacity( nRays );
+	worldFractions.EnsureCapacity( nRays * 2 );
+	rayIndices.EnsureCapacity( nRays );
+
+	Vector vecBatchMins( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecBatchMaxs( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < nRays; ++i )
+	{
+		Ray_t entityRay;
+		float flWorldFraction, flWorldFractionLeftSolidScale;
+		if ( !SetupEntityRay( pRays[i], pTraceFilter, &pTraces[i], entityRay, flWorldFraction, flWorldFractionLeftSolidScale ) )
+			continue;
+
+		entityRays.AddToTail( entityRay );
+		rayIndices.AddToTail( i );
+		worldFractions.AddToTail( flWorldFraction );
+		worldFractions.AddToTail( flWorldFractionLeftSolidScale );
+
+		for ( int j = 0; j < 3; ++j )
+		{
+			float flStart = entityRay.m_Start[j];
+			float flEnd = flStart + entityRay.m_Delta[j];
+			vecBatchMins[j] = min( vecBatchMins[j], min( flStart, flEnd ) - entityRay.m_Extents[j] );
+			vecBatchMaxs[j] = max( vecBatchMaxs[j], max( flStart, flEnd ) + entityRay.m_Extents[j] );
+		}
+	}
+
+	int nEntityRays = entityRays.Count();
+	if ( nEntityRays == 0 )
+		return;
+
+	// Enumerate everything the batch could possibly touch just once. If the rays are
+	// spread out, or there's more than we can hold, each ray enumerates by itself.
+	CEntityListAlongRay batchEnum;
+	bool bCoherent = ( nEntityRays > 1 );
+	for ( int j = 0; j < 3 && bCoherent; ++j )
+	{
+		bCoherent = ( vecBatchMaxs[j] - vecBatchMins[j] ) <= TRACE_BATCH_MAX_EXTENT;
+	}
+
+	if ( bCoherent )
+	{
+		Vector vecBloat( TRACE_BATCH_BOUNDS_BLOAT, TRACE_BATCH_BOUNDS_BLOAT, TRACE_BATCH_BOUNDS_BLOAT );
+		batchEnum.Reset();
+		SpatialPartition()->EnumerateElementsInBox( SpatialPartitionMask(), vecBatchMins - vecBloat, vecBatchMaxs + vecBloat, false, &batchEnum );
+
+		// A full list may have dropped entities
+		bCoherent = ( batchEnum.Count() < CEntityListAlongRay::MAX_ENTITIES_ALONGRAY );
+	}
+
+	if ( !bCoherent )
+	{
+		for ( int i = 0; i < nEntityRays; ++i )
+		{
+			int nRay = rayIndices[i];
+			ClipRayToEntitiesAlongRay( entityRays[i], fMask, pTraceFilter, &pTraces[nRay] );
+			FinishTraceRay( pRays[nRay], &pTraces[nRay], worldFractions[2*i], worldFractions[2*i+1] );
+		}
+		return;
+	}
+
+	// Gather the candidates' collideables + bounds
+	int nCandidates = batchEnum.Count();
+	int nPackets = ( nCandidates + 3 ) >> 2;
+	ICollideable *pCandidates[CEntityListAlongRay::MAX_ENTITIES_ALONGRAY];
+	const char *pDebugNames[CEntityListAlongRay::MAX_ENTITIES_ALONGRAY];
+	CUtlVector< EntityBounds4_t, CUtlMemoryAligned< EntityBounds4_t, 16 > > bounds;
+	bounds.SetCount( nPackets );
+	for ( int i = 0; i < nCandidates; ++i )
+	{
+		HandleEntityToCollideable( batchEnum.m_EntityHandles[i], &pCandidates[i], &pDebugNames[i] );
+
+		Vector vecMins, vecMaxs;
+		pCandidates[i]->WorldSpaceSurroundingBounds( &vecMins, &vecMaxs );
+
+		EntityBounds4_t &packet = bounds[ i >> 2 ];
+		for ( int j = 0; j < 3; ++j )
+		{
+			SubFloat( packet.m_Mins[j], i & 3 ) = vecMins[j];
+			SubFloat( packet.m_Maxs[j], i & 3 ) = vecMaxs[j];
+		}
+	}
+
+	// Fill out the unused slots in the last packet so they're well defined; 
+	// they never get looked at
+	for ( int i = nCandidates; i < ( nPackets << 2 ); ++i )
+	{
+		for ( int j = 0; j < 3; ++j )
+		{
+			SubFloat( bounds[ i >> 2 ].m_Mins[j], i & 3 ) = 0.0f;
+			SubFloat( bounds[ i >> 2 ].m_Maxs[j], i & 3 ) = 0.0f;
+		}
+	}
+
+	trace_t tr;
+	trace_t closest;
+	for ( int i = 0; i < nEntityRays; ++i )
+	{
+		const Ray_t &entityRay = entityRays[i];
+		int nRay = rayIndices[i];
+		trace_t *pTrace = &pTraces[nRay];
+
+		fltx4 startLo[3], startHi[3], invDelta[3];
+		for ( int j = 0; j < 3; ++j )
+		{
+			float flPad = entityRay.m_Extents[j] + TRACE_BATCH_BOUNDS_BLOAT;
+			float flDelta = entityRay.m_Delta[j];
+
+			// Rays parallel to a slab get a huge (finite) inverse so nothing turns into a NAN
+			float flInvDelta = ( fabs( flDelta ) > 1e-8f ) ? 1.0f / flDelta : ( flDelta < 0.0f ? -1e30f : 1e30f );
+
+			startLo[j] = ReplicateX4( entityRay.m_Start[j] + flPad );
+			startHi[j] = ReplicateX4( entityRay.m_Start[j] - flPad );
+			invDelta[j] = ReplicateX4( flInvDelta );
+		}
+
+		// Clip against everything the ray might touch, remembering the closest hit.
+		// The sequential clip in TraceRay picks the first of several equally close hits
+		// (in enumeration order) and handles start solid entities specially, so those 
+		// cases get redone the normal way.
+		bool bSequential = false;
+		bool bTied = false;
+		closest.fraction = 1.0f;
+		for ( int nPacket = 0; nPacket < nPackets && !bSequential; ++nPacket )
+		{
+			int nMask = RayIntersectsBounds4( startLo, startHi, invDelta, bounds[nPacket] );
+			for ( int nSlot = 0; nMask != 0; ++nSlot, nMask >>= 1 )
+			{
+				int nCandidate = ( nPacket << 2 ) + nSlot;
+				if ( !( nMask & 1 ) || ( nCandidate >= nCandidates ) )
+					continue;
+
+				IHandleEntity *pHandleEntity = batchEnum.m_EntityHandles[nCandidate];
+				if ( !ShouldClipToEntity( pHandleEntity, pCandidates[nCandidate], pDebugNames[nCandidate], fMask, pTraceFilter ) )
+					continue;
+
+				ClipRayToCollideable( entityRay, fMask, pCandidates[nCandidate], &tr );
+				if ( tr.allsolid || tr.startsolid )
+				{
+					bSequential = true;
+					break;
+				}
+
+				if ( tr.fraction < closest.fraction )
+				{
+					closest = tr;
+					bTied = false;
+				}
+				else if ( ( tr.fraction == closest.fraction ) && ( tr.fraction < 1.0f ) )
+				{
+					bTied = true;
+				}
+			}
+		}
+
+		if ( bSequential || bTied )
+		{
+			ClipRayToEntitiesAlongRay( entityRay, fMask, pTraceFilter, pTrace );
+		}
+		else if ( closest.fraction < 1.0f )
+		{
+			ClipTraceToTrace( closest, pTrace );
+		}
+
+		FinishTraceRay( pRays[nRay], pTrace, worldFractions[2*i], worldFractions[2*i+1] );
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Checks a TraceRays result against the TraceRay result for the same ray
+//-----------------------------------------------------------------------------
+static bool TracesMatch( const trace_t &a, const trace_t &b )
+{
+	// fractionleftsolid is a NAN for hulls in debug, so compare the bits
+	return ( a.startpos == b.startpos ) && ( a.endpos == b.endpos ) &&
+		( a.plane.normal == b.plane.normal ) && ( a.plane.dist == b.plane.dist ) &&
+		( a.fraction == b.fraction ) && !memcmp( &a.fractionleftsolid, &b.fractionleftsolid, sizeof(float) ) &&
+		( a.contents == b.contents ) && ( a.dispFlags == b.dispFlags ) &&
+		( a.allsolid == b.allsolid ) && ( a.startsolid == b.startsolid ) &&
+		( a.surface.name == b.surface.name ) && ( a.surface.surfaceProps == b.surface.surfaceProps ) && ( a.surface.flags == b.surface.flags ) &&
+		( a.hitgroup == b.hitgroup ) && ( a.physicsbone == b.physicsbone ) && 
+		( a.m_pEnt == b.m_pEnt ) && ( a.hitbox == b.hitbox );
+}
+
+//-----------------------------------------------------------------------------
+// Times TraceRays against a TraceRay loop over a coherent fan of rays
+//-----------------------------------------------------------------------------
+CON_COMMAND( trace_batch_bench, "Compares batched + single ray traces. Usage: trace_batch_bench <x> <y> <z> [rays] [hull half size] [threaded]" )
+{
+	if ( !sv.IsActive() )
+	{
+		ConMsg( "trace_batch_bench: no server running\n" );
+		return;
+	}
+
+	if ( args.ArgC() < 4 )
+	{
+		ConMsg( "Usage: trace_batch_bench <x> <y> <z> [rays] [hull half size] [threaded]\n" );
+		return;
+	}
+
+	Vector vecOrigin( atof( args[1] ), atof( args[2] ), atof( args[3] ) );
+	int nRays = ( args.ArgC() > 4 ) ? clamp( atoi( args[4] ), 1, 65536 ) : 1024;
+	float flHull = ( args.ArgC() > 5 ) ? atof( args[5] ) : 0.0f;
+	bool bThreaded = ( args.ArgC() > 6 ) && ( atoi( args[6] ) != 0 );
+
+	// Fan the rays out over a 90 degree cone in front of the origin
+	CUtlVector< Ray_t, CUtlMemoryAligned< Ray_t, 16 > > rays;
+	rays.SetCount( nRays );
+	int nSide = (int)ceil( sqrt( (float)nRays ) );
+	Vector vecHull( flHull, flHull, flHull );
+	for ( int i = 0; i < nRays; ++i )
+	{
+		QAngle angles( 90.0f * ( ( i / nSide ) / (float)nSide - 0.5f ), 90.0f * ( ( i % nSide ) / (float)nSide - 0.5f ), 0.0f );
+		Vector vecForward, vecEnd;
+		AngleVectors( angles, &vecForward );
+		VectorMA( vecOrigin, 2048.0f, vecForward, vecEnd );
+
+		if ( flHull > 0.0f )
+		{
+			rays[i].Init( vecOrigin, vecEnd, -vecHull, vecHull );
+		}
+		else
+		{
+			rays[i].Init( vecOrigin, vecEnd );
+		}
+	}
+
+	CUtlVector< trace_t > singleTraces;
+	CUtlVector< trace_t > batchTraces;
+	singleTraces.SetCount( nRays );
+	batchTraces.SetCount( nRays );
+
+	const int nIterations = 10;
+	CTraceFilterHitAll traceFilter;
+
+	double flStartTime = Plat_FloatTime();
+	for ( int nIter = 0; nIter < nIterations; ++nIter )
+	{
+		for ( int i = 0; i < nRays; ++i )
+		{
+			g_pEngineTraceServer->TraceRay( rays[i], MASK_SOLID, &traceFilter, &singleTraces[i] );
+		}
+	}
+	double flSingleTime = Plat_FloatTime() - flStartTime;
+
+	flStartTime = Plat_FloatTime();
+	for ( int nIter = 0; nIter < nIterations; ++nIter )
+	{
+		g_pEngineTraceServer->TraceRays( rays.Base(), nRays, MASK_SOLID, &traceFilter, batchTraces.Base(), bThreaded ? TRACE_RAYS_ALLOW_THREADS : 0 );
+	}
+	double flBatchTime = Plat_FloatTime() - flStartTime;
+
+	int nMismatches = 0;
+	for ( int i = 0; i < nRays; ++i )
+	{
+		if ( !TracesMatch( singleTraces[i], batchTraces[i] ) )
+		{
+			++nMismatches;
+		}
+	}
+
+	ConMsg( "%d rays x %d: TraceRay %.2f ms, TraceRays %.2f ms (%.2fx), %d mismatches\n", 
+		nRays, nIterations, flSingleTime * 1000.0, flBatchTime * 1000.0, 
+		( flBatchTime > 0.0 ) ? flSingleTime / flBatchTime : 0.0, nMismatches );
+}
+
+
 //-----------------------------------------------------------------------------
 // A version that sweeps a collideable through the world
 //-----------------------------------------------------------------------------
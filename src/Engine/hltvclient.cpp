@@ -417,32 +417,15 @@ void CHLTVClient::SendSnapshot( CClientFrame * pFrame )
 	byte		buf[NET_MAX_PAYLOAD];
 	bf_write	msg( "CHLTVClient::SendSnapshot", buf, sizeof(buf) );
 
-	// if we send a full snapshot (no delta-compression) before, wait until client
-	// received and acknowledge that update. don't spam client with full updates
-
-	if ( m_pLastSnapshot == pFrame->GetSnapshot() )
-	{
-		// never send the same snapshot twice
-		m_NetChannel->Transmit();	
-		return;
-	}
-
-	if ( m_nForceWaitForTick > 0 )
+	if ( !NeedsSnapshot( pFrame ) )
 	{
 		// just continue transmitting reliable data
-		Assert( !m_bFakePlayer );	// Should never happen
 		m_NetChannel->Transmit();	
 		return;
 	}
 
 	CClientFrame	*pDeltaFrame = GetDeltaFrame( m_nDeltaTick ); // NULL if delta_tick is not found
-	CHLTVFrame		*pLastFrame = (CHLTVFrame*) GetDeltaFrame( m_nLastSendTick );
-
-	if ( pLastFrame )
-	{
-		// start first frame after last send
-		pLastFrame = (CHLTVFrame*) pLastFrame->m_pNext;
-	}
+	CHLTVFrame		*pLastFrame = GetFirstUnsentFrame();
 
 	// add all reliable messages between ]lastframe,currentframe]
 	// add all tempent & sound messages between ]lastframe,currentframe]
@@ -524,3 +507,97 @@ void CHLTVClient::SendSnapshot( CClientFrame * pFrame )
 		Disconnect( "ERROR! Couldn't send snapshot." );
 	}
 }
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns false if pFrame must not be sent yet, then only pending
+//			reliable data may be transmitted
+//-----------------------------------------------------------------------------
+bool CHLTVClient::NeedsSnapshot( CClientFrame * pFrame )
+{
+	// never send the same snapshot twice
+	if ( m_pLastSnapshot == pFrame->GetSnapshot() )
+		return false;
+
+	// if we send a full snapshot (no delta-compression) before, wait until client
+	// received and acknowledge that update. don't spam client with full updates
+	if ( m_nForceWaitForTick > 0 )
+	{
+		Assert( !m_bFakePlayer );	// Should never happen
+		return false;
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the first frame after the last sent one, its buffered
+//			messages haven't been sent to this client yet
+//-----------------------------------------------------------------------------
+CHLTVFrame *CHLTVClient::GetFirstUnsentFrame( void )
+{
+	CHLTVFrame *pLastFrame = (CHLTVFrame*) GetDeltaFrame( m_nLastSendTick );
+
+	if ( pLastFrame )
+	{
+		// start first frame after last send
+		pLastFrame = (CHLTVFrame*) pLastFrame->m_pNext;
+	}
+
+	return pLastFrame;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Relay worker side of SendSnapshot. The server already encoded the
+//			snapshot and updated our snapshot and baseline state, this only
+//			touches our net channel. Returns false if sending failed, the
+//			caller disconnects us on the main thread.
+//-----------------------------------------------------------------------------
+bool CHLTVClient::SendSharedSnapshot( CClientFrame * pFrame, CHLTVFrame *pFirstFrame, const CHLTVSharedSnapshot *pSnapshot )
+{
+	bool bDelta = ( pSnapshot->m_nDeltaTick != -1 );
+
+	// add all reliable messages between ]lastframe,currentframe]
+	// add all tempent & sound messages between ]lastframe,currentframe]
+	for ( CHLTVFrame *pLastFrame = pFirstFrame; pLastFrame && pLastFrame->tick_count <= pFrame->tick_count; pLastFrame = (CHLTVFrame*) pLastFrame->m_pNext )
+	{
+		m_NetChannel->SendData( pLastFrame->m_Messages[HLTV_BUFFER_RELIABLE], true );	
+
+		if ( bDelta )
+		{
+			// if we send entities delta compressed, also send unreliable data
+			m_NetChannel->SendData( pLastFrame->m_Messages[HLTV_BUFFER_UNRELIABLE], false );
+		}
+	}
+
+	// Don't send the datagram to fakeplayers
+	if ( m_bFakePlayer )
+	{
+		m_nDeltaTick = pFrame->tick_count;
+		return true;
+	}
+
+	// the net channel only reads from the message
+	bf_write msg( "CHLTVClient::SendSharedSnapshot", (void *)pSnapshot->m_Data.Base(), pSnapshot->m_Data.Count() );
+	msg.SeekToBit( pSnapshot->m_nBits );
+
+	bool bSendOK;
+
+	// is this is a full entity update (no delta) ?
+	if ( !bDelta )
+	{
+		// transmit snapshot as reliable data chunk
+		bSendOK = m_NetChannel->SendData( msg );
+		bSendOK = bSendOK && m_NetChannel->Transmit();
+
+		// remember this tickcount we send the reliable snapshot
+		// so we can continue sending other updates if this has been acknowledged
+		m_nForceWaitForTick = pFrame->tick_count;
+	}
+	else
+	{
+		// just send it as unreliable snapshot
+		bSendOK = m_NetChannel->SendDatagram( &msg ) > 0;
+	}
+
+	return bSendOK;
+}
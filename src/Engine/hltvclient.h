@@ -13,6 +13,8 @@
 #include "baseclient.h"
 
 class CHLTVServer;
+class CHLTVFrame;
+struct CHLTVSharedSnapshot;
 
 class CHLTVClient : public CBaseClient
 {
@@ -38,6 +40,9 @@ public:
 	void	SpawnPlayer( void );
 	bool	ShouldSendMessages( void );
 	void	SendSnapshot( CClientFrame * pFrame );
+	bool	NeedsSnapshot( CClientFrame * pFrame );
+	CHLTVFrame *GetFirstUnsentFrame( void );
+	bool	SendSharedSnapshot( CClientFrame * pFrame, CHLTVFrame *pFirstFrame, const CHLTVSharedSnapshot *pSnapshot );
 	bool	SendSignonData( void );
 	
 	void	SetRate( int nRate, bool bForce );
@@ -25,6 +25,7 @@
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
 
+static ConVar tv_keyframeinterval( "tv_keyframeinterval", "0", 0, "Write a full update keyframe to SourceTV demos every N seconds so playback can seek, 0=off" );
 
 //////////////////////////////////////////////////////////////////////
 // Construction/Destruction
@@ -72,9 +73,13 @@ void CHLTVDemoRecorder::StartRecording( const char *filename, bool bContinuously
 	Q_memset( dh, 0, sizeof(demoheader_t));
 
 	Q_strncpy( dh->demofilestamp, DEMO_HEADER_ID, sizeof(dh->demofilestamp) );
-	dh->demoprotocol = DEMO_PROTOCOL;
 	dh->networkprotocol = PROTOCOL_VERSION;
 
+	// keyframes need a newer demo protocol, so only use it if asked for
+	m_nKeyframeInterval = max( 0, TIME_TO_TICKS( tv_keyframeinterval.GetFloat() ) );
+	m_nLastKeyframeTick = -1;
+	dh->demoprotocol = m_nKeyframeInterval ? DEMO_PROTOCOL_KEYFRAMES : DEMO_PROTOCOL;
+
 	Q_strncpy( dh->mapname, hltv->GetMapName(), sizeof( dh->mapname ) );
 
 	char szGameDir[MAX_OSPATH];
@@ -117,6 +122,11 @@ void CHLTVDemoRecorder::StopRecording()
 	// Demo playback should read this as an incoming message.
 	m_DemoFile.WriteCmdHeader( dem_stop, GetRecordingTick() );
 
+	if ( m_nKeyframeInterval )
+	{
+		m_DemoFile.WriteKeyframeIndex();
+	}
+
 	// update demo header info
 	m_DemoFile.m_DemoHeader.playback_ticks = GetRecordingTick();
 	m_DemoFile.m_DemoHeader.playback_time =  host_state.interval_per_tick *	GetRecordingTick();
@@ -328,6 +338,49 @@ void CHLTVDemoRecorder::WriteFrame( CHLTVFrame *pFrame )
 
 	// write packet to demo file
 	WriteMessages( dem_packet, msg ); 
+
+	if ( m_nKeyframeInterval &&
+		 ( m_nLastKeyframeTick < 0 || pFrame->tick_count - m_nLastKeyframeTick >= m_nKeyframeInterval ) )
+	{
+		WriteKeyframe( pFrame );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes the complete state at pFrame, so playback can start reading
+//			here. The next dem_packet deltas from pFrame like it does from the
+//			dem_packet for pFrame, so both lead to the same client state.
+//-----------------------------------------------------------------------------
+void CHLTVDemoRecorder::WriteKeyframe( CHLTVFrame *pFrame )
+{
+	byte		buffer[ NET_MAX_PAYLOAD ];
+	bf_write	msg( "CHLTVDemo::WriteKeyframe", buffer, sizeof( buffer ) );
+
+	// send tick time
+	NET_Tick tickmsg( pFrame->tick_count, host_frametime_unbounded, host_frametime_stddeviation );
+	tickmsg.WriteToBuffer( msg );
+
+#ifndef SHARED_NET_STRING_TABLES
+	// all strings, the reader may have skipped any number of updates
+	sv.m_StringTables->WriteUpdateMessage( NULL, -1, msg );
+#endif
+
+	// full entity update, the master client has no entity baselines so this
+	// only depends on the instance baselines sent above
+	sv.WriteDeltaEntities( hltv->m_MasterClient, pFrame, NULL, msg );
+
+	if ( msg.IsOverflowed() )
+	{
+		DevMsg( "CHLTVDemoRecorder::WriteKeyframe: keyframe at tick %i doesn't fit, skipped.\n", pFrame->tick_count );
+		return;
+	}
+
+	int position = m_DemoFile.GetCurPos( false );
+
+	WriteMessages( dem_keyframe, msg );
+
+	m_DemoFile.AddKeyframe( GetRecordingTick(), position );
+	m_nLastKeyframeTick = pFrame->tick_count;
 }
 
 void CHLTVDemoRecorder::WriteMessages( unsigned char cmd, bf_write &message )
@@ -44,6 +44,7 @@ public:
 
 public:
 	void	WriteFrame( CHLTVFrame *pFrame );
+	void	WriteKeyframe( CHLTVFrame *pFrame );
 	void	CloseFile();
 	void	Reset();
 
@@ -61,6 +62,8 @@ public:
 	int				m_SequenceInfo;
 	int				m_nDeltaTick;	
 	int				m_nSignonTick;
+	int				m_nKeyframeInterval;	// in ticks, 0 = no keyframes
+	int				m_nLastKeyframeTick;	// server tick of last keyframe, -1 = none yet
 	bf_write		m_MessageData; // temp buffer for all network messages
 };
 
@@ -38,6 +38,8 @@
 #include "sv_steamauth.h"
 #include "sv_master_legacy.h"
 #include "tier0/icommandline.h"
+#include "tier0/fasttimer.h"
+#include "vstdlib/jobthread.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -75,6 +77,9 @@ ConVar tv_debug( "tv_debug", "0", 0, "SourceTV debug info." );
 ConVar tv_title( "tv_title", "SourceTV", 0, "Set title for SourceTV spectator UI", tv_title_changed_f );
 static ConVar tv_deltacache( "tv_deltacache", "2", 0, "Enable delta entity bit stream cache" );
 static ConVar tv_relayvoice( "tv_relayvoice", "1", 0, "Relay voice data: 0=off, 1=on" );
+static ConVar tv_relaythreads( "tv_relaythreads", "-1", 0, "Relay proxies encode each snapshot once and send it to spectators from this many threads: -1=one per core, 0=off" );
+
+#define HLTV_RELAY_MIN_SENDS_PER_WORKER		8	// don't wake another thread for fewer spectators
 
 CDeltaEntityCache::CDeltaEntityCache()
 {
@@ -449,6 +454,7 @@ CHLTVServer::CHLTVServer()
 	m_flFPS = 0;
 	m_nGameServerMaxClients = 0;
 	m_fNextSendUpdateTime = 0;
+	m_nSharedSnapshots = 0;
 	Q_memset( m_pRecvTables, 0, sizeof( m_pRecvTables ) );
 	m_nRecvTables = 0;
 	m_vPVSOrigin.Init();
@@ -475,6 +481,8 @@ CHLTVServer::~CHLTVServer()
 	// make sure everything was destroyed
 	Assert( m_CurrentFrame == NULL );
 	Assert( CountClientFrames() == 0 );
+
+	m_SharedSnapshots.PurgeAndDeleteElements();
 }
 
 void CHLTVServer::SetMaxClients( int number )
@@ -765,6 +773,16 @@ void CHLTVServer::GetLocalStats( int &proxies, int &slots, int &clients )
 	slots = GetMaxClients();
 }
 
+void CHLTVServer::GetLocalStats( CUtlVector<HLTVRelayWorkerStats_t> &workers )
+{
+	workers.RemoveAll();
+
+	for ( int i = 0; i < m_RelayWorkers.Count(); i++ )
+	{
+		workers.AddToTail( m_RelayWorkers[i].m_Stats );
+	}
+}
+
 void CHLTVServer::GetRelayStats( int &proxies, int &slots, int &clients )
 {
 	proxies = slots = clients = 0;
@@ -1361,6 +1379,17 @@ CClientFrame *CHLTVServer::AddNewFrame( CClientFrame *clientFrame )
 
 void CHLTVServer::SendClientMessages ( bool bSendSnapshots )
 {
+	NET_BeginBatchedSend();
+
+	// Relays don't cull props per spectator, so all spectators with the same
+	// delta tick and baseline get the same snapshot
+	if ( m_CurrentFrame && !sv.IsActive() && tv_relaythreads.GetInt() != 0 )
+	{
+		SendRelayMessages();
+		NET_FlushBatchedSend();
+		return;
+	}
+
 	// build individual updates
 	for ( int i=0; i< m_Clients.Count(); i++ )
 	{
@@ -1387,6 +1416,370 @@ void CHLTVServer::SendClientMessages ( bool bSendSnapshots )
 		client->UpdateSendState();
 		client->m_fLastSendTime = net_time;
 	}
+
+	NET_FlushBatchedSend();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Sends the current frame to all spectators of a relay. Snapshots are
+//			encoded on this thread, once per distinct key, and all per spectator
+//			state is updated here too. The workers only send from the shared
+//			buffers through each spectator's own net channel.
+//-----------------------------------------------------------------------------
+void CHLTVServer::SendRelayMessages( void )
+{
+	VPROF_BUDGET( "CHLTVServer::SendRelayMessages", "HLTV" );
+
+	m_nSharedSnapshots = 0;
+	m_RelaySends.RemoveAll();
+
+	for ( int i=0; i< m_Clients.Count(); i++ )
+	{
+		CHLTVClient* client = Client(i);
+
+		// Update Host client send state...
+		if ( !client->ShouldSendMessages() )
+			continue;
+
+		if ( !client->IsActive() )
+		{
+			// Connected, but inactive, just send reliable, sequenced info.
+			client->m_NetChannel->Transmit();
+			client->UpdateSendState();
+			client->m_fLastSendTime = net_time;
+			continue;
+		}
+
+		CHLTVRelaySend send;
+		send.m_pClient = client;
+		send.m_pFirstFrame = NULL;
+		send.m_pSnapshot = NULL;
+		send.m_bSendFailed = false;
+
+		if ( client->NeedsSnapshot( m_CurrentFrame ) )
+		{
+			CClientFrame *pDeltaFrame = client->GetDeltaFrame( client->m_nDeltaTick ); // NULL if delta_tick is not found
+			CHLTVSharedSnapshot *pSnapshot = GetSharedSnapshot( client, pDeltaFrame );
+
+			if ( pSnapshot->m_bOverflowed )
+			{
+				if ( !pDeltaFrame )
+				{
+					// if this is a reliable snapshot, drop the client
+					client->Disconnect( "ERROR! Reliable snapshot overflow." );
+					continue;
+				}
+
+				// unreliable snapshots may be dropped
+				ConMsg ("WARNING: msg overflowed for %s\n", client->m_Name);
+			}
+
+			// same state changes the encoder made for the spectator it encoded with
+			if ( pSnapshot->m_bBaselineUpdateReady )
+			{
+				client->m_BaselinesSent = pSnapshot->m_BaselinesSent;
+
+				if ( pSnapshot->m_bBaselineUpdate )
+				{
+					client->m_nBaselineUpdateTick = m_CurrentFrame->tick_count;
+				}
+			}
+
+			send.m_pFirstFrame = client->GetFirstUnsentFrame();
+			send.m_pSnapshot = pSnapshot;
+
+			// remember this snapshot
+			client->m_pLastSnapshot = m_CurrentFrame->GetSnapshot();
+			client->m_nLastSendTick = m_CurrentFrame->tick_count;
+		}
+
+		m_RelaySends.AddToTail( send );
+	}
+
+	int nWorkers = GetRelayWorkerCount( m_RelaySends.Count() );
+
+	if ( m_RelayWorkers.Count() < nWorkers )
+	{
+		int nFirstNew = m_RelayWorkers.AddMultipleToTail( nWorkers - m_RelayWorkers.Count() );
+		for ( int i = nFirstNew; i < m_RelayWorkers.Count(); i++ )
+		{
+			Q_memset( &m_RelayWorkers[i].m_Stats, 0, sizeof( m_RelayWorkers[i].m_Stats ) );
+		}
+	}
+
+	// contiguous slices, so each worker mostly touches its own spectators
+	int nFirstSend = 0;
+	for ( int i = 0; i < m_RelayWorkers.Count(); i++ )
+	{
+		CHLTVRelayWorker &worker = m_RelayWorkers[i];
+		int nSends = ( i < nWorkers ) ? ( m_RelaySends.Count() - nFirstSend ) / ( nWorkers - i ) : 0;
+
+		worker.m_nFirstSend = nFirstSend;
+		worker.m_nSends = nSends;
+		worker.m_Stats.nSpectators = 0;
+		nFirstSend += nSends;
+	}
+
+	if ( nWorkers > 1 )
+	{
+		ParallelProcess( m_RelayWorkers.Base(), nWorkers, this, &CHLTVServer::RunRelayWorker );
+	}
+	else if ( nWorkers == 1 )
+	{
+		RunRelayWorker( m_RelayWorkers[0] );
+	}
+
+	for ( int i = 0; i < m_RelaySends.Count(); i++ )
+	{
+		if ( m_RelaySends[i].m_bSendFailed )
+		{
+			m_RelaySends[i].m_pClient->Disconnect( "ERROR! Couldn't send snapshot." );
+		}
+	}
+}
+
+int CHLTVServer::GetRelayWorkerCount( int nSends )
+{
+	int nWorkers = tv_relaythreads.GetInt();
+
+	if ( nWorkers < 0 )
+	{
+		// the calling thread works too
+		nWorkers = g_pThreadPool ? g_pThreadPool->NumThreads() + 1 : 1;
+	}
+
+	nWorkers = min( nWorkers, ( nSends + HLTV_RELAY_MIN_SENDS_PER_WORKER - 1 ) / HLTV_RELAY_MIN_SENDS_PER_WORKER );
+
+	return max( nWorkers, 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the snapshot encoded this frame for spectators in the same
+//			state as pClient, encoding it if it's the first one.
+//-----------------------------------------------------------------------------
+CHLTVSharedSnapshot *CHLTVServer::GetSharedSnapshot( CHLTVClient *pClient, CClientFrame *pDeltaFrame )
+{
+	int nDeltaTick = pDeltaFrame ? pDeltaFrame->tick_count : -1;
+	int nAckTick = pClient->GetMaxAckTickCount();
+	bool bHasBaseline = ( pClient->m_pBaseline != NULL );
+	bool bBaselineUpdateReady = ( pClient->m_nBaselineUpdateTick == -1 );
+
+	// traced spectators get their own encoding with trace output
+	bool bShared = !pClient->IsTracing();
+
+	if ( bShared )
+	{
+		for ( int i = 0; i < m_nSharedSnapshots; i++ )
+		{
+			CHLTVSharedSnapshot *pSnapshot = m_SharedSnapshots[i];
+
+			if ( pSnapshot->m_bShared &&
+				 pSnapshot->m_nDeltaTick == nDeltaTick &&
+				 pSnapshot->m_nAckTick == nAckTick &&
+				 pSnapshot->m_nBaselineUsed == pClient->m_nBaselineUsed &&
+				 pSnapshot->m_bHasBaseline == bHasBaseline &&
+				 pSnapshot->m_bBaselineUpdateReady == bBaselineUpdateReady &&
+				 !Q_memcmp( pSnapshot->m_BaselineSignature, pClient->m_BaselineSignature, sizeof( pSnapshot->m_BaselineSignature ) ) )
+			{
+				return pSnapshot;
+			}
+		}
+	}
+
+	if ( m_nSharedSnapshots == m_SharedSnapshots.Count() )
+	{
+		m_SharedSnapshots.AddToTail( new CHLTVSharedSnapshot );
+	}
+
+	CHLTVSharedSnapshot *pSnapshot = m_SharedSnapshots[m_nSharedSnapshots++];
+
+	pSnapshot->m_nDeltaTick = nDeltaTick;
+	pSnapshot->m_nAckTick = nAckTick;
+	pSnapshot->m_nBaselineUsed = pClient->m_nBaselineUsed;
+	Q_memcpy( pSnapshot->m_BaselineSignature, pClient->m_BaselineSignature, sizeof( pSnapshot->m_BaselineSignature ) );
+	pSnapshot->m_bHasBaseline = bHasBaseline;
+	pSnapshot->m_bBaselineUpdateReady = bBaselineUpdateReady;
+	pSnapshot->m_bShared = bShared;
+
+	EncodeSharedSnapshot( pSnapshot, pClient, pDeltaFrame );
+
+	return pSnapshot;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Builds the snapshot message as CHLTVClient::SendSnapshot would for pClient
+//-----------------------------------------------------------------------------
+static byte s_RelayEncodeBuffer[NET_MAX_PAYLOAD];
+
+void CHLTVServer::EncodeSharedSnapshot( CHLTVSharedSnapshot *pSnapshot, CHLTVClient *pClient, CClientFrame *pDeltaFrame )
+{
+	VPROF_BUDGET( "CHLTVServer::EncodeSharedSnapshot", "HLTV" );
+
+	bf_write msg( "CHLTVServer::EncodeSharedSnapshot", s_RelayEncodeBuffer, sizeof(s_RelayEncodeBuffer) );
+
+	// send tick time
+	NET_Tick tickmsg( m_CurrentFrame->tick_count, host_frametime_unbounded, host_frametime_stddeviation );
+	tickmsg.WriteToBuffer( msg );
+
+	// Update shared client/server string tables. Must be done before sending entities
+	m_StringTables->WriteUpdateMessage( NULL, pSnapshot->m_nAckTick, msg );
+
+	// WriteDeltaEntities only points this at the spectator's baseline list if it
+	// may take a baseline update, don't let it collect into someone else's
+	m_CurrentFrame->from_baseline = NULL;
+
+	// send entity update, delta compressed if deltaFrame != NULL
+	WriteDeltaEntities( pClient, m_CurrentFrame, pDeltaFrame, msg );
+
+	m_CurrentFrame->from_baseline = NULL;
+
+	pSnapshot->m_bOverflowed = msg.IsOverflowed();
+	pSnapshot->m_nBits = pSnapshot->m_bOverflowed ? 0 : msg.GetNumBitsWritten();
+	pSnapshot->m_bBaselineUpdate = pSnapshot->m_bBaselineUpdateReady && ( pClient->m_nBaselineUpdateTick == m_CurrentFrame->tick_count );
+	pSnapshot->m_BaselinesSent = pClient->m_BaselinesSent;
+
+	// bf_write wants whole dwords
+	pSnapshot->m_Data.SetCount( max( PAD_NUMBER( Bits2Bytes( pSnapshot->m_nBits ), 4 ), 4 ) );
+	Q_memcpy( pSnapshot->m_Data.Base(), s_RelayEncodeBuffer, Bits2Bytes( pSnapshot->m_nBits ) );
+}
+
+void CHLTVServer::RunRelayWorker( CHLTVRelayWorker &worker )
+{
+	CFastTimer timer;
+	timer.Start();
+
+	for ( int i = worker.m_nFirstSend; i < worker.m_nFirstSend + worker.m_nSends; i++ )
+	{
+		CHLTVRelaySend &send = m_RelaySends[i];
+		CHLTVClient *client = send.m_pClient;
+
+		if ( send.m_pSnapshot )
+		{
+			send.m_bSendFailed = !client->SendSharedSnapshot( m_CurrentFrame, send.m_pFirstFrame, send.m_pSnapshot );
+
+			worker.m_Stats.nSnapshots++;
+			worker.m_Stats.nBytes += Bits2Bytes( send.m_pSnapshot->m_nBits );
+		}
+		else
+		{
+			// just continue transmitting reliable data
+			client->m_NetChannel->Transmit();
+		}
+
+		client->UpdateSendState();
+		client->m_fLastSendTime = net_time;
+	}
+
+	timer.End();
+
+	worker.m_Stats.nSpectators = worker.m_nSends;
+	worker.m_Stats.flBusyTime += timer.GetDuration().GetSeconds();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Measures the cost of sending the current frame to nSpectators
+//			spectators spread over the recent delta ticks, encoding for each
+//			spectator versus encoding once per delta tick and copying. Runs in
+//			memory with a scratch spectator, nothing goes out on the wire.
+//-----------------------------------------------------------------------------
+void CHLTVServer::RunRelayBenchmark( int nSpectators, int nFrames )
+{
+	if ( !m_CurrentFrame )
+	{
+		ConMsg( "SourceTV has no frame to send yet.\n" );
+		return;
+	}
+
+	// delta ticks the spectators could have acknowledged
+	CUtlVector<CClientFrame *> deltaFrames;
+	for ( CClientFrame *pFrame = GetClientFrame( m_nFirstTick, false ); pFrame; pFrame = pFrame->m_pNext )
+	{
+		if ( pFrame->tick_count < m_CurrentFrame->tick_count )
+		{
+			deltaFrames.AddToTail( pFrame );
+		}
+	}
+
+	// the last few frames are what connected spectators usually ack
+	if ( deltaFrames.Count() > 8 )
+	{
+		deltaFrames.RemoveMultiple( 0, deltaFrames.Count() - 8 );
+	}
+
+	if ( !deltaFrames.Count() )
+	{
+		ConMsg( "SourceTV has no delta frames yet.\n" );
+		return;
+	}
+
+	// scratch spectator with an empty baseline and a baseline update pending,
+	// so encoding doesn't change any state
+	CHLTVClient *pClient = new CHLTVClient( 0, this );
+	pClient->m_pBaseline = framesnapshotmanager->CreateEmptySnapshot( 0, MAX_EDICTS );
+	pClient->m_nBaselineUpdateTick = 0;
+
+	CUtlVector<unsigned char> sends;
+	sends.SetCount( NET_MAX_PAYLOAD );
+
+	CFastTimer timer;
+
+	// encode for each spectator
+	timer.Start();
+	for ( int f = 0; f < nFrames; f++ )
+	{
+		for ( int i = 0; i < nSpectators; i++ )
+		{
+			CClientFrame *pDeltaFrame = deltaFrames[i % deltaFrames.Count()];
+			bf_write msg( "tv_relay_bench", sends.Base(), sends.Count() );
+
+			NET_Tick tickmsg( m_CurrentFrame->tick_count, host_frametime_unbounded, host_frametime_stddeviation );
+			tickmsg.WriteToBuffer( msg );
+			m_StringTables->WriteUpdateMessage( NULL, pDeltaFrame->tick_count, msg );
+			m_CurrentFrame->from_baseline = NULL;
+			WriteDeltaEntities( pClient, m_CurrentFrame, pDeltaFrame, msg );
+		}
+	}
+	timer.End();
+	double flPerSpectator = timer.GetDuration().GetSeconds();
+
+	// encode once per delta tick, copy for each spectator
+	int nOldShared = m_nSharedSnapshots;
+	timer.Start();
+	for ( int f = 0; f < nFrames; f++ )
+	{
+		m_nSharedSnapshots = 0;
+
+		for ( int i = 0; i < nSpectators; i++ )
+		{
+			CClientFrame *pDeltaFrame = deltaFrames[i % deltaFrames.Count()];
+			pClient->m_nDeltaTick = pDeltaFrame->tick_count;
+			CHLTVSharedSnapshot *pSnapshot = GetSharedSnapshot( pClient, pDeltaFrame );
+
+			bf_write msg( "tv_relay_bench", sends.Base(), sends.Count() );
+			msg.WriteBits( pSnapshot->m_Data.Base(), pSnapshot->m_nBits );
+		}
+	}
+	timer.End();
+	double flShared = timer.GetDuration().GetSeconds();
+
+	m_nSharedSnapshots = nOldShared;
+	pClient->FreeBaselines();
+	delete pClient;
+
+	int nSends = nSpectators * nFrames;
+	float flSnapshotRate = 1.0f / GetTickInterval();
+	const ConVar *pSnapshotRate = g_pCVar->FindVar( "tv_snapshotrate" );
+	if ( pSnapshotRate )
+	{
+		flSnapshotRate = pSnapshotRate->GetFloat();
+	}
+
+	ConMsg( "Relay fan-out, %d spectators over %d delta ticks, %d frames:\n", nSpectators, deltaFrames.Count(), nFrames );
+	ConMsg( "  Encode per spectator : %.2f us/spectator, %.0f spectators per core at %.0f snapshots/sec\n",
+		flPerSpectator * 1000000.0 / nSends, flPerSpectator > 0 ? nSends / ( flPerSpectator * flSnapshotRate ) : 0.0, flSnapshotRate );
+	ConMsg( "  Shared encoding      : %.2f us/spectator, %.0f spectators per core at %.0f snapshots/sec\n",
+		flShared * 1000000.0 / nSends, flShared > 0 ? nSends / ( flShared * flSnapshotRate ) : 0.0, flSnapshotRate );
+	ConMsg( "  Send workers         : %d (tv_relaythreads %d)\n", GetRelayWorkerCount( nSpectators ), tv_relaythreads.GetInt() );
 }
 
 void CHLTVServer::UpdateStats( void )
@@ -1666,6 +2059,10 @@ void CHLTVServer::Clear( void )
 
 	m_DeltaCache.Flush();
 	m_FrameCache.RemoveAll();
+
+	m_nSharedSnapshots = 0;
+	m_RelaySends.RemoveAll();
+	m_RelayWorkers.RemoveAll();
 }
 
 void CHLTVServer::Init(bool bIsDedicated)
@@ -1876,6 +2273,15 @@ void CHLTVServer::ReadCompeleteDemoFile()
 				// MOTODO HLTV must store user commands too
 			}
 			break;
+		case dem_keyframe:
+			{
+				// we read every packet, so keyframes have nothing new
+				int inseq, outseqack = 0;
+				m_DemoFile.ReadCmdInfo( m_LastCmdInfo );
+				m_DemoFile.ReadSequenceInfo( inseq, outseqack );
+				m_DemoFile.ReadRawData( NULL, 0 );
+			}
+			break;
 		case dem_signon:
 		case dem_packet:
 			{
@@ -2001,6 +2407,15 @@ CON_COMMAND( tv_status, "Show SourceTV server status." )
 	ConMsg("Total Slots %i, Spectators %i, Proxies %i\n", 
 		slots, clients-proxies, proxies);
 
+	CUtlVector<HLTVRelayWorkerStats_t> workers;
+	hltv->GetLocalStats( workers );
+
+	for ( int i = 0; i < workers.Count(); i++ )
+	{
+		ConMsg("Relay Thread %i, Spectators %i, Snapshots %i, KB Sent %.1f, Busy %.2f sec\n",
+			i, workers[i].nSpectators, workers[i].nSnapshots, workers[i].nBytes / 1024.0f, workers[i].flBusyTime );
+	}
+
 	if ( hltv->m_DemoRecorder.IsRecording() )
 	{
 		ConMsg("Recording to \"%s\", length %s.\n", hltv->m_DemoRecorder.GetDemoFile()->m_szFileName, 
@@ -2008,6 +2423,20 @@ CON_COMMAND( tv_status, "Show SourceTV server status." )
 	}		
 }
 
+CON_COMMAND( tv_relay_bench, "Measures relay snapshot fan-out cost: tv_relay_bench [spectators] [frames]" )
+{
+	if ( !hltv || !hltv->IsActive() )
+	{
+		ConMsg("SourceTV not active.\n" );
+		return;
+	}
+
+	int nSpectators = ( args.ArgC() > 1 ) ? Q_atoi( args[1] ) : 256;
+	int nFrames = ( args.ArgC() > 2 ) ? Q_atoi( args[2] ) : 20;
+
+	hltv->RunRelayBenchmark( max( nSpectators, 1 ), max( nFrames, 1 ) );
+}
+
 CON_COMMAND( tv_relay, "Connect to SourceTV server and relay broadcast." )
 {
 	if ( args.ArgC() < 2 )
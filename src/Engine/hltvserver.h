@@ -85,6 +85,53 @@ protected:
 };
 
 
+//-----------------------------------------------------------------------------
+// Relay fan-out. A relay encodes each distinct snapshot message once per frame,
+// then worker threads send it to all spectators that share its key. Workers only
+// read the encoded buffer.
+//-----------------------------------------------------------------------------
+struct CHLTVSharedSnapshot
+{
+	// key
+	int		m_nDeltaTick;			// -1 for a full update
+	int		m_nAckTick;				// string table state the spectators acknowledged
+	int		m_nBaselineUsed;
+	unsigned char m_BaselineSignature[MD5_DIGEST_LENGTH];
+	bool	m_bHasBaseline;
+	bool	m_bBaselineUpdateReady;	// no baseline update pending, so this one may become one
+	bool	m_bShared;				// false if encoded for a single traced spectator
+
+	// encoded message
+	CUtlVector<unsigned char> m_Data;
+	int		m_nBits;
+	bool	m_bOverflowed;
+	bool	m_bBaselineUpdate;		// message tells the spectators to keep it as a baseline
+	CBitVec<MAX_EDICTS> m_BaselinesSent;
+};
+
+struct CHLTVRelaySend
+{
+	CHLTVClient			*m_pClient;
+	CHLTVFrame			*m_pFirstFrame;	// first frame with buffered messages for this spectator
+	CHLTVSharedSnapshot	*m_pSnapshot;	// NULL if only pending reliable data is transmitted
+	bool				m_bSendFailed;
+};
+
+struct HLTVRelayWorkerStats_t
+{
+	int		nSpectators;	// spectators served in the last frame
+	int		nSnapshots;		// snapshots sent since the relay started
+	int64	nBytes;			// snapshot bytes sent since the relay started
+	double	flBusyTime;		// seconds spent sending since the relay started
+};
+
+struct CHLTVRelayWorker
+{
+	int		m_nFirstSend;	// slice of CHLTVServer::m_RelaySends
+	int		m_nSends;
+	HLTVRelayWorkerStats_t m_Stats;
+};
+
 class CGameClient;
 class CGameServer;
 class IHLTVDirector;
@@ -120,6 +167,7 @@ public: // IHLTVServer interface:
 	int		GetHLTVSlot( void ); // return entity index-1 of HLTV in game
 	float	GetOnlineTime( void ); // seconds since broadcast started
 	void	GetLocalStats( int &proxies, int &slots, int &clients ); 
+	void	GetLocalStats( CUtlVector<HLTVRelayWorkerStats_t> &workers ); // per relay worker thread
 	void	GetGlobalStats( int &proxies, int &slots, int &clients );
 	void	GetRelayStats( int &proxies, int &slots, int &clients );
 
@@ -178,6 +226,7 @@ public:
 	bool	DispatchToRelay( CHLTVClient *pClient);
 	bf_write *GetBuffer( int nBuffer);
 	CClientFrame *GetDeltaFrame( int nTick );
+	void	RunRelayBenchmark( int nSpectators, int nFrames );
 		
 	inline  CHLTVClient* Client( int i ) { return static_cast<CHLTVClient*>(m_Clients[i]); }
 
@@ -196,6 +245,12 @@ private:
 	void		FreeClientRecvTables();
 	void		ReadCompeleteDemoFile();
 	void		ResyncDemoClock();
+
+	int			GetRelayWorkerCount( int nSends );
+	void		SendRelayMessages( void );
+	CHLTVSharedSnapshot *GetSharedSnapshot( CHLTVClient *pClient, CClientFrame *pDeltaFrame );
+	void		EncodeSharedSnapshot( CHLTVSharedSnapshot *pSnapshot, CHLTVClient *pClient, CClientFrame *pDeltaFrame );
+	void		RunRelayWorker( CHLTVRelayWorker &worker );
 		
 
 	// Vector		GetOriginFromPackedEntity(PackedEntity* pe);
@@ -234,6 +289,11 @@ public:
 	CDeltaEntityCache				m_DeltaCache;
 	CUtlVector<CFrameCacheEntry_s>	m_FrameCache;
 
+	CUtlVector<CHLTVSharedSnapshot*> m_SharedSnapshots;	// reused every frame, first m_nSharedSnapshots are valid
+	int								m_nSharedSnapshots;
+	CUtlVector<CHLTVRelaySend>		m_RelaySends;
+	CUtlVector<CHLTVRelayWorker>	m_RelayWorkers;
+
 	// demoplayer stuff:
 	CDemoFile		m_DemoFile;		// for demo playback
 	int				m_nStartTick;
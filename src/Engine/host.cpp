@@ -426,6 +426,11 @@ CON_COMMAND( threadpool_run_tests, "" )
 		RunThreadPoolTests();
 	}
 }
+
+CON_COMMAND( threadpool_run_scheduler_tests, "Compare the shared queue and work stealing thread pool schedulers" )
+{
+	RunThreadPoolSchedulerTests();
+}
 #endif
 
 //-----------------------------------------------------------------------------
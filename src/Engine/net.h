@@ -16,6 +16,7 @@
 #include "common.h"
 #include "bitbuf.h"
 #include "netadr.h"
+#include "inetchannel.h"
 
 // Flow control bytes per second limits
 #define MAX_RATE		(1024*1024)				
@@ -127,6 +128,9 @@ void		NET_OutOfBandPrintf(int sock, const netadr_t &adr, const char *format, ...
 int			NET_SendPacket ( INetChannel *chan, int sock,  const netadr_t &to, const  unsigned char *data, int length, bf_write *pVoicePayload = NULL, bool bUseCompression = false );
 // Called periodically to maybe send any queued packets (up to 4 per frame)
 void		NET_SendQueuedPackets();
+// Queue outgoing datagrams and send them with as few syscalls as possible (net_batchudp)
+void		NET_BeginBatchedSend();
+void		NET_FlushBatchedSend();
 // Start set current network configuration
 void		NET_SetMutiplayer(bool multiplayer);
 // Set net_time
@@ -164,9 +168,24 @@ void NET_RemoveAllExtraSockets();
 const char *NET_ErrorString (int code); // translate a socket error into a friendly string
 
 // Returns true if compression succeeded, false otherwise
-bool NET_BufferToBufferCompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen );
+bool NET_BufferToBufferCompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen, int nCompressor = NET_COMPRESSOR_LZSS );
 bool NET_BufferToBufferDecompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen );
 
+// Packet + fragment codecs (net_compress.cpp)
+void NET_InitCompression();
+void NET_ShutdownCompression();
+const char *NET_GetCompressorName( int nCompressor );
+// Picks the codec to use for a remote that asked for nRequested and has the given dictionary
+int NET_NegotiateCompressor( int nRequested, const char *pszDictionaryId );
+// pOutput must hold nInputSize bytes, returns false if the data didn't get smaller
+bool NET_CompressBuffer( int nCompressor, byte *pOutput, unsigned int *pOutputSize, const byte *pInput, unsigned int nInputSize );
+// Returns 0 if the buffer wasn't compressed by any codec we know
+unsigned int NET_GetDecompressedSize( const byte *pInput, unsigned int nInputSize );
+// Returns the uncompressed size, 0 on failure
+unsigned int NET_DecompressBuffer( byte *pOutput, unsigned int nOutputSize, const byte *pInput, unsigned int nInputSize );
+// Records the payload to the net_compress_capture file, if there is one
+void NET_CaptureCompressionSample( const byte *pData, unsigned int nSize );
+
 //============================================================================
 
 // Message data
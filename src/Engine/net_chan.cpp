@@ -189,7 +189,9 @@ void CNetChan::CompressFragments()
 			unsigned int compressedSize = data->bytes;
 			char * compressedData = new char[data->bytes];
 
-			if ( NET_BufferToBufferCompress( compressedData , &compressedSize, data->buffer, data->bytes ) )
+			NET_CaptureCompressionSample( (byte *)data->buffer, data->bytes );
+
+			if ( NET_BufferToBufferCompress( compressedData , &compressedSize, data->buffer, data->bytes, m_nCompressor ) )
 			{
 				DevMsg("Compressing fragments (%d -> %d bytes)\n", data->bytes, compressedSize );
 
@@ -241,8 +243,9 @@ void CNetChan::CompressFragments()
 				// read in source file
 				g_pFileSystem->Read( uncompressed, data->bytes, data->file );
 
-				// compress into buffer
-				if ( NET_BufferToBufferCompress( compressed, &compressedSize, uncompressed, uncompressedSize ) )
+				// compress into buffer. The .ztmp file is shared by every client that 
+				// downloads the file, so it always uses the codec they all understand
+				if ( NET_BufferToBufferCompress( compressed, &compressedSize, uncompressed, uncompressedSize, NET_COMPRESSOR_LZSS ) )
 				{
 					// write out to disk compressed version
 					hZipFile = g_pFileSystem->Open( compressedfilename, "wb", NULL );
@@ -282,25 +285,30 @@ void CNetChan::CompressFragments()
 	}
 }
 
-void CNetChan::UncompressFragments( dataFragments_t *data )
+bool CNetChan::UncompressFragments( dataFragments_t *data )
 {
 	if ( !data->isCompressed )
-		return;
+		return true;
 
 	 // allocate buffer for uncompressed data, align to 4 bytes boundary
 	char *newbuffer = new char[PAD_NUMBER( data->nUncompressedSize, 4 )];
 	unsigned int uncompressedSize = data->nUncompressedSize;
 
 	// uncompress data
-	NET_BufferToBufferDecompress( newbuffer, &uncompressedSize, data->buffer, data->bytes );
-
-	Assert( uncompressedSize == data->nUncompressedSize );
+	if ( !NET_BufferToBufferDecompress( newbuffer, &uncompressedSize, data->buffer, data->bytes ) ||
+		 uncompressedSize != data->nUncompressedSize )
+	{
+		ConMsg("Receiving failed: uncompressed %u of %u bytes\n", uncompressedSize, data->nUncompressedSize );
+		delete [] newbuffer;
+		return false;
+	}
 
 	// free old buffer and set new buffer
 	delete [] data->buffer;
 	data->buffer = newbuffer;
 	data->bytes = uncompressedSize;
 	data->isCompressed = false;
+	return true;
 }
 
 unsigned int CNetChan::RequestFile(const char *filename	)
@@ -458,6 +466,7 @@ CNetChan::CNetChan()
 	m_FileRequestCounter = 0;
 	m_bFileBackgroundTranmission = true;
 	m_bUseCompression = false;
+	m_nCompressor = NET_COMPRESSOR_LZSS;
 	m_nQueuedPackets = 0;
 
 	m_flRemoteFrameTime = 0;
@@ -2032,9 +2041,12 @@ bool CNetChan::CheckReceivingList(int nList)
 	if ( net_showfragments.GetBool() )
 		ConMsg("Receiving complete: %i fragments, %i bytes\n", data->numFragments, data->bytes );
 
-	if ( data->isCompressed )
+	if ( data->isCompressed && !UncompressFragments( data ) )
 	{
-		UncompressFragments( data );
+		// drop the transfer, the data can't be used
+		delete [] data->buffer;
+		data->buffer = NULL;
+		return false;
 	}
 
 	if ( !data->filename[0] )
@@ -2945,6 +2957,22 @@ int CNetChan::GetMaxRoutablePayloadSize()
 	return m_nMaxRoutablePayloadSize;
 }
 
+void CNetChan::SetCompressor( int nCompressor )
+{
+	Assert( nCompressor >= NET_COMPRESSOR_LZSS && nCompressor < NET_COMPRESSOR_COUNT );
+	if ( m_nCompressor != nCompressor )
+	{
+		DevMsg( "Setting compressor from %s to %s for %s\n",
+			NET_GetCompressorName( m_nCompressor ), NET_GetCompressorName( nCompressor ), GetName() );
+	}
+	m_nCompressor = nCompressor;
+}
+
+int CNetChan::GetCompressor()
+{
+	return m_nCompressor;
+}
+
 int CNetChan::IncrementSplitPacketSequence()
 {
 	return ++m_nSplitPacketSequence;
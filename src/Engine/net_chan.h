@@ -198,6 +198,10 @@ public:	// INetChannel interface
 	virtual void	SetMaxRoutablePayloadSize( int nSplitSize );
 	virtual int	GetMaxRoutablePayloadSize();
 
+	// Codec for compressed packets + fragments
+	virtual void	SetCompressor( int nCompressor );
+	virtual int		GetCompressor();
+
 	int			IncrementSplitPacketSequence();
 public:
 
@@ -225,7 +229,7 @@ private:
 	bool	CreateFragmentsFromFile( const char *filename, int stream, unsigned int transferID );
 
 	void	CompressFragments();
-	void	UncompressFragments( dataFragments_t *data );
+	bool	UncompressFragments( dataFragments_t *data );
 
 	bool	SendSubChannelData( bf_write &buf );
 	bool	ReadSubChannelData( bf_read &buf, int stream );
@@ -300,6 +304,7 @@ public:
 	unsigned int	m_FileRequestCounter;	// increasing counter with each file request
 	bool			m_bFileBackgroundTranmission; // if true, only send 1 fragment per packet
 	bool			m_bUseCompression;	// if true, larger reliable data will be bzip compressed
+	int				m_nCompressor;		// NET_COMPRESSOR_* used for outgoing packets + fragments
 	
 	// TCP stream state maschine:
 	bool		m_StreamActive;		// true if TCP is active
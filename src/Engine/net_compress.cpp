@@ -0,0 +1,369 @@
+//========= Copyright  1996-2007, Valve Corporation, All rights reserved. ============//
+//
+// Purpose: Codecs for compressed packets and netchannel fragments.
+//
+//	The server picks a codec per client out of what the client advertised through its
+//	net_compressor userinfo. Clients that don't send it stay on LZSS, and the receiving
+//	side tells the codecs apart by their magic so it doesn't need to know the choice.
+//
+//=============================================================================//
+
+#include "net.h"
+#include "filesystem_engine.h"
+#include "filesystem.h"
+#include "convar.h"
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier1/lzss.h"
+#include "tier1/lzfast.h"
+#include "tier1/utlbuffer.h"
+#include "tier1/utlvector.h"
+#include "tier1/strtools.h"
+#include "threadtools.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define NET_COMPRESS_DICTIONARY_FILE	"scripts/net_compress.dict"
+
+static CLZFastDictionary s_CompressDictionary;
+
+ConVar net_compressor( "net_compressor", "2", FCVAR_ARCHIVE | FCVAR_USERINFO, "Best codec we accept for compressed packets and fragments (0 = LZSS, 1 = LZFast, 2 = LZFast with dictionary).", true, NET_COMPRESSOR_LZSS, true, NET_COMPRESSOR_COUNT - 1 );
+ConVar net_compressor_dict( "net_compressor_dict", "0", FCVAR_USERINFO | FCVAR_HIDDEN | FCVAR_DONTRECORD, "Id of the loaded packet compression dictionary." );
+static ConVar sv_net_compressor( "sv_net_compressor", "2", 0, "Server upper bound on net_compressor that a client can use.", true, NET_COMPRESSOR_LZSS, true, NET_COMPRESSOR_COUNT - 1 );
+
+static const char *s_pszCompressorNames[NET_COMPRESSOR_COUNT] =
+{
+	"LZSS",
+	"LZFast",
+	"LZFast+dict",
+};
+
+const char *NET_GetCompressorName( int nCompressor )
+{
+	if ( nCompressor < 0 || nCompressor >= NET_COMPRESSOR_COUNT )
+		return "unknown";
+
+	return s_pszCompressorNames[nCompressor];
+}
+
+//-----------------------------------------------------------------------------
+// Dictionary
+//-----------------------------------------------------------------------------
+static void NET_LoadCompressionDictionary()
+{
+	s_CompressDictionary.Shutdown();
+
+	CUtlBuffer buf;
+	if ( g_pFileSystem && g_pFileSystem->ReadFile( NET_COMPRESS_DICTIONARY_FILE, "GAME", buf, LZFAST_MAX_DICTIONARY ) && buf.TellPut() > 0 )
+	{
+		s_CompressDictionary.Init( (const unsigned char *)buf.Base(), buf.TellPut() );
+	}
+
+	char szId[16];
+	Q_snprintf( szId, sizeof( szId ), "%08x", s_CompressDictionary.GetId() );
+	net_compressor_dict.SetValue( szId );
+}
+
+void NET_InitCompression()
+{
+	NET_LoadCompressionDictionary();
+}
+
+static void NET_StopCompressionCapture();
+
+void NET_ShutdownCompression()
+{
+	NET_StopCompressionCapture();
+	s_CompressDictionary.Shutdown();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Picks the codec for a remote end that accepts up to nRequested
+//-----------------------------------------------------------------------------
+int NET_NegotiateCompressor( int nRequested, const char *pszDictionaryId )
+{
+	int nCompressor = min( nRequested, sv_net_compressor.GetInt() );
+	nCompressor = clamp( nCompressor, (int)NET_COMPRESSOR_LZSS, NET_COMPRESSOR_COUNT - 1 );
+
+	if ( nCompressor == NET_COMPRESSOR_LZFAST_DICT )
+	{
+		// both ends have to have loaded the very same dictionary
+		unsigned int nDictionaryId = pszDictionaryId ? strtoul( pszDictionaryId, NULL, 16 ) : 0;
+		if ( !s_CompressDictionary.IsValid() || nDictionaryId != s_CompressDictionary.GetId() )
+		{
+			nCompressor = NET_COMPRESSOR_LZFAST;
+		}
+	}
+
+	return nCompressor;
+}
+
+//-----------------------------------------------------------------------------
+// Compression
+//-----------------------------------------------------------------------------
+bool NET_CompressBuffer( int nCompressor, byte *pOutput, unsigned int *pOutputSize, const byte *pInput, unsigned int nInputSize )
+{
+	switch ( nCompressor )
+	{
+	case NET_COMPRESSOR_LZFAST:
+	case NET_COMPRESSOR_LZFAST_DICT:
+		{
+			const CLZFastDictionary *pDictionary = ( nCompressor == NET_COMPRESSOR_LZFAST_DICT && s_CompressDictionary.IsValid() ) ? &s_CompressDictionary : NULL;
+			CLZFast lzfast;
+			return lzfast.CompressNoAlloc( pInput, nInputSize, pOutput, pOutputSize, pDictionary ) != NULL;
+		}
+
+	default:
+		{
+			CLZSS lzss;
+			return lzss.CompressNoAlloc( (byte *)pInput, nInputSize, pOutput, pOutputSize ) != NULL;
+		}
+	}
+}
+
+unsigned int NET_GetDecompressedSize( const byte *pInput, unsigned int nInputSize )
+{
+	CLZFast lzfast;
+	if ( nInputSize >= sizeof( lzfast_header_t ) && lzfast.IsCompressed( pInput ) )
+		return lzfast.GetActualSize( pInput );
+
+	CLZSS lzss;
+	if ( nInputSize >= sizeof( lzss_header_t ) && lzss.IsCompressed( (byte *)pInput ) )
+		return lzss.GetActualSize( (byte *)pInput );
+
+	return 0;
+}
+
+unsigned int NET_DecompressBuffer( byte *pOutput, unsigned int nOutputSize, const byte *pInput, unsigned int nInputSize )
+{
+	CLZFast lzfast;
+	if ( nInputSize >= sizeof( lzfast_header_t ) && lzfast.IsCompressed( pInput ) )
+	{
+		const CLZFastDictionary *pDictionary = lzfast.GetDictionaryId( pInput ) ? &s_CompressDictionary : NULL;
+		return lzfast.Uncompress( pInput, nInputSize, pOutput, nOutputSize, pDictionary );
+	}
+
+	CLZSS lzss;
+	if ( nInputSize >= sizeof( lzss_header_t ) && lzss.IsCompressed( (byte *)pInput ) )
+	{
+		if ( lzss.GetActualSize( (byte *)pInput ) > nOutputSize )
+			return 0;
+
+		return lzss.Uncompress( (byte *)pInput, pOutput );
+	}
+
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Capture. The file is a series of [int size][size bytes] records holding
+// the payloads as they were before compression.
+//-----------------------------------------------------------------------------
+static CThreadFastMutex s_CaptureMutex;
+static FileHandle_t s_hCaptureFile = FILESYSTEM_INVALID_HANDLE;
+static int s_nCaptureSamples = 0;
+
+void NET_CaptureCompressionSample( const byte *pData, unsigned int nSize )
+{
+	if ( s_hCaptureFile == FILESYSTEM_INVALID_HANDLE )
+		return;
+
+	AUTO_LOCK( s_CaptureMutex );
+	if ( s_hCaptureFile == FILESYSTEM_INVALID_HANDLE )
+		return;
+
+	int nLittleSize = LittleLong( (int)nSize );
+	g_pFileSystem->Write( &nLittleSize, sizeof( nLittleSize ), s_hCaptureFile );
+	g_pFileSystem->Write( pData, nSize, s_hCaptureFile );
+	s_nCaptureSamples++;
+}
+
+static void NET_StopCompressionCapture()
+{
+	AUTO_LOCK( s_CaptureMutex );
+	if ( s_hCaptureFile == FILESYSTEM_INVALID_HANDLE )
+		return;
+
+	g_pFileSystem->Close( s_hCaptureFile );
+	s_hCaptureFile = FILESYSTEM_INVALID_HANDLE;
+	ConMsg( "net_compress_capture: wrote %d packets\n", s_nCaptureSamples );
+}
+
+// Loads a capture file, the samples are stored back to back in data
+static bool NET_LoadCompressionCapture( const char *pszFile, CUtlBuffer &data, CUtlVector< int > &sizes )
+{
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pszFile, "MOD", buf ) )
+	{
+		ConMsg( "Couldn't read capture file %s\n", pszFile );
+		return false;
+	}
+
+	while ( buf.GetBytesRemaining() >= (int)sizeof( int ) )
+	{
+		int nSize = LittleLong( buf.GetInt() );
+		if ( nSize <= 0 || nSize > buf.GetBytesRemaining() )
+			break;
+
+		sizes.AddToTail( nSize );
+		data.Put( (const byte *)buf.PeekGet(), nSize );
+		buf.SeekGet( CUtlBuffer::SEEK_CURRENT, nSize );
+	}
+
+	if ( !sizes.Count() )
+	{
+		ConMsg( "Capture file %s has no packets\n", pszFile );
+		return false;
+	}
+
+	return true;
+}
+
+CON_COMMAND( net_compress_capture, "Record outgoing packets and fragments before compression: <file> | stop" )
+{
+	if ( args.ArgC() != 2 )
+	{
+		ConMsg( "Usage: net_compress_capture <file> | stop\n" );
+		return;
+	}
+
+	NET_StopCompressionCapture();
+
+	if ( !Q_stricmp( args[1], "stop" ) )
+		return;
+
+	AUTO_LOCK( s_CaptureMutex );
+	s_nCaptureSamples = 0;
+	s_hCaptureFile = g_pFileSystem->Open( args[1], "wb", "MOD" );
+	if ( s_hCaptureFile == FILESYSTEM_INVALID_HANDLE )
+	{
+		ConMsg( "Couldn't open %s for writing\n", args[1] );
+		return;
+	}
+
+	ConMsg( "Capturing compressed packets to %s\n", args[1] );
+}
+
+CON_COMMAND( net_compress_train, "Build a packet compression dictionary from a capture: <capture file> <dictionary file> [max size]" )
+{
+	if ( args.ArgC() < 3 )
+	{
+		ConMsg( "Usage: net_compress_train <capture file> <dictionary file> [max size]\n" );
+		return;
+	}
+
+	int nMaxSize = ( args.ArgC() > 3 ) ? atoi( args[3] ) : 16384;
+	nMaxSize = clamp( nMaxSize, 256, LZFAST_MAX_DICTIONARY );
+
+	CUtlBuffer data;
+	CUtlVector< int > sizes;
+	if ( !NET_LoadCompressionCapture( args[1], data, sizes ) )
+		return;
+
+	CUtlBuffer dict;
+	dict.EnsureCapacity( nMaxSize );
+	int nDictSize = CLZFastDictionary::Train( (const unsigned char *)data.Base(), sizes.Base(), sizes.Count(), (unsigned char *)dict.Base(), nMaxSize );
+	if ( nDictSize <= 0 )
+	{
+		ConMsg( "net_compress_train: not enough repeated data in %s\n", args[1] );
+		return;
+	}
+	dict.SeekPut( CUtlBuffer::SEEK_HEAD, nDictSize );
+
+	if ( !g_pFileSystem->WriteFile( args[2], "MOD", dict ) )
+	{
+		ConMsg( "Couldn't write %s\n", args[2] );
+		return;
+	}
+
+	ConMsg( "Wrote %d byte dictionary from %d packets to %s, copy it to %s on both ends\n", nDictSize, sizes.Count(), args[2], NET_COMPRESS_DICTIONARY_FILE );
+}
+
+CON_COMMAND( net_compress_bench, "Compare the packet codecs on a capture: <capture file> [iterations]" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		ConMsg( "Usage: net_compress_bench <capture file> [iterations]\n" );
+		return;
+	}
+
+	int nIterations = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 10;
+	nIterations = max( nIterations, 1 );
+
+	CUtlBuffer data;
+	CUtlVector< int > sizes;
+	if ( !NET_LoadCompressionCapture( args[1], data, sizes ) )
+		return;
+
+	int nTotalSize = data.TellPut();
+	int nLargest = 0;
+	for ( int i = 0; i < sizes.Count(); i++ )
+	{
+		nLargest = max( nLargest, sizes[i] );
+	}
+
+	// every packet keeps its own slot so the decompress pass has something to read
+	CUtlMemory< byte > compressed( 0, sizes.Count() * nLargest );
+	CUtlVector< unsigned int > compressedSizes;
+	compressedSizes.SetCount( sizes.Count() );
+	CUtlMemory< byte > decompressed( 0, nLargest );
+
+	ConMsg( "%d packets, %d bytes, dictionary %s\n", sizes.Count(), nTotalSize, s_CompressDictionary.IsValid() ? net_compressor_dict.GetString() : "not loaded" );
+
+	for ( int nCompressor = 0; nCompressor < NET_COMPRESSOR_COUNT; nCompressor++ )
+	{
+		if ( nCompressor == NET_COMPRESSOR_LZFAST_DICT && !s_CompressDictionary.IsValid() )
+			continue;
+
+		int nOutputSize = 0;
+		double flStart = Plat_FloatTime();
+		for ( int nIter = 0; nIter < nIterations; nIter++ )
+		{
+			nOutputSize = 0;
+			const byte *pInput = (const byte *)data.Base();
+			for ( int i = 0; i < sizes.Count(); i++ )
+			{
+				// store packets that don't compress as they are, the same way NET_SendPacket does
+				byte *pOutput = compressed.Base() + i * nLargest;
+				unsigned int nSize = sizes[i];
+				if ( !NET_CompressBuffer( nCompressor, pOutput, &nSize, pInput, sizes[i] ) )
+				{
+					nSize = 0;
+				}
+				compressedSizes[i] = nSize;
+				nOutputSize += nSize ? nSize : sizes[i];
+				pInput += sizes[i];
+			}
+		}
+		double flCompress = Plat_FloatTime() - flStart;
+
+		int nErrors = 0;
+		flStart = Plat_FloatTime();
+		for ( int nIter = 0; nIter < nIterations; nIter++ )
+		{
+			const byte *pInput = (const byte *)data.Base();
+			for ( int i = 0; i < sizes.Count(); i++ )
+			{
+				if ( compressedSizes[i] )
+				{
+					unsigned int nSize = NET_DecompressBuffer( decompressed.Base(), nLargest, compressed.Base() + i * nLargest, compressedSizes[i] );
+					if ( nIter == 0 && ( nSize != (unsigned int)sizes[i] || Q_memcmp( decompressed.Base(), pInput, nSize ) ) )
+					{
+						nErrors++;
+					}
+				}
+				pInput += sizes[i];
+			}
+		}
+		double flDecompress = Plat_FloatTime() - flStart;
+
+		double flMegabytes = (double)nTotalSize * nIterations / ( 1024.0 * 1024.0 );
+		ConMsg( "%-12s: %5.1f%% of input, compress %7.1f MB/s, decompress %7.1f MB/s, %d errors\n",
+			NET_GetCompressorName( nCompressor ),
+			100.0 * nOutputSize / nTotalSize,
+			flCompress > 0 ? flMegabytes / flCompress : 0.0,
+			flDecompress > 0 ? flMegabytes / flDecompress : 0.0,
+			nErrors );
+	}
+}
@@ -11,6 +11,7 @@
 #include "net_ws_headers.h"
 #include "net_ws_queued_packet_sender.h"
 #include "tier1/lzss.h"
+#include "tier1/lzfast.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -1308,6 +1309,253 @@ bool NET_GetLoopPacket ( netpacket_t * packet )
 	return ( NET_LagPacket( true, packet ) );	
 }
 
+//-----------------------------------------------------------------------------
+// Batched UDP (Linux only). With net_batchudp each socket is drained with one
+// recvmmsg() into a ring of preallocated buffers, and the datagrams sent while
+// the server writes its client messages are queued and flushed with sendmmsg().
+// Fake lag/loss and split packets work on the individual datagrams as before.
+//-----------------------------------------------------------------------------
+
+#if defined( _LINUX )
+
+static ConVar net_batchudp( "net_batchudp", "0", 0, "Receive and send UDP packets in batches with recvmmsg/sendmmsg" );
+
+#define NET_BATCH_RECV_PACKETS	32		// datagrams per recvmmsg call
+#define NET_BATCH_SEND_PACKETS	256		// datagrams queued before the send queue is flushed early
+
+struct netrecvbatch_t
+{
+	int				hUDP;		// socket the ring was filled from
+	int				nCount;		// datagrams in the ring
+	int				nNext;		// next datagram to hand out
+	struct mmsghdr	msgs[NET_BATCH_RECV_PACKETS];
+	struct iovec	iovecs[NET_BATCH_RECV_PACKETS];
+	struct sockaddr	from[NET_BATCH_RECV_PACKETS];
+	byte			buffers[NET_BATCH_RECV_PACKETS][NET_MAX_MESSAGE];
+};
+
+struct netsenditem_t
+{
+	SOCKET			s;
+	int				len;
+	struct sockaddr	to;
+	byte			data[MAX_ROUTABLE_PAYLOAD];	// split packets never exceed this
+};
+
+struct netsendbatch_t
+{
+	netsenditem_t	items[NET_BATCH_SEND_PACKETS];
+	struct mmsghdr	msgs[NET_BATCH_SEND_PACKETS];
+	struct iovec	iovecs[NET_BATCH_SEND_PACKETS];
+	int				nCount;
+};
+
+static netrecvbatch_t		*s_pRecvBatch[MAX_SOCKETS];
+static netsendbatch_t		*s_pSendBatch = NULL;
+static bool					s_bSendBatchActive = false;
+static CThreadFastMutex		s_SendBatchMutex;
+
+// syscall counters for net_batchudp_stats
+static CInterlockedInt		s_nRecvSyscalls;
+static CInterlockedInt		s_nRecvPackets;
+static int					s_nSendSyscalls;
+static int					s_nSendPackets;
+static int					s_nSendTicks;
+
+static bool NET_UseBatchedReceive( int sock )
+{
+	if ( VCRGetMode() != VCR_Disabled )
+		return false;
+
+	// keep handing out what's left in the ring after net_batchudp was turned off
+	netrecvbatch_t *pBatch = s_pRecvBatch[sock];
+	return net_batchudp.GetBool() || ( pBatch && pBatch->nNext < pBatch->nCount );
+}
+
+// Same contract as recvfrom(), but serves datagrams out of the receive ring
+static int NET_ReceiveBatched( int sock, int net_socket, unsigned char *pData, struct sockaddr *pFrom )
+{
+	netrecvbatch_t *pBatch = s_pRecvBatch[sock];
+
+	if ( !pBatch )
+	{
+		pBatch = s_pRecvBatch[sock] = new netrecvbatch_t;
+		pBatch->hUDP = net_socket;
+		pBatch->nCount = pBatch->nNext = 0;
+	}
+
+	if ( pBatch->hUDP != net_socket )
+	{
+		// socket was reopened, whatever is left belongs to the old one
+		pBatch->hUDP = net_socket;
+		pBatch->nCount = pBatch->nNext = 0;
+	}
+
+	if ( pBatch->nNext >= pBatch->nCount )
+	{
+		pBatch->nCount = pBatch->nNext = 0;
+
+		for ( int i = 0; i < NET_BATCH_RECV_PACKETS; i++ )
+		{
+			pBatch->iovecs[i].iov_base = pBatch->buffers[i];
+			pBatch->iovecs[i].iov_len = NET_MAX_MESSAGE;
+
+			Q_memset( &pBatch->msgs[i].msg_hdr, 0, sizeof( pBatch->msgs[i].msg_hdr ) );
+			pBatch->msgs[i].msg_hdr.msg_name = &pBatch->from[i];
+			pBatch->msgs[i].msg_hdr.msg_namelen = sizeof( pBatch->from[i] );
+			pBatch->msgs[i].msg_hdr.msg_iov = &pBatch->iovecs[i];
+			pBatch->msgs[i].msg_hdr.msg_iovlen = 1;
+			pBatch->msgs[i].msg_len = 0;
+		}
+
+		int nReceived = recvmmsg( net_socket, pBatch->msgs, NET_BATCH_RECV_PACKETS, MSG_DONTWAIT, NULL );
+		s_nRecvSyscalls++;
+
+		if ( nReceived <= 0 )
+			return ( nReceived < 0 ) ? -1 : 0;	// errno is picked up by NET_GetLastError
+
+		pBatch->nCount = nReceived;
+		s_nRecvPackets += nReceived;
+	}
+
+	int i = pBatch->nNext++;
+
+	if ( pBatch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC )
+	{
+		// let the caller report it as oversize
+		pBatch->msgs[i].msg_len = NET_MAX_MESSAGE;
+	}
+
+	int nBytes = pBatch->msgs[i].msg_len;
+	Q_memcpy( pData, pBatch->buffers[i], nBytes );
+	Q_memcpy( pFrom, &pBatch->from[i], sizeof( struct sockaddr ) );
+
+	return nBytes;
+}
+
+// Sends everything in the queue, caller must hold s_SendBatchMutex
+static void NET_FlushBatchedSendQueue()
+{
+	netsendbatch_t *pBatch = s_pSendBatch;
+	if ( !pBatch || !pBatch->nCount )
+		return;
+
+	for ( int i = 0; i < pBatch->nCount; i++ )
+	{
+		netsenditem_t &item = pBatch->items[i];
+
+		pBatch->iovecs[i].iov_base = item.data;
+		pBatch->iovecs[i].iov_len = item.len;
+
+		Q_memset( &pBatch->msgs[i].msg_hdr, 0, sizeof( pBatch->msgs[i].msg_hdr ) );
+		pBatch->msgs[i].msg_hdr.msg_name = &item.to;
+		pBatch->msgs[i].msg_hdr.msg_namelen = sizeof( item.to );
+		pBatch->msgs[i].msg_hdr.msg_iov = &pBatch->iovecs[i];
+		pBatch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	// sendmmsg takes a single socket, send each run of the same socket at once
+	int iFirst = 0;
+	while ( iFirst < pBatch->nCount )
+	{
+		SOCKET s = pBatch->items[iFirst].s;
+		int iLast = iFirst + 1;
+		while ( iLast < pBatch->nCount && pBatch->items[iLast].s == s )
+		{
+			iLast++;
+		}
+
+		while ( iFirst < iLast )
+		{
+			int nSent = sendmmsg( s, &pBatch->msgs[iFirst], iLast - iFirst, 0 );
+			s_nSendSyscalls++;
+
+			if ( nSent <= 0 )
+			{
+				// a single bad datagram mustn't block the rest, drop it like a failed sendto
+				NET_GetLastError();
+				ConDMsg( "NET_FlushBatchedSend: %s\n", NET_ErrorString( net_error ) );
+				nSent = 1;
+			}
+			else
+			{
+				s_nSendPackets += nSent;
+			}
+
+			iFirst += nSent;
+		}
+	}
+
+	pBatch->nCount = 0;
+}
+
+// Returns false if the datagram has to be sent right away
+static bool NET_QueueBatchedSend( SOCKET s, const char *buf, int len, const struct sockaddr *to, int tolen )
+{
+	AUTO_LOCK_FM( s_SendBatchMutex );
+
+	if ( !s_bSendBatchActive )
+		return false;
+
+	if ( len > MAX_ROUTABLE_PAYLOAD || tolen > (int)sizeof( struct sockaddr ) )
+	{
+		// don't let this one overtake the datagrams already queued
+		NET_FlushBatchedSendQueue();
+		return false;
+	}
+
+	if ( s_pSendBatch->nCount == NET_BATCH_SEND_PACKETS )
+	{
+		NET_FlushBatchedSendQueue();
+	}
+
+	netsenditem_t &item = s_pSendBatch->items[s_pSendBatch->nCount++];
+	item.s = s;
+	item.len = len;
+	Q_memset( &item.to, 0, sizeof( item.to ) );
+	Q_memcpy( &item.to, to, tolen );
+	Q_memcpy( item.data, buf, len );
+
+	return true;
+}
+
+#endif // _LINUX
+
+//-----------------------------------------------------------------------------
+// Purpose: Queue outgoing datagrams until NET_FlushBatchedSend (net_batchudp)
+//-----------------------------------------------------------------------------
+void NET_BeginBatchedSend()
+{
+#if defined( _LINUX )
+	if ( !net_batchudp.GetBool() || VCRGetMode() != VCR_Disabled || !NET_IsMultiplayer() )
+		return;
+
+	AUTO_LOCK_FM( s_SendBatchMutex );
+
+	if ( !s_pSendBatch )
+	{
+		s_pSendBatch = new netsendbatch_t;
+		s_pSendBatch->nCount = 0;
+	}
+
+	s_bSendBatchActive = true;
+#endif
+}
+
+void NET_FlushBatchedSend()
+{
+#if defined( _LINUX )
+	AUTO_LOCK_FM( s_SendBatchMutex );
+
+	if ( !s_bSendBatchActive )
+		return;
+
+	NET_FlushBatchedSendQueue();
+	s_bSendBatchActive = false;
+	s_nSendTicks++;
+#endif
+}
+
 bool NET_ReceiveDatagram ( const int sock, netpacket_t * packet )
 {
 	Assert ( packet );
@@ -1334,7 +1582,18 @@ bool NET_ReceiveDatagram ( const int sock, netpacket_t * packet )
 	}
 #endif
 
-	int ret = VCRHook_recvfrom(net_socket, (char *)packet->data, NET_MAX_MESSAGE, 0, (struct sockaddr *)&from, (int *)&fromlen );
+	int ret;
+#if defined( _LINUX )
+	if ( NET_UseBatchedReceive( sock ) )
+	{
+		ret = NET_ReceiveBatched( sock, net_socket, packet->data, &from );
+	}
+	else
+#endif
+	{
+		ret = VCRHook_recvfrom(net_socket, (char *)packet->data, NET_MAX_MESSAGE, 0, (struct sockaddr *)&from, (int *)&fromlen );
+	}
+
 	if ( ret > 0 )
 	{
 		packet->wiresize = ret;
@@ -1406,18 +1665,20 @@ bool NET_ReceiveDatagram ( const int sock, netpacket_t * packet )
 			if ( LittleLong( *(int *)packet->data) == NET_HEADER_FLAG_COMPRESSEDPACKET )
 			{
 				byte *pCompressedData = packet->data + sizeof( unsigned int );
+				unsigned int nCompressedSize = packet->size - sizeof( unsigned int );
 
-				CLZSS lzss;
 				// Decompress
-				int actualSize = lzss.GetActualSize( pCompressedData );
-				if ( actualSize <= 0 )
+				unsigned int actualSize = NET_GetDecompressedSize( pCompressedData, nCompressedSize );
+				if ( actualSize == 0 || actualSize > NET_MAX_MESSAGE )
 					return false;
 
 				MEM_ALLOC_CREDIT();
 				CUtlMemoryFixedGrowable< byte, NET_COMPRESSION_STACKBUF_SIZE > memDecompressed( NET_COMPRESSION_STACKBUF_SIZE );
 				memDecompressed.EnsureCapacity( actualSize );
 
-				unsigned int uDecompressedSize = lzss.Uncompress( pCompressedData, memDecompressed.Base() );
+				unsigned int uDecompressedSize = NET_DecompressBuffer( memDecompressed.Base(), actualSize, pCompressedData, nCompressedSize );
+				if ( uDecompressedSize == 0 )
+					return false;
 
 				// packet->wiresize is already set
 				Q_memcpy( packet->data, memDecompressed.Base(), uDecompressedSize );
@@ -1799,6 +2060,13 @@ int NET_SendToImpl( SOCKET s, const char FAR * buf, int len, const struct sockad
 	}
 	else
 #endif //defined( _X360 )
+#if defined( _LINUX )
+	if ( NET_QueueBatchedSend( s, buf, len, to, tolen ) )
+	{
+		nSend = len;
+	}
+	else
+#endif
 	{
 		nSend = sendto( s, buf, len, 0, to, tolen );
 	}
@@ -2254,15 +2522,16 @@ int NET_SendPacket ( INetChannel *chan, int sock,  const netadr_t &to, const uns
 
 	if ( bUseCompression )
 	{
-		CLZSS lzss;
 		unsigned int nCompressedLength = length;
 	
 		memCompressed.EnsureCapacity( length + nVoiceBytes + sizeof( unsigned int ) );
 
 		*(int *)memCompressed.Base() = LittleLong( NET_HEADER_FLAG_COMPRESSEDPACKET );
 
-		byte *pOutput = lzss.CompressNoAlloc( (byte *)data, length, memCompressed.Base() + sizeof( unsigned int ), &nCompressedLength );
-		if ( pOutput )
+		NET_CaptureCompressionSample( data, length );
+
+		int nCompressor = chan ? chan->GetCompressor() : NET_COMPRESSOR_LZSS;
+		if ( NET_CompressBuffer( nCompressor, memCompressed.Base() + sizeof( unsigned int ), &nCompressedLength, data, length ) )
 		{
 			data	= memCompressed.Base();
 			length	= nCompressedLength + sizeof( unsigned int );
@@ -2359,9 +2628,19 @@ NET_CloseAllSockets
 */
 void NET_CloseAllSockets (void)
 {
+	// anything still queued must go out before the sockets are gone
+	NET_FlushBatchedSend();
+
 	// shut down any existing and open sockets
 	for (int i=0 ; i<net_sockets.Count() ; i++)
 	{
+#if defined( _LINUX )
+		if ( s_pRecvBatch[i] )
+		{
+			s_pRecvBatch[i]->nCount = s_pRecvBatch[i]->nNext = 0;
+		}
+#endif
+
 		if ( net_sockets[i].nPort )
 		{
 			NET_CloseSocket( net_sockets[i].hUDP );
@@ -3060,6 +3339,8 @@ void NET_Init( bool bIsDedicated )
 		// set SP mode
 		NET_ConfigLoopbackBuffers( true );
 	}
+
+	NET_InitCompression();
 }
 
 /*
@@ -3084,6 +3365,7 @@ void NET_Shutdown (void)
 
 	NET_CloseAllSockets();
 	NET_ConfigLoopbackBuffers( false );
+	NET_ShutdownCompression();
 
 #if defined(_WIN32)
 	if ( !net_noip )
@@ -3205,6 +3487,173 @@ CON_COMMAND( net_status, "Shows current network status" )
 	ConMsg( "           per client out %.1f, in %.1f kB/s\n", (avgDataOut/numChannels)/1024.0f, (avgDataIn/numChannels)/1024.0f );
 }
 
+#if defined( _LINUX )
+
+CON_COMMAND( net_batchudp_stats, "Shows syscall counts of the batched UDP path (net_batchudp)" )
+{
+	ConMsg( "net_batchudp %d\n", net_batchudp.GetInt() );
+	ConMsg( "- Receive: %d packets in %d recvmmsg calls (%.1f per call)\n", 
+		(int)s_nRecvPackets, (int)s_nRecvSyscalls, s_nRecvSyscalls ? (float)s_nRecvPackets / s_nRecvSyscalls : 0.0f );
+	ConMsg( "- Send:    %d packets in %d sendmmsg calls over %d ticks (%.2f calls, %.1f packets per tick)\n",
+		s_nSendPackets, s_nSendSyscalls, s_nSendTicks,
+		s_nSendTicks ? (float)s_nSendSyscalls / s_nSendTicks : 0.0f, s_nSendTicks ? (float)s_nSendPackets / s_nSendTicks : 0.0f );
+
+	if ( args.ArgC() > 1 && !Q_stricmp( args[1], "reset" ) )
+	{
+		s_nRecvPackets = 0;
+		s_nRecvSyscalls = 0;
+		s_nSendPackets = s_nSendSyscalls = s_nSendTicks = 0;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Loopback benchmark: sends "ticks" of datagrams from one local socket to another
+// and drains them again, once with sendto/recvfrom and once with sendmmsg/recvmmsg
+//-----------------------------------------------------------------------------
+static int NET_OpenBenchSocket( struct sockaddr_in *pAddr )
+{
+	int s = socket( PF_INET, SOCK_DGRAM, IPPROTO_UDP );
+	if ( s == -1 )
+		return -1;
+
+	int nBufSize = 4 * 1024 * 1024;
+	setsockopt( s, SOL_SOCKET, SO_RCVBUF, (char *)&nBufSize, sizeof( nBufSize ) );
+	setsockopt( s, SOL_SOCKET, SO_SNDBUF, (char *)&nBufSize, sizeof( nBufSize ) );
+
+	Q_memset( pAddr, 0, sizeof( *pAddr ) );
+	pAddr->sin_family = AF_INET;
+	pAddr->sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+	pAddr->sin_port = 0;
+
+	socklen_t len = sizeof( *pAddr );
+	if ( bind( s, (struct sockaddr *)pAddr, len ) == -1 || getsockname( s, (struct sockaddr *)pAddr, &len ) == -1 )
+	{
+		closesocket( s );
+		return -1;
+	}
+
+	return s;
+}
+
+CON_COMMAND( net_batchudp_bench, "Loopback benchmark of sendto/recvfrom vs. sendmmsg/recvmmsg: [ticks] [packets per tick] [packet size]" )
+{
+	int nTicks = ( args.ArgC() > 1 ) ? atoi( args[1] ) : 1000;
+	int nPacketsPerTick = ( args.ArgC() > 2 ) ? atoi( args[2] ) : 64;
+	int nPacketSize = ( args.ArgC() > 3 ) ? atoi( args[3] ) : 1000;
+
+	nTicks = max( nTicks, 1 );
+	nPacketsPerTick = clamp( nPacketsPerTick, 1, NET_BATCH_SEND_PACKETS );
+	nPacketSize = clamp( nPacketSize, 16, MAX_ROUTABLE_PAYLOAD );
+
+	struct sockaddr_in sendAddr, recvAddr;
+	int hSend = NET_OpenBenchSocket( &sendAddr );
+	int hRecv = NET_OpenBenchSocket( &recvAddr );
+	if ( hSend == -1 || hRecv == -1 )
+	{
+		ConMsg( "net_batchudp_bench: couldn't open loopback sockets\n" );
+		if ( hSend != -1 ) closesocket( hSend );
+		if ( hRecv != -1 ) closesocket( hRecv );
+		return;
+	}
+
+	byte payload[MAX_ROUTABLE_PAYLOAD];
+	for ( int i = 0; i < nPacketSize; i++ )
+	{
+		payload[i] = (byte)i;
+	}
+
+	netsendbatch_t *pSend = new netsendbatch_t;
+	netrecvbatch_t *pRecv = new netrecvbatch_t;
+
+	for ( int bBatched = 0; bBatched < 2; bBatched++ )
+	{
+		int nSyscalls = 0;
+		int nReceived = 0;
+		double flStart = Plat_FloatTime();
+
+		for ( int t = 0; t < nTicks; t++ )
+		{
+			if ( bBatched )
+			{
+				for ( int i = 0; i < nPacketsPerTick; i++ )
+				{
+					pSend->iovecs[i].iov_base = payload;
+					pSend->iovecs[i].iov_len = nPacketSize;
+					Q_memset( &pSend->msgs[i].msg_hdr, 0, sizeof( pSend->msgs[i].msg_hdr ) );
+					pSend->msgs[i].msg_hdr.msg_name = &recvAddr;
+					pSend->msgs[i].msg_hdr.msg_namelen = sizeof( recvAddr );
+					pSend->msgs[i].msg_hdr.msg_iov = &pSend->iovecs[i];
+					pSend->msgs[i].msg_hdr.msg_iovlen = 1;
+				}
+
+				int nSent = 0;
+				while ( nSent < nPacketsPerTick )
+				{
+					int n = sendmmsg( hSend, &pSend->msgs[nSent], nPacketsPerTick - nSent, 0 );
+					nSyscalls++;
+					if ( n <= 0 )
+						break;
+					nSent += n;
+				}
+
+				for (;;)
+				{
+					for ( int i = 0; i < NET_BATCH_RECV_PACKETS; i++ )
+					{
+						pRecv->iovecs[i].iov_base = pRecv->buffers[i];
+						pRecv->iovecs[i].iov_len = NET_MAX_MESSAGE;
+						Q_memset( &pRecv->msgs[i].msg_hdr, 0, sizeof( pRecv->msgs[i].msg_hdr ) );
+						pRecv->msgs[i].msg_hdr.msg_name = &pRecv->from[i];
+						pRecv->msgs[i].msg_hdr.msg_namelen = sizeof( pRecv->from[i] );
+						pRecv->msgs[i].msg_hdr.msg_iov = &pRecv->iovecs[i];
+						pRecv->msgs[i].msg_hdr.msg_iovlen = 1;
+					}
+
+					int n = recvmmsg( hRecv, pRecv->msgs, NET_BATCH_RECV_PACKETS, MSG_DONTWAIT, NULL );
+					nSyscalls++;
+					if ( n <= 0 )
+						break;
+					nReceived += n;
+				}
+			}
+			else
+			{
+				for ( int i = 0; i < nPacketsPerTick; i++ )
+				{
+					sendto( hSend, (const char *)payload, nPacketSize, 0, (struct sockaddr *)&recvAddr, sizeof( recvAddr ) );
+					nSyscalls++;
+				}
+
+				for (;;)
+				{
+					struct sockaddr from;
+					socklen_t fromlen = sizeof( from );
+					int n = recvfrom( hRecv, pRecv->buffers[0], NET_MAX_MESSAGE, MSG_DONTWAIT, &from, &fromlen );
+					nSyscalls++;
+					if ( n <= 0 )
+						break;
+					nReceived++;
+				}
+			}
+		}
+
+		double flElapsed = Plat_FloatTime() - flStart;
+		int nTotal = nTicks * nPacketsPerTick;
+
+		ConMsg( "%-17s: %d/%d packets in %.3fs, %.0f packets/s, %.1f syscalls/tick\n",
+			bBatched ? "sendmmsg/recvmmsg" : "sendto/recvfrom",
+			nReceived, nTotal, flElapsed, flElapsed > 0 ? nReceived / flElapsed : 0.0,
+			(float)nSyscalls / nTicks );
+	}
+
+	delete pSend;
+	delete pRecv;
+	closesocket( hSend );
+	closesocket( hRecv );
+}
+
+#endif // _LINUX
+
 //-----------------------------------------------------------------------------
 // Purpose: Generic buffer compression from source into dest
 // Input  : *dest - 
@@ -3213,12 +3662,24 @@ CON_COMMAND( net_status, "Shows current network status" )
 //			sourceLen - 
 // Output : int
 //-----------------------------------------------------------------------------
-bool NET_BufferToBufferCompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen )
+bool NET_BufferToBufferCompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen, int nCompressor )
 {
 	Assert( dest );
 	Assert( destLen );
 	Assert( source );
 
+	if ( nCompressor != NET_COMPRESSOR_LZSS )
+	{
+		// The fast codecs compress straight into dest, which must be able to hold the source
+		Assert( *destLen >= sourceLen );
+		if ( NET_CompressBuffer( nCompressor, (byte *)dest, destLen, (byte *)source, sourceLen ) )
+			return true;
+
+		Q_memcpy( dest, source, sourceLen );
+		*destLen = sourceLen;
+		return false;
+	}
+
 	Q_memcpy( dest, source, sourceLen );
 	CLZSS s;
 	unsigned int uCompressedLen = 0;
@@ -3252,6 +3713,21 @@ bool NET_BufferToBufferCompress( char *dest, unsigned int *destLen, char *source
 //-----------------------------------------------------------------------------
 bool NET_BufferToBufferDecompress( char *dest, unsigned int *destLen, char *source, unsigned int sourceLen )
 {
+	CLZFast lzfast;
+	if ( sourceLen >= sizeof( lzfast_header_t ) && lzfast.IsCompressed( (byte *)source ) )
+	{
+		unsigned int uDecompressedLen = NET_DecompressBuffer( (byte *)dest, *destLen, (byte *)source, sourceLen );
+		if ( uDecompressedLen == 0 )
+		{
+			Warning( "NET_BufferToBufferDecompress: failed to decompress %u bytes (%u in, %u needed)\n", sourceLen, *destLen, lzfast.GetActualSize( (byte *)source ) );
+			*destLen = 0;
+			return false;
+		}
+
+		*destLen = uDecompressedLen;
+		return true;
+	}
+
 	CLZSS s;
 	if ( s.IsCompressed( (byte *)source ) )
 	{
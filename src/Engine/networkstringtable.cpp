@@ -38,23 +38,65 @@ static int CountSimilarCharacters( char const *str1, char const *str2 )
 	return c;
 }
 
-static int GetBestPreviousString( CUtlVector< StringHistoryEntry >& history, char const *newstring, int& substringsize )
+//-----------------------------------------------------------------------------
+// Encoder side string history. Holds the same 32 entry window the decoder keeps
+// in ParseUpdate, as a ring. A base string must share at least 3 characters, so
+// entries are bucketed by their first 3 and only the new string's bucket is searched.
+//-----------------------------------------------------------------------------
+#define STRING_HISTORY_SIZE		32		// history index is sent in 5 bits
+#define STRING_HISTORY_BUCKETS	64
+
+class CStringHistoryEncoder
+{
+public:
+	CStringHistoryEncoder()
+	{
+		m_nFirst = 0;
+		m_nCount = 0;
+		memset( m_BucketSlots, 0, sizeof( m_BucketSlots ) );
+	}
+
+	int GetBestPreviousString( char const *newstring, int& substringsize ) const;
+	void AddString( char const *pString );
+
+private:
+	static int GetBucket( char const *pString )
+	{
+		if ( !pString[0] || !pString[1] || !pString[2] )
+			return -1;
+
+		return ( (unsigned char)pString[0] * 7 + (unsigned char)pString[1] * 3 + (unsigned char)pString[2] ) & ( STRING_HISTORY_BUCKETS - 1 );
+	}
+
+	StringHistoryEntry	m_Entries[STRING_HISTORY_SIZE];
+	int					m_nBucket[STRING_HISTORY_SIZE];
+	unsigned int		m_BucketSlots[STRING_HISTORY_BUCKETS];	// one bit per ring slot
+	int					m_nFirst;	// ring slot of history index 0
+	int					m_nCount;
+};
+
+int CStringHistoryEncoder::GetBestPreviousString( char const *newstring, int& substringsize ) const
 {
 	int bestindex = -1;
 	int bestcount = 0;
-	int c = history.Count();
-	for ( int i = 0; i < c; i++ )
+
+	int bucket = GetBucket( newstring );
+	unsigned int slots = ( bucket != -1 ) ? m_BucketSlots[bucket] : 0;
+	for ( int slot = 0; slots; slot++, slots >>= 1 )
 	{
-		char const *prev = history[ i ].string;
-		int similar = CountSimilarCharacters( prev, newstring );
-		
+		if ( !( slots & 1 ) )
+			continue;
+
+		int similar = CountSimilarCharacters( m_Entries[slot].string, newstring );
 		if ( similar < 3 )
 			continue;
 
-		if ( similar > bestcount )
+		// ties go to the oldest entry
+		int index = ( slot - m_nFirst ) & ( STRING_HISTORY_SIZE - 1 );
+		if ( similar > bestcount || ( similar == bestcount && index < bestindex ) )
 		{
 			bestcount = similar;
-			bestindex = i;
+			bestindex = index;
 		}
 	}
 
@@ -62,6 +104,35 @@ static int GetBestPreviousString( CUtlVector< StringHistoryEntry >& history, cha
 	return bestindex;
 }
 
+void CStringHistoryEncoder::AddString( char const *pString )
+{
+	int slot;
+	if ( m_nCount == STRING_HISTORY_SIZE )
+	{
+		// drop the oldest entry
+		slot = m_nFirst;
+		if ( m_nBucket[slot] != -1 )
+		{
+			m_BucketSlots[m_nBucket[slot]] &= ~( 1u << slot );
+		}
+		m_nFirst = ( m_nFirst + 1 ) & ( STRING_HISTORY_SIZE - 1 );
+	}
+	else
+	{
+		slot = ( m_nFirst + m_nCount ) & ( STRING_HISTORY_SIZE - 1 );
+		m_nCount++;
+	}
+
+	Q_strncpy( m_Entries[slot].string, pString, sizeof( m_Entries[slot].string ) );
+	m_nBucket[slot] = GetBucket( m_Entries[slot].string );
+	if ( m_nBucket[slot] != -1 )
+	{
+		m_BucketSlots[m_nBucket[slot]] |= ( 1u << slot );
+	}
+}
+
+static ConVar sv_stringtable_update_cache( "sv_stringtable_update_cache", "1", 0, "Encode string table updates once for all clients that acknowledged the same table state." );
+
 bool CNetworkStringTable_LessFunc( FileNameHandle_t const &a, FileNameHandle_t const &b )
 {
 	return a < b;
@@ -217,6 +288,20 @@ CNetworkStringTable::CNetworkStringTable( TABLEID id, const char *tableName, int
 	m_bChangeHistoryEnabled = false;
 	m_bLocked = false;
 
+#ifndef SHARED_NET_STRING_TABLES
+	m_bChangeTicksTruncated = false;
+	m_nUpdateSerial = 0;
+	m_nUpdateCacheUses = 0;
+	for ( int i = 0; i < UPDATE_CACHE_SIZE; i++ )
+	{
+		m_UpdateCache[i].nKey = 0;
+		m_UpdateCache[i].nSerial = -1;
+		m_UpdateCache[i].nEntries = 0;
+		m_UpdateCache[i].nBits = 0;
+		m_UpdateCache[i].nLastUsed = 0;
+	}
+#endif
+
 	m_nMaxEntries = maxentries;
 	m_nEntryBits = Q_log2( m_nMaxEntries );
 
@@ -331,6 +416,12 @@ void CNetworkStringTable::DeleteAllStrings( void )
 	{
 		m_pItemsClientSide->Purge();
 	}
+
+#ifndef SHARED_NET_STRING_TABLES
+	m_ChangeTicks.RemoveAll();
+	m_bChangeTicksTruncated = false;
+	m_nUpdateSerial++;
+#endif
 }
 
 //-----------------------------------------------------------------------------
@@ -435,6 +526,109 @@ void CNetworkStringTable::RestoreTick(int tick)
 		if ( tickChanged > m_nLastChangedTick )
 			m_nLastChangedTick = tickChanged;
 	}
+
+	RebuildChangeTicks();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Records that a networked item changed at tick, which invalidates
+//			the cached updates
+//-----------------------------------------------------------------------------
+void CNetworkStringTable::NoteItemChanged( int tick )
+{
+	m_nUpdateSerial++;
+
+	// Ticks come in order except from CopyStringTable
+	int i = m_ChangeTicks.Count();
+	while ( i > 0 && m_ChangeTicks[i-1] > tick )
+	{
+		i--;
+	}
+
+	if ( i > 0 && m_ChangeTicks[i-1] == tick )
+		return;
+
+	// Older than the window, GetUpdateKey doesn't normalize those tick_acks anyway
+	if ( i == 0 && m_bChangeTicksTruncated )
+		return;
+
+	m_ChangeTicks.InsertBefore( i, tick );
+
+	if ( m_ChangeTicks.Count() > MAX_CHANGE_TICKS )
+	{
+		m_ChangeTicks.RemoveMultiple( 0, m_ChangeTicks.Count() - MAX_CHANGE_TICKS );
+		m_bChangeTicksTruncated = true;
+	}
+}
+
+static int __cdecl ChangeTickCompare( const int *a, const int *b )
+{
+	return *a - *b;
+}
+
+void CNetworkStringTable::RebuildChangeTicks()
+{
+	m_ChangeTicks.RemoveAll();
+	m_bChangeTicksTruncated = false;
+	m_nUpdateSerial++;
+
+	int count = m_pItems->Count();
+	for ( int i = 0; i < count; i++ )
+	{
+		CNetworkStringTableItem *p = &m_pItems->Element( i );
+		m_ChangeTicks.AddToTail( p->GetTickChanged() );
+		m_ChangeTicks.AddToTail( p->GetTickCreated() );
+	}
+
+	m_ChangeTicks.Sort( ChangeTickCompare );
+
+	// remove duplicates
+	int nUnique = 0;
+	for ( int i = 0; i < m_ChangeTicks.Count(); i++ )
+	{
+		if ( nUnique == 0 || m_ChangeTicks[nUnique-1] != m_ChangeTicks[i] )
+		{
+			m_ChangeTicks[nUnique++] = m_ChangeTicks[i];
+		}
+	}
+	m_ChangeTicks.RemoveMultiple( nUnique, m_ChangeTicks.Count() - nUnique );
+
+	if ( m_ChangeTicks.Count() > MAX_CHANGE_TICKS )
+	{
+		m_ChangeTicks.RemoveMultiple( 0, m_ChangeTicks.Count() - MAX_CHANGE_TICKS );
+		m_bChangeTicksTruncated = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Maps tick_ack to the latest change tick at or before it. Every
+//			tick_ack with the same key gets the same update.
+//-----------------------------------------------------------------------------
+int CNetworkStringTable::GetUpdateKey( int tick_ack ) const
+{
+	int found = -1;
+	int lo = 0;
+	int hi = m_ChangeTicks.Count() - 1;
+	while ( lo <= hi )
+	{
+		int mid = ( lo + hi ) / 2;
+		if ( m_ChangeTicks[mid] <= tick_ack )
+		{
+			found = mid;
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid - 1;
+		}
+	}
+
+	if ( found != -1 )
+		return m_ChangeTicks[found];
+
+	// Before every known change. If older ticks were dropped we can't tell
+	// which changes lie between, so only identical acks share.
+	return m_bChangeTicksTruncated ? tick_ack : -1;
 }
 
 //-----------------------------------------------------------------------------
@@ -485,7 +679,73 @@ void CNetworkStringTable::UpdateMirrorTable( int tick_ack  )
 
 int CNetworkStringTable::WriteUpdate( CBaseClient *client, bf_write &buf, int tick_ack )
 {
-	CUtlVector< StringHistoryEntry > history;
+	// Tracing clients want the size of every entry, so they always encode
+	if ( !sv_stringtable_update_cache.GetBool() || ( client && client->IsTracing() ) )
+		return EncodeUpdate( client, buf, tick_ack );
+
+	int nKey = GetUpdateKey( tick_ack );
+
+	{
+		AUTO_LOCK_FM( m_UpdateCacheMutex );
+
+		for ( int i = 0; i < UPDATE_CACHE_SIZE; i++ )
+		{
+			UpdateCacheEntry_t &entry = m_UpdateCache[i];
+			if ( entry.nSerial == m_nUpdateSerial && entry.nKey == nKey )
+			{
+				entry.nLastUsed = ++m_nUpdateCacheUses;
+				buf.WriteBits( entry.data.Base(), entry.nBits );
+				return entry.nEntries;
+			}
+		}
+	}
+
+	int nStartBit = buf.GetNumBitsWritten();
+	int entries = EncodeUpdate( client, buf, tick_ack );
+
+	if ( !entries || buf.IsOverflowed() )
+		return entries;
+
+	AUTO_LOCK_FM( m_UpdateCacheMutex );
+
+	// Take an entry encoded for an older table state first, then the least recently used
+	int iReplace = -1;
+	bool bReplaceStale = false;
+	for ( int i = 0; i < UPDATE_CACHE_SIZE; i++ )
+	{
+		UpdateCacheEntry_t &entry = m_UpdateCache[i];
+		bool bStale = ( entry.nSerial != m_nUpdateSerial );
+
+		// another client encoded it meanwhile
+		if ( !bStale && entry.nKey == nKey )
+			return entries;
+
+		if ( iReplace == -1 || ( bStale && !bReplaceStale ) ||
+			 ( bStale == bReplaceStale && entry.nLastUsed < m_UpdateCache[iReplace].nLastUsed ) )
+		{
+			iReplace = i;
+			bReplaceStale = bStale;
+		}
+	}
+
+	UpdateCacheEntry_t &entry = m_UpdateCache[iReplace];
+	entry.nKey = nKey;
+	entry.nSerial = m_nUpdateSerial;
+	entry.nEntries = entries;
+	entry.nBits = buf.GetNumBitsWritten() - nStartBit;
+	entry.nLastUsed = ++m_nUpdateCacheUses;
+	entry.data.SetCount( BitByte( entry.nBits ) );
+
+	bf_read encoded( buf.GetBasePointer(), buf.GetNumBytesWritten() );
+	encoded.Seek( nStartBit );
+	encoded.ReadBits( entry.data.Base(), entry.nBits );
+
+	return entries;
+}
+
+int CNetworkStringTable::EncodeUpdate( CBaseClient *client, bf_write &buf, int tick_ack )
+{
+	CStringHistoryEncoder history;
 
 	int entriesUpdated = 0;
 	int lastEntry = -1;
@@ -522,7 +782,7 @@ int CNetworkStringTable::WriteUpdate( CBaseClient *client, bf_write &buf, int ti
 			buf.WriteOneBit( 1 );
 			
 			int substringsize = 0;
-			int bestprevious = GetBestPreviousString( history, pEntry, substringsize );
+			int bestprevious = history.GetBestPreviousString( pEntry, substringsize );
 			if ( bestprevious != -1 )
 			{
 				buf.WriteOneBit( 1 );
@@ -564,16 +824,8 @@ int CNetworkStringTable::WriteUpdate( CBaseClient *client, bf_write &buf, int ti
 			buf.WriteOneBit( 0 );
 		}
 
-		// limit string history to 32 entries
-		if ( history.Count() > 31 )
-		{
-			history.Remove( 0 );
-		}
-
-		// add string to string history
-		StringHistoryEntry she;
-		Q_strncpy( she.string, pEntry, sizeof( she.string ) );
-		history.AddToTail( she );
+		// add string to string history, it keeps the last 32 entries
+		history.AddString( pEntry );
 
 		entriesUpdated++;
 		lastEntry = i;
@@ -915,6 +1167,13 @@ int CNetworkStringTable::AddString( bool bIsServer, const char *string, int leng
 		{
 			DataChanged( i, item );
 		}
+
+#ifndef SHARED_NET_STRING_TABLES
+		if ( bHasChanged )
+		{
+			NoteItemChanged( m_nTickCount );
+		}
+#endif
 	}
 
 	return i;
@@ -976,6 +1235,13 @@ void CNetworkStringTable::SetStringUserData( int stringNumber, int length /*=0*/
 	{
 		// Mark changed
 		DataChanged( saveStringNumber, p );
+
+#ifndef SHARED_NET_STRING_TABLES
+		if ( dict == m_pItems )
+		{
+			NoteItemChanged( m_nTickCount );
+		}
+#endif
 	}
 }
 
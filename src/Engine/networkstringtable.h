@@ -15,7 +15,9 @@
 
 #include <utldict.h>
 #include <utlbuffer.h>
+#include <utlvector.h>
 #include "tier1/bitbuf.h"
+#include "tier0/threadtools.h"
 
 class SVC_CreateStringTable;
 class CBaseClient;
@@ -107,6 +109,32 @@ public:
 protected:
 	void			DataChanged( int stringNumber, CNetworkStringTableItem *item );
 
+#ifndef SHARED_NET_STRING_TABLES
+	// Encode once update cache. Clients whose tick_ack falls between the same two
+	// change ticks get identical updates, so the first one encodes and the rest
+	// copy the bits.
+	enum
+	{
+		UPDATE_CACHE_SIZE = 4,
+		MAX_CHANGE_TICKS = 128,
+	};
+
+	struct UpdateCacheEntry_t
+	{
+		int						nKey;		// normalized tick_ack
+		int						nSerial;	// m_nUpdateSerial when encoded
+		int						nEntries;
+		int						nBits;
+		unsigned int			nLastUsed;
+		CUtlVector<unsigned char> data;
+	};
+
+	int				EncodeUpdate( CBaseClient *client, bf_write &buf, int tick_ack );
+	int				GetUpdateKey( int tick_ack ) const;
+	void			NoteItemChanged( int tick );
+	void			RebuildChangeTicks();
+#endif
+
 	// Destroy string table
 	void			DeleteAllStrings( void );
 
@@ -139,6 +167,15 @@ protected:
 
 	INetworkStringDict		*m_pItems;
 	INetworkStringDict		*m_pItemsClientSide;	 // For m_bAllowClientSideAddString, these items are non-networked and are referenced by a negative string index!!!
+
+#ifndef SHARED_NET_STRING_TABLES
+	CUtlVector<int>			m_ChangeTicks;			// sorted, distinct ticks any networked item was changed or created at
+	bool					m_bChangeTicksTruncated;// oldest ticks were dropped from m_ChangeTicks
+	int						m_nUpdateSerial;		// bumped on every networked change
+	UpdateCacheEntry_t		m_UpdateCache[UPDATE_CACHE_SIZE];
+	unsigned int			m_nUpdateCacheUses;
+	CThreadFastMutex		m_UpdateCacheMutex;		// clients send snapshots in parallel
+#endif
 };
 
 //-----------------------------------------------------------------------------
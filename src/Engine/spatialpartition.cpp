@@ -31,6 +31,9 @@
 #include "tier2/renderutils.h"
 #include "bitvec.h"
 #include "tier1/mempool.h"
+#include "mathlib/ssemath.h"
+#include "vstdlib/random.h"
+#include "tier0/fasttimer.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -218,18 +221,46 @@ private:
 
 class CSpatialPartition;
 
+//-----------------------------------------------------------------------------
+// A single client or server tree. CSpatialPartition owns the handles and
+// forwards the tree operations to one of these, picked at map load.
+//-----------------------------------------------------------------------------
+abstract_class IPartitionTree
+{
+public:
+	virtual ~IPartitionTree() {}
+
+	virtual void Init( CSpatialPartition *pOwner, int iTree, const Vector& worldmin, const Vector& worldmax ) = 0;
+	virtual void Shutdown( void ) = 0;
+
+	virtual void InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs ) = 0;
+	virtual void RemoveFromTree( SpatialPartitionHandle_t hPartition ) = 0;
+
+	virtual void ElementMoved( SpatialPartitionHandle_t handle, const Vector& mins, const Vector& maxs ) = 0;
+	virtual void EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, bool coarseTest, IPartitionEnumerator* pIterator ) = 0;
+	virtual void EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, const Vector& origin, float radius, bool coarseTest, IPartitionEnumerator* pIterator ) = 0;
+	virtual void EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, bool coarseTest, IPartitionEnumerator* pIterator ) = 0;
+	virtual void EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, const Vector& pt, bool coarseTest, IPartitionEnumerator* pIterator ) = 0;
+
+	virtual void RenderAllObjectsInTree( float flTime ) = 0;
+	virtual void RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const Vector &vecPlayerMax, float flTime ) = 0;
+
+	virtual void ReportStats( const char *pFileName ) = 0;
+	virtual void DrawDebugOverlays() = 0;
+};
+
 //-----------------------------------------------------------------------------
 // 
 //-----------------------------------------------------------------------------
 
-class CVoxelTree
+class CVoxelTree : public IPartitionTree
 {
 public:
 	// constructor, destructor
 	CVoxelTree();
 	virtual ~CVoxelTree();
 
-	// Inherited from ISpatialPartition
+	// Inherited from IPartitionTree
 	virtual void Init(  CSpatialPartition *pOwner, int iTree, const Vector& worldmin, const Vector& worldmax );
 
 	virtual void ElementMoved( SpatialPartitionHandle_t handle, const Vector& mins, const Vector& maxs );
@@ -254,13 +285,13 @@ public:
 	void EndVisit( CPartitionVisits * );
 
 	// Shut down the allocated memory
-	void Shutdown( void );
+	virtual void Shutdown( void );
 
 	// Insert into the appropriate tree
-	void InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs );
+	virtual void InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs );
 
 	// Remove from appropriate tree
-	void RemoveFromTree( SpatialPartitionHandle_t hPartition );
+	virtual void RemoveFromTree( SpatialPartitionHandle_t hPartition );
 
 	void LockForWrite()		{ m_lock.LockForWrite(); }
 	void UnlockWrite()		{ m_lock.UnlockWrite(); }
@@ -294,6 +325,112 @@ private:
 	CThreadSpinRWLock					m_lock;
 };
 
+
+//-----------------------------------------------------------------------------
+// Dynamic AABB tree. A height balanced 4-ary tree, split R-tree style, whose
+// nodes keep the bounds of their children in SoA form so each node is tested
+// against a query with a handful of SIMD ops. Leaves hold fattened bounds so
+// small moves only touch the entity info; larger moves refit the ancestors
+// in place and only fall back to a reinsert when the refit would grow the
+// leaf node too much.
+//-----------------------------------------------------------------------------
+#define BVH_NODE_WIDTH			4
+#define BVH_FAT_MARGIN			8.0f		// Leaf bounds are grown by this much
+#define BVH_MAX_DISPLACEMENT	64.0f		// and stretched along the last move by up to this much
+#define BVH_REFIT_MAX_GROWTH	1.25f		// Max leaf node area growth handled by a refit
+
+struct BVHNode_t
+{
+	fltx4				m_Mins[3];					// Child bounds, SoA: [axis] holds all 4 children
+	fltx4				m_Maxs[3];
+	int					m_nChild[BVH_NODE_WIDTH];	// Child node index, or the partition handle in leaf nodes
+	int					m_nParent;					// Also links the free list
+	uint8				m_nParentSlot;
+	uint8				m_nCount;
+	bool				m_bLeaf;
+};
+
+class CBVHTree : public IPartitionTree
+{
+public:
+	CBVHTree();
+	virtual ~CBVHTree();
+
+	// Inherited from IPartitionTree
+	virtual void Init( CSpatialPartition *pOwner, int iTree, const Vector& worldmin, const Vector& worldmax );
+	virtual void Shutdown( void );
+
+	virtual void InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs );
+	virtual void RemoveFromTree( SpatialPartitionHandle_t hPartition );
+
+	virtual void ElementMoved( SpatialPartitionHandle_t handle, const Vector& mins, const Vector& maxs );
+	virtual void EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, bool coarseTest, IPartitionEnumerator* pIterator );
+	virtual void EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, const Vector& origin, float radius, bool coarseTest, IPartitionEnumerator* pIterator );
+	virtual void EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, bool coarseTest, IPartitionEnumerator* pIterator );
+	virtual void EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, const Vector& pt, bool coarseTest, IPartitionEnumerator* pIterator );
+
+	virtual void RenderAllObjectsInTree( float flTime );
+	virtual void RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const Vector &vecPlayerMax, float flTime );
+
+	virtual void ReportStats( const char *pFileName );
+	virtual void DrawDebugOverlays();
+
+private:
+	EntityInfo_t &EntityInfo( SpatialPartitionHandle_t hPartition );
+
+	// The leaf reference lives in EntityInfo_t::m_iLeafList, which the voxel
+	// tree uses for its leaf list and which is otherwise unused here
+	static int EncodeLeaf( int nNode, int nSlot )	{ return ( nNode * BVH_NODE_WIDTH + nSlot ) + 1; }
+	bool IsInTree( SpatialPartitionHandle_t hPartition );
+
+	// Node pool
+	int AllocNode( bool bLeaf );
+	void FreeNode( int nNode );
+
+	// Children
+	void SetChild( int nNode, int nSlot, const Vector &vecMin, const Vector &vecMax, int nChild );
+	void SetChildBounds( int nNode, int nSlot, const Vector &vecMin, const Vector &vecMax );
+	void GetChildBounds( int nNode, int nSlot, Vector *pVecMin, Vector *pVecMax ) const;
+	void ClearChild( int nNode, int nSlot );
+	void ComputeNodeBounds( int nNode, Vector *pVecMin, Vector *pVecMax ) const;
+
+	// Tree maintenance
+	void InsertLeaf( SpatialPartitionHandle_t hPartition, const Vector &vecFatMin, const Vector &vecFatMax );
+	int ChooseChild( int nNode, const Vector &vecMin, const Vector &vecMax ) const;
+	void AddChild( int nNode, const Vector &vecMin, const Vector &vecMax, int nChild );
+	void SplitNode( int nNode, const Vector &vecMin, const Vector &vecMax, int nChild );
+	void RemoveChild( int nNode, int nSlot );
+	void RefitAncestors( int nNode );
+
+	// Queries
+	template <class T> void EnumerateElements( SpatialPartitionListMask_t listMask, const T &intersectTest, IPartitionEnumerator *pIterator );
+
+	// Writers need to drop any read locks this thread holds from an enclosing enumeration
+	void LockForWrite();
+	void UnlockWrite();
+
+	void RenderNode( int nNode, int nDepth, int nRenderDepth, float flTime );
+	int ComputeHeight() const;
+
+	typedef CUtlVector< BVHNode_t, CUtlMemoryAligned< BVHNode_t, 16 > > CNodeList;
+
+	CNodeList							m_Nodes;
+	int									m_nRoot;
+	int									m_nFirstFreeNode;
+	int									m_nElementCount;
+	int									m_TreeId;
+	CSpatialPartition *					m_pOwner;
+
+	// Bumped on every change to the tree shape so an enumeration can tell if its callbacks changed anything
+	int									m_nModifyCount;
+	CThreadLocalInt<int>				m_nReadDepth;
+	CThreadSpinRWLock					m_lock;
+
+	// Stats
+	int									m_nRefitCount;
+	int									m_nReinsertCount;
+};
+
 //-----------------------------------------------------------------------------
 // The spatial partition
 //-----------------------------------------------------------------------------
@@ -311,6 +448,7 @@ public:
 
 	// Inherited from ISpatialPartition
 	virtual void Init( const Vector& worldmin, const Vector& worldmax );
+	void Init( const Vector& worldmin, const Vector& worldmax, bool bUseBVH );
 	void Shutdown( void );
 
 	virtual SpatialPartitionHandle_t CreateHandle( IHandleEntity *pHandleEntity );
@@ -362,13 +500,21 @@ public:
 	virtual void InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs );
 	virtual void RemoveFromTree( SpatialPartitionHandle_t hPartition );
 
-	CVoxelTree * VoxelTree( SpatialPartitionListMask_t listMask );
-	CVoxelTree * VoxelTreeForHandle( SpatialPartitionHandle_t handle );
+	IPartitionTree * Tree( SpatialPartitionListMask_t listMask );
+	IPartitionTree * TreeForHandle( SpatialPartitionHandle_t handle );
+
+	bool IsUsingBVH() const;
+
+	// Writes all the elements currently in the trees to a query recording
+	void RecordElements( class CPartitionRecorder *pRecorder );
 
 protected:
 	// Invokes the pre-query callbacks.
 	void InvokeQueryCallbacks( SpatialPartitionListMask_t listMask, bool = false );
 
+	// Are updates and queries being written to a recording?
+	bool IsRecording() const;
+
 	typedef CUtlLinkedList<EntityInfo_t, SpatialPartitionHandle_t, false, SpatialPartitionHandle_t, CUtlMemoryStack<UtlLinkedListElem_t< EntityInfo_t, SpatialPartitionHandle_t >, SpatialPartitionHandle_t, 0xffff, 1024> > CHandleList;
 
 private:
@@ -376,6 +522,8 @@ private:
 	CThreadFastMutex										m_HandlesMutex;
 
 	CVoxelTree												m_VoxelTrees[NUM_TREES];
+	CBVHTree												m_BVHTrees[NUM_TREES];
+	IPartitionTree											*m_pTrees[NUM_TREES];		// Points at whichever set is in use
 
 	IPartitionQueryCallback									*m_pQueryCallback[MAX_QUERY_CALLBACK];		// Query callbacks.
 	bool													m_bUseOldQueryCallback[MAX_QUERY_CALLBACK];
@@ -429,15 +577,25 @@ inline void CVoxelTree::EndVisit( CPartitionVisits *pPrev )
 	m_pVisits = pPrev;
 }
 
-inline CVoxelTree *CSpatialPartition::VoxelTree( SpatialPartitionListMask_t listMask )
+inline IPartitionTree *CSpatialPartition::Tree( SpatialPartitionListMask_t listMask )
 {
 	int iTree = ( ( listMask & PARTITION_ALL_CLIENT_EDICTS ) == 0 ) ? SERVER_TREE : CLIENT_TREE;
-	return &m_VoxelTrees[iTree];
+	return m_pTrees[iTree];
+}
+
+inline IPartitionTree *CSpatialPartition::TreeForHandle( SpatialPartitionHandle_t handle )
+{
+	return Tree( m_aHandles[handle].m_fList );
+}
+
+inline bool CSpatialPartition::IsUsingBVH() const
+{
+	return ( m_pTrees[0] == &m_BVHTrees[0] );
 }
 
-inline CVoxelTree *CSpatialPartition::VoxelTreeForHandle( SpatialPartitionHandle_t handle )
+inline EntityInfo_t &CBVHTree::EntityInfo( SpatialPartitionHandle_t hPartition )
 {
-	return VoxelTree( m_aHandles[handle].m_fList );
+	return m_pOwner->EntityInfo( hPartition );
 }
 
 
@@ -2381,129 +2539,1296 @@ void CVoxelTree::RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const V
 
 
 //-----------------------------------------------------------------------------
-// Expose CSpatialPartition to the game + client DLL.
+// BVH intersection tests. NodeMask returns which of a node's children the query
+// may touch; Intersects is the exact test against an element and matches the
+// voxel tree's, so both trees enumerate the same elements.
 //-----------------------------------------------------------------------------
-static CSpatialPartition	g_SpatialPartition;
-EXPOSE_SINGLE_INTERFACE_GLOBALVAR( CSpatialPartition, ISpatialPartition, INTERFACEVERSION_SPATIALPARTITION, g_SpatialPartition );
+class CBVHIntersectBox
+{
+public:
+	CBVHIntersectBox( const Vector &vecMins, const Vector &vecMaxs ) : m_vecMins( vecMins ), m_vecMaxs( vecMaxs )
+	{
+		for ( int i = 0; i < 3; ++i )
+		{
+			m_Mins[i] = ReplicateX4( vecMins[i] );
+			m_Maxs[i] = ReplicateX4( vecMaxs[i] );
+		}
+	}
 
-//-----------------------------------------------------------------------------
-// Expose ISpatialPartitionInternal to the engine.
-//-----------------------------------------------------------------------------
-ISpatialPartitionInternal *SpatialPartition()
+	int NodeMask( const BVHNode_t &node ) const
+	{
+		fltx4 hit = AndSIMD( CmpLeSIMD( node.m_Mins[0], m_Maxs[0] ), CmpGeSIMD( node.m_Maxs[0], m_Mins[0] ) );
+		hit = AndSIMD( hit, AndSIMD( CmpLeSIMD( node.m_Mins[1], m_Maxs[1] ), CmpGeSIMD( node.m_Maxs[1], m_Mins[1] ) ) );
+		hit = AndSIMD( hit, AndSIMD( CmpLeSIMD( node.m_Mins[2], m_Maxs[2] ), CmpGeSIMD( node.m_Maxs[2], m_Mins[2] ) ) );
+		return TestSignSIMD( hit );
+	}
+
+	bool Intersects( const Vector &vecMins, const Vector &vecMaxs ) const
+	{
+		return ( vecMins.x <= m_vecMaxs.x ) && ( vecMaxs.x >= m_vecMins.x ) &&
+				( vecMins.y <= m_vecMaxs.y ) && ( vecMaxs.y >= m_vecMins.y ) &&
+				( vecMins.z <= m_vecMaxs.z ) && ( vecMaxs.z >= m_vecMins.z );
+	}
+
+private:
+	fltx4 m_Mins[3];
+	fltx4 m_Maxs[3];
+	const Vector &m_vecMins;
+	const Vector &m_vecMaxs;
+};
+
+
+class CBVHIntersectPoint : public CBVHIntersectBox
 {
-	return &g_SpatialPartition;
+public:
+	CBVHIntersectPoint( const Vector &pt ) : CBVHIntersectBox( pt, pt ), m_vecPoint( pt )
+	{
+	}
+
+	bool Intersects( const Vector &vecMins, const Vector &vecMaxs ) const
+	{
+		return IsPointInBox( m_vecPoint, vecMins, vecMaxs );
+	}
+
+private:
+	const Vector &m_vecPoint;
+};
+
+
+class CBVHIntersectRay
+{
+public:
+	CBVHIntersectRay( const Ray_t &ray, const Vector &vecInvDelta ) : m_Ray( ray ), m_vecInvDelta( vecInvDelta )
+	{
+		// Grow the children by the ray extents by moving the start point instead
+		for ( int i = 0; i < 3; ++i )
+		{
+			m_StartLo[i] = ReplicateX4( ray.m_Start[i] + ray.m_Extents[i] );
+			m_StartHi[i] = ReplicateX4( ray.m_Start[i] - ray.m_Extents[i] );
+			m_InvDelta[i] = ReplicateX4( vecInvDelta[i] );
+		}
+	}
+
+	int NodeMask( const BVHNode_t &node ) const
+	{
+		// Slab test. Zero delta axes have an inverse delta of FLT_MAX, which sends
+		// t to +/- infinity but never to NaN, so they drop out correctly
+		fltx4 tNear = Four_Zeros;
+		fltx4 tFar = Four_Ones;
+		for ( int i = 0; i < 3; ++i )
+		{
+			fltx4 t1 = MulSIMD( SubSIMD( node.m_Mins[i], m_StartLo[i] ), m_InvDelta[i] );
+			fltx4 t2 = MulSIMD( SubSIMD( node.m_Maxs[i], m_StartHi[i] ), m_InvDelta[i] );
+			tNear = MaxSIMD( tNear, MinSIMD( t1, t2 ) );
+			tFar = MinSIMD( tFar, MaxSIMD( t1, t2 ) );
+		}
+		return TestSignSIMD( CmpLeSIMD( tNear, tFar ) );
+	}
+
+	bool Intersects( const Vector &vecMins, const Vector &vecMaxs ) const
+	{
+		if ( m_Ray.m_IsRay )
+			return IsBoxIntersectingRay( vecMins, vecMaxs, m_Ray.m_Start, m_Ray.m_Delta, m_vecInvDelta );
+
+		Vector vecTestMin, vecTestMax;
+		VectorSubtract( vecMins, m_Ray.m_Extents, vecTestMin );
+		VectorAdd( vecMaxs, m_Ray.m_Extents, vecTestMax );
+		return IsBoxIntersectingRay( vecTestMin, vecTestMax, m_Ray.m_Start, m_Ray.m_Delta, m_vecInvDelta );
+	}
+
+private:
+	fltx4 m_StartLo[3];
+	fltx4 m_StartHi[3];
+	fltx4 m_InvDelta[3];
+	const Ray_t &m_Ray;
+	const Vector &m_vecInvDelta;
+};
+
+
+static inline float BoxSurfaceArea( const Vector &vecMin, const Vector &vecMax )
+{
+	Vector vecSize;
+	VectorSubtract( vecMax, vecMin, vecSize );
+	return vecSize.x * vecSize.y + vecSize.y * vecSize.z + vecSize.z * vecSize.x;
+}
+
+static inline bool IsBoxInBox( const Vector &vecMin, const Vector &vecMax, const Vector &vecOuterMin, const Vector &vecOuterMax )
+{
+	return ( vecMin.x >= vecOuterMin.x ) && ( vecMax.x <= vecOuterMax.x ) &&
+			( vecMin.y >= vecOuterMin.y ) && ( vecMax.y <= vecOuterMax.y ) &&
+			( vecMin.z >= vecOuterMin.z ) && ( vecMax.z <= vecOuterMax.z );
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Constructor
+// Constructor, destructor
 //-----------------------------------------------------------------------------
-CSpatialPartition::CSpatialPartition()
+CBVHTree::CBVHTree()
 {
-	m_nQueryCallbackCount = 0;
+	m_pOwner = NULL;
+	m_TreeId = 0;
+	m_nModifyCount = 0;
+	Shutdown();
 }
 
-
-CSpatialPartition::~CSpatialPartition()
+CBVHTree::~CBVHTree()
 {
 	Shutdown();
 }
 
+
 //-----------------------------------------------------------------------------
 // Purpose:
-//   Input: worldmin - 
-//          worldmax - 
 //-----------------------------------------------------------------------------
-void CSpatialPartition::Init( const Vector &worldmin, const Vector &worldmax )
+void CBVHTree::Init( CSpatialPartition *pOwner, int iTree, const Vector &worldmin, const Vector &worldmax )
 {
-	// Clear the handle list and ensure some new memory.
-	m_aHandles.Purge();
-	m_aHandles.EnsureCapacity( SPHASH_HANDLELIST_BLOCK );
+	m_pOwner = pOwner;
+	m_TreeId = iTree;
 
-	for ( int i = 0; i < NUM_TREES; i++ )
-	{
-		m_VoxelTrees[i].Init( this, i, worldmin, worldmax );
-	}
+	Shutdown();
+	m_Nodes.EnsureCapacity( SPHASH_HANDLELIST_BLOCK );
 }
 
+
 //-----------------------------------------------------------------------------
 // Purpose:
 //-----------------------------------------------------------------------------
-void CSpatialPartition::Shutdown( void )
+void CBVHTree::Shutdown( void )
 {
-	for ( int i = 0; i < NUM_TREES; i++ )
+	m_Nodes.Purge();
+	m_nRoot = -1;
+	m_nFirstFreeNode = -1;
+	m_nElementCount = 0;
+	m_nRefitCount = 0;
+	m_nReinsertCount = 0;
+	++m_nModifyCount;
+}
+
+
+//-----------------------------------------------------------------------------
+// Locking
+//-----------------------------------------------------------------------------
+void CBVHTree::LockForWrite()
+{
+	// If we're recursing in this thread, need to release our read locks to allow ourselves to write
+	for ( int i = m_nReadDepth; --i >= 0; )
 	{
-		m_VoxelTrees[i].Shutdown();
+		m_lock.UnlockRead();
+	}
+	m_lock.LockForWrite();
+}
+
+void CBVHTree::UnlockWrite()
+{
+	m_lock.UnlockWrite();
+	for ( int i = m_nReadDepth; --i >= 0; )
+	{
+		m_lock.LockForRead();
 	}
-	m_aHandles.Purge();
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Add a callback to the query callback list.  Functions get called 
-//          right before a query occurs.
-//   Input: pCallback - pointer to the callback function to add
+// Is the element still where its leaf reference says it is?
 //-----------------------------------------------------------------------------
-void CSpatialPartition::InstallQueryCallback( IPartitionQueryCallback *pCallback )
+bool CBVHTree::IsInTree( SpatialPartitionHandle_t hPartition )
 {
-	// Verify data.
-	Assert( pCallback && m_nQueryCallbackCount < MAX_QUERY_CALLBACK );
-	if ( !pCallback || ( m_nQueryCallbackCount >= MAX_QUERY_CALLBACK ) )
-		return;
-
-	m_pQueryCallback[m_nQueryCallbackCount] = pCallback;
-	m_bUseOldQueryCallback[m_nQueryCallbackCount] = false;
-	++m_nQueryCallbackCount;
+	int nLeaf = EntityInfo( hPartition ).m_iLeafList[m_TreeId];
+	if ( nLeaf == CLeafList::InvalidIndex() )
+		return false;
+
+	--nLeaf;
+	int nNode = nLeaf / BVH_NODE_WIDTH;
+	int nSlot = nLeaf % BVH_NODE_WIDTH;
+	if ( nNode >= m_Nodes.Count() )
+		return false;
+
+	const BVHNode_t &node = m_Nodes[nNode];
+	return node.m_bLeaf && ( nSlot < node.m_nCount ) && ( node.m_nChild[nSlot] == hPartition );
 }
 
+
 //-----------------------------------------------------------------------------
-// Purpose: Add a callback to the query callback list.  Functions get called 
-//          right before a query occurs.
-//   Input: pCallback - pointer to the callback function to add
+// Node pool
 //-----------------------------------------------------------------------------
-void CSpatialPartition::InstallQueryCallback_V1( IPartitionQueryCallback *pCallback )
+int CBVHTree::AllocNode( bool bLeaf )
 {
-	// Verify data.
-	Assert( pCallback && m_nQueryCallbackCount < MAX_QUERY_CALLBACK );
-	if ( !pCallback || ( m_nQueryCallbackCount >= MAX_QUERY_CALLBACK ) )
-		return;
+	int nNode;
+	if ( m_nFirstFreeNode >= 0 )
+	{
+		nNode = m_nFirstFreeNode;
+		m_nFirstFreeNode = m_Nodes[nNode].m_nParent;
+	}
+	else
+	{
+		nNode = m_Nodes.AddToTail();
+	}
 
-	// NOTE: the query callbacks are not mutexed. Only add and remove when threads are joined
+	BVHNode_t &node = m_Nodes[nNode];
+	for ( int i = 0; i < 3; ++i )
+	{
+		node.m_Mins[i] = Four_FLT_MAX;
+		node.m_Maxs[i] = Four_Negative_FLT_MAX;
+	}
+	for ( int i = 0; i < BVH_NODE_WIDTH; ++i )
+	{
+		node.m_nChild[i] = -1;
+	}
+	node.m_nParent = -1;
+	node.m_nParentSlot = 0;
+	node.m_nCount = 0;
+	node.m_bLeaf = bLeaf;
+	return nNode;
+}
 
-	m_pQueryCallback[m_nQueryCallbackCount] = pCallback;
-	m_bUseOldQueryCallback[m_nQueryCallbackCount] = true;
-	++m_nQueryCallbackCount;
+void CBVHTree::FreeNode( int nNode )
+{
+	BVHNode_t &node = m_Nodes[nNode];
+	node.m_nCount = 0;
+	node.m_bLeaf = false;
+	node.m_nParent = m_nFirstFreeNode;
+	m_nFirstFreeNode = nNode;
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Remove a callback from the query callback list.
-//   Input: pCallback - pointer to the callback function to remove
+// Children
 //-----------------------------------------------------------------------------
-void CSpatialPartition::RemoveQueryCallback( IPartitionQueryCallback *pCallback )
+void CBVHTree::SetChild( int nNode, int nSlot, const Vector &vecMin, const Vector &vecMax, int nChild )
 {
-	// Verify data.
-	if ( !pCallback )
-		return;
+	SetChildBounds( nNode, nSlot, vecMin, vecMax );
 
-	for ( int iQuery = m_nQueryCallbackCount; --iQuery >= 0;  )
+	BVHNode_t &node = m_Nodes[nNode];
+	node.m_nChild[nSlot] = nChild;
+	if ( node.m_bLeaf )
 	{
-		if ( m_pQueryCallback[iQuery] == pCallback )
+		EntityInfo( (SpatialPartitionHandle_t)nChild ).m_iLeafList[m_TreeId] = EncodeLeaf( nNode, nSlot );
+	}
+	else
+	{
+		m_Nodes[nChild].m_nParent = nNode;
+		m_Nodes[nChild].m_nParentSlot = nSlot;
+	}
+}
+
+void CBVHTree::SetChildBounds( int nNode, int nSlot, const Vector &vecMin, const Vector &vecMax )
+{
+	BVHNode_t &node = m_Nodes[nNode];
+	for ( int i = 0; i < 3; ++i )
+	{
+		SubFloat( node.m_Mins[i], nSlot ) = vecMin[i];
+		SubFloat( node.m_Maxs[i], nSlot ) = vecMax[i];
+	}
+}
+
+void CBVHTree::GetChildBounds( int nNode, int nSlot, Vector *pVecMin, Vector *pVecMax ) const
+{
+	const BVHNode_t &node = m_Nodes[nNode];
+	for ( int i = 0; i < 3; ++i )
+	{
+		(*pVecMin)[i] = SubFloat( node.m_Mins[i], nSlot );
+		(*pVecMax)[i] = SubFloat( node.m_Maxs[i], nSlot );
+	}
+}
+
+void CBVHTree::ClearChild( int nNode, int nSlot )
+{
+	BVHNode_t &node = m_Nodes[nNode];
+	for ( int i = 0; i < 3; ++i )
+	{
+		SubFloat( node.m_Mins[i], nSlot ) = FLT_MAX;
+		SubFloat( node.m_Maxs[i], nSlot ) = -FLT_MAX;
+	}
+	node.m_nChild[nSlot] = -1;
+}
+
+void CBVHTree::ComputeNodeBounds( int nNode, Vector *pVecMin, Vector *pVecMax ) const
+{
+	const BVHNode_t &node = m_Nodes[nNode];
+	pVecMin->Init( FLT_MAX, FLT_MAX, FLT_MAX );
+	pVecMax->Init( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	for ( int i = 0; i < node.m_nCount; ++i )
+	{
+		for ( int j = 0; j < 3; ++j )
 		{
-			--m_nQueryCallbackCount;
-			m_pQueryCallback[iQuery] = m_pQueryCallback[m_nQueryCallbackCount];
-			return;
+			(*pVecMin)[j] = min( (*pVecMin)[j], SubFloat( node.m_Mins[j], i ) );
+			(*pVecMax)[j] = max( (*pVecMax)[j], SubFloat( node.m_Maxs[j], i ) );
 		}
 	}
 }
 
 
 //-----------------------------------------------------------------------------
-// Purpose: Invokes the pre-query callbacks.
+// Picks the child that grows the least by adding the box
 //-----------------------------------------------------------------------------
-void CSpatialPartition::InvokeQueryCallbacks( SpatialPartitionListMask_t listMask, bool bDone )
+int CBVHTree::ChooseChild( int nNode, const Vector &vecMin, const Vector &vecMax ) const
 {
-	for ( int iQuery = 0; iQuery < m_nQueryCallbackCount; ++iQuery )
+	const BVHNode_t &node = m_Nodes[nNode];
+
+	fltx4 size[3], grownSize[3];
+	for ( int i = 0; i < 3; ++i )
+	{
+		size[i] = SubSIMD( node.m_Maxs[i], node.m_Mins[i] );
+		grownSize[i] = SubSIMD( MaxSIMD( node.m_Maxs[i], ReplicateX4( vecMax[i] ) ), MinSIMD( node.m_Mins[i], ReplicateX4( vecMin[i] ) ) );
+	}
+
+	fltx4 area = AddSIMD( AddSIMD( MulSIMD( size[0], size[1] ), MulSIMD( size[1], size[2] ) ), MulSIMD( size[2], size[0] ) );
+	fltx4 grownArea = AddSIMD( AddSIMD( MulSIMD( grownSize[0], grownSize[1] ), MulSIMD( grownSize[1], grownSize[2] ) ), MulSIMD( grownSize[2], grownSize[0] ) );
+	fltx4 growth = SubSIMD( grownArea, area );
+
+	int nBest = 0;
+	for ( int i = 1; i < node.m_nCount; ++i )
+	{
+		float flGrowth = SubFloat( growth, i );
+		float flBestGrowth = SubFloat( growth, nBest );
+		if ( ( flGrowth < flBestGrowth ) || ( ( flGrowth == flBestGrowth ) && ( SubFloat( area, i ) < SubFloat( area, nBest ) ) ) )
+		{
+			nBest = i;
+		}
+	}
+	return nBest;
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds an element (fat bounds) to the best leaf node
+//-----------------------------------------------------------------------------
+void CBVHTree::InsertLeaf( SpatialPartitionHandle_t hPartition, const Vector &vecFatMin, const Vector &vecFatMax )
+{
+	if ( m_nRoot < 0 )
+	{
+		m_nRoot = AllocNode( true );
+	}
+
+	int nNode = m_nRoot;
+	while ( !m_Nodes[nNode].m_bLeaf )
+	{
+		nNode = m_Nodes[nNode].m_nChild[ ChooseChild( nNode, vecFatMin, vecFatMax ) ];
+	}
+
+	AddChild( nNode, vecFatMin, vecFatMax, hPartition );
+}
+
+
+//-----------------------------------------------------------------------------
+// Adds a child to a node, splitting it if it's full
+//-----------------------------------------------------------------------------
+void CBVHTree::AddChild( int nNode, const Vector &vecMin, const Vector &vecMax, int nChild )
+{
+	int nCount = m_Nodes[nNode].m_nCount;
+	if ( nCount < BVH_NODE_WIDTH )
+	{
+		SetChild( nNode, nCount, vecMin, vecMax, nChild );
+		m_Nodes[nNode].m_nCount = nCount + 1;
+		RefitAncestors( nNode );
+		return;
+	}
+
+	SplitNode( nNode, vecMin, vecMax, nChild );
+}
+
+
+//-----------------------------------------------------------------------------
+// Splits a full node plus one more child in two, along the axis its children
+// are most spread out on. The new sibling goes into the parent, which may split
+// in turn, so all leaves stay at the same depth.
+//-----------------------------------------------------------------------------
+void CBVHTree::SplitNode( int nNode, const Vector &vecMin, const Vector &vecMax, int nChild )
+{
+	Vector vecMins[BVH_NODE_WIDTH + 1];
+	Vector vecMaxs[BVH_NODE_WIDTH + 1];
+	int nChildren[BVH_NODE_WIDTH + 1];
+	for ( int i = 0; i < BVH_NODE_WIDTH; ++i )
+	{
+		GetChildBounds( nNode, i, &vecMins[i], &vecMaxs[i] );
+		nChildren[i] = m_Nodes[nNode].m_nChild[i];
+	}
+	vecMins[BVH_NODE_WIDTH] = vecMin;
+	vecMaxs[BVH_NODE_WIDTH] = vecMax;
+	nChildren[BVH_NODE_WIDTH] = nChild;
+
+	// Centers are left doubled, only their order matters
+	Vector vecCenterMin( FLT_MAX, FLT_MAX, FLT_MAX );
+	Vector vecCenterMax( -FLT_MAX, -FLT_MAX, -FLT_MAX );
+	Vector vecCenters[BVH_NODE_WIDTH + 1];
+	for ( int i = 0; i <= BVH_NODE_WIDTH; ++i )
+	{
+		VectorAdd( vecMins[i], vecMaxs[i], vecCenters[i] );
+		VectorMin( vecCenterMin, vecCenters[i], vecCenterMin );
+		VectorMax( vecCenterMax, vecCenters[i], vecCenterMax );
+	}
+
+	Vector vecSpread;
+	VectorSubtract( vecCenterMax, vecCenterMin, vecSpread );
+	int nAxis = ( vecSpread.x >= vecSpread.y ) ? ( ( vecSpread.x >= vecSpread.z ) ? 0 : 2 ) : ( ( vecSpread.y >= vecSpread.z ) ? 1 : 2 );
+
+	int nOrder[BVH_NODE_WIDTH + 1];
+	for ( int i = 0; i <= BVH_NODE_WIDTH; ++i )
+	{
+		int j = i;
+		for ( ; ( j > 0 ) && ( vecCenters[ nOrder[j - 1] ][nAxis] > vecCenters[i][nAxis] ); --j )
+		{
+			nOrder[j] = nOrder[j - 1];
+		}
+		nOrder[j] = i;
+	}
+
+	// NOTE: This can grow m_Nodes, so no node references are held across it
+	int nSibling = AllocNode( m_Nodes[nNode].m_bLeaf );
+
+	for ( int i = 0; i < BVH_NODE_WIDTH; ++i )
+	{
+		ClearChild( nNode, i );
+	}
+
+	const int nSplit = ( BVH_NODE_WIDTH + 1 ) / 2;
+	for ( int i = 0; i < nSplit; ++i )
+	{
+		int k = nOrder[i];
+		SetChild( nNode, i, vecMins[k], vecMaxs[k], nChildren[k] );
+	}
+	m_Nodes[nNode].m_nCount = nSplit;
+
+	for ( int i = nSplit; i <= BVH_NODE_WIDTH; ++i )
+	{
+		int k = nOrder[i];
+		SetChild( nSibling, i - nSplit, vecMins[k], vecMaxs[k], nChildren[k] );
+	}
+	m_Nodes[nSibling].m_nCount = BVH_NODE_WIDTH + 1 - nSplit;
+
+	Vector vecNodeMin, vecNodeMax, vecSiblingMin, vecSiblingMax;
+	ComputeNodeBounds( nNode, &vecNodeMin, &vecNodeMax );
+	ComputeNodeBounds( nSibling, &vecSiblingMin, &vecSiblingMax );
+
+	int nParent = m_Nodes[nNode].m_nParent;
+	if ( nParent < 0 )
+	{
+		// Splitting the root, grow the tree by a level
+		int nRoot = AllocNode( false );
+		SetChild( nRoot, 0, vecNodeMin, vecNodeMax, nNode );
+		SetChild( nRoot, 1, vecSiblingMin, vecSiblingMax, nSibling );
+		m_Nodes[nRoot].m_nCount = 2;
+		m_nRoot = nRoot;
+		return;
+	}
+
+	SetChildBounds( nParent, m_Nodes[nNode].m_nParentSlot, vecNodeMin, vecNodeMax );
+	AddChild( nParent, vecSiblingMin, vecSiblingMax, nSibling );
+}
+
+
+//-----------------------------------------------------------------------------
+// Removes a child from a node, freeing nodes that end up empty
+//-----------------------------------------------------------------------------
+void CBVHTree::RemoveChild( int nNode, int nSlot )
+{
+	int nLast = m_Nodes[nNode].m_nCount - 1;
+	if ( nSlot != nLast )
+	{
+		Vector vecMin, vecMax;
+		GetChildBounds( nNode, nLast, &vecMin, &vecMax );
+		SetChild( nNode, nSlot, vecMin, vecMax, m_Nodes[nNode].m_nChild[nLast] );
+	}
+	ClearChild( nNode, nLast );
+	m_Nodes[nNode].m_nCount = nLast;
+
+	int nParent = m_Nodes[nNode].m_nParent;
+	if ( nLast == 0 )
+	{
+		int nParentSlot = m_Nodes[nNode].m_nParentSlot;
+		FreeNode( nNode );
+		if ( nParent < 0 )
+		{
+			m_nRoot = -1;
+			return;
+		}
+
+		RemoveChild( nParent, nParentSlot );
+		return;
+	}
+
+	if ( nParent < 0 )
+	{
+		// Drop a level when the root is down to a single node
+		if ( !m_Nodes[nNode].m_bLeaf && ( nLast == 1 ) )
+		{
+			m_nRoot = m_Nodes[nNode].m_nChild[0];
+			m_Nodes[m_nRoot].m_nParent = -1;
+			FreeNode( nNode );
+		}
+		return;
+	}
+
+	RefitAncestors( nNode );
+}
+
+
+//-----------------------------------------------------------------------------
+// Propagates a change in a node's bounds up the tree
+//-----------------------------------------------------------------------------
+void CBVHTree::RefitAncestors( int nNode )
+{
+	while ( m_Nodes[nNode].m_nParent >= 0 )
+	{
+		int nParent = m_Nodes[nNode].m_nParent;
+		int nSlot = m_Nodes[nNode].m_nParentSlot;
+
+		Vector vecMin, vecMax, vecOldMin, vecOldMax;
+		ComputeNodeBounds( nNode, &vecMin, &vecMax );
+		GetChildBounds( nParent, nSlot, &vecOldMin, &vecOldMax );
+		if ( ( vecMin == vecOldMin ) && ( vecMax == vecOldMax ) )
+			break;
+
+		SetChildBounds( nParent, nSlot, vecMin, vecMax );
+		nNode = nParent;
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Insert into the tree
+//-----------------------------------------------------------------------------
+void CBVHTree::InsertIntoTree( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs )
+{
+	Assert( hPartition != PARTITION_INVALID_HANDLE );
+
+	LockForWrite();
+
+	EntityInfo_t &info = EntityInfo( hPartition );
+	Assert( info.m_iLeafList[m_TreeId] == CLeafList::InvalidIndex() );
+
+	// Bloat by an eps before inserting the object into the tree.
+	Vector vecMin( mins.x - SPHASH_EPS, mins.y - SPHASH_EPS, mins.z - SPHASH_EPS );
+	Vector vecMax( maxs.x + SPHASH_EPS, maxs.y + SPHASH_EPS, maxs.z + SPHASH_EPS );
+
+	ClampVector( vecMin, s_PartitionMin, s_PartitionMax );
+	ClampVector( vecMax, s_PartitionMin, s_PartitionMax );
+	info.m_vecMin = vecMin;
+	info.m_vecMax = vecMax;
+
+	Vector vecFatMin( vecMin.x - BVH_FAT_MARGIN, vecMin.y - BVH_FAT_MARGIN, vecMin.z - BVH_FAT_MARGIN );
+	Vector vecFatMax( vecMax.x + BVH_FAT_MARGIN, vecMax.y + BVH_FAT_MARGIN, vecMax.z + BVH_FAT_MARGIN );
+	InsertLeaf( hPartition, vecFatMin, vecFatMax );
+
+	++m_nElementCount;
+	++m_nModifyCount;
+	UnlockWrite();
+}
+
+
+//-----------------------------------------------------------------------------
+// Remove from the tree
+//-----------------------------------------------------------------------------
+void CBVHTree::RemoveFromTree( SpatialPartitionHandle_t hPartition )
+{
+	Assert( hPartition != PARTITION_INVALID_HANDLE );
+	EntityInfo_t &info = EntityInfo( hPartition );
+	if ( info.m_iLeafList[m_TreeId] == CLeafList::InvalidIndex() )
+		return;
+
+	LockForWrite();
+
+	int nLeaf = info.m_iLeafList[m_TreeId] - 1;
+	RemoveChild( nLeaf / BVH_NODE_WIDTH, nLeaf % BVH_NODE_WIDTH );
+	info.m_iLeafList[m_TreeId] = CLeafList::InvalidIndex();
+
+	--m_nElementCount;
+	++m_nModifyCount;
+	UnlockWrite();
+}
+
+
+//-----------------------------------------------------------------------------
+// Called when an element moves
+//-----------------------------------------------------------------------------
+void CBVHTree::ElementMoved( SpatialPartitionHandle_t hPartition, const Vector& mins, const Vector& maxs )
+{
+	if ( hPartition == PARTITION_INVALID_HANDLE )
+		return;
+
+	// If it doesn't already exist in the tree - add it.
+	EntityInfo_t &info = EntityInfo( hPartition );
+	if ( info.m_iLeafList[m_TreeId] == CLeafList::InvalidIndex() )
+	{
+		InsertIntoTree( hPartition, mins, maxs );
+		return;
+	}
+
+	// Bloat by an eps, same as on insertion
+	Vector vecMin( mins.x - SPHASH_EPS, mins.y - SPHASH_EPS, mins.z - SPHASH_EPS );
+	Vector vecMax( maxs.x + SPHASH_EPS, maxs.y + SPHASH_EPS, maxs.z + SPHASH_EPS );
+
+	// The stored bounds are clamped, so clamp before comparing against them
+	ClampVector( vecMin, s_PartitionMin, s_PartitionMax );
+	ClampVector( vecMax, s_PartitionMin, s_PartitionMax );
+	if ( ( info.m_vecMin == vecMin ) && ( info.m_vecMax == vecMax ) )
+		return;
+
+	LockForWrite();
+
+	Vector vecOldCenter;
+	VectorAdd( info.m_vecMin, info.m_vecMax, vecOldCenter );
+	info.m_vecMin = vecMin;
+	info.m_vecMax = vecMax;
+
+	int nLeaf = info.m_iLeafList[m_TreeId] - 1;
+	int nNode = nLeaf / BVH_NODE_WIDTH;
+	int nSlot = nLeaf % BVH_NODE_WIDTH;
+
+	// Most moves stay inside the fat bounds and don't touch the tree at all
+	Vector vecFatMin, vecFatMax;
+	GetChildBounds( nNode, nSlot, &vecFatMin, &vecFatMax );
+	if ( IsBoxInBox( vecMin, vecMax, vecFatMin, vecFatMax ) )
+	{
+		UnlockWrite();
+		return;
+	}
+
+	// Fatten the new bounds, stretched along the direction it's moving in
+	Vector vecDisplacement;
+	VectorAdd( vecMin, vecMax, vecDisplacement );
+	VectorSubtract( vecDisplacement, vecOldCenter, vecDisplacement );
+	vecDisplacement *= 0.5f;
+	for ( int i = 0; i < 3; ++i )
+	{
+		float flDisplacement = clamp( vecDisplacement[i], -BVH_MAX_DISPLACEMENT, BVH_MAX_DISPLACEMENT );
+		vecFatMin[i] = vecMin[i] - BVH_FAT_MARGIN + min( flDisplacement, 0.0f );
+		vecFatMax[i] = vecMax[i] + BVH_FAT_MARGIN + max( flDisplacement, 0.0f );
+	}
+
+	// Refit in place when that grows the leaf node only a little, otherwise
+	// find it a better home. Measure against the union with the old node bounds
+	// so a single element node drifting across the map still gets reinserted.
+	Vector vecNodeMin, vecNodeMax, vecRefitMin, vecRefitMax;
+	ComputeNodeBounds( nNode, &vecNodeMin, &vecNodeMax );
+	VectorMin( vecNodeMin, vecFatMin, vecRefitMin );
+	VectorMax( vecNodeMax, vecFatMax, vecRefitMax );
+	if ( BoxSurfaceArea( vecRefitMin, vecRefitMax ) <= BVH_REFIT_MAX_GROWTH * BoxSurfaceArea( vecNodeMin, vecNodeMax ) )
+	{
+		SetChildBounds( nNode, nSlot, vecFatMin, vecFatMax );
+		RefitAncestors( nNode );
+		++m_nRefitCount;
+	}
+	else
+	{
+		RemoveChild( nNode, nSlot );
+		InsertLeaf( hPartition, vecFatMin, vecFatMax );
+		++m_nReinsertCount;
+	}
+
+	++m_nModifyCount;
+	UnlockWrite();
+}
+
+
+//-----------------------------------------------------------------------------
+// Walks the tree with the query, then enumerates whatever passes the exact test
+//-----------------------------------------------------------------------------
+template <class T>
+void CBVHTree::EnumerateElements( SpatialPartitionListMask_t listMask, const T &intersectTest, IPartitionEnumerator *pIterator )
+{
+	CUtlVectorFixedGrowable< SpatialPartitionHandle_t, 256 > candidates;
+	CUtlVectorFixedGrowable< int, 64 > stack;
+
+	m_lock.LockForRead();
+	++m_nReadDepth;
+
+	// Gather everything up front; enumerators are allowed to move and remove
+	// elements, which would pull the tree out from under a traversal
+	if ( m_nRoot >= 0 )
+	{
+		stack.AddToTail( m_nRoot );
+	}
+
+	while ( stack.Count() )
+	{
+		const BVHNode_t &node = m_Nodes[ stack.Tail() ];
+		stack.Remove( stack.Count() - 1 );
+
+		int nMask = intersectTest.NodeMask( node );
+		for ( int i = 0; i < node.m_nCount; ++i )
+		{
+			if ( !( nMask & ( 1 << i ) ) )
+				continue;
+
+			if ( !node.m_bLeaf )
+			{
+				stack.AddToTail( node.m_nChild[i] );
+				continue;
+			}
+
+			SpatialPartitionHandle_t hPartition = node.m_nChild[i];
+			EntityInfo_t &hInfo = EntityInfo( hPartition );
+			if ( ( listMask & hInfo.m_fList ) && !( hInfo.m_flags & ENTITY_HIDDEN ) )
+			{
+				candidates.AddToTail( hPartition );
+			}
+		}
+	}
+
+	int nModifyCount = m_nModifyCount;
+	for ( int i = 0; i < candidates.Count(); ++i )
+	{
+		SpatialPartitionHandle_t hPartition = candidates[i];
+
+		// An earlier callback changed the tree; skip anything it took out
+		if ( ( m_nModifyCount != nModifyCount ) && !IsInTree( hPartition ) )
+			continue;
+
+		EntityInfo_t &hInfo = EntityInfo( hPartition );
+
+		// Keep going if this dude isn't in the list
+		if ( !( listMask & hInfo.m_fList ) )
+			continue;
+
+		if ( hInfo.m_flags & ENTITY_HIDDEN )
+			continue;
+
+		// Intersection test
+		if ( !intersectTest.Intersects( hInfo.m_vecMin, hInfo.m_vecMax ) )
+			continue;
+
+		// Okay, this one is good...
+		if ( pIterator->EnumElement( hInfo.m_pHandleEntity ) == ITERATION_STOP )
+			break;
+	}
+
+	--m_nReadDepth;
+	m_lock.UnlockRead();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CBVHTree::EnumerateElementsInBox( SpatialPartitionListMask_t listMask, 
+										const Vector& mins, const Vector& maxs, 
+										bool coarseTest, IPartitionEnumerator* pIterator )
+{
+	VPROF( "BoxTest/SphereTest" );
+
+	// Early-out.
+	if ( listMask == 0 )
+		return;
+
+	CBVHIntersectBox intersectBox( mins, maxs );
+	EnumerateElements( listMask, intersectBox, pIterator );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CBVHTree::EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, 
+										   const Vector& origin, float radius, bool coarseTest, IPartitionEnumerator* pIterator )
+{
+	// Otherwise they might as well just walk the entire ent list!!!
+	Assert( radius <= MAX_COORD_FLOAT );
+
+	// Same as the voxel tree, this is a box test
+	Vector vecMin( origin.x - radius, origin.y - radius, origin.z - radius );
+	Vector vecMax( origin.x + radius, origin.y + radius, origin.z + radius );
+	EnumerateElementsInBox( listMask, vecMin, vecMax, coarseTest, pIterator );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CBVHTree::EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, 
+										   const Ray_t &ray, bool coarseTest, IPartitionEnumerator *pIterator )
+{
+	VPROF("EnumerateElementsAlongRay");
+
+	if ( !ray.m_IsSwept )
+	{
+		Vector vecMin, vecMax;
+		VectorSubtract( ray.m_Start, ray.m_Extents, vecMin );
+		VectorAdd( ray.m_Start, ray.m_Extents, vecMax );
+		EnumerateElementsInBox( listMask, vecMin, vecMax, coarseTest, pIterator );
+		return;
+	}
+
+	// Early-out.
+	if ( listMask == 0 )
+		return;
+
+	// Clip the ray to the partition bounds the same way the voxel tree does
+	Vector vecEnd;
+	Vector vecInvDelta;
+	Ray_t clippedRay = ray;
+	VectorAdd( clippedRay.m_Start, clippedRay.m_Delta, vecEnd );
+
+	bool bStartIn = IsPointInBox( ray.m_Start, s_PartitionMin, s_PartitionMax );
+	bool bEndIn = IsPointInBox( vecEnd, s_PartitionMin, s_PartitionMax );
+	if ( !bStartIn && !bEndIn )
+		return;
+
+	if ( !bStartIn )
+	{
+		ClampStartPoint( clippedRay, vecEnd );
+	}
+	else if ( !bEndIn )
+	{
+		ClampEndPoint( clippedRay, vecEnd );
+	}
+
+	vecInvDelta[0] = ( clippedRay.m_Delta[0] != 0.0f ) ? 1.0f / clippedRay.m_Delta[0] : FLT_MAX;
+	vecInvDelta[1] = ( clippedRay.m_Delta[1] != 0.0f ) ? 1.0f / clippedRay.m_Delta[1] : FLT_MAX;
+	vecInvDelta[2] = ( clippedRay.m_Delta[2] != 0.0f ) ? 1.0f / clippedRay.m_Delta[2] : FLT_MAX;
+
+	CBVHIntersectRay intersectRay( clippedRay, vecInvDelta );
+	EnumerateElements( listMask, intersectRay, pIterator );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CBVHTree::EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, 
+										  const Vector& pt, bool coarseTest, IPartitionEnumerator* pIterator )
+{
+	// Early-out.
+	if ( listMask == 0 )
+		return;
+
+	CBVHIntersectPoint intersectPoint( pt );
+	EnumerateElements( listMask, intersectPoint, pIterator );
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Debug! Render boxes around objects in tree.
+//-----------------------------------------------------------------------------
+void CBVHTree::RenderAllObjectsInTree( float flTime )
+{
+#ifndef SWDS
+	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
+	m_lock.LockForRead();
+	for ( int i = 0; i < m_Nodes.Count(); ++i )
+	{
+		const BVHNode_t &node = m_Nodes[i];
+		if ( !node.m_bLeaf )
+			continue;
+
+		for ( int j = 0; j < node.m_nCount; ++j )
+		{
+			EntityInfo_t &info = EntityInfo( node.m_nChild[j] );
+			CDebugOverlay::AddBoxOverlay( vec3_origin, info.m_vecMin, info.m_vecMax, vec3_angle, s_pVoxelColor[0][0], s_pVoxelColor[0][1], s_pVoxelColor[0][2], 75, flTime );
+		}
+	}
+	m_lock.UnlockRead();
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Debug! Render the leaf nodes touching the player and their objects.
+//-----------------------------------------------------------------------------
+void CBVHTree::RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin, const Vector &vecPlayerMax, float flTime )
+{
+#ifndef SWDS
+	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
+	CBVHIntersectBox intersectBox( vecPlayerMin, vecPlayerMax );
+	CUtlVectorFixedGrowable< int, 64 > stack;
+
+	m_lock.LockForRead();
+	if ( m_nRoot >= 0 )
+	{
+		stack.AddToTail( m_nRoot );
+	}
+
+	while ( stack.Count() )
+	{
+		int nNode = stack.Tail();
+		stack.Remove( stack.Count() - 1 );
+
+		const BVHNode_t &node = m_Nodes[nNode];
+		int nMask = intersectBox.NodeMask( node );
+		for ( int i = 0; i < node.m_nCount; ++i )
+		{
+			if ( !( nMask & ( 1 << i ) ) )
+				continue;
+
+			if ( !node.m_bLeaf )
+			{
+				stack.AddToTail( node.m_nChild[i] );
+				continue;
+			}
+
+			// Every element in a leaf node the player touches
+			Vector vecMin, vecMax;
+			ComputeNodeBounds( nNode, &vecMin, &vecMax );
+			CDebugOverlay::AddBoxOverlay( vec3_origin, vecMin, vecMax, vec3_angle, s_pVoxelColor[1][0], s_pVoxelColor[1][1], s_pVoxelColor[1][2], 30, flTime );
+			for ( int j = 0; j < node.m_nCount; ++j )
+			{
+				EntityInfo_t &info = EntityInfo( node.m_nChild[j] );
+				CDebugOverlay::AddBoxOverlay( vec3_origin, info.m_vecMin, info.m_vecMax, vec3_angle, s_pVoxelColor[0][0], s_pVoxelColor[0][1], s_pVoxelColor[0][2], 75, flTime );
+			}
+			break;
+		}
+	}
+	m_lock.UnlockRead();
+#endif
+}
+
+
+//-----------------------------------------------------------------------------
+// Debug rendering of a level of the tree
+//-----------------------------------------------------------------------------
+void CBVHTree::RenderNode( int nNode, int nDepth, int nRenderDepth, float flTime )
+{
+#ifndef SWDS
+	const BVHNode_t &node = m_Nodes[nNode];
+	if ( nDepth == nRenderDepth )
+	{
+		const Color &color = s_pVoxelColor[ nDepth % ARRAYSIZE( s_pVoxelColor ) ];
+		for ( int i = 0; i < node.m_nCount; ++i )
+		{
+			Vector vecMin, vecMax;
+			GetChildBounds( nNode, i, &vecMin, &vecMax );
+			CDebugOverlay::AddBoxOverlay( vec3_origin, vecMin, vecMax, vec3_angle, color[0], color[1], color[2], 30, flTime );
+		}
+		return;
+	}
+
+	if ( node.m_bLeaf )
+		return;
+
+	for ( int i = 0; i < node.m_nCount; ++i )
+	{
+		RenderNode( node.m_nChild[i], nDepth + 1, nRenderDepth, flTime );
+	}
+#endif
+}
+
+int CBVHTree::ComputeHeight() const
+{
+	// All the leaves are at the same depth
+	int nHeight = 0;
+	for ( int nNode = m_nRoot; nNode >= 0; nNode = m_Nodes[nNode].m_bLeaf ? -1 : m_Nodes[nNode].m_nChild[0] )
+	{
+		++nHeight;
+	}
+	return nHeight;
+}
+
+
+static ConVar spatialpartition_bvh( "spatialpartition_bvh", "0", 0, "Use the dynamic AABB tree instead of the voxel hash for the spatial partition. Takes effect on the next map load." );
+
+//-----------------------------------------------------------------------------
+// Query recording. Captures the element updates and queries made against the
+// engine's partition so they can be played back against either tree.
+//-----------------------------------------------------------------------------
+#define PARTITION_RECORD_ID			(('R'<<24)|('Q'<<16)|('P'<<8)|('S'))
+#define PARTITION_RECORD_VERSION	1
+
+enum PartitionRecordOp_t
+{
+	PARTITION_RECORD_MOVE = 0,			// handle, lists, mins, maxs. Creates the element the first time.
+	PARTITION_RECORD_LISTS,				// handle, lists
+	PARTITION_RECORD_DESTROY,			// handle
+	PARTITION_RECORD_HIDE,				// handle
+	PARTITION_RECORD_UNHIDE,			// handle
+	PARTITION_RECORD_QUERY_BOX,			// lists, coarse, mins, maxs
+	PARTITION_RECORD_QUERY_SPHERE,		// lists, coarse, origin, radius
+	PARTITION_RECORD_QUERY_RAY,			// lists, coarse, ray/swept, start, delta, extents
+	PARTITION_RECORD_QUERY_POINT,		// lists, coarse, point
+};
+
+class CPartitionRecorder
+{
+public:
+	CPartitionRecorder() : m_Buffer( 0, 0, 0 )
+	{
+		m_pFileName[0] = 0;
+		m_bRecording = false;
+	}
+
+	bool IsRecording() const	{ return m_bRecording; }
+	CUtlBuffer &GetBuffer()		{ return m_Buffer; }
+
+	// With no file name the recording just stays in memory
+	void Start( const char *pFileName );
+	void Stop();
+
+	void RecordMove( SpatialPartitionHandle_t handle, SpatialPartitionListMask_t listMask, const Vector &mins, const Vector &maxs );
+	void RecordLists( SpatialPartitionHandle_t handle, SpatialPartitionListMask_t listMask );
+	void RecordHandle( PartitionRecordOp_t op, SpatialPartitionHandle_t handle );
+	void RecordBox( SpatialPartitionListMask_t listMask, const Vector &mins, const Vector &maxs, bool coarseTest );
+	void RecordSphere( SpatialPartitionListMask_t listMask, const Vector &origin, float radius, bool coarseTest );
+	void RecordRay( SpatialPartitionListMask_t listMask, const Ray_t &ray, bool coarseTest );
+	void RecordPoint( SpatialPartitionListMask_t listMask, const Vector &pt, bool coarseTest );
+
+private:
+	void PutVector( const Vector &v )
+	{
+		m_Buffer.PutFloat( v.x );
+		m_Buffer.PutFloat( v.y );
+		m_Buffer.PutFloat( v.z );
+	}
+
+	void PutQuery( PartitionRecordOp_t op, SpatialPartitionListMask_t listMask, bool coarseTest )
+	{
+		m_Buffer.PutUnsignedChar( op );
+		m_Buffer.PutUnsignedShort( listMask );
+		m_Buffer.PutUnsignedChar( coarseTest );
+	}
+
+	CThreadFastMutex	m_Mutex;
+	CUtlBuffer			m_Buffer;
+	char				m_pFileName[MAX_PATH];
+	volatile bool		m_bRecording;
+};
+
+void CPartitionRecorder::Start( const char *pFileName )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	Q_strncpy( m_pFileName, pFileName ? pFileName : "", sizeof( m_pFileName ) );
+	m_Buffer.Purge();
+	m_Buffer.PutInt( PARTITION_RECORD_ID );
+	m_Buffer.PutInt( PARTITION_RECORD_VERSION );
+	m_bRecording = true;
+}
+
+void CPartitionRecorder::Stop()
+{
+	AUTO_LOCK_FM( m_Mutex );
+	if ( !m_bRecording )
+		return;
+
+	m_bRecording = false;
+	if ( !m_pFileName[0] )
+		return;
+
+	if ( g_pFileSystem->WriteFile( m_pFileName, "MOD", m_Buffer ) )
+	{
+		Msg( "Wrote %d bytes of spatial partition queries to %s\n", m_Buffer.TellPut(), m_pFileName );
+	}
+	else
+	{
+		Warning( "Unable to write spatial partition recording %s\n", m_pFileName );
+	}
+	m_Buffer.Purge();
+}
+
+void CPartitionRecorder::RecordMove( SpatialPartitionHandle_t handle, SpatialPartitionListMask_t listMask, const Vector &mins, const Vector &maxs )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	m_Buffer.PutUnsignedChar( PARTITION_RECORD_MOVE );
+	m_Buffer.PutUnsignedShort( handle );
+	m_Buffer.PutUnsignedShort( listMask );
+	PutVector( mins );
+	PutVector( maxs );
+}
+
+void CPartitionRecorder::RecordLists( SpatialPartitionHandle_t handle, SpatialPartitionListMask_t listMask )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	m_Buffer.PutUnsignedChar( PARTITION_RECORD_LISTS );
+	m_Buffer.PutUnsignedShort( handle );
+	m_Buffer.PutUnsignedShort( listMask );
+}
+
+void CPartitionRecorder::RecordHandle( PartitionRecordOp_t op, SpatialPartitionHandle_t handle )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	m_Buffer.PutUnsignedChar( op );
+	m_Buffer.PutUnsignedShort( handle );
+}
+
+void CPartitionRecorder::RecordBox( SpatialPartitionListMask_t listMask, const Vector &mins, const Vector &maxs, bool coarseTest )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	PutQuery( PARTITION_RECORD_QUERY_BOX, listMask, coarseTest );
+	PutVector( mins );
+	PutVector( maxs );
+}
+
+void CPartitionRecorder::RecordSphere( SpatialPartitionListMask_t listMask, const Vector &origin, float radius, bool coarseTest )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	PutQuery( PARTITION_RECORD_QUERY_SPHERE, listMask, coarseTest );
+	PutVector( origin );
+	m_Buffer.PutFloat( radius );
+}
+
+void CPartitionRecorder::RecordRay( SpatialPartitionListMask_t listMask, const Ray_t &ray, bool coarseTest )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	PutQuery( PARTITION_RECORD_QUERY_RAY, listMask, coarseTest );
+	m_Buffer.PutUnsignedChar( ( ray.m_IsRay ? 1 : 0 ) | ( ray.m_IsSwept ? 2 : 0 ) );
+	PutVector( ray.m_Start );
+	PutVector( ray.m_Delta );
+	PutVector( ray.m_Extents );
+}
+
+void CPartitionRecorder::RecordPoint( SpatialPartitionListMask_t listMask, const Vector &pt, bool coarseTest )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	PutQuery( PARTITION_RECORD_QUERY_POINT, listMask, coarseTest );
+	PutVector( pt );
+}
+
+static CPartitionRecorder	s_PartitionRecorder;
+
+
+//-----------------------------------------------------------------------------
+// Expose CSpatialPartition to the game + client DLL.
+//-----------------------------------------------------------------------------
+static CSpatialPartition	g_SpatialPartition;
+EXPOSE_SINGLE_INTERFACE_GLOBALVAR( CSpatialPartition, ISpatialPartition, INTERFACEVERSION_SPATIALPARTITION, g_SpatialPartition );
+
+// Only the engine's partition gets recorded
+inline bool CSpatialPartition::IsRecording() const
+{
+	return s_PartitionRecorder.IsRecording() && ( this == &g_SpatialPartition );
+}
+
+//-----------------------------------------------------------------------------
+// Expose ISpatialPartitionInternal to the engine.
+//-----------------------------------------------------------------------------
+ISpatialPartitionInternal *SpatialPartition()
+{
+	return &g_SpatialPartition;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Constructor
+//-----------------------------------------------------------------------------
+CSpatialPartition::CSpatialPartition()
+{
+	m_nQueryCallbackCount = 0;
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		m_pTrees[i] = &m_VoxelTrees[i];
+	}
+}
+
+
+CSpatialPartition::~CSpatialPartition()
+{
+	Shutdown();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//   Input: worldmin - 
+//          worldmax - 
+//-----------------------------------------------------------------------------
+void CSpatialPartition::Init( const Vector &worldmin, const Vector &worldmax )
+{
+	Init( worldmin, worldmax, spatialpartition_bvh.GetBool() );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Same as above, picking the tree implementation explicitly
+//-----------------------------------------------------------------------------
+void CSpatialPartition::Init( const Vector &worldmin, const Vector &worldmax, bool bUseBVH )
+{
+	// The handles in a recording don't survive this
+	if ( IsRecording() )
+	{
+		Warning( "Spatial partition re-initialized, stopping the query recording\n" );
+		s_PartitionRecorder.Stop();
+	}
+
+	// Clear the handle list and ensure some new memory.
+	m_aHandles.Purge();
+	m_aHandles.EnsureCapacity( SPHASH_HANDLELIST_BLOCK );
+
+	// No handles are left, so this is the one place the tree implementation can change
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		IPartitionTree *pTree = bUseBVH ? static_cast<IPartitionTree*>( &m_BVHTrees[i] ) : &m_VoxelTrees[i];
+		if ( m_pTrees[i] != pTree )
+		{
+			m_pTrees[i]->Shutdown();
+			m_pTrees[i] = pTree;
+		}
+		m_pTrees[i]->Init( this, i, worldmin, worldmax );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose:
+//-----------------------------------------------------------------------------
+void CSpatialPartition::Shutdown( void )
+{
+	for ( int i = 0; i < NUM_TREES; i++ )
+	{
+		m_pTrees[i]->Shutdown();
+	}
+	m_aHandles.Purge();
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Add a callback to the query callback list.  Functions get called 
+//          right before a query occurs.
+//   Input: pCallback - pointer to the callback function to add
+//-----------------------------------------------------------------------------
+void CSpatialPartition::InstallQueryCallback( IPartitionQueryCallback *pCallback )
+{
+	// Verify data.
+	Assert( pCallback && m_nQueryCallbackCount < MAX_QUERY_CALLBACK );
+	if ( !pCallback || ( m_nQueryCallbackCount >= MAX_QUERY_CALLBACK ) )
+		return;
+
+	m_pQueryCallback[m_nQueryCallbackCount] = pCallback;
+	m_bUseOldQueryCallback[m_nQueryCallbackCount] = false;
+	++m_nQueryCallbackCount;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Add a callback to the query callback list.  Functions get called 
+//          right before a query occurs.
+//   Input: pCallback - pointer to the callback function to add
+//-----------------------------------------------------------------------------
+void CSpatialPartition::InstallQueryCallback_V1( IPartitionQueryCallback *pCallback )
+{
+	// Verify data.
+	Assert( pCallback && m_nQueryCallbackCount < MAX_QUERY_CALLBACK );
+	if ( !pCallback || ( m_nQueryCallbackCount >= MAX_QUERY_CALLBACK ) )
+		return;
+
+	// NOTE: the query callbacks are not mutexed. Only add and remove when threads are joined
+
+	m_pQueryCallback[m_nQueryCallbackCount] = pCallback;
+	m_bUseOldQueryCallback[m_nQueryCallbackCount] = true;
+	++m_nQueryCallbackCount;
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Remove a callback from the query callback list.
+//   Input: pCallback - pointer to the callback function to remove
+//-----------------------------------------------------------------------------
+void CSpatialPartition::RemoveQueryCallback( IPartitionQueryCallback *pCallback )
+{
+	// Verify data.
+	if ( !pCallback )
+		return;
+
+	for ( int iQuery = m_nQueryCallbackCount; --iQuery >= 0;  )
+	{
+		if ( m_pQueryCallback[iQuery] == pCallback )
+		{
+			--m_nQueryCallbackCount;
+			m_pQueryCallback[iQuery] = m_pQueryCallback[m_nQueryCallbackCount];
+			return;
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Purpose: Invokes the pre-query callbacks.
+//-----------------------------------------------------------------------------
+void CSpatialPartition::InvokeQueryCallbacks( SpatialPartitionListMask_t listMask, bool bDone )
+{
+	for ( int iQuery = 0; iQuery < m_nQueryCallbackCount; ++iQuery )
 	{
 		if ( !bDone )
 		{
@@ -2560,6 +3885,11 @@ void CSpatialPartition::DestroyHandle( SpatialPartitionHandle_t hPartition )
 {
 	if ( hPartition != PARTITION_INVALID_HANDLE )
 	{
+		if ( IsRecording() )
+		{
+			s_PartitionRecorder.RecordHandle( PARTITION_RECORD_DESTROY, hPartition );
+		}
+
 		RemoveFromTree( hPartition );
 		m_HandlesMutex.Lock();
 //		memset( &m_aHandles[hPartition], 0xcd, sizeof(EntityInfo_t) );
@@ -2585,6 +3915,11 @@ SpatialPartitionHandle_t CSpatialPartition::CreateHandle( IHandleEntity *pHandle
 	Insert( listMask, hPartition );
 	InsertIntoTree( hPartition, mins, maxs );
 
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordMove( hPartition, listMask, mins, maxs );
+	}
+
 	return hPartition;
 }
 
@@ -2598,6 +3933,11 @@ void CSpatialPartition::Insert( SpatialPartitionListMask_t listId, SpatialPartit
 	Assert( m_aHandles.IsValidIndex( handle ) );
 	Assert( listId <= USHRT_MAX );
 	m_aHandles[handle].m_fList |= listId;
+
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordLists( handle, m_aHandles[handle].m_fList );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -2610,6 +3950,11 @@ void CSpatialPartition::Remove( SpatialPartitionListMask_t listId, SpatialPartit
 	Assert( m_aHandles.IsValidIndex( handle ) );
 	Assert( listId <= USHRT_MAX );
 	m_aHandles[handle].m_fList &= ~listId;
+
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordLists( handle, m_aHandles[handle].m_fList );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -2623,6 +3968,11 @@ void CSpatialPartition::RemoveAndInsert( SpatialPartitionListMask_t removeMask,
 	Assert( insertMask <= USHRT_MAX );
 	m_aHandles[handle].m_fList &= ~removeMask;
 	m_aHandles[handle].m_fList |= insertMask;
+
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordLists( handle, m_aHandles[handle].m_fList );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -2633,6 +3983,11 @@ void CSpatialPartition::Remove( SpatialPartitionHandle_t handle )
 {
 	Assert( m_aHandles.IsValidIndex( handle ) );
 	m_aHandles[handle].m_fList = 0;
+
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordLists( handle, 0 );
+	}
 }
 
 //-----------------------------------------------------------------------------
@@ -2646,6 +4001,11 @@ void CSpatialPartition::UnhideElement( SpatialPartitionHandle_t handle, SpatialT
 	m_HandlesMutex.Lock();
 	m_aHandles[handle].m_flags &= ~ENTITY_HIDDEN;
 	m_HandlesMutex.Unlock();
+
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordHandle( PARTITION_RECORD_UNHIDE, handle );
+	}
 }
 
 
@@ -2660,6 +4020,11 @@ SpatialTempHandle_t CSpatialPartition::HideElement( SpatialPartitionHandle_t han
 	m_aHandles[handle].m_flags |= ENTITY_HIDDEN;
 	m_HandlesMutex.Unlock();
 
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordHandle( PARTITION_RECORD_HIDE, handle );
+	}
+
 	return 1;
 }
 
@@ -2697,24 +4062,28 @@ void CSpatialPartition::ElementMoved( SpatialPartitionHandle_t handle, const Vec
 	EntityInfo_t &entityInfo = EntityInfo( handle );
 	SpatialPartitionListMask_t listMask = entityInfo.m_fList;
 
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordMove( handle, listMask, mins, maxs );
+	}
 
 	if ( CLIENT_TREE != SERVER_TREE )
 	{
 		if ( listMask & PARTITION_ALL_CLIENT_EDICTS )
 		{
-			m_VoxelTrees[CLIENT_TREE].ElementMoved( handle, mins, maxs );
+			m_pTrees[CLIENT_TREE]->ElementMoved( handle, mins, maxs );
 			entityInfo.m_flags |= IN_CLIENT_TREE;
 		}
 
 		if ( listMask & ~PARTITION_ALL_CLIENT_EDICTS )
 		{
-			m_VoxelTrees[SERVER_TREE].ElementMoved( handle, mins, maxs );
+			m_pTrees[SERVER_TREE]->ElementMoved( handle, mins, maxs );
 			entityInfo.m_flags |= IN_SERVER_TREE;
 		}
 	}
 	else
 	{
-		m_VoxelTrees[CLIENT_TREE].ElementMoved( handle, mins, maxs );
+		m_pTrees[CLIENT_TREE]->ElementMoved( handle, mins, maxs );
 		entityInfo.m_flags |= IN_CLIENT_TREE;
 	}
 }
@@ -2725,7 +4094,12 @@ void CSpatialPartition::ElementMoved( SpatialPartitionHandle_t handle, const Vec
 void CSpatialPartition::EnumerateElementsInBox( SpatialPartitionListMask_t listMask, const Vector& mins, const Vector& maxs, bool coarseTest, IPartitionEnumerator* pIterator )
 {
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
-	CVoxelTree *pTree = VoxelTree( listMask );
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordBox( listMask, mins, maxs, coarseTest );
+	}
+
+	IPartitionTree *pTree = Tree( listMask );
 	InvokeQueryCallbacks( listMask );
 	pTree->EnumerateElementsInBox( listMask, mins, maxs, coarseTest, pIterator );
 	InvokeQueryCallbacks( listMask, true );
@@ -2737,7 +4111,12 @@ void CSpatialPartition::EnumerateElementsInBox( SpatialPartitionListMask_t listM
 void CSpatialPartition::EnumerateElementsInSphere( SpatialPartitionListMask_t listMask, const Vector& origin, float radius, bool coarseTest, IPartitionEnumerator* pIterator )
 {
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
-	CVoxelTree *pTree = VoxelTree( listMask );
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordSphere( listMask, origin, radius, coarseTest );
+	}
+
+	IPartitionTree *pTree = Tree( listMask );
 	InvokeQueryCallbacks( listMask );
 	pTree->EnumerateElementsInSphere( listMask, origin, radius, coarseTest, pIterator );
 	InvokeQueryCallbacks( listMask, true );
@@ -2749,7 +4128,12 @@ void CSpatialPartition::EnumerateElementsInSphere( SpatialPartitionListMask_t li
 void CSpatialPartition::EnumerateElementsAlongRay( SpatialPartitionListMask_t listMask, const Ray_t& ray, bool coarseTest, IPartitionEnumerator* pIterator )
 {
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
-	CVoxelTree *pTree = VoxelTree( listMask );
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordRay( listMask, ray, coarseTest );
+	}
+
+	IPartitionTree *pTree = Tree( listMask );
 	InvokeQueryCallbacks( listMask );
 	pTree->EnumerateElementsAlongRay( listMask, ray, coarseTest, pIterator );
 	InvokeQueryCallbacks( listMask, true );
@@ -2761,7 +4145,12 @@ void CSpatialPartition::EnumerateElementsAlongRay( SpatialPartitionListMask_t li
 void CSpatialPartition::EnumerateElementsAtPoint( SpatialPartitionListMask_t listMask, const Vector& pt, bool coarseTest, IPartitionEnumerator* pIterator )
 {
 	MDLCACHE_CRITICAL_SECTION_(g_pMDLCache);
-	CVoxelTree *pTree = VoxelTree( listMask );
+	if ( IsRecording() )
+	{
+		s_PartitionRecorder.RecordPoint( listMask, pt, coarseTest );
+	}
+
+	IPartitionTree *pTree = Tree( listMask );
 	InvokeQueryCallbacks( listMask );
 	pTree->EnumerateElementsAtPoint( listMask, pt, coarseTest, pIterator );
 	InvokeQueryCallbacks( listMask, true );
@@ -2780,19 +4169,19 @@ void CSpatialPartition::InsertIntoTree( SpatialPartitionHandle_t hPartition, con
 	{
 		if ( ( listMask & PARTITION_ALL_CLIENT_EDICTS ) && !( entityInfo.m_flags & IN_CLIENT_TREE ) )
 		{
-			m_VoxelTrees[CLIENT_TREE].InsertIntoTree( hPartition, mins, maxs );
+			m_pTrees[CLIENT_TREE]->InsertIntoTree( hPartition, mins, maxs );
 			entityInfo.m_flags |= IN_CLIENT_TREE;
 		}
 
 		if ( ( listMask & ~PARTITION_ALL_CLIENT_EDICTS ) && !( entityInfo.m_flags & IN_SERVER_TREE ) )
 		{
-			m_VoxelTrees[SERVER_TREE].InsertIntoTree( hPartition, mins, maxs );
+			m_pTrees[SERVER_TREE]->InsertIntoTree( hPartition, mins, maxs );
 			entityInfo.m_flags |= IN_SERVER_TREE;
 		}
 	}
 	else if ( !( entityInfo.m_flags & IN_CLIENT_TREE ) )
 	{
-		m_VoxelTrees[CLIENT_TREE].InsertIntoTree( hPartition, mins, maxs );
+		m_pTrees[CLIENT_TREE]->InsertIntoTree( hPartition, mins, maxs );
 		entityInfo.m_flags |= IN_CLIENT_TREE;
 	}
 }
@@ -2806,13 +4195,13 @@ void CSpatialPartition::RemoveFromTree( SpatialPartitionHandle_t hPartition )
 
 	if ( entityInfo.m_flags & IN_CLIENT_TREE )
 	{
-		m_VoxelTrees[CLIENT_TREE].RemoveFromTree( hPartition ); 
+		m_pTrees[CLIENT_TREE]->RemoveFromTree( hPartition ); 
 		entityInfo.m_flags &= ~IN_CLIENT_TREE;
 	}
 
 	if ( entityInfo.m_flags & IN_SERVER_TREE )
 	{
-		m_VoxelTrees[SERVER_TREE].RemoveFromTree( hPartition ); 
+		m_pTrees[SERVER_TREE]->RemoveFromTree( hPartition ); 
 		entityInfo.m_flags &= ~IN_SERVER_TREE;
 	}
 }
@@ -2845,7 +4234,7 @@ void CSpatialPartition::RenderAllObjectsInTree( float flTime )
 {
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
-		m_VoxelTrees[i].RenderAllObjectsInTree( flTime );
+		m_pTrees[i]->RenderAllObjectsInTree( flTime );
 	}
 }
 
@@ -2853,7 +4242,7 @@ void CSpatialPartition::RenderObjectsInPlayerLeafs( const Vector &vecPlayerMin,
 {
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
-		m_VoxelTrees[i].RenderObjectsInPlayerLeafs( vecPlayerMin, vecPlayerMax, flTime );
+		m_pTrees[i]->RenderObjectsInPlayerLeafs( vecPlayerMin, vecPlayerMax, flTime );
 	}
 }
 
@@ -2869,12 +4258,37 @@ void CVoxelTree::ReportStats( const char *pFileName )
 	}
 }
 
+void CBVHTree::ReportStats( const char *pFileName )
+{
+	m_lock.LockForRead();
+	int nNodeCount = 0;
+	int nLeafNodeCount = 0;
+	int nChildCount = 0;
+	for ( int i = 0; i < m_Nodes.Count(); ++i )
+	{
+		if ( m_Nodes[i].m_nCount == 0 )
+			continue;
+
+		++nNodeCount;
+		nChildCount += m_Nodes[i].m_nCount;
+		if ( m_Nodes[i].m_bLeaf )
+		{
+			++nLeafNodeCount;
+		}
+	}
+
+	Msg( "BVH : %d elements, %d nodes (%d leaves), height %d, %.2f children per node\n", 
+		m_nElementCount, nNodeCount, nLeafNodeCount, ComputeHeight(), nNodeCount ? (float)nChildCount / nNodeCount : 0.0f );
+	Msg( "\t%d refits, %d reinserts\n", m_nRefitCount, m_nReinsertCount );
+	m_lock.UnlockRead();
+}
+
 void CSpatialPartition::ReportStats( const char *pFileName )
 {
 	Msg( "Handle Count %d (%d bytes, %d total)\n", m_aHandles.Count(), m_aHandles.Count() * ( sizeof(EntityInfo_t) + 2 * sizeof(SpatialPartitionHandle_t) ) );
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
-		m_VoxelTrees[i].ReportStats( pFileName );
+		m_pTrees[i]->ReportStats( pFileName );
 	}
 }
 
@@ -2898,11 +4312,25 @@ void CVoxelTree::DrawDebugOverlays()
 	m_lock.UnlockRead();
 }
 
+void CBVHTree::DrawDebugOverlays()
+{
+	int nLevel = r_partition_level.GetInt();
+	if ( nLevel < 0 )
+		return;
+
+	m_lock.LockForRead();
+	if ( m_nRoot >= 0 )
+	{
+		RenderNode( m_nRoot, 0, nLevel, 0.01f );
+	}
+	m_lock.UnlockRead();
+}
+
 void CSpatialPartition::DrawDebugOverlays()
 {
 	for ( int i = 0; i < NUM_TREES; i++ )
 	{
-		m_VoxelTrees[i].DrawDebugOverlays();
+		m_pTrees[i]->DrawDebugOverlays();
 	}
 }
 
@@ -2921,3 +4349,557 @@ void DestroySpatialPartition( ISpatialPartition *pPartition )
 }
 
 
+//-----------------------------------------------------------------------------
+// Writes the elements currently in the trees to a recording, so the queries
+// that follow run against the same state they saw in game
+//-----------------------------------------------------------------------------
+void CSpatialPartition::RecordElements( CPartitionRecorder *pRecorder )
+{
+	AUTO_LOCK_FM( m_HandlesMutex );
+	for ( SpatialPartitionHandle_t hPartition = m_aHandles.Head(); hPartition != m_aHandles.InvalidIndex(); hPartition = m_aHandles.Next( hPartition ) )
+	{
+		const EntityInfo_t &info = m_aHandles[hPartition];
+		if ( !( info.m_flags & ( IN_CLIENT_TREE | IN_SERVER_TREE ) ) )
+			continue;
+
+		// Undo the eps bloat, the trees add it back
+		Vector vecMin( info.m_vecMin.x + SPHASH_EPS, info.m_vecMin.y + SPHASH_EPS, info.m_vecMin.z + SPHASH_EPS );
+		Vector vecMax( info.m_vecMax.x - SPHASH_EPS, info.m_vecMax.y - SPHASH_EPS, info.m_vecMax.z - SPHASH_EPS );
+		pRecorder->RecordMove( hPartition, info.m_fList, vecMin, vecMax );
+		if ( info.m_flags & ENTITY_HIDDEN )
+		{
+			pRecorder->RecordHandle( PARTITION_RECORD_HIDE, hPartition );
+		}
+	}
+}
+
+
+//-----------------------------------------------------------------------------
+// Recording playback, used to check the two trees against each other and to
+// time them on the same stream of updates and queries
+//-----------------------------------------------------------------------------
+class CPartitionReplayEnum : public IPartitionEnumerator
+{
+public:
+	CPartitionReplayEnum( CUtlVector<IHandleEntity*> *pElements ) : m_pElements( pElements ), m_nCount( 0 )
+	{
+	}
+
+	virtual IterationRetval_t EnumElement( IHandleEntity *pHandleEntity )
+	{
+		if ( m_pElements )
+		{
+			m_pElements->AddToTail( pHandleEntity );
+		}
+		++m_nCount;
+		return ITERATION_CONTINUE;
+	}
+
+	CUtlVector<IHandleEntity*>	*m_pElements;
+	int							m_nCount;
+};
+
+struct PartitionReplay_t
+{
+	PartitionReplay_t() : m_nUpdateCount( 0 ), m_nQueryCount( 0 ), m_nResultCount( 0 )
+	{
+		m_TotalTime.Init();
+		m_QueryTime.Init();
+	}
+
+	CUtlVector<IHandleEntity*>	m_Results;			// Sorted elements of every query, back to back
+	CUtlVector<int>				m_QueryResults;		// Index of each query's first element in m_Results
+	int							m_nUpdateCount;
+	int							m_nQueryCount;
+	int							m_nResultCount;
+	CCycleCount					m_TotalTime;
+	CCycleCount					m_QueryTime;
+};
+
+static int __cdecl ComparePartitionElements( IHandleEntity * const *ppLeft, IHandleEntity * const *ppRight )
+{
+	if ( *ppLeft == *ppRight )
+		return 0;
+	return ( *ppLeft < *ppRight ) ? -1 : 1;
+}
+
+static Vector GetRecordVector( CUtlBuffer &buf )
+{
+	Vector v;
+	v.x = buf.GetFloat();
+	v.y = buf.GetFloat();
+	v.z = buf.GetFloat();
+	return v;
+}
+
+//-----------------------------------------------------------------------------
+// Plays a recording back against a new partition using the given tree. The
+// recorded handles stand in for the entities, so both trees report the same
+// pointers. Results are only kept if bKeepResults is set.
+//-----------------------------------------------------------------------------
+static bool ReplayPartitionRecording( CUtlBuffer &buf, bool bUseBVH, bool bKeepResults, PartitionReplay_t *pReplay )
+{
+	buf.SeekGet( CUtlBuffer::SEEK_HEAD, 0 );
+	if ( ( buf.GetInt() != PARTITION_RECORD_ID ) || ( buf.GetInt() != PARTITION_RECORD_VERSION ) )
+	{
+		Warning( "Not a spatial partition recording, or the wrong version\n" );
+		return false;
+	}
+
+	CSpatialPartition *pPartition = new CSpatialPartition;
+	pPartition->Init( s_PartitionMin, s_PartitionMax, bUseBVH );
+
+	CUtlVector<SpatialPartitionHandle_t> handleMap;
+	handleMap.SetCount( 0x10000 );
+	for ( int i = 0; i < handleMap.Count(); ++i )
+	{
+		handleMap[i] = PARTITION_INVALID_HANDLE;
+	}
+
+	CUtlVector<IHandleEntity*> elements;
+	CPartitionReplayEnum replayEnum( bKeepResults ? &elements : NULL );
+
+	CFastTimer totalTimer;
+	CFastTimer queryTimer;
+	bool bOk = true;
+
+	totalTimer.Start();
+	while ( bOk && ( buf.GetBytesRemaining() > 0 ) )
+	{
+		int nOp = buf.GetUnsignedChar();
+		if ( nOp <= PARTITION_RECORD_UNHIDE )
+		{
+			int nRecordedHandle = buf.GetUnsignedShort();
+			SpatialPartitionHandle_t &hPartition = handleMap[nRecordedHandle];
+			switch ( nOp )
+			{
+			case PARTITION_RECORD_MOVE:
+				{
+					SpatialPartitionListMask_t listMask = buf.GetUnsignedShort();
+					Vector vecMin = GetRecordVector( buf );
+					Vector vecMax = GetRecordVector( buf );
+					if ( hPartition == PARTITION_INVALID_HANDLE )
+					{
+						hPartition = pPartition->CreateHandle( (IHandleEntity*)(intp)( nRecordedHandle + 1 ), listMask, vecMin, vecMax );
+					}
+					else
+					{
+						pPartition->RemoveAndInsert( USHRT_MAX, listMask, hPartition );
+						pPartition->ElementMoved( hPartition, vecMin, vecMax );
+					}
+				}
+				break;
+
+			case PARTITION_RECORD_LISTS:
+				{
+					SpatialPartitionListMask_t listMask = buf.GetUnsignedShort();
+					if ( hPartition != PARTITION_INVALID_HANDLE )
+					{
+						pPartition->RemoveAndInsert( USHRT_MAX, listMask, hPartition );
+					}
+				}
+				break;
+
+			case PARTITION_RECORD_DESTROY:
+				if ( hPartition != PARTITION_INVALID_HANDLE )
+				{
+					pPartition->DestroyHandle( hPartition );
+					hPartition = PARTITION_INVALID_HANDLE;
+				}
+				break;
+
+			case PARTITION_RECORD_HIDE:
+				if ( hPartition != PARTITION_INVALID_HANDLE )
+				{
+					pPartition->HideElement( hPartition );
+				}
+				break;
+
+			case PARTITION_RECORD_UNHIDE:
+				if ( hPartition != PARTITION_INVALID_HANDLE )
+				{
+					pPartition->UnhideElement( hPartition, 0 );
+				}
+				break;
+			}
+
+			++pReplay->m_nUpdateCount;
+		}
+		else
+		{
+			SpatialPartitionListMask_t listMask = buf.GetUnsignedShort();
+			bool bCoarseTest = ( buf.GetUnsignedChar() != 0 );
+
+			elements.RemoveAll();
+			replayEnum.m_nCount = 0;
+
+			switch ( nOp )
+			{
+			case PARTITION_RECORD_QUERY_BOX:
+				{
+					Vector vecMin = GetRecordVector( buf );
+					Vector vecMax = GetRecordVector( buf );
+					queryTimer.Start();
+					pPartition->EnumerateElementsInBox( listMask, vecMin, vecMax, bCoarseTest, &replayEnum );
+					queryTimer.End();
+				}
+				break;
+
+			case PARTITION_RECORD_QUERY_SPHERE:
+				{
+					Vector vecOrigin = GetRecordVector( buf );
+					float flRadius = buf.GetFloat();
+					queryTimer.Start();
+					pPartition->EnumerateElementsInSphere( listMask, vecOrigin, flRadius, bCoarseTest, &replayEnum );
+					queryTimer.End();
+				}
+				break;
+
+			case PARTITION_RECORD_QUERY_RAY:
+				{
+					int nFlags = buf.GetUnsignedChar();
+					Ray_t ray;
+					ray.m_Start = GetRecordVector( buf );
+					ray.m_Delta = GetRecordVector( buf );
+					ray.m_Extents = GetRecordVector( buf );
+					ray.m_StartOffset.Init();
+					ray.m_IsRay = ( nFlags & 1 ) != 0;
+					ray.m_IsSwept = ( nFlags & 2 ) != 0;
+					queryTimer.Start();
+					pPartition->EnumerateElementsAlongRay( listMask, ray, bCoarseTest, &replayEnum );
+					queryTimer.End();
+				}
+				break;
+
+			case PARTITION_RECORD_QUERY_POINT:
+				{
+					Vector vecPoint = GetRecordVector( buf );
+					queryTimer.Start();
+					pPartition->EnumerateElementsAtPoint( listMask, vecPoint, bCoarseTest, &replayEnum );
+					queryTimer.End();
+				}
+				break;
+
+			default:
+				Warning( "Bad spatial partition recording (unknown op %d)\n", nOp );
+				bOk = false;
+				continue;
+			}
+
+			pReplay->m_QueryTime += queryTimer.GetDuration();
+			++pReplay->m_nQueryCount;
+			pReplay->m_nResultCount += replayEnum.m_nCount;
+
+			if ( bKeepResults )
+			{
+				elements.Sort( ComparePartitionElements );
+				pReplay->m_QueryResults.AddToTail( pReplay->m_Results.Count() );
+				pReplay->m_Results.AddVectorToTail( elements );
+			}
+		}
+
+		if ( !buf.IsValid() )
+		{
+			Warning( "Spatial partition recording is truncated\n" );
+			bOk = false;
+		}
+	}
+	totalTimer.End();
+	pReplay->m_TotalTime += totalTimer.GetDuration();
+
+	delete pPartition;
+	return bOk;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the number of queries that didn't find the same elements
+//-----------------------------------------------------------------------------
+static int ComparePartitionReplays( const PartitionReplay_t &voxel, const PartitionReplay_t &bvh )
+{
+	Assert( voxel.m_QueryResults.Count() == bvh.m_QueryResults.Count() );
+
+	int nMismatches = 0;
+	int nQueryCount = voxel.m_QueryResults.Count();
+	for ( int i = 0; i < nQueryCount; ++i )
+	{
+		int nVoxelStart = voxel.m_QueryResults[i];
+		int nVoxelCount = ( ( i + 1 < nQueryCount ) ? voxel.m_QueryResults[i + 1] : voxel.m_Results.Count() ) - nVoxelStart;
+		int nBVHStart = bvh.m_QueryResults[i];
+		int nBVHCount = ( ( i + 1 < nQueryCount ) ? bvh.m_QueryResults[i + 1] : bvh.m_Results.Count() ) - nBVHStart;
+
+		if ( nVoxelCount == nBVHCount )
+		{
+			if ( !nVoxelCount || !memcmp( &voxel.m_Results[nVoxelStart], &bvh.m_Results[nBVHStart], nVoxelCount * sizeof(IHandleEntity*) ) )
+				continue;
+		}
+
+		if ( nMismatches < 8 )
+		{
+			Warning( "Query %d: voxel hash found %d elements, BVH found %d\n", i, nVoxelCount, nBVHCount );
+		}
+		++nMismatches;
+	}
+	return nMismatches;
+}
+
+static void ComparePartitionTrees( CUtlBuffer &buf, int nIterations )
+{
+	PartitionReplay_t voxel, bvh;
+	if ( !ReplayPartitionRecording( buf, false, true, &voxel ) || !ReplayPartitionRecording( buf, true, true, &bvh ) )
+		return;
+
+	Msg( "%d updates, %d queries, %d elements found\n", voxel.m_nUpdateCount, voxel.m_nQueryCount, voxel.m_nResultCount );
+
+	int nMismatches = ComparePartitionReplays( voxel, bvh );
+	if ( nMismatches )
+	{
+		Warning( "%d of %d queries found different elements\n", nMismatches, voxel.m_nQueryCount );
+	}
+	else
+	{
+		Msg( "Voxel hash and BVH found the same elements for every query\n" );
+	}
+
+	// Alternate between the trees so neither one gets a warmer cache
+	PartitionReplay_t timings[2];
+	for ( int i = 0; i < nIterations; ++i )
+	{
+		ReplayPartitionRecording( buf, false, false, &timings[0] );
+		ReplayPartitionRecording( buf, true, false, &timings[1] );
+	}
+
+	static const char *s_pTreeNames[2] = { "voxel hash", "BVH" };
+	for ( int i = 0; i < 2; ++i )
+	{
+		const PartitionReplay_t &timing = timings[i];
+		Msg( "%-10s : %8.3f ms per replay, %8.3f ms in queries (%.3f us per query)\n", s_pTreeNames[i],
+			timing.m_TotalTime.GetMillisecondsF() / nIterations, 
+			timing.m_QueryTime.GetMillisecondsF() / nIterations,
+			timing.m_nQueryCount ? timing.m_QueryTime.GetMicrosecondsF() / timing.m_nQueryCount : 0.0 );
+	}
+}
+
+CON_COMMAND( spatialpartition_record, "Records spatial partition updates and queries to a file. Usage: spatialpartition_record <filename>" )
+{
+	if ( args.ArgC() != 2 )
+	{
+		Msg( "Usage: spatialpartition_record <filename>\n" );
+		return;
+	}
+
+	if ( s_PartitionRecorder.IsRecording() )
+	{
+		Warning( "Already recording spatial partition queries\n" );
+		return;
+	}
+
+	char pFileName[MAX_PATH];
+	Q_strncpy( pFileName, args[1], sizeof( pFileName ) );
+	Q_DefaultExtension( pFileName, ".spq", sizeof( pFileName ) );
+
+	s_PartitionRecorder.Start( pFileName );
+	g_SpatialPartition.RecordElements( &s_PartitionRecorder );
+	Msg( "Recording spatial partition queries to %s\n", pFileName );
+}
+
+CON_COMMAND( spatialpartition_stoprecord, "Stops recording spatial partition queries." )
+{
+	if ( !s_PartitionRecorder.IsRecording() )
+	{
+		Msg( "Not recording spatial partition queries\n" );
+		return;
+	}
+
+	s_PartitionRecorder.Stop();
+}
+
+CON_COMMAND( spatialpartition_replay, "Plays a spatial partition recording back against the voxel hash and the BVH, checks they find the same elements and times both. Usage: spatialpartition_replay <filename> [iterations]" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: spatialpartition_replay <filename> [iterations]\n" );
+		return;
+	}
+
+	char pFileName[MAX_PATH];
+	Q_strncpy( pFileName, args[1], sizeof( pFileName ) );
+	Q_DefaultExtension( pFileName, ".spq", sizeof( pFileName ) );
+
+	CUtlBuffer buf;
+	if ( !g_pFileSystem->ReadFile( pFileName, "MOD", buf ) )
+	{
+		Warning( "Unable to read %s\n", pFileName );
+		return;
+	}
+
+	int nIterations = ( args.ArgC() > 2 ) ? max( atoi( args[2] ), 1 ) : 10;
+	ComparePartitionTrees( buf, nIterations );
+}
+
+static Vector RandomRecordVector( CUniformRandomStream &random, float flMin, float flMax )
+{
+	return Vector( random.RandomFloat( flMin, flMax ), random.RandomFloat( flMin, flMax ), random.RandomFloat( flMin, flMax ) );
+}
+
+//-----------------------------------------------------------------------------
+// Builds a random recording: elements of all sizes, some hugging the edges of
+// the world, moving, teleporting, changing lists and coming and going, with a
+// mix of every query type in between
+//-----------------------------------------------------------------------------
+static void BuildRandomPartitionRecording( CPartitionRecorder *pRecorder, int nElements, int nFrames, int nSeed )
+{
+	static const SpatialPartitionListMask_t s_pElementLists[] = 
+	{
+		PARTITION_ENGINE_SOLID_EDICTS | PARTITION_ENGINE_NON_STATIC_EDICTS,
+		PARTITION_ENGINE_TRIGGER_EDICTS | PARTITION_ENGINE_NON_STATIC_EDICTS,
+		PARTITION_ENGINE_SOLID_EDICTS | PARTITION_ENGINE_STATIC_PROPS,
+		PARTITION_CLIENT_SOLID_EDICTS | PARTITION_CLIENT_NON_STATIC_EDICTS,
+		PARTITION_CLIENT_RESPONSIVE_EDICTS | PARTITION_CLIENT_NON_STATIC_EDICTS,
+		PARTITION_CLIENT_STATIC_PROPS,
+		PARTITION_ENGINE_SOLID_EDICTS | PARTITION_CLIENT_SOLID_EDICTS,
+	};
+
+	static const SpatialPartitionListMask_t s_pQueryLists[] = 
+	{
+		PARTITION_ENGINE_SOLID_EDICTS,
+		PARTITION_ENGINE_TRIGGER_EDICTS,
+		PARTITION_SERVER_GAME_EDICTS,
+		PARTITION_ENGINE_SOLID_EDICTS | PARTITION_ENGINE_STATIC_PROPS,
+		PARTITION_CLIENT_SOLID_EDICTS,
+		PARTITION_CLIENT_GAME_EDICTS,
+		PARTITION_ALL_CLIENT_EDICTS,
+	};
+
+	CUniformRandomStream random;
+	random.SetSeed( nSeed );
+
+	CUtlVector<Vector> centers, extents;
+	CUtlVector<bool> alive;
+	centers.SetCount( nElements );
+	extents.SetCount( nElements );
+	alive.SetCount( nElements );
+
+	const float flWorldSize = MAX_COORD_FLOAT * 0.95f;
+	for ( int i = 0; i < nElements; ++i )
+	{
+		alive[i] = false;
+	}
+
+	for ( int nFrame = 0; nFrame < nFrames; ++nFrame )
+	{
+		// Updates
+		for ( int i = 0; i < nElements; ++i )
+		{
+			if ( !alive[i] )
+			{
+				if ( ( nFrame != 0 ) && ( random.RandomFloat() > 0.1f ) )
+					continue;
+
+				// Mostly small things, some big ones, a few that hang off the edge of the world
+				float flSize = random.RandomFloat();
+				float flExtent = ( flSize < 0.8f ) ? random.RandomFloat( 4.0f, 32.0f ) : ( ( flSize < 0.95f ) ? random.RandomFloat( 32.0f, 256.0f ) : random.RandomFloat( 256.0f, 2048.0f ) );
+				extents[i].Init( flExtent * random.RandomFloat( 0.5f, 1.0f ), flExtent * random.RandomFloat( 0.5f, 1.0f ), flExtent * random.RandomFloat( 0.5f, 1.0f ) );
+				float flRange = ( random.RandomFloat() < 0.02f ) ? MAX_COORD_FLOAT + 64.0f : flWorldSize;
+				centers[i].Init( random.RandomFloat( -flRange, flRange ), random.RandomFloat( -flRange, flRange ), random.RandomFloat( -flRange, flRange ) );
+				alive[i] = true;
+
+				pRecorder->RecordMove( i, s_pElementLists[ random.RandomInt( 0, ARRAYSIZE( s_pElementLists ) - 1 ) ], centers[i] - extents[i], centers[i] + extents[i] );
+				continue;
+			}
+
+			float flEvent = random.RandomFloat();
+			if ( flEvent < 0.002f )
+			{
+				pRecorder->RecordHandle( PARTITION_RECORD_DESTROY, i );
+				alive[i] = false;
+			}
+			else if ( flEvent < 0.005f )
+			{
+				pRecorder->RecordLists( i, s_pElementLists[ random.RandomInt( 0, ARRAYSIZE( s_pElementLists ) - 1 ) ] );
+			}
+			else if ( flEvent < 0.015f )
+			{
+				centers[i].Init( random.RandomFloat( -flWorldSize, flWorldSize ), random.RandomFloat( -flWorldSize, flWorldSize ), random.RandomFloat( -flWorldSize, flWorldSize ) );
+				pRecorder->RecordMove( i, s_pElementLists[0], centers[i] - extents[i], centers[i] + extents[i] );
+				pRecorder->RecordLists( i, s_pElementLists[ random.RandomInt( 0, ARRAYSIZE( s_pElementLists ) - 1 ) ] );
+			}
+			else if ( flEvent < 0.25f )
+			{
+				centers[i] += RandomRecordVector( random, -16.0f, 16.0f );
+				pRecorder->RecordMove( i, s_pElementLists[ random.RandomInt( 0, ARRAYSIZE( s_pElementLists ) - 1 ) ], centers[i] - extents[i], centers[i] + extents[i] );
+			}
+		}
+
+		// Hide something for the duration of the queries
+		int nHidden = random.RandomInt( 0, nElements - 1 );
+		pRecorder->RecordHandle( PARTITION_RECORD_HIDE, nHidden );
+
+		// Queries, mostly around elements so they find something
+		for ( int i = 0; i < 64; ++i )
+		{
+			SpatialPartitionListMask_t listMask = s_pQueryLists[ random.RandomInt( 0, ARRAYSIZE( s_pQueryLists ) - 1 ) ];
+			int nNear = random.RandomInt( 0, nElements - 1 );
+			Vector vecCenter = alive[nNear] ? centers[nNear] + RandomRecordVector( random, -64.0f, 64.0f ) : RandomRecordVector( random, -flWorldSize, flWorldSize );
+			float flSize = random.RandomFloat( 1.0f, ( random.RandomFloat() < 0.9f ) ? 128.0f : 2048.0f );
+			Vector vecSize( flSize, flSize, flSize );
+			switch ( random.RandomInt( 0, 4 ) )
+			{
+			case 0:
+				pRecorder->RecordBox( listMask, vecCenter - vecSize, vecCenter + vecSize, false );
+				break;
+
+			case 1:
+				pRecorder->RecordSphere( listMask, vecCenter, flSize, false );
+				break;
+
+			case 2:
+				pRecorder->RecordPoint( listMask, vecCenter, false );
+				break;
+
+			default:
+				{
+					// Rays and hulls, some starting or ending outside the world, some not moving at all
+					Vector vecStart = vecCenter;
+					if ( random.RandomFloat() < 0.05f )
+					{
+						vecStart.z = MAX_COORD_FLOAT + random.RandomFloat( 1.0f, 512.0f );
+					}
+					Vector vecDelta = RandomRecordVector( random, -1.0f, 1.0f ) * random.RandomFloat( 0.0f, ( random.RandomFloat() < 0.8f ) ? 1024.0f : 16384.0f );
+					if ( random.RandomFloat() < 0.1f )
+					{
+						vecDelta.Init();
+					}
+
+					Ray_t ray;
+					if ( random.RandomFloat() < 0.5f )
+					{
+						ray.Init( vecStart, vecStart + vecDelta );
+					}
+					else
+					{
+						Vector vecExtents( random.RandomFloat( 1.0f, 32.0f ), random.RandomFloat( 1.0f, 32.0f ), random.RandomFloat( 1.0f, 72.0f ) );
+						ray.Init( vecStart, vecStart + vecDelta, -vecExtents, vecExtents );
+					}
+					pRecorder->RecordRay( listMask, ray, false );
+				}
+				break;
+			}
+		}
+
+		pRecorder->RecordHandle( PARTITION_RECORD_UNHIDE, nHidden );
+	}
+}
+
+CON_COMMAND( spatialpartition_selftest, "Runs a random stream of updates and queries through the voxel hash and the BVH and checks they find the same elements. Usage: spatialpartition_selftest [elements] [frames] [seed]" )
+{
+	int nElements = ( args.ArgC() > 1 ) ? clamp( atoi( args[1] ), 1, 32768 ) : 4000;
+	int nFrames = ( args.ArgC() > 2 ) ? max( atoi( args[2] ), 1 ) : 100;
+	int nSeed = ( args.ArgC() > 3 ) ? atoi( args[3] ) : 1;
+
+	CPartitionRecorder recorder;
+	recorder.Start( NULL );
+	BuildRandomPartitionRecording( &recorder, nElements, nFrames, nSeed );
+	recorder.Stop();
+
+	ComparePartitionTrees( recorder.GetBuffer(), 3 );
+}
@@ -17,8 +17,10 @@
 #include "LocalNetworkBackdoor.h"
 #include "ents_shared.h"
 #include "hltvserver.h"
+#include "changeframelist.h"
 #include "tier0/vcrmode.h"
 #include "framesnapshot.h"
+#include "sv_packedentities.h"
 
 
 // memdbgon must be the last include file in a .cpp file!!!
@@ -33,6 +35,9 @@ extern ConVar g_CV_DTWatchEnt;
 static ConVar		sv_deltatime( "sv_deltatime", "0", 0, "Enable profiling of CalcDelta calls" );
 static ConVar		sv_deltaprint( "sv_deltaprint", "0", 0, "Print accumulated CalcDelta profiling data (only if sv_deltatime is on)" );
 
+static ConVar		sv_deltacache( "sv_deltacache", "1", 0, "Share encoded entity deltas between clients that use the same delta base" );
+static ConVar		sv_deltacache_size( "sv_deltacache_size", "4096", 0, "Size of the per tick shared entity delta cache (in KB)" );
+
 #if defined( DEBUG_NETWORKING )
 ConVar  sv_packettrace( "sv_packettrace", "1", 0, "For debugging, print entity creation/deletion info to console." );
 #endif
@@ -75,6 +80,10 @@ public:
 
 	int				m_nFullProps;	// number of properties send as full update (Enter PVS)
 	bool			m_bCullProps;	// filter props by clients in recipient lists
+	bool			m_bUseDeltaCache;	// share encoded deltas with other clients this tick
+	int				m_nDeltaCacheHits;
+	int				m_nDeltaCacheMisses;
+	int				m_nDeltaCacheBits;	// bits copied from the shared delta cache
 	
 	/* Some profiling data
 	int				m_nTotalGap;
@@ -83,6 +92,229 @@ public:
 
 
 
+//-----------------------------------------------------------------------------
+// Shared entity delta cache. Many clients ack the same snapshot, so the same
+// (from PackedEntity, to PackedEntity) pair would be diffed and encoded once per
+// client. The first client to write a pair stores the encoded bits (including
+// the encoded prop index list) and everyone else just copies them. Entries only
+// live for one tick and are inserted lock free so the cache can be used from
+// the sv_parallel_sendsnapshot jobs.
+//-----------------------------------------------------------------------------
+
+#define DELTACACHE_BUCKETS	4096	// must be a power of 2
+#define DELTACACHE_ALIGN	16		// entries and the bits in them start on this boundary
+
+class CSharedDeltaCache
+{
+	struct DeltaCacheEntry_s
+	{
+		DeltaCacheEntry_s	*pNext;
+		const PackedEntity	*pFromPack;
+		const PackedEntity	*pToPack;
+		int					nFromTick;
+		int					nBits;	// 0 means the entity didn't change
+	};
+
+	// the encoded bits follow the entry header
+	enum { DELTACACHE_HEADER_SIZE = ALIGN_VALUE( sizeof( DeltaCacheEntry_s ), DELTACACHE_ALIGN ) };
+
+public:
+	CSharedDeltaCache();
+	~CSharedDeltaCache();
+
+	// Must be called from the main thread before any client writes its snapshot
+	void	SetTick( int nTick );
+	bool	IsValidForTick( int nTick ) const { return m_pMemory != NULL && m_nTick == nTick; }
+
+	unsigned char *FindDeltaBits( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick, int &nBits );
+	void	AddDeltaBits( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick, int nBits, bf_write *pBuffer );
+
+	void	Flush();
+	void	AddStats( int nHits, int nMisses, int nBitsReused );
+	void	PrintStats();
+	void	ClearStats();
+
+private:
+	static unsigned int HashKey( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick );
+
+	int						m_nTick;
+	char					*m_pMemory;
+	int						m_nMemorySize;
+	volatile int			m_nMemoryUsed;
+	DeltaCacheEntry_s * volatile m_Buckets[DELTACACHE_BUCKETS];
+
+	// accumulated since last sv_deltaprint
+	CInterlockedInt			m_nHits;
+	CInterlockedInt			m_nMisses;
+	CInterlockedInt			m_nStores;
+	CInterlockedInt			m_nFull;
+	CInterlockedInt			m_nBitsSaved;
+	int						m_nTicks;
+};
+
+static CSharedDeltaCache g_SharedDeltaCache;
+
+CSharedDeltaCache::CSharedDeltaCache()
+{
+	Q_memset( (void*)m_Buckets, 0, sizeof(m_Buckets) );
+	m_nTick = -1;
+	m_pMemory = NULL;
+	m_nMemorySize = 0;
+	m_nMemoryUsed = 0;
+	ClearStats();
+}
+
+CSharedDeltaCache::~CSharedDeltaCache()
+{
+	Flush();
+}
+
+void CSharedDeltaCache::Flush()
+{
+	if ( m_pMemory )
+	{
+		MemAlloc_FreeAligned( m_pMemory );
+		m_pMemory = NULL;
+	}
+
+	Q_memset( (void*)m_Buckets, 0, sizeof(m_Buckets) );
+	m_nMemorySize = 0;
+	m_nMemoryUsed = 0;
+	m_nTick = -1;
+}
+
+void CSharedDeltaCache::SetTick( int nTick )
+{
+	int nSize = sv_deltacache.GetBool() ? sv_deltacache_size.GetInt() * 1024 : 0;
+
+	if ( nSize <= 0 )
+	{
+		Flush();
+		return;
+	}
+
+	if ( nSize != m_nMemorySize )
+	{
+		Flush();
+		m_pMemory = (char*)MemAlloc_AllocAligned( nSize, DELTACACHE_ALIGN );
+		m_nMemorySize = nSize;
+	}
+
+	if ( m_nTick != nTick )
+	{
+		// pack handles are only guaranteed to be unique within one tick
+		Q_memset( (void*)m_Buckets, 0, sizeof(m_Buckets) );
+		m_nMemoryUsed = 0;
+		m_nTick = nTick;
+		m_nTicks++;
+	}
+}
+
+inline unsigned int CSharedDeltaCache::HashKey( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick )
+{
+	unsigned int nHash = (unsigned int)((size_t)pFrom >> 4) * 0x9E3779B1;
+	nHash ^= (unsigned int)((size_t)pTo >> 4) + 0x7F4A7C15 + (nHash << 6) + (nHash >> 2);
+	nHash ^= (unsigned int)nFromTick * 0x85EBCA6B;
+	return nHash & (DELTACACHE_BUCKETS-1);
+}
+
+unsigned char *CSharedDeltaCache::FindDeltaBits( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick, int &nBits )
+{
+	nBits = -1;
+
+	DeltaCacheEntry_s *pEntry = m_Buckets[ HashKey( pFrom, pTo, nFromTick ) ];
+
+	while ( pEntry )
+	{
+		if ( pEntry->pToPack == pTo && pEntry->pFromPack == pFrom && pEntry->nFromTick == nFromTick )
+		{
+			nBits = pEntry->nBits;
+			return (unsigned char*)(pEntry) + DELTACACHE_HEADER_SIZE;
+		}
+
+		pEntry = pEntry->pNext;
+	}
+
+	return NULL;
+}
+
+void CSharedDeltaCache::AddDeltaBits( const PackedEntity *pFrom, const PackedEntity *pTo, int nFromTick, int nBits, bf_write *pBuffer )
+{
+	if ( !m_pMemory )
+		return;
+
+	int nBufferSize = PAD_NUMBER( Bits2Bytes(nBits), 4 );
+	int nEntrySize = ALIGN_VALUE( DELTACACHE_HEADER_SIZE + nBufferSize, DELTACACHE_ALIGN );
+
+	int nOffset = ThreadInterlockedExchangeAdd( &m_nMemoryUsed, nEntrySize );
+
+	if ( nOffset + nEntrySize > m_nMemorySize )
+	{
+		// cache is full for this tick, just encode for each client
+		++m_nFull;
+		return;
+	}
+
+	DeltaCacheEntry_s *pEntry = (DeltaCacheEntry_s*)(m_pMemory + nOffset);
+
+	pEntry->pFromPack = pFrom;
+	pEntry->pToPack = pTo;
+	pEntry->nFromTick = nFromTick;
+	pEntry->nBits = nBits;
+
+	if ( nBits > 0 )
+	{
+		bf_read  inBuffer; 
+		inBuffer.StartReading( pBuffer->GetData(), pBuffer->m_nDataBytes, pBuffer->GetNumBitsWritten() );
+		bf_write outBuffer( (char*)(pEntry) + DELTACACHE_HEADER_SIZE, nBufferSize );
+		outBuffer.WriteBitsFromBuffer( &inBuffer, nBits );
+	}
+
+	// publish the entry, it's fully written at this point. If another thread
+	// added the same pair in the meantime we just end up with a duplicate.
+	DeltaCacheEntry_s * volatile *ppHead = &m_Buckets[ HashKey( pFrom, pTo, nFromTick ) ];
+
+	do
+	{
+		pEntry->pNext = *ppHead;
+	}
+	while ( !ThreadInterlockedAssignPointerIf( (void * volatile *)ppHead, pEntry, pEntry->pNext ) );
+
+	++m_nStores;
+}
+
+void CSharedDeltaCache::AddStats( int nHits, int nMisses, int nBitsReused )
+{
+	// accumulated per client to keep the shared counters out of the entity loop
+	m_nHits += nHits;
+	m_nMisses += nMisses;
+	m_nBitsSaved += nBitsReused;
+}
+
+void CSharedDeltaCache::ClearStats()
+{
+	m_nHits = 0;
+	m_nMisses = 0;
+	m_nStores = 0;
+	m_nFull = 0;
+	m_nBitsSaved = 0;
+	m_nTicks = 0;
+}
+
+void CSharedDeltaCache::PrintStats()
+{
+	int nLookups = m_nHits + m_nMisses;
+
+	ConMsg( "Shared delta cache: %s, %d KB\n", m_pMemory ? "on" : "off", m_nMemorySize / 1024 );
+	ConMsg( "  Ticks       : %d\n", m_nTicks );
+	ConMsg( "  Lookups     : %d (%d hits, %d misses, %.1f%% hit rate)\n", 
+		nLookups, (int)m_nHits, (int)m_nMisses, nLookups ? 100.0f * m_nHits / nLookups : 0.0f );
+	ConMsg( "  Stores      : %d (%d rejected, cache full)\n", (int)m_nStores, (int)m_nFull );
+	ConMsg( "  Reused bits : %d KB\n", ( m_nBitsSaved / 8 ) / 1024 );
+	ConMsg( "  Last tick   : %d of %d KB used\n", min( (int)m_nMemoryUsed, m_nMemorySize ) / 1024, m_nMemorySize / 1024 );
+}
+
+
 //-----------------------------------------------------------------------------
 // Delta timing helpers.
 //-----------------------------------------------------------------------------
@@ -144,6 +376,33 @@ void PrintChangeTracks()
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: Prepares the shared delta cache for the snapshot of this tick, must
+//  be called before the clients write their snapshots.
+//-----------------------------------------------------------------------------
+void SV_SetupDeltaCache( int nTick )
+{
+	g_SharedDeltaCache.SetTick( nTick );
+
+	if ( sv_deltaprint.GetBool() )
+	{
+		if ( sv_deltatime.GetBool() )
+		{
+			PrintChangeTracks();
+		}
+
+		g_SharedDeltaCache.PrintStats();
+		g_SharedDeltaCache.ClearStats();
+		sv_deltaprint.SetValue( 0 );
+	}
+}
+
+void SV_FlushDeltaCache()
+{
+	g_SharedDeltaCache.Flush();
+}
+
+
 //-----------------------------------------------------------------------------
 // Purpose: Entity wasn't dealt with in packet, but it has been deleted, we'll flag
 //  the entity for destruction
@@ -524,8 +783,45 @@ static inline void SV_DetermineUpdateType( CEntityWriteInfo &u )
 	}
 #endif
 
+	// Entities without proxy recipient lists encode the same bits for every client,
+	// so the delta can be shared between all clients that use the same delta base.
+	bool bShareDelta = u.m_bUseDeltaCache && 
+		u.m_pOldPack->GetNumRecipients() == 0 && u.m_pNewPack->GetNumRecipients() == 0;
+
+	if ( bShareDelta )
+	{
+		int nBits;
+		unsigned char *pBuffer = g_SharedDeltaCache.FindDeltaBits( u.m_pOldPack, u.m_pNewPack, u.m_pFromSnapshot->m_nTickCount, nBits );
+
+		if ( pBuffer )
+		{
+			u.m_nDeltaCacheHits++;
+
+			if ( nBits > 0 )
+			{
+				SV_WriteDeltaHeader( u, u.m_nNewEntity, FHDR_ZERO );
+				u.m_pBuf->WriteBits( pBuffer, nBits );
+				u.m_nDeltaCacheBits += nBits;
+				u.m_UpdateType = DeltaEnt;
+			}
+			else
+			{
+				u.m_UpdateType = PreserveEnt;
+			}
+
+			return;
+		}
+
+		u.m_nDeltaCacheMisses++;
+	}
+
 	int checkProps[MAX_DATATABLE_PROPS];
 	int nCheckProps = u.m_pNewPack->GetPropsChangedAfterTick( u.m_pFromSnapshot->m_nTickCount, checkProps, ARRAYSIZE( checkProps ) );
+
+	if ( ChangeFrameList_IsRecording() && ( nCheckProps != -1 ) )
+	{
+		ChangeFrameList_RecordDelta( u.m_nNewEntity, u.m_pFromSnapshot->m_nTickCount );
+	}
 	
 	if ( nCheckProps == -1 )
 	{
@@ -578,14 +874,19 @@ static inline void SV_DetermineUpdateType( CEntityWriteInfo &u )
 	{
 		// Write a header.
 		SV_WriteDeltaHeader( u, u.m_nNewEntity, FHDR_ZERO );
-#if defined( DEBUG_NETWORKING )
+		bf_write bufStart = *u.m_pBuf;
 		int startBit = u.m_pBuf->GetNumBitsWritten();
-#endif
+
 		SV_WritePropsFromPackedEntity( u, checkProps, nCheckProps );
-#if defined( DEBUG_NETWORKING )
+
 		int endBit = u.m_pBuf->GetNumBitsWritten();
 		TRACE_PACKET( ( "    Delta Bits (%d) = %d (%d bytes)\n", u.m_nNewEntity, (endBit - startBit), ( (endBit - startBit) + 7 ) / 8 ) );
-#endif
+
+		if ( bShareDelta && !u.m_pBuf->IsOverflowed() )
+		{
+			g_SharedDeltaCache.AddDeltaBits( u.m_pOldPack, u.m_pNewPack, u.m_pFromSnapshot->m_nTickCount, endBit - startBit, &bufStart );
+		}
+
 		// If the numbers are the same, then the entity was in the old and new packet.
 		// Just delta compress the differences.
 		u.m_UpdateType = DeltaEnt;
@@ -599,6 +900,11 @@ static inline void SV_DetermineUpdateType( CEntityWriteInfo &u )
 			hltv->m_DeltaCache.AddDeltaBits( u.m_nNewEntity, u.m_pFromSnapshot->m_nTickCount, 0, NULL );
 		}
 #endif
+		if ( bShareDelta )
+		{
+			g_SharedDeltaCache.AddDeltaBits( u.m_pOldPack, u.m_pNewPack, u.m_pFromSnapshot->m_nTickCount, 0, NULL );
+		}
+
 		u.m_UpdateType = PreserveEnt;
 	}
 }
@@ -888,15 +1194,22 @@ void CBaseServer::WriteDeltaEntities( CBaseClient *client, CClientFrame *to, CCl
 		u.m_pFrom = from;
 		u.m_pFromSnapshot = from->GetSnapshot();
 		Assert( u.m_pFromSnapshot );
+
+		// the shared cache is only valid for the snapshot of the current server tick
+		u.m_bUseDeltaCache = !IsHLTV() && g_SharedDeltaCache.IsValidForTick( u.m_pToSnapshot->m_nTickCount );
 	}
 	else
 	{
 		u.m_bAsDelta = false;
 		u.m_pFrom = NULL;
 		u.m_pFromSnapshot = NULL;
+		u.m_bUseDeltaCache = false;
 	}
 
 	u.m_nHeaderCount = 0;
+	u.m_nDeltaCacheHits = 0;
+	u.m_nDeltaCacheMisses = 0;
+	u.m_nDeltaCacheBits = 0;
 //	u.m_nTotalGap = 0;
 //	u.m_nTotalGapCount = 0;
 
@@ -995,6 +1308,11 @@ void CBaseServer::WriteDeltaEntities( CBaseClient *client, CClientFrame *to, CCl
 		{
 			client->TraceNetworkData( pBuf, "Delta: [%d] deletions", nNumDeletions );
 		}
+
+		if ( u.m_bUseDeltaCache )
+		{
+			g_SharedDeltaCache.AddStats( u.m_nDeltaCacheHits, u.m_nDeltaCacheMisses, u.m_nDeltaCacheBits );
+		}
 	}
 
 	// get number of written bits
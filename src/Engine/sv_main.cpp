@@ -925,6 +925,7 @@ void CGameServer::Shutdown( void )
 
 	// Actually performs a shutdown.
 	framesnapshotmanager->LevelChanged();
+	SV_FlushDeltaCache();
 
 	IGameEvent *event = g_GameEventManager.CreateEvent( "server_shutdown" );
 
@@ -1440,6 +1441,9 @@ void SV_ParallelSendSnapshot( CGameClient *& pClient )
 void CGameServer::SendClientMessages ( bool bSendSnapshots )
 {
 	VPROF_BUDGET( "SendClientMessages", VPROF_BUDGETGROUP_OTHER_NETWORKING );
+
+	// collect all datagrams of this tick and send them at once
+	NET_BeginBatchedSend();
 	
 	// build individual updates
 	int receivingClientCount = 0;
@@ -1492,6 +1496,9 @@ void CGameServer::SendClientMessages ( bool bSendSnapshots )
 		// Compute the client packs
 		SV_ComputeClientPacks( receivingClientCount, pReceivingClients, pSnapshot );
 
+		// Clients that ack the same tick share their encoded entity deltas
+		SV_SetupDeltaCache( pSnapshot->m_nTickCount );
+
 		if ( receivingClientCount > 1 && sv_parallel_sendsnapshot.GetBool() )
 		{
 			ParallelProcess( pReceivingClients, receivingClientCount, &SV_ParallelSendSnapshot );
@@ -1515,6 +1522,8 @@ void CGameServer::SendClientMessages ( bool bSendSnapshots )
 		pSnapshot->ReleaseReference();
 	}
 
+	NET_FlushBatchedSend();
+
 	// Allow game .dll to run code, including unsetting EF_MUZZLEFLASH and EF_NOINTERP on effects fields
 	// etc.
 	serverGameClients->PostClientMessagesSent();
@@ -2017,6 +2026,7 @@ bool CGameServer::SpawnServer( char *mapname, char *startspot )
 	// Clear out the state of the most recently sent packed entities from
 	// the snapshot manager
 	framesnapshotmanager->LevelChanged();
+	SV_FlushDeltaCache();
 
 	// set map name
 	Q_strncpy( m_szMapname, mapname, sizeof( m_szMapname ) );
@@ -212,13 +212,16 @@ static inline void SV_PackEntity(
 			}
 		}
 
+		ChangeFrameRecordMode_t recordMode = CHANGEFRAME_RECORD_SNAG;
+
 #ifndef _XBOX	
 		if ( hltv && hltv->IsActive() )
 		{
 			// in HLTV mode every PackedEntity keeps it's own ChangeFrameList
 			// we just copy the ChangeFrameList from prev frame and update it
 			pChangeFrame = pPrevFrame->GetChangeFrameList();
-			pChangeFrame = pChangeFrame->Copy(); // allocs and copies ChangeFrameList
+			pChangeFrame = pChangeFrame->Copy(); // shares the ticks until SetChangeTick changes them
+			recordMode = CHANGEFRAME_RECORD_COPY;
 		}
 		else
 #endif
@@ -234,11 +237,21 @@ static inline void SV_PackEntity(
 			("SV_PackEntity: SnagChangeFrameList mismatched number of props[%d vs %d]", nFlatProps, pChangeFrame->GetNumProps() ) );
 
 		pChangeFrame->SetChangeTick( deltaProps, nChanges, pSnapshot->m_nTickCount );
+
+		if ( ChangeFrameList_IsRecording() )
+		{
+			ChangeFrameList_RecordPack( edictIdx, recordMode, pSnapshot->m_nTickCount, nFlatProps, deltaProps, nChanges );
+		}
 	}
 	else
 	{
 		// Ok, init the change frames for the first time.
 		pChangeFrame = AllocChangeFrameList( nFlatProps, pSnapshot->m_nTickCount );
+
+		if ( ChangeFrameList_IsRecording() )
+		{
+			ChangeFrameList_RecordPack( edictIdx, CHANGEFRAME_RECORD_NEW, pSnapshot->m_nTickCount, nFlatProps, NULL, 0 );
+		}
 	}
 
 	// Now make a PackedEntity and store the new packed data in there.
@@ -419,6 +432,32 @@ void PackEntities_Normal(
 // Writes the compressed packet of entities to all clients
 //-----------------------------------------------------------------------------
 
+static ConVar sv_parallel_checktransmit( "sv_parallel_checktransmit", "1", 0, "Run CheckTransmit for several clients in parallel if the game dll declares it thread safe." );
+
+struct CheckTransmitWork_t
+{
+	CGameClient		*pClient;
+	CFrameSnapshot	*pSnapshot;
+
+	static void Process( CheckTransmitWork_t &item )
+	{
+		serverGameEnts->CheckTransmit( &item.pClient->m_PackInfo, item.pSnapshot->m_pValidEntities, item.pSnapshot->m_nValidEntities );
+		item.pClient->SetupPrevPackInfo();
+	}
+};
+
+//-----------------------------------------------------------------------------
+// Returns true if this frame's CheckTransmit calls may run concurrently. Older
+// game dlls (ServerGameEnts001) can't tell us, so they always run serially.
+//-----------------------------------------------------------------------------
+static bool SV_ShouldParallelCheckTransmit( int clientCount, CFrameSnapshot *snapshot )
+{
+	if ( clientCount < 2 || !sv_parallel_checktransmit.GetBool() || g_iServerGameEntsVersion < 2 )
+		return false;
+
+	return serverGameEnts->PrepareParallelCheckTransmit( snapshot->m_pValidEntities, snapshot->m_nValidEntities );
+}
+
 void SV_ComputeClientPacks( 
 	int clientCount, 
 	CGameClient **clients,
@@ -429,12 +468,32 @@ void SV_ComputeClientPacks(
 	{
 		VPROF_BUDGET_FLAGS( "SV_ComputeClientPacks", "CheckTransmit", BUDGETFLAG_SERVER );
 
-		for (int iClient = 0; iClient < clientCount; ++iClient)
+		if ( SV_ShouldParallelCheckTransmit( clientCount, snapshot ) )
+		{
+			// SetupPackInfo calls back into the game and touches the shared frame lists,
+			// so it stays on this thread. Only the per-client transmit checks go wide.
+			CUtlVectorFixed< CheckTransmitWork_t, ABSOLUTE_PLAYER_LIMIT > workItems;
+			for (int iClient = 0; iClient < clientCount; ++iClient)
+			{
+				clients[iClient]->SetupPackInfo( snapshot );
+
+				CheckTransmitWork_t w;
+				w.pClient = clients[iClient];
+				w.pSnapshot = snapshot;
+				workItems.AddToTail( w );
+			}
+
+			ParallelProcess( workItems.Base(), workItems.Count(), &CheckTransmitWork_t::Process );
+		}
+		else
 		{
-			CCheckTransmitInfo *pInfo = &clients[iClient]->m_PackInfo;
-			clients[iClient]->SetupPackInfo( snapshot );
-			serverGameEnts->CheckTransmit( pInfo, snapshot->m_pValidEntities, snapshot->m_nValidEntities );
-			clients[iClient]->SetupPrevPackInfo();
+			for (int iClient = 0; iClient < clientCount; ++iClient)
+			{
+				CCheckTransmitInfo *pInfo = &clients[iClient]->m_PackInfo;
+				clients[iClient]->SetupPackInfo( snapshot );
+				serverGameEnts->CheckTransmit( pInfo, snapshot->m_pValidEntities, snapshot->m_nValidEntities );
+				clients[iClient]->SetupPrevPackInfo();
+			}
 		}
 	}
 
@@ -30,5 +30,9 @@ void SV_EnsureInstanceBaseline( ServerClass *pServerClass, int iEdict, const voi
 
 void SV_EnableChangeFrames( bool state );
 
+// Shared per tick cache of encoded entity deltas (sv_ents_write.cpp)
+void SV_SetupDeltaCache( int nTick );
+void SV_FlushDeltaCache();
+
 
 #endif // SV_PACKEDENTITIES_H
@@ -108,6 +108,7 @@ IServerGameDLL	*serverGameDLL = NULL;
 bool g_bServerGameDLLGreaterThanV4;
 bool g_bServerGameDLLGreaterThanV5;
 IServerGameEnts *serverGameEnts = NULL;
+int g_iServerGameEntsVersion = 0;	// This matches the number at the end of the interface name (so for "ServerGameEnts002", this would be 2).
 
 IServerGameClients *serverGameClients = NULL;
 int g_iServerGameClientsVersion = 0;	// This matches the number at the end of the interface name (so for "ServerGameClients004", this would be 4).
@@ -1164,10 +1165,24 @@ static bool LoadThisDll( char *szDllFilename )
 
 
 		serverGameEnts = (IServerGameEnts*)g_ServerFactory(INTERFACEVERSION_SERVERGAMEENTS, NULL);
-		if ( !serverGameEnts )
+		if ( serverGameEnts )
 		{
-			ConMsg( "Could not get IServerGameEnts interface from library %s", szDllFilename );
-			goto IgnoreThisDLL;
+			g_iServerGameEntsVersion = 2;
+		}
+		else
+		{
+			// Try the previous version. It lacks PrepareParallelCheckTransmit, so CheckTransmit stays serial.
+			const char *pINTERFACEVERSION_SERVERGAMEENTS_V1 = "ServerGameEnts001";
+			serverGameEnts = (IServerGameEnts*)g_ServerFactory(pINTERFACEVERSION_SERVERGAMEENTS_V1, NULL);
+			if ( serverGameEnts )
+			{
+				g_iServerGameEntsVersion = 1;
+			}
+			else
+			{
+				ConMsg( "Could not get IServerGameEnts interface from library %s", szDllFilename );
+				goto IgnoreThisDLL;
+			}
 		}
 		
 		serverGameClients = (IServerGameClients*)g_ServerFactory(INTERFACEVERSION_SERVERGAMECLIENTS, NULL);
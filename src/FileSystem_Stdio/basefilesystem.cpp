@@ -35,6 +35,11 @@
 // Needed for getting file type string
 #define WIN32_LEAN_AND_MEAN
 #include <shellapi.h>
+#include <psapi.h>
+#pragma comment( lib, "psapi.lib" )
+#elif defined( _LINUX )
+#include <sys/mman.h>
+#include <fcntl.h>
 #endif
 
 #if defined( _X360 )
@@ -52,6 +57,86 @@
 ConVar fs_report_sync_opens( "fs_report_sync_opens", "0", 0, "0:Off, 1:Always, 2:Not during load" );
 ConVar fs_warning_mode( "fs_warning_mode", "0", 0, "0:Off, 1:Warn main thread, 2:Warn other threads"  );
 ConVar fs_monitor_read_from_pack( "fs_monitor_read_from_pack", "0", 0, "0:Off, 1:Any, 2:Sync only" );
+ConVar fs_mmap_packfiles( "fs_mmap_packfiles", "0", 0, "Memory map pack files as they get added. 0:Off, 1:Map (.bsp) packs, 2:All packs" );
+
+#ifdef _LINUX
+static void PrintDirIndexStats( const DirIndexStats_t &stats )
+{
+	Msg( "Directory index (%s): %d directories, %d lookups, %d scans, %d invalidations, %d stats avoided\n",
+		stats.m_bUsingInotify ? "inotify" : "mtime",
+		stats.m_nDirectories, stats.m_nLookups, stats.m_nDirScans, stats.m_nInvalidations, stats.m_nStatsAvoided );
+}
+
+CON_COMMAND( fs_dirindex_stats, "Prints the Linux case-insensitive directory index counters" )
+{
+	DirIndexStats_t stats;
+	DirIndex_GetStats( stats );
+	PrintDirIndexStats( stats );
+}
+
+CON_COMMAND( fs_dirindex_flush, "Drops the Linux case-insensitive directory index" )
+{
+	DirIndex_Flush();
+}
+
+//-----------------------------------------------------------------------------
+// Replays a file list (e.g. a reslist from -makereslists) through FileExists
+// once against an empty directory index and once against the warm one.
+//-----------------------------------------------------------------------------
+CON_COMMAND( fs_dirindex_bench, "fs_dirindex_bench <file list> [pathID]: compares level load lookups with a cold and a warm directory index" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: fs_dirindex_bench <file list> [pathID]\n" );
+		return;
+	}
+
+	const char *pPathID = ( args.ArgC() > 2 ) ? args[2] : "GAME";
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !BaseFileSystem()->ReadFile( args[1], NULL, buf, 0, 0 ) )
+	{
+		Msg( "fs_dirindex_bench: couldn't read %s\n", args[1] );
+		return;
+	}
+
+	CUtlVector< CUtlSymbol > fileNames;
+	CUtlSymbolTable fileNameTable( 0, 256, false );
+	characterset_t breakSet;
+	CharacterSetBuild( &breakSet, "" );
+	char szToken[MAX_PATH];
+	while ( buf.ParseToken( &breakSet, szToken, sizeof( szToken ) ) > 0 )
+	{
+		fileNames.AddToTail( fileNameTable.AddString( szToken ) );
+	}
+
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		if ( nPass == 0 )
+		{
+			DirIndex_Flush();
+		}
+		DirIndex_ClearStats();
+
+		int nFound = 0;
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < fileNames.Count(); i++ )
+		{
+			if ( BaseFileSystem()->FileExists( fileNameTable.String( fileNames[i] ), pPathID ) )
+			{
+				nFound++;
+			}
+		}
+		double flElapsed = Plat_FloatTime() - flStart;
+
+		Msg( "%s index: %d files (%d found) in %.2f ms\n", ( nPass == 0 ) ? "Cold" : "Warm", fileNames.Count(), nFound, flElapsed * 1000.0 );
+
+		DirIndexStats_t stats;
+		DirIndex_GetStats( stats );
+		PrintDirIndexStats( stats );
+	}
+}
+#endif
 
 #define BSPOUTPUT	0	// bsp output flag -- determines type of fs_log output to generate
 
@@ -300,8 +385,14 @@ CBaseFileSystem::CBaseFileSystem()
 
 	m_iMapLoad = 0;
 
+	m_MappedViews.SetLessFunc( DefLessFunc( const void * ) );
+
 	Q_memset( m_PreloadData, 0, sizeof( m_PreloadData ) );
 
+	m_bKeyValuesCacheLoaded = false;
+	m_bKeyValuesCacheEnabled = false;
+	m_bKeyValuesCacheDirty = false;
+
 	// allows very specifc constrained behavior
 	m_DVDMode = DVDMODE_OFF;
 	if ( IsX360() )
@@ -476,6 +567,7 @@ void CBaseFileSystem::Shutdown()
 #endif
 
 	UnloadCompiledKeyValues();
+	WriteKeyValuesCache();
 
 	RemoveAllSearchPaths();
 	Trace_DumpUnclosedFiles();
@@ -772,6 +864,11 @@ bool CBaseFileSystem::AddPackFileFromPath( const char *pPath, const char *pakfil
 		return false;
 	}
 
+	if ( ShouldMapPackFile( false ) )
+	{
+		pf->MapFile( fullpath );
+	}
+
 	// Add this pack file to the search path:
 	CSearchPath *sp = &m_SearchPaths[ m_SearchPaths.AddToTail() ];
 	pf->SetPath( sp->GetPath() );
@@ -837,6 +934,31 @@ int CPackFileHandle::Seek( int nOffset, int nWhence )
 //-----------------------------------------------------------------------------
 int CPackFile::ReadFromPack( int nIndex, void* buffer, int nDestBytes, int nBytes, int64 nOffset )
 {
+	if ( m_pMappedView )
+	{
+		// the mapping doesn't change while the pack is alive, no need to serialize
+		int64 nAvailable = m_nMappedOffset + m_nMappedSize - ( m_nBaseOffset + nOffset );
+		int nBytesRead = (int)clamp( (int64)nBytes, (int64)0, nAvailable );
+		if ( nDestBytes >= 0 )
+		{
+			nBytesRead = min( nBytesRead, nDestBytes );
+		}
+
+		const byte *pData = GetMappedData( m_nBaseOffset + nOffset, nBytesRead );
+		if ( !pData )
+			return 0;
+
+		if ( fs_monitor_read_from_pack.GetInt() == 1 )
+		{
+			char szName[MAX_PATH];
+			IndexToFilename( nIndex, szName, sizeof( szName ) );
+			Msg( "Read From Pack: Mapped: Requested:%7d, Offset:0x%16.16x, %s\n", nBytes, m_nBaseOffset + nOffset, szName );
+		}
+
+		V_memcpy( buffer, pData, nBytesRead );
+		return nBytesRead;
+	}
+
 	m_mutex.Lock();
 
 	if ( fs_monitor_read_from_pack.GetInt() == 1 || ( fs_monitor_read_from_pack.GetInt() == 2 && ThreadInMainThread() ) )
@@ -868,7 +990,7 @@ CFileHandle *CPackFile::OpenFile( const char *pFileName, const char *pOptions )
 	if ( FindFile( pFileName, nIndex, nPosition, nLength ) )
 	{
 		m_mutex.Lock();
-		if ( m_nOpenFiles == 0 && m_hPackFileHandle == NULL )
+		if ( m_nOpenFiles == 0 && m_hPackFileHandle == NULL && !m_pMappedView )
 		{
 			m_hPackFileHandle = m_fs->Trace_FOpen( m_ZipName, "rb", 0, NULL );
 		}
@@ -898,6 +1020,111 @@ CFileHandle *CPackFile::OpenFile( const char *pFileName, const char *pOptions )
 	return NULL;
 }
 
+//-----------------------------------------------------------------------------
+// Maps the pack's part of the file read only. Failing is fine, the pack just
+// keeps reading through its file handle.
+//-----------------------------------------------------------------------------
+bool CPackFile::MapFile( const char *pFullPath )
+{
+	if ( m_pMappedView )
+		return true;
+
+	if ( m_FileLength <= 0 )
+		return false;
+
+	int64 nStart = m_nBaseOffset;
+	int64 nEnd = m_nBaseOffset + m_FileLength;
+	void *pView = NULL;
+
+#if defined( _WIN32 ) && !defined( _X360 )
+	SYSTEM_INFO sysInfo;
+	GetSystemInfo( &sysInfo );
+	int64 nAlignedStart = nStart - ( nStart % sysInfo.dwAllocationGranularity );
+	if ( (int64)(SIZE_T)( nEnd - nAlignedStart ) != nEnd - nAlignedStart )
+		return false;
+
+	HANDLE hFile = CreateFile( pFullPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if ( hFile == INVALID_HANDLE_VALUE )
+		return false;
+
+	HANDLE hMapping = CreateFileMapping( hFile, NULL, PAGE_READONLY, 0, 0, NULL );
+	if ( hMapping )
+	{
+		pView = MapViewOfFile( hMapping, FILE_MAP_READ, (DWORD)( nAlignedStart >> 32 ), (DWORD)( nAlignedStart & 0xFFFFFFFF ), (SIZE_T)( nEnd - nAlignedStart ) );
+	}
+
+	if ( !pView )
+	{
+		if ( hMapping )
+		{
+			CloseHandle( hMapping );
+		}
+		CloseHandle( hFile );
+		Warning( "Couldn't memory map pack file %s\n", pFullPath );
+		return false;
+	}
+
+	m_hMappedFile = hFile;
+	m_hMapping = hMapping;
+#elif defined( _LINUX )
+	int64 nPageSize = sysconf( _SC_PAGESIZE );
+	int64 nAlignedStart = nStart - ( nStart % nPageSize );
+	if ( (int64)(size_t)( nEnd - nAlignedStart ) != nEnd - nAlignedStart )
+		return false;
+
+	int fd = open( pFullPath, O_RDONLY );
+	if ( fd < 0 )
+		return false;
+
+	// the mapping holds its own reference to the file
+	pView = mmap( NULL, (size_t)( nEnd - nAlignedStart ), PROT_READ, MAP_SHARED, fd, (off_t)nAlignedStart );
+	close( fd );
+
+	if ( pView == MAP_FAILED )
+	{
+		Warning( "Couldn't memory map pack file %s\n", pFullPath );
+		return false;
+	}
+#else
+	return false;
+#endif
+
+	m_pMappedView = (const byte *)pView;
+	m_nMappedOffset = nAlignedStart;
+	m_nMappedSize = nEnd - nAlignedStart;
+
+	// reads don't need the handle anymore
+	m_mutex.Lock();
+	if ( m_nOpenFiles == 0 && m_hPackFileHandle )
+	{
+		m_fs->Trace_FClose( m_hPackFileHandle );
+		m_hPackFileHandle = NULL;
+	}
+	m_mutex.Unlock();
+
+	return true;
+}
+
+void CPackFile::UnmapFile()
+{
+	if ( !m_pMappedView )
+		return;
+
+#if defined( _WIN32 ) && !defined( _X360 )
+	UnmapViewOfFile( m_pMappedView );
+	CloseHandle( m_hMapping );
+	CloseHandle( m_hMappedFile );
+	m_hMapping = NULL;
+	m_hMappedFile = INVALID_HANDLE_VALUE;
+#elif defined( _LINUX )
+	munmap( (void *)m_pMappedView, (size_t)m_nMappedSize );
+#endif
+
+	m_pMappedView = NULL;
+	m_nMappedOffset = 0;
+	m_nMappedSize = 0;
+}
+
 //-----------------------------------------------------------------------------
 //	Get a directory entry from a pack's preload section
 //-----------------------------------------------------------------------------
@@ -1438,6 +1665,11 @@ void CBaseFileSystem::AddPackFiles( const char *pPath, const CUtlSymbol &pathID,
 			if ( pf->Prepare( pakSizes[i] ) )
 			{
 				FS_setbufsize( pf->m_hPackFileHandle, filesystem_buffer_size.GetInt() );
+
+				if ( ShouldMapPackFile( false ) )
+				{
+					pf->MapFile( fullpath );
+				}
 			}
 			else
 			{
@@ -1589,6 +1821,11 @@ void CBaseFileSystem::AddMapPackFile( const char *pPath, const char *pPathID, Se
 		Trace_FClose( pf->m_hPackFileHandle );
 		pf->m_hPackFileHandle = NULL;
 
+		if ( ShouldMapPackFile( true ) )
+		{
+			pf->MapFile( fullpath );
+		}
+
 		m_ZipFiles.AddToTail( pf );
 	}
 	else
@@ -1612,7 +1849,7 @@ void CBaseFileSystem::BeginMapAccess()
 			{
 				pPackFile->AddRef();
 				pPackFile->m_mutex.Lock();
-				if ( pPackFile->m_nOpenFiles == 0 && pPackFile->m_hPackFileHandle == NULL )
+				if ( pPackFile->m_nOpenFiles == 0 && pPackFile->m_hPackFileHandle == NULL && !pPackFile->IsMapped() )
 				{
 					pPackFile->m_hPackFileHandle = Trace_FOpen( pPackFile->m_ZipName, "rb", 0, NULL );
 				}
@@ -2286,6 +2523,261 @@ int CBaseFileSystem::ReadFileEx( const char *pFileName, const char *pPath, void
 	return nBytesRead;
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Is fs_mmap_packfiles (or -fs_mmap_packfiles) asking for this kind of pack to be mapped
+//-----------------------------------------------------------------------------
+bool CBaseFileSystem::ShouldMapPackFile( bool bIsMapPath )
+{
+	if ( IsX360() )
+		return false;
+
+	int nMode = CommandLine()->ParmValue( "-fs_mmap_packfiles", fs_mmap_packfiles.GetInt() );
+	return ( nMode >= 2 ) || ( nMode == 1 && bIsMapPath );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Hands out a pointer into the pack mapping for part of an open file.
+//			The view keeps the pack (and so the mapping) alive until released.
+//-----------------------------------------------------------------------------
+const void *CBaseFileSystem::AcquireMappedView( FileHandle_t hFile, int nOffset, int nBytes )
+{
+	CFileHandle *fh = (CFileHandle *)hFile;
+	if ( !fh || !fh->m_pPackFileHandle || nOffset < 0 || nBytes <= 0 )
+		return NULL;
+
+	CPackFileHandle *ph = fh->m_pPackFileHandle;
+	const void *pView = ph->GetMappedData( nOffset, nBytes );
+	if ( !pView )
+		return NULL;
+
+	CPackFile *pPackFile = ph->GetOwner();
+	pPackFile->AddRef();
+
+	AUTO_LOCK_FM( m_MappedViewsMutex );
+	unsigned short idx = m_MappedViews.Find( pView );
+	if ( !m_MappedViews.IsValidIndex( idx ) )
+	{
+		MappedView_t view;
+		view.m_pPackFile = pPackFile;
+		view.m_nRefCount = 0;
+		idx = m_MappedViews.Insert( pView, view );
+	}
+	m_MappedViews[idx].m_nRefCount++;
+
+	return pView;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads a file without promising a writable buffer, which lets files in
+//			memory mapped packs skip the copy entirely
+//-----------------------------------------------------------------------------
+int CBaseFileSystem::ReadFileReadOnly( const char *pFileName, const char *pPath, const void **ppBuf, int nMaxBytes, int nStartingByte )
+{
+	*ppBuf = NULL;
+
+	FileHandle_t fp = Open( pFileName, "rb", pPath );
+	if ( !fp )
+	{
+		return 0;
+	}
+
+	int nBytesToRead = max( Size( fp ) - nStartingByte, 0 );
+	if ( nMaxBytes > 0 )
+	{
+		nBytesToRead = min( nMaxBytes, nBytesToRead );
+	}
+
+	int nBytesRead = 0;
+	if ( nBytesToRead != 0 )
+	{
+		*ppBuf = AcquireMappedView( fp, nStartingByte, nBytesToRead );
+		if ( *ppBuf )
+		{
+			nBytesRead = nBytesToRead;
+		}
+		else
+		{
+			// loose file or unmapped pack, ReleaseReadOnlyBuffer() deletes it
+			byte *pBuf = new byte[nBytesToRead];
+			SetBufferSize( fp, 0 );
+			if ( nStartingByte != 0 )
+			{
+				Seek( fp, nStartingByte, FILESYSTEM_SEEK_HEAD );
+			}
+			nBytesRead = ReadEx( pBuf, nBytesToRead, nBytesToRead, fp );
+			*ppBuf = pBuf;
+		}
+	}
+
+	Close( fp );
+	return nBytesRead;
+}
+
+bool CBaseFileSystem::IsMappedView( const void *pBuf )
+{
+	AUTO_LOCK_FM( m_MappedViewsMutex );
+	return m_MappedViews.Find( pBuf ) != m_MappedViews.InvalidIndex();
+}
+
+void CBaseFileSystem::ReleaseReadOnlyBuffer( const void *pBuf )
+{
+	if ( !pBuf )
+		return;
+
+	CPackFile *pPackFile = NULL;
+	{
+		AUTO_LOCK_FM( m_MappedViewsMutex );
+		unsigned short idx = m_MappedViews.Find( pBuf );
+		if ( m_MappedViews.IsValidIndex( idx ) )
+		{
+			pPackFile = m_MappedViews[idx].m_pPackFile;
+			if ( --m_MappedViews[idx].m_nRefCount == 0 )
+			{
+				m_MappedViews.RemoveAt( idx );
+			}
+		}
+	}
+
+	if ( pPackFile )
+	{
+		pPackFile->Release();
+	}
+	else
+	{
+		delete [] (byte *)pBuf;
+	}
+}
+
+static void GetProcessMemory( int64 &nResident, int64 &nPrivate )
+{
+	nResident = nPrivate = 0;
+#if defined( IS_WINDOWS_PC )
+	PROCESS_MEMORY_COUNTERS_EX counters;
+	if ( GetProcessMemoryInfo( GetCurrentProcess(), (PROCESS_MEMORY_COUNTERS *)&counters, sizeof( counters ) ) )
+	{
+		nResident = counters.WorkingSetSize;
+		nPrivate = counters.PrivateUsage;
+	}
+#elif defined( _LINUX )
+	FILE *fp = fopen( "/proc/self/statm", "r" );
+	if ( fp )
+	{
+		long nSize, nRes, nShared;
+		if ( fscanf( fp, "%ld %ld %ld", &nSize, &nRes, &nShared ) == 3 )
+		{
+			int64 nPageSize = sysconf( _SC_PAGESIZE );
+			nResident = nRes * nPageSize;
+			// file backed pages (the mappings) are shared, the rest is anonymous memory
+			nPrivate = ( nRes - nShared ) * nPageSize;
+		}
+		fclose( fp );
+	}
+#endif
+}
+
+//-----------------------------------------------------------------------------
+// Replays a file list (e.g. a map's reslist) once through ReadFileEx and once
+// through ReadFileReadOnly, holding on to everything like a level load would.
+//-----------------------------------------------------------------------------
+CON_COMMAND( fs_mmap_bench, "fs_mmap_bench <file list> [pathID]: compares copying reads with read only (memory mapped) reads" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: fs_mmap_bench <file list> [pathID]\n" );
+		return;
+	}
+
+	const char *pPathID = ( args.ArgC() > 2 ) ? args[2] : "GAME";
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !BaseFileSystem()->ReadFile( args[1], NULL, buf, 0, 0 ) )
+	{
+		Msg( "fs_mmap_bench: couldn't read %s\n", args[1] );
+		return;
+	}
+
+	CUtlVector< CUtlSymbol > fileNames;
+	CUtlSymbolTable fileNameTable( 0, 256, false );
+	characterset_t breakSet;
+	CharacterSetBuild( &breakSet, "" );
+	char szToken[MAX_PATH];
+	while ( buf.ParseToken( &breakSet, szToken, sizeof( szToken ) ) > 0 )
+	{
+		fileNames.AddToTail( fileNameTable.AddString( szToken ) );
+	}
+
+	CUtlVector< const void * > buffers;
+	buffers.EnsureCapacity( fileNames.Count() );
+
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		bool bReadOnly = ( nPass == 1 );
+
+		int64 nResidentBefore, nPrivateBefore;
+		GetProcessMemory( nResidentBefore, nPrivateBefore );
+
+		int64 nTotalBytes = 0;
+		int nFound = 0;
+		int nMapped = 0;
+		unsigned int nChecksum = 0;
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < fileNames.Count(); i++ )
+		{
+			const char *pFileName = fileNameTable.String( fileNames[i] );
+			const void *pData = NULL;
+			int nBytes;
+			if ( bReadOnly )
+			{
+				nBytes = BaseFileSystem()->ReadFileReadOnly( pFileName, pPathID, &pData );
+			}
+			else
+			{
+				nBytes = BaseFileSystem()->ReadFileEx( pFileName, pPathID, (void **)&pData, false, false );
+			}
+
+			if ( !pData )
+				continue;
+
+			// touch every page, the way a loader would
+			for ( int j = 0; j < nBytes; j += 4096 )
+			{
+				nChecksum += ((const byte *)pData)[j];
+			}
+
+			if ( bReadOnly && BaseFileSystem()->IsMappedView( pData ) )
+			{
+				nMapped++;
+			}
+
+			nTotalBytes += nBytes;
+			nFound++;
+			buffers.AddToTail( pData );
+		}
+		double flElapsed = Plat_FloatTime() - flStart;
+
+		int64 nResidentAfter, nPrivateAfter;
+		GetProcessMemory( nResidentAfter, nPrivateAfter );
+
+		Msg( "%s: %d files (%d found, %d mapped), %.1f MB in %.2f ms, resident +%.1f MB, private +%.1f MB (checksum %u)\n",
+			bReadOnly ? "ReadFileReadOnly" : "ReadFileEx",
+			fileNames.Count(), nFound, nMapped, nTotalBytes / ( 1024.0 * 1024.0 ), flElapsed * 1000.0,
+			( nResidentAfter - nResidentBefore ) / ( 1024.0 * 1024.0 ), ( nPrivateAfter - nPrivateBefore ) / ( 1024.0 * 1024.0 ), nChecksum );
+
+		for ( int i = 0; i < buffers.Count(); i++ )
+		{
+			if ( bReadOnly )
+			{
+				BaseFileSystem()->ReleaseReadOnlyBuffer( buffers[i] );
+			}
+			else
+			{
+				delete [] (byte *)buffers[i];
+			}
+		}
+		buffers.RemoveAll();
+	}
+}
+
 
 //-----------------------------------------------------------------------------
 // NOTE NOTE!! 
@@ -3071,18 +3563,24 @@ long CBaseFileSystem::FastFileTime( const CSearchPath *path, const char *pFileNa
 
 		Q_FixSlashes( pTmpFileName );
 
-		if( FS_stat( pTmpFileName, &buf ) != -1 )
-		{
-			return buf.st_mtime;
-		}
 #ifdef _LINUX
-		const char *realName = findFileInDirCaseInsensitive( pTmpFileName );
-		if ( realName && FS_stat( realName, &buf ) != -1 )
+		char pRealFileName[ MAX_FILEPATH ];
+		switch ( DirIndex_FindFile( pTmpFileName, pRealFileName, sizeof( pRealFileName ) ) )
 		{
-			free( (void *)realName );
-			return buf.st_size;
+		case DIRINDEX_MISSING:
+			return ( 0L );
+		case DIRINDEX_FOUND:
+			Q_strncpy( pTmpFileName, pRealFileName, sizeof( pTmpFileName ) );
+			break;
+		default:
+			break;
 		}
 #endif
+
+		if( FS_stat( pTmpFileName, &buf ) != -1 )
+		{
+			return buf.st_mtime;
+		}
 	}
 
 	return ( 0L );
@@ -3118,19 +3616,28 @@ int CBaseFileSystem::FastFindFile( const CSearchPath *path, const char *pFileNam
 
 		Q_FixSlashes( pTmpFileName );
 
+#ifdef _LINUX
+		// Most lookups miss in all but one search path; the directory index
+		// answers those without a stat and fixes up the case of the hits
+		char pRealFileName[ MAX_FILEPATH ];
+		switch ( DirIndex_FindFile( pTmpFileName, pRealFileName, sizeof( pRealFileName ) ) )
+		{
+		case DIRINDEX_MISSING:
+			return ( -1 );
+		case DIRINDEX_FOUND:
+			Q_strncpy( pTmpFileName, pRealFileName, sizeof( pTmpFileName ) );
+			break;
+		default:
+			break;
+		}
+#endif
+
 		if ( FS_stat( pTmpFileName, &buf ) != -1 )
 		{
 			LogAccessToFile( "stat", pTmpFileName, "" );
 
 			return buf.st_size;
 		}
-#ifdef _LINUX
-		const char *realName = findFileInDirCaseInsensitive( pTmpFileName );
-		if ( realName && FS_stat( realName, &buf ) != -1 )
-		{
-			return buf.st_size;
-		}
-#endif
 	}
 
 	return ( -1 );
@@ -3224,11 +3731,11 @@ bool CBaseFileSystem::LoadKeyValues( KeyValues& head, KeyValuesPreloadType_t typ
 	// FIXME:  THIS STUFF DOESN'T TRACK pPathID AT ALL RIGHT NOW!!!!!
 	if ( !m_PreloadData[ type ].m_pReader || !m_PreloadData[ type ].m_pReader->InstanceInPlace( head, filename ) )
 	{
-		bret = head.LoadFromFile( this, filename, pPathID );
+		bret = LoadKeyValuesCached( head, filename, pPathID );
 	}
 	return bret;
 #else
-	bret = head.LoadFromFile( this, filename, pPathID );
+	bret = LoadKeyValuesCached( head, filename, pPathID );
 	return bret;
 #endif
 }
@@ -3252,7 +3759,7 @@ KeyValues *CBaseFileSystem::LoadKeyValues( KeyValuesPreloadType_t type, char con
 		kv = new KeyValues( filename );
 		if ( kv )
 		{
-			kv->LoadFromFile( this, filename, pPathID );
+			LoadKeyValuesCached( *kv, filename, pPathID );
 		}
 	}
 	else
@@ -3265,7 +3772,7 @@ KeyValues *CBaseFileSystem::LoadKeyValues( KeyValuesPreloadType_t type, char con
 			kv = new KeyValues( filename );
 			if ( kv )
 			{
-				kv->LoadFromFile( this, filename, pPathID );
+				LoadKeyValuesCached( *kv, filename, pPathID );
 			}
 		}
 #endif
@@ -3273,6 +3780,344 @@ KeyValues *CBaseFileSystem::LoadKeyValues( KeyValuesPreloadType_t type, char con
 	return kv;
 }
 
+//-----------------------------------------------------------------------------
+// Compiled keyvalues cache. Parsed files are kept in KeyValues::WriteAsCompiled
+// form, keyed by path ID, file name and the full path the file resolved to, and
+// tagged with the file's time and size. The cache file is read in one go the
+// first time it's needed and written back after level loads and on shutdown
+// when something was added.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_CACHE_FILE		"kvcache.dat"
+#define KEYVALUES_CACHE_PATH		"DEFAULT_WRITE_PATH"
+#define KEYVALUES_CACHE_ID			(('C'<<24)|('F'<<16)|('V'<<8)|('K'))
+#define KEYVALUES_CACHE_VERSION		2
+
+struct KeyValuesCacheFileHeader_t
+{
+	int		m_nId;
+	int		m_nVersion;
+	int		m_nEntries;
+};
+
+// Each entry is the length of its key (padded to 4 bytes), the key, the file time,
+// the file size, the size of the compiled data and the compiled data (also padded
+// to 4 bytes).
+
+//-----------------------------------------------------------------------------
+// Purpose: Reads the cache file, throwing everything away if it doesn't check out
+//-----------------------------------------------------------------------------
+void CBaseFileSystem::ReadKeyValuesCache()
+{
+	m_bKeyValuesCacheLoaded = true;
+	m_bKeyValuesCacheEnabled = !IsX360() && !CommandLine()->FindParm( "-fs_nokvcache" );
+	if ( !m_bKeyValuesCacheEnabled )
+		return;
+
+	m_KeyValuesCacheData.Purge();
+	if ( !ReadFile( KEYVALUES_CACHE_FILE, KEYVALUES_CACHE_PATH, m_KeyValuesCacheData, 0, 0 ) )
+		return;
+
+	const byte *pBase = (const byte *)m_KeyValuesCacheData.Base();
+	int nSize = m_KeyValuesCacheData.TellPut();
+
+	const KeyValuesCacheFileHeader_t *pHeader = (const KeyValuesCacheFileHeader_t *)pBase;
+	bool bValid = ( nSize >= (int)sizeof( KeyValuesCacheFileHeader_t ) && pHeader->m_nId == KEYVALUES_CACHE_ID &&
+		pHeader->m_nVersion == KEYVALUES_CACHE_VERSION && pHeader->m_nEntries >= 0 );
+
+	int nOffset = sizeof( KeyValuesCacheFileHeader_t );
+	for ( int i = 0; bValid && i < pHeader->m_nEntries; i++ )
+	{
+		if ( nOffset + (int)sizeof( int ) > nSize )
+		{
+			bValid = false;
+			break;
+		}
+
+		int nKeyLength = *(const int *)( pBase + nOffset );
+		nOffset += sizeof( int );
+		if ( nKeyLength <= 0 || ( nKeyLength & 3 ) || nKeyLength > nSize - nOffset || pBase[nOffset + nKeyLength - 1] != 0 )
+		{
+			bValid = false;
+			break;
+		}
+
+		const char *pKey = (const char *)( pBase + nOffset );
+		nOffset += nKeyLength;
+		if ( nOffset + 3 * (int)sizeof( int ) > nSize )
+		{
+			bValid = false;
+			break;
+		}
+
+		KeyValuesCacheEntry_t entry;
+		entry.m_nFileTime = *(const int *)( pBase + nOffset );
+		entry.m_nFileSize = *(const int *)( pBase + nOffset + sizeof( int ) );
+		entry.m_nSize = *(const int *)( pBase + nOffset + 2 * sizeof( int ) );
+		entry.m_nOffset = nOffset + 3 * sizeof( int );
+		if ( entry.m_nSize <= 0 || entry.m_nSize > nSize - entry.m_nOffset )
+		{
+			bValid = false;
+			break;
+		}
+
+		// the compiled data itself is checked by ReadAsCompiled when it's used
+		m_KeyValuesCache.Insert( pKey, entry );
+		nOffset = entry.m_nOffset + ALIGN_VALUE( entry.m_nSize, 4 );
+	}
+
+	if ( !bValid )
+	{
+		Warning( FILESYSTEM_WARNING, "FS:  Ignoring bad compiled keyvalues cache %s\n", KEYVALUES_CACHE_FILE );
+		m_KeyValuesCache.Purge();
+		m_KeyValuesCacheData.Purge();
+		m_bKeyValuesCacheDirty = true;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes out the live entries if anything was added since the last write
+//-----------------------------------------------------------------------------
+void CBaseFileSystem::WriteKeyValuesCache()
+{
+	AUTO_LOCK_FM( m_KeyValuesCacheMutex );
+
+	if ( !m_bKeyValuesCacheDirty || !m_bKeyValuesCacheEnabled )
+		return;
+
+	CUtlBuffer buf;
+
+	KeyValuesCacheFileHeader_t header;
+	header.m_nId = KEYVALUES_CACHE_ID;
+	header.m_nVersion = KEYVALUES_CACHE_VERSION;
+	header.m_nEntries = m_KeyValuesCache.Count();
+	buf.Put( &header, sizeof( header ) );
+
+	const byte pad[4] = { 0, 0, 0, 0 };
+	for ( int i = m_KeyValuesCache.First(); i != m_KeyValuesCache.InvalidIndex(); i = m_KeyValuesCache.Next( i ) )
+	{
+		const char *pKey = m_KeyValuesCache.GetElementName( i );
+		const KeyValuesCacheEntry_t &entry = m_KeyValuesCache[i];
+
+		int nKeyLength = Q_strlen( pKey ) + 1;
+		buf.PutInt( ALIGN_VALUE( nKeyLength, 4 ) );
+		buf.Put( pKey, nKeyLength );
+		buf.Put( pad, ALIGN_VALUE( nKeyLength, 4 ) - nKeyLength );
+
+		buf.PutInt( (int)entry.m_nFileTime );
+		buf.PutInt( (int)entry.m_nFileSize );
+		buf.PutInt( entry.m_nSize );
+		buf.Put( (const byte *)m_KeyValuesCacheData.Base() + entry.m_nOffset, entry.m_nSize );
+		buf.Put( pad, ALIGN_VALUE( entry.m_nSize, 4 ) - entry.m_nSize );
+	}
+
+	if ( WriteFile( KEYVALUES_CACHE_FILE, KEYVALUES_CACHE_PATH, buf ) )
+	{
+		m_bKeyValuesCacheDirty = false;
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Loads a keyvalues file, out of the compiled keyvalues cache if the file
+//			hasn't changed since it was compiled. Anything else is parsed as text and
+//			compiled into the cache for next time.
+// Input  : head - 
+//			*filename - 
+//			*pPathID - 
+//			*pbFromCache - optional, set if the cache was used
+// Output : Returns true on success, false on failure.
+//-----------------------------------------------------------------------------
+bool CBaseFileSystem::LoadKeyValuesCached( KeyValues& head, char const *filename, char const *pPathID, bool *pbFromCache )
+{
+	if ( pbFromCache )
+	{
+		*pbFromCache = false;
+	}
+
+	{
+		AUTO_LOCK_FM( m_KeyValuesCacheMutex );
+		if ( !m_bKeyValuesCacheLoaded )
+		{
+			ReadKeyValuesCache();
+		}
+	}
+
+	// Under a whitelist the file has to be opened for real so the file tracker sees it
+	bool bUseCache = m_bKeyValuesCacheEnabled;
+	CWhitelistSpecs *pWhitelist = bUseCache ? m_FileWhitelist.AddRef() : NULL;
+	if ( pWhitelist )
+	{
+		m_FileWhitelist.ReleaseRef( pWhitelist );
+		bUseCache = false;
+	}
+
+	// The same name can resolve to a different file when the search paths change, and
+	// the time alone can miss a file that was replaced by an older copy
+	char fullPath[ MAX_PATH ];
+	long nFileTime = bUseCache ? GetFileTime( filename, pPathID ) : 0L;
+	if ( !nFileTime || !RelativePathToFullPath( filename, pPathID, fullPath, sizeof( fullPath ) ) )
+	{
+		return head.LoadFromFile( this, filename, pPathID );
+	}
+	unsigned int nFileSize = Size( filename, pPathID );
+
+	char key[ MAX_PATH * 3 ];
+	Q_snprintf( key, sizeof( key ), "%s:%s:%s", pPathID ? pPathID : "", filename, fullPath );
+	Q_FixSlashes( key );
+
+	{
+		AUTO_LOCK_FM( m_KeyValuesCacheMutex );
+		int i = m_KeyValuesCache.Find( key );
+		if ( i != m_KeyValuesCache.InvalidIndex() && m_KeyValuesCache[i].m_nFileTime == nFileTime && m_KeyValuesCache[i].m_nFileSize == nFileSize )
+		{
+			const KeyValuesCacheEntry_t &entry = m_KeyValuesCache[i];
+			if ( head.ReadAsCompiled( (const byte *)m_KeyValuesCacheData.Base() + entry.m_nOffset, entry.m_nSize ) )
+			{
+				if ( pbFromCache )
+				{
+					*pbFromCache = true;
+				}
+				return true;
+			}
+		}
+	}
+
+	// Same as KeyValues::LoadFromFile, but keeping hold of the text to look for other files
+	void *pBuffer = NULL;
+	ReadFileEx( filename, pPathID, &pBuffer, true, true );
+	if ( !pBuffer )
+		return false;
+
+	// Only this file's time is checked, so anything pulling in other files can't be cached
+	bool bCompile = !Q_stristr( (const char *)pBuffer, "#include" ) && !Q_stristr( (const char *)pBuffer, "#base" );
+	bool bRetOK = head.LoadFromBuffer( filename, (const char *)pBuffer, this );
+	FreeOptimalReadBuffer( pBuffer );
+
+	CUtlBuffer compiled;
+	if ( bRetOK && bCompile && head.WriteAsCompiled( compiled ) )
+	{
+		AUTO_LOCK_FM( m_KeyValuesCacheMutex );
+
+		KeyValuesCacheEntry_t entry;
+		entry.m_nFileTime = nFileTime;
+		entry.m_nFileSize = nFileSize;
+		entry.m_nOffset = m_KeyValuesCacheData.TellPut();
+		entry.m_nSize = compiled.TellPut();
+
+		// keep every entry 4 byte aligned, like in the file
+		m_KeyValuesCacheData.Put( compiled.Base(), compiled.TellPut() );
+		while ( m_KeyValuesCacheData.TellPut() & 3 )
+		{
+			m_KeyValuesCacheData.PutUnsignedChar( 0 );
+		}
+
+		int i = m_KeyValuesCache.Find( key );
+		if ( i == m_KeyValuesCache.InvalidIndex() )
+		{
+			m_KeyValuesCache.Insert( key, entry );
+		}
+		else
+		{
+			m_KeyValuesCache[i] = entry;
+		}
+		m_bKeyValuesCacheDirty = true;
+	}
+
+	return bRetOK;
+}
+
+//-----------------------------------------------------------------------------
+// Replays a file list (e.g. the sound scripts from game_sounds_manifest.txt)
+// once through the text parser and once through the compiled keyvalues cache,
+// holding on to every tree like startup would.
+//-----------------------------------------------------------------------------
+CON_COMMAND( fs_kvcache_bench, "fs_kvcache_bench <file list> [pathID]: compares parsing keyvalues files with loading them from the compiled cache" )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: fs_kvcache_bench <file list> [pathID]\n" );
+		return;
+	}
+
+	const char *pPathID = ( args.ArgC() > 2 ) ? args[2] : "GAME";
+
+	CUtlBuffer buf( 0, 0, CUtlBuffer::TEXT_BUFFER );
+	if ( !BaseFileSystem()->ReadFile( args[1], NULL, buf, 0, 0 ) )
+	{
+		Msg( "fs_kvcache_bench: couldn't read %s\n", args[1] );
+		return;
+	}
+
+	CUtlVector< CUtlSymbol > fileNames;
+	CUtlSymbolTable fileNameTable( 0, 256, false );
+	characterset_t breakSet;
+	CharacterSetBuild( &breakSet, "" );
+	char szToken[MAX_PATH];
+	while ( buf.ParseToken( &breakSet, szToken, sizeof( szToken ) ) > 0 )
+	{
+		fileNames.AddToTail( fileNameTable.AddString( szToken ) );
+	}
+
+	// Compile anything that isn't cached yet so the timed pass only sees hits
+	for ( int i = 0; i < fileNames.Count(); i++ )
+	{
+		const char *pFileName = fileNameTable.String( fileNames[i] );
+		KeyValues *kv = new KeyValues( pFileName );
+		BaseFileSystem()->LoadKeyValuesCached( *kv, pFileName, pPathID );
+		kv->deleteThis();
+	}
+
+	CUtlVector< KeyValues * > trees;
+	trees.EnsureCapacity( fileNames.Count() );
+
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		bool bCompiled = ( nPass == 1 );
+
+		int nLoaded = 0;
+		int nFromCache = 0;
+		double flStart = Plat_FloatTime();
+		for ( int i = 0; i < fileNames.Count(); i++ )
+		{
+			const char *pFileName = fileNameTable.String( fileNames[i] );
+			KeyValues *kv = new KeyValues( pFileName );
+
+			bool bFromCache = false;
+			bool bLoaded;
+			if ( bCompiled )
+			{
+				bLoaded = BaseFileSystem()->LoadKeyValuesCached( *kv, pFileName, pPathID, &bFromCache );
+			}
+			else
+			{
+				bLoaded = kv->LoadFromFile( BaseFileSystem(), pFileName, pPathID );
+			}
+
+			nLoaded += bLoaded ? 1 : 0;
+			nFromCache += bFromCache ? 1 : 0;
+			trees.AddToTail( kv );
+		}
+		double flLoad = Plat_FloatTime() - flStart;
+
+		int nBlocks = 0;
+		for ( int i = 0; i < trees.Count(); i++ )
+		{
+			nBlocks += trees[i]->GetAllocationCount();
+		}
+
+		flStart = Plat_FloatTime();
+		for ( int i = 0; i < trees.Count(); i++ )
+		{
+			trees[i]->deleteThis();
+		}
+		double flFree = Plat_FloatTime() - flStart;
+		trees.RemoveAll();
+
+		Msg( "%s: %d files (%d loaded, %d from cache) in %.2f ms, %d heap blocks held, freed in %.2f ms\n",
+			bCompiled ? "Compiled cache" : "Text", fileNames.Count(), nLoaded, nFromCache,
+			flLoad * 1000.0, nBlocks, flFree * 1000.0 );
+	}
+}
+
 //-----------------------------------------------------------------------------
 // Purpose: This is the fallback method of reading the name of the first key in the file
 // Input  : *filename - 
@@ -3416,6 +4261,9 @@ void CBaseFileSystem::DiscardPreloadData()
 	}
 
 	UnloadCompiledKeyValues();
+
+	// level load is over, save whatever it compiled
+	WriteKeyValuesCache();
 }
 
 //-----------------------------------------------------------------------------
@@ -55,8 +55,10 @@
 #include "tier1/utllinkedlist.h"
 #include "tier1/utlstring.h"
 #include "tier1/UtlSortVector.h"
+#include "tier1/utlmap.h"
 #include "bspfile.h"
 #include "tier1/utldict.h"
+#include "tier1/utlbuffer.h"
 #include "tier1/tier1.h"
 #include "byteswap.h"
 #include "threadsaferefcountedobject.h"
@@ -189,6 +191,10 @@ public:
 	inline int		GetSectorSize();
 	inline int64	AbsoluteBaseOffset();
 
+	// Pointer to nBytes at nOffset into the file if the pack is memory mapped, otherwise NULL
+	inline const void *GetMappedData( unsigned int nOffset, int nBytes );
+	CPackFile		*GetOwner() { return m_pOwner; }
+
 protected:
 	int64			m_nBase;			// Base offset of the file inside the pack file.
 	unsigned int	m_nFilePointer;		// Current seek pointer (0 based from the beginning of the file).
@@ -225,6 +231,14 @@ public:
 	virtual void DiscardPreloadData() {}
 	virtual int64 GetPackFileBaseOffset() = 0;
 
+	// Optional read only mapping of the pack's part of the file. Once mapped, reads
+	// are served out of the mapping and the pack doesn't need a file handle.
+	bool MapFile( const char *pFullPath );
+	void UnmapFile();
+	bool IsMapped() const { return m_pMappedView != NULL; }
+	// nOffset is absolute in the file on disk, like the offsets ReadFromPack seeks to
+	inline const byte *GetMappedData( int64 nOffset, int nBytes );
+
 	// Note: threading model for pack files assumes that data
 	// is segmented into pack files that aggregate files
 	// meant to be read in one thread. Performance characteristics
@@ -253,6 +267,14 @@ protected:
 	int64				m_FileLength;
 	CBaseFileSystem		*m_fs;
 
+	const byte			*m_pMappedView;		// starts at file offset m_nMappedOffset
+	int64				m_nMappedOffset;
+	int64				m_nMappedSize;
+#ifdef _WIN32
+	HANDLE				m_hMappedFile;
+	HANDLE				m_hMapping;
+#endif
+
 	friend class		CPackFileHandle;
 };
 
@@ -485,6 +507,10 @@ public:
 	virtual void				SetWhitelistSpewFlags( int flags );
 	virtual void				InstallDirtyDiskReportFunc( FSDirtyDiskReportFunc_t func );
 
+	virtual int					ReadFileReadOnly( const char *pFileName, const char *pPath, const void **ppBuf, int nMaxBytes = 0, int nStartingByte = 0 );
+	virtual void				ReleaseReadOnlyBuffer( const void *pBuf );
+	bool						IsMappedView( const void *pBuf );
+
 	// Returns the file system statistics retreived by the implementation.  Returns NULL if not supported.
 	virtual const FileSystemStatistics *GetFilesystemStatistics();
 	
@@ -552,6 +578,11 @@ public:
 	FSAsyncStatus_t				SyncGetFileSize( const FileAsyncRequest_t &request );
 	void						DoAsyncCallback( const FileAsyncRequest_t &request, void *pData, int nBytesRead, FSAsyncStatus_t result );
 
+	// Returns a pointer into the pack mapping for the given part of an open file, or NULL
+	// if it doesn't come from a mapped pack. Must be released with ReleaseReadOnlyBuffer().
+	const void					*AcquireMappedView( FileHandle_t hFile, int nOffset, int nBytes );
+	bool						ShouldMapPackFile( bool bIsMapPath );
+
 	void						SetupPreloadData();
 	void						DiscardPreloadData();
 
@@ -563,6 +594,9 @@ public:
 	virtual bool				LoadKeyValues( KeyValues& head, KeyValuesPreloadType_t type, char const *filename, char const *pPathID = 0 );
 	virtual bool				ExtractRootKeyName( KeyValuesPreloadType_t type, char *outbuf, size_t bufsize, char const *filename, char const *pPathID = 0 );
 
+	// Regular KeyValues loading, served out of the compiled keyvalues cache when the file's time matches
+	bool						LoadKeyValuesCached( KeyValues& head, char const *filename, char const *pPathID, bool *pbFromCache = NULL );
+
 	virtual DVDMode_t			GetDVDMode() { return m_DVDMode; }
 
 	FSDirtyDiskReportFunc_t		GetDirtyDiskReportFunc() { return m_DirtyDiskReportFunc; }
@@ -770,6 +804,15 @@ public:
 	// Global list of pack file handles
 	CUtlVector<CPackFile *> m_ZipFiles;
 
+	// Read only views handed out of mapped packs, each holds a reference on its pack
+	struct MappedView_t
+	{
+		CPackFile	*m_pPackFile;
+		int			m_nRefCount;
+	};
+	CThreadFastMutex m_MappedViewsMutex;
+	CUtlMap< const void *, MappedView_t > m_MappedViews;
+
 	FILE *m_pLogFile;
 	bool m_bOutputDebugString;
 
@@ -904,6 +947,8 @@ protected:
 	void LogFileAccess( const char *pFullFileName );
 	bool LookupKeyValuesRootKeyName( char const *filename, char const *pPathID, char *rootName, size_t bufsize );
 	void UnloadCompiledKeyValues();
+	void ReadKeyValuesCache();
+	void WriteKeyValuesCache();
 
 	// If bByRequestOnly is -1, then it will default to false if it doesn't already exist, and it 
 	// won't change it if it does already exist. Otherwise, it will be set to the value of bByRequestOnly.
@@ -931,6 +976,22 @@ protected:
 
 	CompiledKeyValuesPreloaders_t	m_PreloadData[ NUM_PRELOAD_TYPES ];
 
+	// Compiled keyvalues cache, see LoadKeyValuesCached. The whole cache file is read into
+	// m_KeyValuesCacheData and newly compiled files are appended to it.
+	struct KeyValuesCacheEntry_t
+	{
+		long	m_nFileTime;
+		unsigned int m_nFileSize;
+		int		m_nOffset;
+		int		m_nSize;
+	};
+	CThreadFastMutex				m_KeyValuesCacheMutex;
+	CUtlDict< KeyValuesCacheEntry_t, int >	m_KeyValuesCache;
+	CUtlBuffer						m_KeyValuesCacheData;
+	bool							m_bKeyValuesCacheLoaded;
+	bool							m_bKeyValuesCacheEnabled;
+	bool							m_bKeyValuesCacheDirty;
+
 	static CUtlSymbol			m_GamePathID;
 	static CUtlSymbol			m_BSPPathID;
 
@@ -1050,7 +1111,10 @@ inline CPackFileHandle::~CPackFileHandle()
 
 inline void CPackFileHandle::SetBufferSize( int nBytes ) 
 {
-	m_pOwner->m_fs->FS_setbufsize( m_pOwner->m_hPackFileHandle, nBytes );
+	if ( m_pOwner->m_hPackFileHandle )
+	{
+		m_pOwner->m_fs->FS_setbufsize( m_pOwner->m_hPackFileHandle, nBytes );
+	}
 }
 
 inline int CPackFileHandle::GetSectorSize() 
@@ -1063,6 +1127,14 @@ inline int64 CPackFileHandle::AbsoluteBaseOffset()
 	return m_pOwner->GetPackFileBaseOffset() + m_nBase;
 }
 
+inline const void *CPackFileHandle::GetMappedData( unsigned int nOffset, int nBytes )
+{
+	if ( nBytes < 0 || nOffset > m_nLength || nBytes > (int)( m_nLength - nOffset ) )
+		return NULL;
+
+	return m_pOwner->GetMappedData( m_nBase + nOffset, nBytes );
+}
+
 // Pack file implementation:
 inline CPackFile::CPackFile()
 {
@@ -1074,6 +1146,13 @@ inline CPackFile::CPackFile()
 	m_lPackFileTime = 0L;
 	m_refCount = 0;
 	m_nOpenFiles = 0;
+	m_pMappedView = NULL;
+	m_nMappedOffset = 0;
+	m_nMappedSize = 0;
+#ifdef _WIN32
+	m_hMappedFile = INVALID_HANDLE_VALUE;
+	m_hMapping = NULL;
+#endif
 }
 
 inline CPackFile::~CPackFile()
@@ -1089,9 +1168,19 @@ inline CPackFile::~CPackFile()
 		m_hPackFileHandle = NULL;
 	}
 
+	UnmapFile();
+
 	m_fs->m_ZipFiles.FindAndRemove( this );
 }
 
+inline const byte *CPackFile::GetMappedData( int64 nOffset, int nBytes )
+{
+	if ( !m_pMappedView || nOffset < m_nMappedOffset || nOffset + nBytes > m_nMappedOffset + m_nMappedSize )
+		return NULL;
+
+	return m_pMappedView + ( nOffset - m_nMappedOffset );
+}
+
 
 inline int CPackFile::GetSectorSize()
 {
@@ -1099,6 +1188,11 @@ inline int CPackFile::GetSectorSize()
 	{
 		return m_fs->FS_GetSectorSize( m_hPackFileHandle );
 	}
+	else if ( m_pMappedView )
+	{
+		// reads are memcpys out of the mapping, no constraints
+		return 1;
+	}
 	else
 	{
 		return -1;
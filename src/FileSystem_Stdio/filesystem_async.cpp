@@ -1125,7 +1125,19 @@ FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
 			nBytesToRead = 0; // bad offset?
 		}
 
-		if ( request.pData )
+		// read only requests out of a memory mapped pack get pointed straight at the mapping
+		const void *pMappedView = NULL;
+		if ( !request.pData && !request.pfnAlloc && ( request.flags & FSASYNC_FLAGS_READONLY ) && !( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) )
+		{
+			pMappedView = AcquireMappedView( hFile, request.nOffset, nBytesToRead );
+		}
+
+		if ( pMappedView )
+		{
+			pDest = (void *)pMappedView;
+			nBytesBuffer = nBytesToRead;
+		}
+		else if ( request.pData )
 		{
 			// caller provided buffer
 			Assert( !( request.flags & FSASYNC_FLAGS_NULLTERMINATE ) );
@@ -1160,7 +1172,7 @@ FSAsyncStatus_t CBaseFileSystem::SyncRead( const FileAsyncRequest_t &request )
 		}
 
 		// perform the read operation
-		int nBytesRead = ReadEx( pDest, nBytesBuffer, nBytesToRead, hFile );
+		int nBytesRead = ( pMappedView ) ? nBytesToRead : ReadEx( pDest, nBytesBuffer, nBytesToRead, hFile );
 
 		if ( !pHeldFile )
 		{
@@ -1320,7 +1332,15 @@ void CBaseFileSystem::DoAsyncCallback( const FileAsyncRequest_t &request, void *
 	if ( pDataToFree  )
 	{
 		Assert( !request.pfnAlloc );
-		delete [] pDataToFree;
+		if ( request.flags & FSASYNC_FLAGS_READONLY )
+		{
+			// may be a view of a mapped pack
+			ReleaseReadOnlyBuffer( pDataToFree );
+		}
+		else
+		{
+			delete [] pDataToFree;
+		}
 	}
 }
 
@@ -687,6 +687,25 @@ CStdioFile *CStdioFile::FS_fopen( const char *filename, const char *options, int
 
 	// stop newline characters at end of filename
 	Assert(!strchr(filename, '\n') && !strchr(filename, '\r'));
+
+#if !defined _WIN32
+	// Reads go through the directory index first: a miss there means the file
+	// isn't on disk in any case, and a hit gives us the on-disk spelling
+	char realName[MAX_PATH];
+	if ( !strchr(options,'w') && !strchr(options,'+') && !strchr(options,'a') )
+	{
+		switch ( DirIndex_FindFile( filename, realName, sizeof( realName ) ) )
+		{
+		case DIRINDEX_MISSING:
+			return NULL;
+		case DIRINDEX_FOUND:
+			filename = realName;
+			break;
+		default:
+			break;
+		}
+	}
+#endif
 	
 	pFile = fopen(filename, options);
 	if (pFile && size)
@@ -7,20 +7,24 @@
 
 #include "linux_support.h"
 #include "tier1/strtools.h"
+#include "tier1/utldict.h"
+#include "tier1/utlmap.h"
+#include "tier0/threadtools.h"
+#include <sys/inotify.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 
 char selectBuf[PATH_MAX];
 
 
-int FileSelect(const struct dirent *ent)
+static int MatchFileMask(const char *mask, const char *name)
 {
-	const char *mask=selectBuf;
-	const char *name=ent->d_name;
-
 	//printf("Test:%s %s\n",mask,name);
 
 	if(!strcmp(name,".") || !strcmp(name,"..") ) return 0;
 
-	if(!strcmp(selectBuf,"*.*")) return 1;
+	if(!strcmp(mask,"*.*")) return 1;
 
 	while( *mask && *name )
 	{
@@ -68,6 +72,398 @@ int FileSelect(const struct dirent *ent)
 	return( !*mask && !*name ); // both of the strings are at the end
 }
 
+int FileSelect(const struct dirent *ent)
+{
+	return MatchFileMask( selectBuf, ent->d_name );
+}
+
+
+//-----------------------------------------------------------------------------
+// Case-insensitive directory index
+//-----------------------------------------------------------------------------
+#define DIRINDEX_WATCH_EVENTS	( IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF )
+
+struct DirIndexDir_t
+{
+	DirIndexDir_t() : m_Files( k_eDictCompareTypeCaseInsensitive ), m_nMTime( 0 ), m_nWatch( -1 ), m_bStale( true ), m_bMissing( false ) {}
+
+	CUtlDict< unsigned char, int > m_Files;	// on-disk name -> DT_DIR/DT_REG, looked up without case
+	time_t	m_nMTime;
+	int		m_nWatch;		// inotify watch, or -1 to validate with the directory mtime
+	bool	m_bStale;
+	bool	m_bMissing;		// couldn't be read; validated through the parent directory's entry
+};
+
+class CDirIndex
+{
+public:
+	CDirIndex();
+	~CDirIndex();
+
+	DirIndexResult_t FindFile( const char *pPath, char *pRealPath, int nRealPathSize );
+	int FindMatches( const char *pDirName, const char *pMask, struct dirent ***pppNameList );
+	void Flush();
+	void GetStats( DirIndexStats_t &stats );
+	void ClearStats();
+
+private:
+	DirIndexDir_t *FindDir( const char *pDirName, bool *pbMissing = NULL );
+	bool IsStillMissing( const char *pDirName );
+	bool ScanDir( const char *pDirName, int iDir );
+	void PollNotifications();
+
+	CThreadFastMutex m_Mutex;
+	CUtlDict< DirIndexDir_t *, int > m_Dirs;
+	CUtlMap< int, int > m_Watches;	// inotify watch -> m_Dirs index
+	int m_nNotifyFD;
+	DirIndexStats_t m_Stats;
+};
+
+static CDirIndex g_DirIndex;
+
+CDirIndex::CDirIndex() : m_Dirs( k_eDictCompareTypeCaseSensitive ), m_Watches( DefLessFunc( int ) )
+{
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+
+	m_nNotifyFD = inotify_init();
+	if ( m_nNotifyFD >= 0 )
+	{
+		fcntl( m_nNotifyFD, F_SETFL, fcntl( m_nNotifyFD, F_GETFL ) | O_NONBLOCK );
+		fcntl( m_nNotifyFD, F_SETFD, FD_CLOEXEC );
+	}
+}
+
+CDirIndex::~CDirIndex()
+{
+	Flush();
+	if ( m_nNotifyFD >= 0 )
+	{
+		close( m_nNotifyFD );
+	}
+}
+
+// Marks directories stale for every change inotify has seen since the last call
+void CDirIndex::PollNotifications()
+{
+	if ( m_nNotifyFD < 0 )
+		return;
+
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	for ( ;; )
+	{
+		int nBytes = read( m_nNotifyFD, buf, sizeof( buf ) );
+		if ( nBytes <= 0 )
+			break;
+
+		for ( char *p = buf; p < buf + nBytes; )
+		{
+			struct inotify_event *pEvent = (struct inotify_event *)p;
+			p += sizeof( struct inotify_event ) + pEvent->len;
+
+			if ( pEvent->mask & IN_Q_OVERFLOW )
+			{
+				// events were dropped, so any directory could have changed
+				for ( int i = m_Dirs.First(); i != m_Dirs.InvalidIndex(); i = m_Dirs.Next( i ) )
+				{
+					m_Dirs[i]->m_bStale = true;
+				}
+				m_Stats.m_nInvalidations++;
+				continue;
+			}
+
+			int iWatch = m_Watches.Find( pEvent->wd );
+			if ( iWatch == m_Watches.InvalidIndex() )
+				continue;
+
+			DirIndexDir_t *pDir = m_Dirs[ m_Watches[iWatch] ];
+			if ( !pDir->m_bStale )
+			{
+				pDir->m_bStale = true;
+				m_Stats.m_nInvalidations++;
+			}
+
+			if ( pEvent->mask & IN_IGNORED )
+			{
+				// the kernel dropped the watch (directory deleted or unmounted)
+				pDir->m_nWatch = -1;
+				m_Watches.RemoveAt( iWatch );
+			}
+		}
+	}
+}
+
+bool CDirIndex::ScanDir( const char *pDirName, int iDir )
+{
+	DirIndexDir_t *pDir = m_Dirs[iDir];
+
+	// Watch before reading so nothing that changes during the scan gets lost
+	if ( m_nNotifyFD >= 0 && pDir->m_nWatch < 0 )
+	{
+		int nWatch = inotify_add_watch( m_nNotifyFD, pDirName, DIRINDEX_WATCH_EVENTS );
+		if ( nWatch >= 0 )
+		{
+			// Two spellings of the same directory share one watch; the second one uses mtimes
+			int iWatch = m_Watches.Find( nWatch );
+			if ( iWatch == m_Watches.InvalidIndex() )
+			{
+				m_Watches.Insert( nWatch, iDir );
+				pDir->m_nWatch = nWatch;
+			}
+		}
+	}
+
+	struct stat dirStat;
+	DIR *pDirHandle = ( stat( pDirName, &dirStat ) == 0 ) ? opendir( pDirName ) : NULL;
+	if ( !pDirHandle )
+		return false;
+
+	m_Stats.m_nDirScans++;
+	pDir->m_Files.RemoveAll();
+
+	char pFullName[PATH_MAX];
+	struct dirent *pEnt;
+	while ( ( pEnt = readdir( pDirHandle ) ) != NULL )
+	{
+		if ( !strcmp( pEnt->d_name, "." ) || !strcmp( pEnt->d_name, ".." ) )
+			continue;
+
+		unsigned char nType = pEnt->d_type;
+		if ( nType != DT_DIR && nType != DT_REG )
+		{
+			// symlinks and filesystems without d_type need a stat to tell
+			struct stat fileStat;
+			Q_snprintf( pFullName, sizeof( pFullName ), "%s/%s", pDirName, pEnt->d_name );
+			nType = ( !stat( pFullName, &fileStat ) && S_ISDIR( fileStat.st_mode ) ) ? DT_DIR : DT_REG;
+		}
+
+		// if several names only differ in case, resolve to the first in sorted order like scandir did
+		int i = pDir->m_Files.Find( pEnt->d_name );
+		if ( i != pDir->m_Files.InvalidIndex() )
+		{
+			if ( strcmp( pEnt->d_name, pDir->m_Files.GetElementName( i ) ) >= 0 )
+				continue;
+			pDir->m_Files.RemoveAt( i );
+		}
+		pDir->m_Files.Insert( pEnt->d_name, nType );
+	}
+	closedir( pDirHandle );
+
+	// Without inotify the mtime is all we have. It only has a one second
+	// resolution, so a directory touched during this second stays stale.
+	pDir->m_nMTime = dirStat.st_mtime;
+	pDir->m_bStale = ( pDir->m_nWatch < 0 && dirStat.st_mtime >= time( NULL ) );
+	return true;
+}
+
+// A directory that couldn't be read stays missing for as long as its parent (which
+// is indexed and watched like any other) has no entry with exactly its name
+bool CDirIndex::IsStillMissing( const char *pDirName )
+{
+	const char *pSep = strrchr( pDirName, '/' );
+	if ( !pSep || !pSep[1] || pSep == pDirName )
+		return false;
+
+	char pParentName[PATH_MAX];
+	Q_strncpy( pParentName, pDirName, min( (int)( pSep - pDirName ) + 1, (int)sizeof( pParentName ) ) );
+
+	DirIndexDir_t *pParent = FindDir( pParentName );
+	if ( !pParent )
+		return true;
+
+	int i = pParent->m_Files.Find( pSep + 1 );
+	return ( i == pParent->m_Files.InvalidIndex() || strcmp( pParent->m_Files.GetElementName( i ), pSep + 1 ) );
+}
+
+DirIndexDir_t *CDirIndex::FindDir( const char *pDirName, bool *pbMissing )
+{
+	int iDir = m_Dirs.Find( pDirName );
+	if ( iDir != m_Dirs.InvalidIndex() )
+	{
+		DirIndexDir_t *pDir = m_Dirs[iDir];
+		if ( pDir->m_bMissing )
+		{
+			if ( IsStillMissing( pDirName ) )
+			{
+				m_Stats.m_nStatsAvoided++;
+				if ( pbMissing )
+				{
+					*pbMissing = true;
+				}
+				return NULL;
+			}
+		}
+		else if ( !pDir->m_bStale )
+		{
+			if ( pDir->m_nWatch >= 0 )
+				return pDir;
+
+			struct stat dirStat;
+			if ( stat( pDirName, &dirStat ) == 0 && dirStat.st_mtime == pDir->m_nMTime )
+				return pDir;
+
+			m_Stats.m_nInvalidations++;
+		}
+	}
+	else
+	{
+		iDir = m_Dirs.Insert( pDirName, new DirIndexDir_t );
+	}
+
+	DirIndexDir_t *pDir = m_Dirs[iDir];
+	if ( !ScanDir( pDirName, iDir ) )
+	{
+		// keep the entry so the next lookup only has to check the parent
+		if ( pDir->m_nWatch >= 0 )
+		{
+			inotify_rm_watch( m_nNotifyFD, pDir->m_nWatch );
+			m_Watches.Remove( pDir->m_nWatch );
+			pDir->m_nWatch = -1;
+		}
+		pDir->m_Files.RemoveAll();
+		pDir->m_bMissing = true;
+		if ( pbMissing )
+		{
+			// unreadable isn't the same as missing
+			*pbMissing = IsStillMissing( pDirName );
+		}
+		return NULL;
+	}
+
+	pDir->m_bMissing = false;
+	return pDir;
+}
+
+DirIndexResult_t CDirIndex::FindFile( const char *pPath, char *pRealPath, int nRealPathSize )
+{
+	const char *pSep = strrchr( pPath, '/' );
+	const char *pBackSep = strrchr( pPath, '\\' );
+	if ( pBackSep > pSep )
+	{
+		pSep = pBackSep;
+	}
+	if ( !pSep || !pSep[1] || pSep - pPath >= PATH_MAX )
+		return DIRINDEX_UNKNOWN;
+
+	char pDirName[PATH_MAX];
+	int nDirLen = pSep - pPath;
+	if ( nDirLen == 0 )
+	{
+		// file in the root directory
+		nDirLen = 1;
+	}
+	memcpy( pDirName, pPath, nDirLen );
+	pDirName[nDirLen] = '\0';
+
+	AUTO_LOCK_FM( m_Mutex );
+	PollNotifications();
+	m_Stats.m_nLookups++;
+
+	bool bMissing = false;
+	DirIndexDir_t *pDir = FindDir( pDirName, &bMissing );
+	if ( !pDir )
+		return bMissing ? DIRINDEX_MISSING : DIRINDEX_UNKNOWN;
+
+	int i = pDir->m_Files.Find( pSep + 1 );
+	if ( i == pDir->m_Files.InvalidIndex() )
+	{
+		m_Stats.m_nStatsAvoided++;
+		return DIRINDEX_MISSING;
+	}
+
+	Q_snprintf( pRealPath, nRealPathSize, "%.*s/%s", (int)( pSep - pPath ), pPath, pDir->m_Files.GetElementName( i ) );
+	return DIRINDEX_FOUND;
+}
+
+// Same case-insensitive order the index looks names up in
+static int DirentCompare( const void *a, const void *b )
+{
+	return Q_stricmp( (*(struct dirent **)a)->d_name, (*(struct dirent **)b)->d_name );
+}
+
+// Same contract as scandir(), but served out of the index. The d_type of each
+// entry is always DT_DIR or DT_REG, so callers don't need to stat them.
+int CDirIndex::FindMatches( const char *pDirName, const char *pMask, struct dirent ***pppNameList )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	PollNotifications();
+	m_Stats.m_nLookups++;
+
+	DirIndexDir_t *pDir = FindDir( pDirName );
+	if ( !pDir )
+		return -1;
+
+	int nMatches = 0;
+	struct dirent **ppNameList = (struct dirent **)malloc( ( pDir->m_Files.Count() + 1 ) * sizeof( struct dirent * ) );
+	for ( int i = pDir->m_Files.First(); i != pDir->m_Files.InvalidIndex(); i = pDir->m_Files.Next( i ) )
+	{
+		const char *pName = pDir->m_Files.GetElementName( i );
+		if ( !MatchFileMask( pMask, pName ) )
+			continue;
+
+		struct dirent *pEnt = (struct dirent *)malloc( sizeof( struct dirent ) );
+		memset( pEnt, 0, sizeof( struct dirent ) );
+		Q_strncpy( pEnt->d_name, pName, sizeof( pEnt->d_name ) );
+		pEnt->d_type = pDir->m_Files[i];
+		ppNameList[nMatches++] = pEnt;
+	}
+	m_Stats.m_nStatsAvoided += nMatches;
+
+	qsort( ppNameList, nMatches, sizeof( struct dirent * ), DirentCompare );
+	*pppNameList = ppNameList;
+	return nMatches;
+}
+
+void CDirIndex::Flush()
+{
+	AUTO_LOCK_FM( m_Mutex );
+	for ( int i = m_Dirs.First(); i != m_Dirs.InvalidIndex(); i = m_Dirs.Next( i ) )
+	{
+		if ( m_Dirs[i]->m_nWatch >= 0 )
+		{
+			inotify_rm_watch( m_nNotifyFD, m_Dirs[i]->m_nWatch );
+		}
+	}
+	m_Dirs.PurgeAndDeleteElements();
+	m_Watches.RemoveAll();
+
+	// drop the IN_IGNORED events the removals just queued
+	PollNotifications();
+}
+
+void CDirIndex::GetStats( DirIndexStats_t &stats )
+{
+	AUTO_LOCK_FM( m_Mutex );
+	stats = m_Stats;
+	stats.m_nDirectories = m_Dirs.Count();
+	stats.m_bUsingInotify = ( m_nNotifyFD >= 0 );
+}
+
+void CDirIndex::ClearStats()
+{
+	AUTO_LOCK_FM( m_Mutex );
+	memset( &m_Stats, 0, sizeof( m_Stats ) );
+}
+
+DirIndexResult_t DirIndex_FindFile( const char *pPath, char *pRealPath, int nRealPathSize )
+{
+	return g_DirIndex.FindFile( pPath, pRealPath, nRealPathSize );
+}
+
+void DirIndex_Flush()
+{
+	g_DirIndex.Flush();
+}
+
+void DirIndex_GetStats( DirIndexStats_t &stats )
+{
+	g_DirIndex.GetStats( stats );
+}
+
+void DirIndex_ClearStats()
+{
+	g_DirIndex.ClearStats();
+}
+
 int FillDataStruct(FIND_DATA *dat)
 {
 	struct stat fileStat;
@@ -77,7 +473,16 @@ int FillDataStruct(FIND_DATA *dat)
 
 	Q_strncpy(dat->cFileName,dat->namelist[dat->numMatches]->d_name, sizeof( dat->cFileName ) );
 
-	if(!stat(dat->cFileName,&fileStat))
+	// entries from the directory index already know their type
+	if( dat->namelist[dat->numMatches]->d_type == DT_DIR )
+	{
+		dat->dwFileAttributes=S_IFDIR;
+	}
+	else if( dat->namelist[dat->numMatches]->d_type == DT_REG )
+	{
+		dat->dwFileAttributes=S_IFREG;
+	}
+	else if(!stat(dat->cFileName,&fileStat))
 	{
 		dat->dwFileAttributes=fileStat.st_mode;           
 	}
@@ -129,9 +534,12 @@ int FindFirstFile(char *fileName, FIND_DATA *dat)
 
 	if( strlen(dir)>0 )
 	{
-		Q_strncpy(selectBuf,fileName+strlen(dir)+1, sizeof( selectBuf ) );
-
-		n = scandir(dir, &dat->namelist, FileSelect, alphasort);
+		n = g_DirIndex.FindMatches(dir, fileName+strlen(dir)+1, &dat->namelist);
+		if (n < 0)
+		{
+			Q_strncpy(selectBuf,fileName+strlen(dir)+1, sizeof( selectBuf ) );
+			n = scandir(dir, &dat->namelist, FileSelect, alphasort);
+		}
            	if (n < 0)
 		{
 			// silently return, nothing interesting
@@ -172,56 +580,18 @@ bool FindClose(int handle)
 
 
 static char fileName[MAX_PATH];
-int CheckName(const struct dirent *dir)
-{
-	return !strcasecmp( dir->d_name, fileName );
-}
-
 
 const char *findFileInDirCaseInsensitive(const char *file)
 {
-
-	const char *dirSep = strrchr(file,'/');
-	if( !dirSep )
+	if( !strrchr(file,'/') && !strrchr(file,'\\') )
 	{
-		dirSep=strrchr(file,'\\');
-		if( !dirSep ) 
-		{
-			return NULL;
-		}
-	}
-
-	char *dirName = static_cast<char *>( alloca( ( dirSep - file ) +1 ) ); 
-	if( !dirName )
 		return NULL;
-
-	strncpy( dirName , file, dirSep - file );
-	dirName[ dirSep - file ] = '\0';
-
-	struct dirent **namelist;
-	int n;
-
-	strncpy( fileName, dirSep + 1, MAX_PATH );
-
-
-	n = scandir( dirName , &namelist, CheckName, alphasort );
-
-	if( n > 0 )
-	{
-		while( n > 1 )
-		{
-			free( namelist[n] ); // free the malloc'd strings
-			n--;
-		}
-
-		Q_snprintf( fileName, sizeof( fileName ), "%s/%s", dirName, namelist[0]->d_name );
-		free( namelist[0] );
-		return fileName;
 	}
-	else
+
+	if( DirIndex_FindFile( file, fileName, sizeof( fileName ) ) != DIRINDEX_FOUND )
 	{
 		Q_strncpy( fileName, file, sizeof(fileName) );
 		Q_strlower( fileName );
-		return fileName;
 	}
+	return fileName;
 }
@@ -39,4 +39,31 @@ bool FindNextFile(int handle, FIND_DATA *dat);
 bool FindClose(int handle);
 const char *findFileInDirCaseInsensitive(const char *file);
 
+//-----------------------------------------------------------------------------
+// Case-insensitive directory index. Each directory is scanned once, then kept
+// up to date through inotify (or the directory mtime when inotify isn't
+// available), so repeated misses don't have to hit the disk.
+//-----------------------------------------------------------------------------
+enum DirIndexResult_t
+{
+	DIRINDEX_UNKNOWN = 0,	// the directory couldn't be read, ask the OS
+	DIRINDEX_MISSING,		// the directory has no such file in any case
+	DIRINDEX_FOUND,			// pRealPath holds the path with the on-disk case
+};
+
+struct DirIndexStats_t
+{
+	int		m_nLookups;
+	int		m_nDirScans;
+	int		m_nStatsAvoided;
+	int		m_nInvalidations;
+	int		m_nDirectories;
+	bool	m_bUsingInotify;
+};
+
+DirIndexResult_t DirIndex_FindFile( const char *pPath, char *pRealPath, int nRealPathSize );
+void DirIndex_Flush();
+void DirIndex_GetStats( DirIndexStats_t &stats );
+void DirIndex_ClearStats();
+
 #endif // LINUX_SUPPORT_H
@@ -419,6 +419,11 @@ END_PARTICLE_OPERATOR_UNPACK( C_OP_PlanarConstraint )
 
 
 
+bool g_bParticleBatchedWorldCollide = true;
+
+// How long C_OP_WorldCollideConstraint keeps the plane set of a control point that isn't moving
+#define WORLD_COLLIDE_RETRACE_INTERVAL	0.1f
+
 void CWorldCollideContextData::CalculatePlanes( CParticleCollection *pParticles, int nCollisionMode,
 												int nCollisionGroup, Vector const *pCPOffset, float flDistanceTolerance )
 {
@@ -453,9 +458,25 @@ void CWorldCollideContextData::CalculatePlanes( CParticleCollection *pParticles,
 															  MASK_SOLID, NULL, nCollisionGroup, &tr );
 					if ( tr.fraction < 1.0 )
 					{
+						Vector vecPoint = RayStart+(tr.fraction*flRadius)*TraceDir;
+						float flDist = DotProduct( vecPoint, tr.plane.normal );
+
+						// rays into the same wall find the same plane; only keep it once
 						int n=m_nActivePlanes;
-						m_PointOnPlane[n].DuplicateVector( RayStart+(tr.fraction*flRadius)*TraceDir );
+						if ( g_bParticleBatchedWorldCollide )
+						{
+							for( n = 0; n < m_nActivePlanes; n++ )
+							{
+								if ( ( DotProduct( m_PlaneNormal[n].Vec( 0 ), tr.plane.normal ) > 0.9999f ) &&
+									 ( fabs( SubFloat( m_PlaneDist[n], 0 ) - flDist ) < 0.01f ) )
+									break;
+							}
+							if ( n < m_nActivePlanes )
+								continue;
+						}
+						m_PointOnPlane[n].DuplicateVector( vecPoint );
 						m_PlaneNormal[n].DuplicateVector( tr.plane.normal );
+						m_PlaneDist[n] = ReplicateX4( flDist );
 						m_nActivePlanes++;
 					}
 				}
@@ -486,6 +507,15 @@ class C_OP_WorldCollideConstraint : public CParticleOperatorInstance
 		return sizeof( CWorldCollideContextData );
 	}
 
+	void InitializeContextData( CParticleCollection *pParticles,
+								void *pContext ) const
+	{
+		CWorldCollideContextData *pCtx =
+			reinterpret_cast<CWorldCollideContextData *>( pContext );
+		pCtx->m_nActivePlanes = 0;
+		pCtx->m_flLastUpdateTime = -1.0;
+	}
+
 	bool EnforceConstraint( int nStartBlock,
 							int nEndBlock,
 							CParticleCollection *pParticles,
@@ -501,7 +531,23 @@ void C_OP_WorldCollideConstraint::SetupConstraintPerFrameData( CParticleCollecti
 {
 	CWorldCollideContextData *pCtx =
 		reinterpret_cast<CWorldCollideContextData *>( pContext );
-	pCtx->CalculatePlanes( pParticles, COLLISION_MODE_PER_FRAME_PLANESET, COLLISION_GROUP_NONE );
+	if ( !g_bParticleBatchedWorldCollide )
+	{
+		pCtx->CalculatePlanes( pParticles, COLLISION_MODE_PER_FRAME_PLANESET, COLLISION_GROUP_NONE );
+		return;
+	}
+
+	// The traces also hit doors, props and NPCs, so the plane set of a still control point
+	// only holds for a short while. No planes at all (say, traced before the map was in)
+	// is always traced again.
+	Vector vecControlPoint = pParticles->GetControlPointAtCurrentTime( 0 );
+	if ( ( pCtx->m_flLastUpdateTime <= 0. ) || !pCtx->m_nActivePlanes ||
+		 ( fabs( pParticles->m_flCurTime - pCtx->m_flLastUpdateTime ) >= WORLD_COLLIDE_RETRACE_INTERVAL ) ||
+		 ( ( vecControlPoint - pCtx->m_vecLastUpdateOrigin ).LengthSqr() >= Square( 0.01f ) ) )
+	{
+		pCtx->CalculatePlanes( pParticles, COLLISION_MODE_PER_FRAME_PLANESET, COLLISION_GROUP_NONE );
+		pCtx->m_flLastUpdateTime = max( pParticles->m_flCurTime, FLT_EPSILON );
+	}
 }
 
 bool C_OP_WorldCollideConstraint::EnforceConstraint( int nStartBlock,
@@ -518,6 +564,34 @@ bool C_OP_WorldCollideConstraint::EnforceConstraint( int nStartBlock,
 	CWorldCollideContextData *pCtx = 
 		reinterpret_cast<CWorldCollideContextData *>( pContext );
 
+	if ( !pCtx->m_nActivePlanes )
+		return false;
+
+	if ( g_bParticleBatchedWorldCollide )
+	{
+		// push each group of 4 particles out of every plane in turn, without branching
+		// on the result. pushes are accumulated into a mask tested once at the end.
+		fltx4 fl4AnyPushed = Four_Zeros;
+		do
+		{
+			FourVectors pts = *pXYZ;
+			for( int i=0; i < pCtx->m_nActivePlanes; i++ )
+			{
+				// where planeeq<0, inside
+				fltx4 PlaneEq = SubSIMD( pts * pCtx->m_PlaneNormal[i], AddSIMD( pCtx->m_PlaneDist[i], *pRadius ) );
+				fltx4 PenetrationDistance = MinSIMD( Four_Zeros, PlaneEq );
+				fl4AnyPushed = OrSIMD( fl4AnyPushed, CmpLtSIMD( PlaneEq, Four_Zeros ) );
+				pts.x = SubSIMD( pts.x, MulSIMD( pCtx->m_PlaneNormal[i].x, PenetrationDistance ) );
+				pts.y = SubSIMD( pts.y, MulSIMD( pCtx->m_PlaneNormal[i].y, PenetrationDistance ) );
+				pts.z = SubSIMD( pts.z, MulSIMD( pCtx->m_PlaneNormal[i].z, PenetrationDistance ) );
+			}
+			*pXYZ = pts;
+			++pXYZ;
+			++pRadius;
+		} while (--nNumBlocks);
+		return IsAnyNegative( fl4AnyPushed );
+	}
+
 	bool bChangedSomething = false;
 	do
 	{
@@ -21,9 +21,9 @@
 #if MEASURE_PARTICLE_PERF
 
 #if VPROF_LEVEL > 0
-#define START_OP float flOpStartTime = Plat_FloatTime(); VPROF_ENTER_SCOPE(pOp->GetDefinition()->GetName())
+#define START_OP double flOpStartTime = Plat_FloatTime(); VPROF_ENTER_SCOPE(pOp->GetDefinition()->GetName())
 #else
-#define START_OP float flOpStartTime = Plat_FloatTime();
+#define START_OP double flOpStartTime = Plat_FloatTime();
 #endif
 
 #if VPROF_LEVEL > 0
@@ -199,9 +199,12 @@ void C_OP_BasicMovement::Operate( CParticleCollection *pParticles, float flStren
 			bFinalConstraint[i] = pParticles->m_pDef->m_Constraints[i]->IsFinalConstaint();
 
 			bConstraintSatisfied[i] = false;
-			pParticles->m_pDef->m_Constraints[i]->SetupConstraintPerFrameData(
+			CParticleOperatorInstance *pOp = pParticles->m_pDef->m_Constraints[i];
+			START_OP;
+			pOp->SetupConstraintPerFrameData(
 				pParticles, pParticles->m_pOperatorContextData + 
 				pParticles->m_pDef->m_nConstraintsCtxOffsets[i] );
+			END_OP;
 		}
 
 		// constraints get to see their own per psystem per op random #s
@@ -0,0 +1,259 @@
+//===== Copyright  1996-2006, Valve Corporation, All rights reserved. ======//
+//
+// Purpose: headless particle simulation benchmark
+//
+//===========================================================================//
+
+#include "tier0/platform.h"
+#include "particles/particles.h"
+#include "bspflags.h"
+#include "trace.h"
+#include "vstdlib/jobthread.h"
+#include "particles_internal.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+
+//-----------------------------------------------------------------------------
+//
+// Stand-in collision world: a closed box room around the origin, so systems
+// with world collision operators have something to hit without a map loaded
+//
+//-----------------------------------------------------------------------------
+#define BENCHMARK_ROOM_HALF_WIDTH		256.0f
+#define BENCHMARK_ROOM_HEIGHT			256.0f
+
+class CBenchmarkParticleSystemQuery : public CBaseAppSystem< IParticleSystemQuery >
+{
+public:
+	virtual void GetLightingAtPoint( const Vector& vecOrigin, Color &tint )
+	{
+		tint.SetColor( 255, 255, 255, 255 );
+	}
+	virtual void TraceLine( const Vector& vecAbsStart,
+							const Vector& vecAbsEnd, unsigned int mask, 
+							const class IHandleEntity *ignore,
+							int collisionGroup, CBaseTrace *ptr );
+};
+
+void CBenchmarkParticleSystemQuery::TraceLine( const Vector& vecAbsStart,
+											   const Vector& vecAbsEnd, unsigned int mask, 
+											   const class IHandleEntity *ignore,
+											   int collisionGroup, CBaseTrace *ptr )
+{
+	static const Vector s_vecRoomMins( -BENCHMARK_ROOM_HALF_WIDTH, -BENCHMARK_ROOM_HALF_WIDTH, 0.0f );
+	static const Vector s_vecRoomMaxs( BENCHMARK_ROOM_HALF_WIDTH, BENCHMARK_ROOM_HALF_WIDTH, BENCHMARK_ROOM_HEIGHT );
+
+	ptr->startpos = vecAbsStart;
+	ptr->endpos = vecAbsEnd;
+	ptr->plane.normal.Init();
+	ptr->plane.dist = 0.0f;
+	ptr->plane.type = 0;
+	ptr->plane.signbits = 0;
+	ptr->fraction = 1.0f;
+	ptr->contents = 0;
+	ptr->dispFlags = 0;
+	ptr->allsolid = false;
+	ptr->startsolid = false;
+
+	for ( int i = 0; i < 3; i++ )
+	{
+		if ( vecAbsStart[i] < s_vecRoomMins[i] || vecAbsStart[i] > s_vecRoomMaxs[i] )
+		{
+			ptr->endpos = vecAbsStart;
+			ptr->fraction = 0.0f;
+			ptr->contents = CONTENTS_SOLID;
+			ptr->allsolid = true;
+			ptr->startsolid = true;
+			return;
+		}
+	}
+
+	// find the first wall the segment leaves the room through
+	Vector vecDelta = vecAbsEnd - vecAbsStart;
+	for ( int i = 0; i < 3; i++ )
+	{
+		float flWall;
+		if ( vecAbsEnd[i] > s_vecRoomMaxs[i] )
+		{
+			flWall = s_vecRoomMaxs[i];
+		}
+		else if ( vecAbsEnd[i] < s_vecRoomMins[i] )
+		{
+			flWall = s_vecRoomMins[i];
+		}
+		else
+		{
+			continue;
+		}
+
+		float flFraction = ( flWall - vecAbsStart[i] ) / vecDelta[i];
+		if ( flFraction < ptr->fraction )
+		{
+			ptr->fraction = flFraction;
+			ptr->plane.normal.Init();
+			ptr->plane.normal[i] = ( vecDelta[i] > 0.0f ) ? -1.0f : 1.0f;
+			ptr->plane.dist = ptr->plane.normal[i] * flWall;
+			ptr->plane.type = i;
+			ptr->plane.signbits = ( vecDelta[i] > 0.0f ) ? ( 1 << i ) : 0;
+			ptr->contents = CONTENTS_SOLID;
+		}
+	}
+	ptr->endpos = vecAbsStart + ptr->fraction * vecDelta;
+}
+
+
+//-----------------------------------------------------------------------------
+//
+// Benchmark
+//
+//-----------------------------------------------------------------------------
+static float s_flBenchmarkFrameTime;
+
+static void SimulateBenchmarkCollection( CParticleCollection *&pParticles )
+{
+	pParticles->Simulate( s_flBenchmarkFrameTime );
+}
+
+static int CountActiveParticles( CParticleCollection *pParticles )
+{
+	int nCount = pParticles->m_nActiveParticles;
+	for( CParticleCollection *i = pParticles->m_Children.m_pHead; i; i = i->m_pNext )
+	{
+		nCount += CountActiveParticles( i );
+	}
+	return nCount;
+}
+
+//-----------------------------------------------------------------------------
+// Simulates nCollections instances of a system for nFrames frames, half of
+// them parked at the room's center and half circling it. Returns the wall
+// clock time, and the number of particles simulated summed over all frames
+//-----------------------------------------------------------------------------
+static double RunBenchmarkPass( const char *pParticleSystemName, int nCollections, int nFrames, bool bThreaded, int64 &nParticleFrames )
+{
+	static const Vector s_vecCenter( 0.0f, 0.0f, 64.0f );
+
+	CUtlVector< CParticleCollection * > collections;
+	for ( int i = 0; i < nCollections; i++ )
+	{
+		CParticleCollection *pParticles = g_pParticleSystemMgr->CreateParticleCollection( pParticleSystemName, 0.0f, i );
+		if ( !pParticles )
+			break;
+
+		for ( int j = 0; j < 4; j++ )
+		{
+			pParticles->SetControlPoint( j, s_vecCenter );
+		}
+		collections.AddToTail( pParticles );
+	}
+
+	nParticleFrames = 0;
+	double flTime = 0.0;
+	for ( int nFrame = 0; nFrame < nFrames; nFrame++ )
+	{
+		float flAngle = nFrame * s_flBenchmarkFrameTime * 2.0f * M_PI;
+		Vector vecCircling( s_vecCenter.x + 128.0f * cos( flAngle ), s_vecCenter.y + 128.0f * sin( flAngle ), s_vecCenter.z );
+		for ( int i = 1; i < collections.Count(); i += 2 )
+		{
+			collections[i]->SetControlPoint( 0, vecCircling );
+		}
+
+		double flStart = Plat_FloatTime();
+		if ( bThreaded )
+		{
+			ParallelProcess( collections.Base(), collections.Count(), SimulateBenchmarkCollection );
+		}
+		else
+		{
+			for ( int i = 0; i < collections.Count(); i++ )
+			{
+				SimulateBenchmarkCollection( collections[i] );
+			}
+		}
+		flTime += Plat_FloatTime() - flStart;
+
+		for ( int i = 0; i < collections.Count(); i++ )
+		{
+			nParticleFrames += CountActiveParticles( collections[i] );
+		}
+	}
+
+	collections.PurgeAndDeleteElements();
+	return flTime;
+}
+
+void CParticleSystemMgr::BenchmarkParticleSystem( const char *pParticleSystemName, int nCollections, int nFrames, float flFrameTime )
+{
+	if ( !FindParticleSystem( pParticleSystemName ) )
+	{
+		Warning( "Particle benchmark: unknown particle system %s\n", pParticleSystemName );
+		return;
+	}
+
+	CBenchmarkParticleSystemQuery benchmarkQuery;
+	IParticleSystemQuery *pOldQuery = m_pQuery;
+	bool bOldBatchedWorldCollide = g_bParticleBatchedWorldCollide;
+	m_pQuery = &benchmarkQuery;
+	s_flBenchmarkFrameTime = flFrameTime;
+
+	// pass 0 runs the original world collision, pass 1 the batched one, both on
+	// this thread so the operator timings are trustworthy. pass 2 measures the
+	// throughput on the thread pool.
+	double flTime[3];
+	int64 nParticleFrames[3];
+#if MEASURE_PARTICLE_PERF
+	CUtlVector< float > opTimes[2];
+#endif
+	for ( int nPass = 0; nPass < 3; nPass++ )
+	{
+		g_bParticleBatchedWorldCollide = ( nPass != 0 );
+		CommitProfileInformation( false );
+
+		flTime[nPass] = RunBenchmarkPass( pParticleSystemName, nCollections, nFrames, ( nPass == 2 ), nParticleFrames[nPass] );
+
+#if MEASURE_PARTICLE_PERF
+		if ( nPass < 2 )
+		{
+			for ( int i = 0; i < ARRAYSIZE( m_ParticleOperators ); i++ )
+			{
+				for ( int j = 0; j < m_ParticleOperators[i].Count(); j++ )
+				{
+					opTimes[nPass].AddToTail( m_ParticleOperators[i][j]->m_flUncomittedTime );
+				}
+			}
+		}
+#endif
+	}
+	CommitProfileInformation( false );
+
+	m_pQuery = pOldQuery;
+	g_bParticleBatchedWorldCollide = bOldBatchedWorldCollide;
+
+	Msg( "Particle benchmark: %s, %d collections, %d frames, %.0f particles per frame\n",
+		pParticleSystemName, nCollections, nFrames, (double)nParticleFrames[1] / nFrames );
+	if ( !nParticleFrames[0] || !nParticleFrames[1] || !nParticleFrames[2] )
+	{
+		Msg( "  no particles were simulated\n" );
+		return;
+	}
+
+#if MEASURE_PARTICLE_PERF
+	Msg( "  %-48s %12s %12s\n", "ns per particle", "original", "batched" );
+	int nOp = 0;
+	for ( int i = 0; i < ARRAYSIZE( m_ParticleOperators ); i++ )
+	{
+		for ( int j = 0; j < m_ParticleOperators[i].Count(); j++, nOp++ )
+		{
+			if ( opTimes[0][nOp] <= 0.0f && opTimes[1][nOp] <= 0.0f )
+				continue;
+
+			Msg( "  %-48s %12.2f %12.2f\n", m_ParticleOperators[i][j]->GetName(),
+				opTimes[0][nOp] * 1.0e9 / nParticleFrames[0], opTimes[1][nOp] * 1.0e9 / nParticleFrames[1] );
+		}
+	}
+#endif
+	Msg( "  %-48s %12.2f %12.2f\n", "total", flTime[0] * 1.0e9 / nParticleFrames[0], flTime[1] * 1.0e9 / nParticleFrames[1] );
+	Msg( "  %-48s %12s %12.2f\n", "total, thread pool", "", flTime[2] * 1.0e9 / nParticleFrames[2] );
+}
@@ -1540,9 +1540,9 @@ void CParticleCollection::UpdatePrevControlPoints( float dt )
 #if MEASURE_PARTICLE_PERF
 
 #if VPROF_LEVEL > 0
-#define START_OP float flOpStartTime = Plat_FloatTime(); VPROF_ENTER_SCOPE(pOp->GetDefinition()->GetName())
+#define START_OP double flOpStartTime = Plat_FloatTime(); VPROF_ENTER_SCOPE(pOp->GetDefinition()->GetName())
 #else
-#define START_OP float flOpStartTime = Plat_FloatTime();
+#define START_OP double flOpStartTime = Plat_FloatTime();
 #endif
 
 #if VPROF_LEVEL > 0
@@ -1743,7 +1743,7 @@ void CParticleCollection::Simulate( float dt )
 
 
 #if MEASURE_PARTICLE_PERF
-	float flStartSimTime = Plat_FloatTime();
+	double flStartSimTime = Plat_FloatTime();
 #endif
 
 	bool bAttachedKillList = false;
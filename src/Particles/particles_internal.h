@@ -22,6 +22,11 @@
 #define COLLISION_MODE_PER_FRAME_PLANESET 1
 #define COLLISION_MODE_INITIAL_TRACE_DOWN 2
 
+// When set, world collision merges the traced planes into a set of unique planes, keeps
+// the set while the control point holds still and tests it without branching. Cleared
+// only by the particle benchmark, to measure the original path.
+extern bool g_bParticleBatchedWorldCollide;
+
 struct CWorldCollideContextData
 {
 	int m_nActivePlanes;
@@ -30,6 +35,7 @@ struct CWorldCollideContextData
 
 	FourVectors m_PointOnPlane[MAX_WORLD_PLANAR_CONSTRAINTS];
 	FourVectors m_PlaneNormal[MAX_WORLD_PLANAR_CONSTRAINTS];
+	fltx4 m_PlaneDist[MAX_WORLD_PLANAR_CONSTRAINTS];		// m_PointOnPlane . m_PlaneNormal
 
 	void *operator new( size_t nSize );
 	void *operator new( size_t nSize, int nBlockUse, const char *pFileName, int nLine );
@@ -275,10 +275,115 @@ static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
 	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
 }
 
+// intersect 4 rays with a triangle in intersection format, and store any hits closer than the
+// ones already in rslt_out. Shared by the kd-tree and bvh traversals.
+static FORCEINLINE void IntersectTriangleWith4Rays( TriIntersectData_t const *tri, int32 tnum,
+													const FourRays &rays, RayTracingResult *rslt_out,
+													ITransparentTriangleCallback *pCallback )
+{
+	// compute plane intersection
+	FourVectors N;
+	N.x = ReplicateX4( tri->m_flNx );
+	N.y = ReplicateX4( tri->m_flNy );
+	N.z = ReplicateX4( tri->m_flNz );
+
+	fltx4 DDotN = rays.direction * N;
+	// mask off zero or near zero (ray parallel to surface)
+	fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
+							CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
+
+	fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
+
+	fltx4 isect_t=DivSIMD( numerator,DDotN );
+	// now, we have the distance to the plane. lets update our mask
+	did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
+	//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
+	did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// now, check 3 edges
+	fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
+						MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
+	fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
+						   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
+	
+	// do barycentric coordinate check
+	fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
+
+	B0 = AddSIMD(
+		B0,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
+	B0 = AddSIMD(
+		B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
+
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
+
+	fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
+	B1 = AddSIMD(
+		B1,
+		MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
+
+	B1 = AddSIMD(
+		B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
+	
+	did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
+
+	fltx4 B2 = AddSIMD( B1, B0 );
+	did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
+
+	if ( ! IsAnyNegative( did_hit ) )
+		return;
+
+	// if the triangle is transparent
+	if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
+	{
+		if ( pCallback )
+		{
+			// assuming a triangle indexed as v0, v1, v2
+			// the projected edge equations are set up such that the vert opposite the first
+			// equation is v2, and the vert opposite the second equation is v0
+			// Therefore we pass them back in 1, 2, 0 order
+			// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
+			// barycentric coordinate.  Compute that now and pass it to the callback
+			fltx4 b2 = SubSIMD( Four_Ones, B2 );
+			if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
+			{
+				did_hit = Four_Zeros;
+			}
+		}
+	}
+	// now, set the hit_id and closest_hit fields for any enabled rays
+	fltx4 replicated_n = ReplicateIX4(tnum);
+	StoreAlignedSIMD((float *) rslt_out->HitIds,
+				 OrSIMD(AndSIMD(replicated_n,did_hit),
+						   AndNotSIMD(did_hit,LoadAlignedSIMD(
+											 (float *) rslt_out->HitIds))));
+	rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
+					 AndNotSIMD(did_hit,rslt_out->HitDistance));
+
+	rslt_out->surface_normal.x=OrSIMD(
+		AndSIMD(N.x,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.x));
+	rslt_out->surface_normal.y=OrSIMD(
+		AndSIMD(N.y,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.y));
+	rslt_out->surface_normal.z=OrSIMD(
+		AndSIMD(N.z,did_hit),
+		AndNotSIMD(did_hit,rslt_out->surface_normal.z));
+}
+
 void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 TMax,
 									   RayTracingResult *rslt_out,
 									   int32 skip_id, ITransparentTriangleCallback *pCallback)
 {
+	if ( Flags & RTE_FLAGS_BVH )
+	{
+		// the bvh doesn't care about direction signs
+		Trace4RaysBVH(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
 	int msk=rays.CalculateDirectionSignMask();
 	if (msk!=-1)
 		Trace4Rays(rays,TMin,TMax,msk,rslt_out,skip_id, pCallback);
@@ -349,6 +454,12 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 {
 	rays.Check();
 
+	if ( Flags & RTE_FLAGS_BVH )
+	{
+		Trace4RaysBVH(rays,TMin,TMax,rslt_out,skip_id,pCallback);
+		return;
+	}
+
 	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
 
 	rslt_out->HitDistance=ReplicateX4(1.0e23);
@@ -477,100 +588,7 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 				{
 					n_intersection_calculations++;
 					mailboxids[mbox_slot] = tnum;
-					// compute plane intersection
-
-
-					FourVectors N;
-					N.x = ReplicateX4( tri->m_flNx );
-					N.y = ReplicateX4( tri->m_flNy );
-					N.z = ReplicateX4( tri->m_flNz );
-
-					fltx4 DDotN = rays.direction * N;
-					// mask off zero or near zero (ray parallel to surface)
-					fltx4 did_hit = OrSIMD( CmpGtSIMD( DDotN,FourEpsilons ),
-											CmpLtSIMD( DDotN, FourNegativeEpsilons ) );
-
-					fltx4 numerator=SubSIMD( ReplicateX4( tri->m_flD ), rays.origin * N );
-
-					fltx4 isect_t=DivSIMD( numerator,DDotN );
-					// now, we have the distance to the plane. lets update our mask
-					did_hit = AndSIMD( did_hit, CmpGtSIMD( isect_t, FourZeros ) );
-					//did_hit=AndSIMD(did_hit,CmpLtSIMD(isect_t,TMax));
-					did_hit = AndSIMD( did_hit, CmpLtSIMD( isect_t, rslt_out->HitDistance ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// now, check 3 edges
-					fltx4 hitc1 = AddSIMD( rays.origin[tri->m_nCoordSelect0],
-										MulSIMD( isect_t, rays.direction[ tri->m_nCoordSelect0] ) );
-					fltx4 hitc2 = AddSIMD( rays.origin[tri->m_nCoordSelect1],
-										   MulSIMD( isect_t, rays.direction[tri->m_nCoordSelect1] ) );
-					
-					// do barycentric coordinate check
-					fltx4 B0 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[0] ), hitc1 );
-
-					B0 = AddSIMD(
-						B0,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[1] ), hitc2 ) );
-					B0 = AddSIMD(
-						B0, ReplicateX4( tri->m_ProjectedEdgeEquations[2] ) );
-
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B0, FourZeros ) );
-
-					fltx4 B1 = MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[3] ), hitc1 );
-					B1 = AddSIMD(
-						B1,
-						MulSIMD( ReplicateX4( tri->m_ProjectedEdgeEquations[4]), hitc2 ) );
-
-					B1 = AddSIMD(
-						B1, ReplicateX4( tri->m_ProjectedEdgeEquations[5] ) );
-					
-					did_hit = AndSIMD( did_hit, CmpGeSIMD( B1, FourZeros ) );
-
-					fltx4 B2 = AddSIMD( B1, B0 );
-					did_hit = AndSIMD( did_hit, CmpLeSIMD( B2, Four_Ones ) );
-
-					if ( ! IsAnyNegative( did_hit ) )
-						continue;
-
-					// if the triangle is transparent
-					if ( tri->m_nFlags & FCACHETRI_TRANSPARENT )
-					{
-						if ( pCallback )
-						{
-							// assuming a triangle indexed as v0, v1, v2
-							// the projected edge equations are set up such that the vert opposite the first
-							// equation is v2, and the vert opposite the second equation is v0
-							// Therefore we pass them back in 1, 2, 0 order
-							// Also B2 is currently B1 + B0 and needs to be 1 - (B1+B0) in order to be a real
-							// barycentric coordinate.  Compute that now and pass it to the callback
-							fltx4 b2 = SubSIMD( Four_Ones, B2 );
-							if ( pCallback->VisitTriangle_ShouldContinue( *tri, rays, &did_hit, &B1, &b2, &B0, tnum ) )
-							{
-								did_hit = Four_Zeros;
-							}
-						}
-					}
-					// now, set the hit_id and closest_hit fields for any enabled rays
-					fltx4 replicated_n = ReplicateIX4(tnum);
-					StoreAlignedSIMD((float *) rslt_out->HitIds,
-								 OrSIMD(AndSIMD(replicated_n,did_hit),
-										   AndNotSIMD(did_hit,LoadAlignedSIMD(
-															 (float *) rslt_out->HitIds))));
-					rslt_out->HitDistance=OrSIMD(AndSIMD(isect_t,did_hit),
-									 AndNotSIMD(did_hit,rslt_out->HitDistance));
-
-					rslt_out->surface_normal.x=OrSIMD(
-						AndSIMD(N.x,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.x));
-					rslt_out->surface_normal.y=OrSIMD(
-						AndSIMD(N.y,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.y));
-					rslt_out->surface_normal.z=OrSIMD(
-						AndSIMD(N.z,did_hit),
-						AndNotSIMD(did_hit,rslt_out->surface_normal.z));
-					
+					IntersectTriangleWith4Rays( tri, tnum, rays, rslt_out, pCallback );
 				}
 			} while (--ntris);
 			// now, check if all rays have terminated
@@ -594,6 +612,139 @@ void RayTracingEnvironment::Trace4Rays(const FourRays &rays, fltx4 TMin, fltx4 T
 }
 
 
+#define MAX_BVH_STACK_LEN 256								// 3 per level is enough, see BVH_MAX_DEPTH
+
+struct BVHNodeToVisit {
+	int32 child;
+	float TNear;											// closest any ray can hit it
+};
+
+void RayTracingEnvironment::Trace4RaysBVH(const FourRays &rays, fltx4 TMin, fltx4 TMax,
+										  RayTracingResult *rslt_out,
+										  int32 skip_id, ITransparentTriangleCallback *pCallback)
+{
+	memset(rslt_out->HitIds,0xff,sizeof(rslt_out->HitIds));
+
+	rslt_out->HitDistance=ReplicateX4(1.0e23);
+
+	rslt_out->surface_normal.DuplicateVector(Vector(0.,0.,0.));
+
+	int active_rays=TestSignSIMD(CmpLeSIMD(TMin,TMax));
+	if ( (! active_rays) || (! OptimizedBVH.Count()) )
+		return;
+
+	FourVectors OneOverRayDir=rays.direction;
+	OneOverRayDir.MakeReciprocalSaturate();
+
+	// each ray is tested against the 4 children of a node at once, so splat everything per ray
+	// up front. RayTMax is brought in as hits are found.
+	fltx4 RayOrigin[4][3];
+	fltx4 RayOneOverDir[4][3];
+	fltx4 RayTMin[4];
+	fltx4 RayTMax[4];
+	float flMaxT=-1.0e23;
+	for(int r=0;r<4;r++)
+	{
+		for(int c=0;c<3;c++)
+		{
+			RayOrigin[r][c]=ReplicateX4(SubFloat(rays.origin[c],r));
+			RayOneOverDir[r][c]=ReplicateX4(SubFloat(OneOverRayDir[c],r));
+		}
+		RayTMin[r]=ReplicateX4(SubFloat(TMin,r));
+		RayTMax[r]=ReplicateX4(SubFloat(TMax,r));
+		if ( active_rays & (1<<r) )
+			flMaxT=max(flMaxT,SubFloat(TMax,r));
+	}
+
+	BVHNodeToVisit NodeStack[MAX_BVH_STACK_LEN];
+	BVHNodeToVisit *stack_ptr=NodeStack;
+	stack_ptr->child=0;
+	stack_ptr->TNear=-1.0e23;
+	stack_ptr++;
+	while(stack_ptr!=NodeStack)
+	{
+		// pop stack! skip anything that's beyond all the hits we have now
+		--stack_ptr;
+		if (stack_ptr->TNear>flMaxT)
+			continue;
+		int32 child=stack_ptr->child;
+
+		if ( CacheOptimizedBVHNode::IsLeaf( child ) )
+		{
+			// hit a leaf! must do intersection check
+			int first=CacheOptimizedBVHNode::TriangleIndexStart( child );
+			int ntris=CacheOptimizedBVHNode::NumberOfTrianglesInLeaf( child );
+			TriIntersectData_t const *tri=&( BVHTriangleList[first] );
+			int32 const *tlist=&( BVHTriangleIndexList[first] );
+			for(int t=0;t<ntris;t++,tri++,tlist++)
+			{
+				if ( tri->m_nTriangleID != skip_id )
+					IntersectTriangleWith4Rays( tri, *tlist, rays, rslt_out, pCallback );
+			}
+			// now, pull in the far end of the rays that hit something
+			flMaxT=-1.0e23;
+			for(int r=0;r<4;r++)
+			{
+				float flT=min(SubFloat(TMax,r),SubFloat(rslt_out->HitDistance,r));
+				RayTMax[r]=ReplicateX4(flT);
+				if ( active_rays & (1<<r) )
+					flMaxT=max(flMaxT,flT);
+			}
+			continue;
+		}
+
+		CacheOptimizedBVHNode const &node=OptimizedBVH[child];
+		fltx4 Mins[3],Maxs[3];
+		for(int c=0;c<3;c++)
+		{
+			Mins[c]=LoadAlignedSIMD(node.m_flMins[c]);
+			Maxs[c]=LoadAlignedSIMD(node.m_flMaxs[c]);
+		}
+		// slab test each ray against all 4 children
+		int hit_mask=0;
+		fltx4 ChildTNear=ReplicateX4(1.0e23);
+		for(int r=0;r<4;r++)
+		{
+			if (! (active_rays & (1<<r)))
+				continue;
+			fltx4 TNear=RayTMin[r];
+			fltx4 TFar=RayTMax[r];
+			for(int c=0;c<3;c++)
+			{
+				fltx4 isect_min_t=MulSIMD(SubSIMD(Mins[c],RayOrigin[r][c]),RayOneOverDir[r][c]);
+				fltx4 isect_max_t=MulSIMD(SubSIMD(Maxs[c],RayOrigin[r][c]),RayOneOverDir[r][c]);
+				TNear=MaxSIMD(TNear,MinSIMD(isect_min_t,isect_max_t));
+				TFar=MinSIMD(TFar,MaxSIMD(isect_min_t,isect_max_t));
+			}
+			fltx4 hits=CmpLeSIMD(TNear,TFar);
+			hit_mask|=TestSignSIMD(hits);
+			ChildTNear=MinSIMD(ChildTNear,MaskedAssign(hits,TNear,Four_FLT_MAX));
+		}
+		hit_mask&=(1<<node.m_nNumChildren)-1;
+		if (! hit_mask)
+			continue;
+
+		// push the children that were hit far to near, so the nearest is visited first
+		BVHNodeToVisit hits[BVH_NODE_WIDTH];
+		int nhits=0;
+		for(int i=0;i<BVH_NODE_WIDTH;i++)
+		{
+			if (! (hit_mask & (1<<i)))
+				continue;
+			float flTNear=SubFloat(ChildTNear,i);
+			int j=nhits++;
+			for(;j>0 && hits[j-1].TNear<flTNear;j--)
+				hits[j]=hits[j-1];
+			hits[j].child=node.m_nChildren[i];
+			hits[j].TNear=flTNear;
+		}
+		assert(stack_ptr+nhits<=&NodeStack[MAX_BVH_STACK_LEN]);
+		for(int i=0;i<nhits;i++)
+			*(stack_ptr++)=hits[i];
+	}
+}
+
+
 int RayTracingEnvironment::MakeLeafNode(int first_tri, int last_tri)
 {
 	CacheOptimizedKDNode ret;
@@ -871,7 +1022,7 @@ void RayTracingEnvironment::RefineNode(int node_number,int32 const *tri_list,int
 }
 
 
-void RayTracingEnvironment::SetupAccelerationStructure(void)
+void RayTracingEnvironment::BuildKDTree(void)
 {
 	CacheOptimizedKDNode root;
 	OptimizedKDTree.AddToTail(root);
@@ -882,10 +1033,22 @@ void RayTracingEnvironment::SetupAccelerationStructure(void)
 								m_MaxBound);
 	RefineNode(0,root_triangle_list,OptimizedTriangleList.Count(),m_MinBound,m_MaxBound,0);
 	delete[] root_triangle_list;
+}
+
+
+void RayTracingEnvironment::SetupAccelerationStructure(void)
+{
+	if ( Flags & RTE_FLAGS_BVH )
+		BuildBVH();
+	else
+		BuildKDTree();
 
 	// now, convert all triangles to "intersection format"
 	for(int i=0;i<OptimizedTriangleList.Count();i++)
 		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+
+	if ( Flags & RTE_FLAGS_BVH )
+		CopyBVHTriangles();
 }
 
 
@@ -0,0 +1,571 @@
+// $Id$
+//
+// Bounding volume hierarchy for RayTracingEnvironment. A binary tree is built with the binned
+// surface area heuristic, split across threads by subtree, and then collapsed into 4 wide nodes
+// whose children can be tested against a ray with a handful of simd ops.
+
+#include "raytrace.h"
+#include <tier0/threadtools.h>
+#include <vstdlib/random.h>
+#include <stdio.h>
+
+#define BVH_NUM_BINS 16										// candidate split planes per axis
+#define BVH_MAX_DEPTH 48									// binary levels after which ranges are just halved.
+															// keeps the trace stack bounded.
+#define BVH_MIN_TASK_TRIS 8192								// smaller subtrees are built by the thread that split
+															// them off rather than queued
+#define BVH_MAX_THREADS 32
+
+// same idea as the kd-tree build costs. See the comment above CalculateCostsOfSplit
+#define BVH_COST_OF_TRAVERSAL 75							// approximate #operations
+#define BVH_COST_OF_INTERSECTION 167						// approximate #operations
+
+
+static float BoxSurfaceArea(Vector const &boxmin, Vector const &boxmax)
+{
+	Vector boxdim=boxmax-boxmin;
+	return 2.0*((boxdim[0]*boxdim[2])+(boxdim[0]*boxdim[1])+(boxdim[1]*boxdim[2]));
+}
+
+static void AddPointToBounds( Vector const &p, Vector &mins, Vector &maxs )
+{
+	for(int c=0;c<3;c++)
+	{
+		mins[c]=min(mins[c],p[c]);
+		maxs[c]=max(maxs[c],p[c]);
+	}
+}
+
+static void AddBoundsToBounds( Vector const &boxmin, Vector const &boxmax, Vector &mins, Vector &maxs )
+{
+	for(int c=0;c<3;c++)
+	{
+		mins[c]=min(mins[c],boxmin[c]);
+		maxs[c]=max(maxs[c],boxmax[c]);
+	}
+}
+
+
+struct BVHBuildTriangle_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	Vector m_vecCentroid;
+};
+
+struct BVHBuildNode_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	int m_nLeftChild;										// right child is always next. -1 for leaves
+	int m_nFirstTri;										// range in the builder's index list
+	int m_nNumTris;
+};
+
+struct BVHBuildTask_t
+{
+	int m_nNode;
+	int m_nFirstTri;
+	int m_nNumTris;
+	int m_nDepth;
+};
+
+struct BVHBin_t
+{
+	Vector m_vecMins;
+	Vector m_vecMaxs;
+	int m_nNumTris;
+};
+
+
+//-----------------------------------------------------------------------------
+// Builds the binary tree. Every thread pulls subtrees off a shared queue, and
+// splits big enough parts of its own subtree back onto the queue. Nodes are
+// allocated out of one array with an interlocked counter, so nothing has to
+// be locked except the queue.
+//-----------------------------------------------------------------------------
+class CBVHBuilder
+{
+public:
+	CBVHBuilder( RayTracingEnvironment *pEnv );
+
+	void BuildBinaryTree( void );
+	void WriteOptimizedTree( void );
+
+private:
+	static unsigned WorkerThread( void *pParam );
+	void WorkerLoop( void );
+	void AddTask( BVHBuildTask_t const &task );
+	void BuildSubtree( BVHBuildTask_t const &task );
+
+	// returns false if the node was made a leaf
+	bool SplitNode( BVHBuildTask_t const &task, BVHBuildTask_t &left, BVHBuildTask_t &right );
+
+	int32 WriteChild( int nBuildNode );
+	int WriteNode( int nBuildNode );
+
+	RayTracingEnvironment *m_pEnv;
+	CUtlVector<BVHBuildTriangle_t> m_Triangles;
+	CUtlVector<int32> m_TriIndices;							// partitioned in place as nodes split
+	CUtlVector<BVHBuildNode_t> m_Nodes;
+	long volatile m_nNodesUsed;
+
+	CThreadFastMutex m_TaskMutex;
+	CUtlVector<BVHBuildTask_t> m_Tasks;
+	long volatile m_nTasksOutstanding;						// queued or being worked on
+};
+
+CBVHBuilder::CBVHBuilder( RayTracingEnvironment *pEnv )
+{
+	m_pEnv=pEnv;
+	m_nNodesUsed=0;
+	m_nTasksOutstanding=0;
+}
+
+void CBVHBuilder::BuildBinaryTree( void )
+{
+	int ntris=m_pEnv->OptimizedTriangleList.Count();
+	m_Triangles.SetCount( ntris );
+	m_TriIndices.SetCount( ntris );
+	for(int t=0;t<ntris;t++)
+	{
+		CacheOptimizedTriangle const &tri=m_pEnv->OptimizedTriangleList[t];
+		BVHBuildTriangle_t &bt=m_Triangles[t];
+		bt.m_vecMins=tri.Vertex(0);
+		bt.m_vecMaxs=tri.Vertex(0);
+		AddPointToBounds( tri.Vertex(1), bt.m_vecMins, bt.m_vecMaxs );
+		AddPointToBounds( tri.Vertex(2), bt.m_vecMins, bt.m_vecMaxs );
+		bt.m_vecCentroid=0.5*(bt.m_vecMins+bt.m_vecMaxs);
+		m_TriIndices[t]=t;
+	}
+
+	// a binary tree with single triangle leaves is as big as it can get
+	m_Nodes.SetCount( max( 1, 2*ntris-1 ) );
+	m_nNodesUsed=1;
+
+	BVHBuildTask_t root;
+	root.m_nNode=0;
+	root.m_nFirstTri=0;
+	root.m_nNumTris=ntris;
+	root.m_nDepth=0;
+	AddTask( root );
+
+	int nthreads=1;
+	if ( ntris >= 2*BVH_MIN_TASK_TRIS )
+		nthreads=clamp( (int)GetCPUInformation().m_nLogicalProcessors, 1, BVH_MAX_THREADS );
+
+	ThreadHandle_t hThreads[BVH_MAX_THREADS];
+	for(int i=1;i<nthreads;i++)
+		hThreads[i]=CreateSimpleThread( WorkerThread, this );
+	WorkerLoop();
+	for(int i=1;i<nthreads;i++)
+	{
+		ThreadJoin( hThreads[i] );
+		ReleaseThreadHandle( hThreads[i] );
+	}
+}
+
+unsigned CBVHBuilder::WorkerThread( void *pParam )
+{
+	((CBVHBuilder *) pParam)->WorkerLoop();
+	return 0;
+}
+
+void CBVHBuilder::WorkerLoop( void )
+{
+	for(;;)
+	{
+		BVHBuildTask_t task;
+		bool bGotTask=false;
+		{
+			AUTO_LOCK( m_TaskMutex );
+			if ( m_Tasks.Count() )
+			{
+				task=m_Tasks.Tail();
+				m_Tasks.Remove( m_Tasks.Count()-1 );
+				bGotTask=true;
+			}
+		}
+		if ( bGotTask )
+		{
+			BuildSubtree( task );
+			ThreadInterlockedDecrement( &m_nTasksOutstanding );
+			continue;
+		}
+		// nothing queued. we're done once nobody is working on anything that could add more
+		if ( m_nTasksOutstanding==0 )
+			return;
+		ThreadSleep( 0 );
+	}
+}
+
+void CBVHBuilder::AddTask( BVHBuildTask_t const &task )
+{
+	ThreadInterlockedIncrement( &m_nTasksOutstanding );
+	AUTO_LOCK( m_TaskMutex );
+	m_Tasks.AddToTail( task );
+}
+
+void CBVHBuilder::BuildSubtree( BVHBuildTask_t const &task )
+{
+	CUtlVector<BVHBuildTask_t> stack;
+	stack.AddToTail( task );
+	while( stack.Count() )
+	{
+		BVHBuildTask_t cur=stack.Tail();
+		stack.Remove( stack.Count()-1 );
+		BVHBuildTask_t left,right;
+		if ( !SplitNode( cur, left, right ) )
+			continue;
+		// hand big subtrees to whoever is idle, keep going down the left side here
+		if ( right.m_nNumTris >= BVH_MIN_TASK_TRIS )
+			AddTask( right );
+		else
+			stack.AddToTail( right );
+		stack.AddToTail( left );
+	}
+}
+
+bool CBVHBuilder::SplitNode( BVHBuildTask_t const &task, BVHBuildTask_t &left, BVHBuildTask_t &right )
+{
+	BVHBuildNode_t &node=m_Nodes[task.m_nNode];
+	int32 *tris=m_TriIndices.Base()+task.m_nFirstTri;
+	int ntris=task.m_nNumTris;
+
+	// bounds of the triangles, and of their centroids which is what gets binned
+	Vector CentroidMins( 1.0e23, 1.0e23, 1.0e23 );
+	Vector CentroidMaxs( -1.0e23, -1.0e23, -1.0e23 );
+	node.m_vecMins=CentroidMins;
+	node.m_vecMaxs=CentroidMaxs;
+	for(int t=0;t<ntris;t++)
+	{
+		BVHBuildTriangle_t const &bt=m_Triangles[tris[t]];
+		AddBoundsToBounds( bt.m_vecMins, bt.m_vecMaxs, node.m_vecMins, node.m_vecMaxs );
+		AddPointToBounds( bt.m_vecCentroid, CentroidMins, CentroidMaxs );
+	}
+	node.m_nLeftChild=-1;
+	node.m_nFirstTri=task.m_nFirstTri;
+	node.m_nNumTris=ntris;
+	if ( ntris<=2 )
+		return false;
+
+	float best_cost=1.0e23;
+	int best_axis=-1;
+	int best_split=0;
+	if ( task.m_nDepth<BVH_MAX_DEPTH )
+	{
+		float ISA=BoxSurfaceArea( node.m_vecMins, node.m_vecMaxs );
+		ISA=( ISA>0 ) ? 1.0/ISA : 1.0;
+		for(int axis=0;axis<3;axis++)
+		{
+			float extent=CentroidMaxs[axis]-CentroidMins[axis];
+			if ( extent<=0 )
+				continue;
+			float scale=BVH_NUM_BINS*0.9999/extent;
+			BVHBin_t bins[BVH_NUM_BINS];
+			for(int b=0;b<BVH_NUM_BINS;b++)
+			{
+				bins[b].m_vecMins.Init( 1.0e23, 1.0e23, 1.0e23 );
+				bins[b].m_vecMaxs.Init( -1.0e23, -1.0e23, -1.0e23 );
+				bins[b].m_nNumTris=0;
+			}
+			for(int t=0;t<ntris;t++)
+			{
+				BVHBuildTriangle_t const &bt=m_Triangles[tris[t]];
+				int b=min( BVH_NUM_BINS-1, (int) ( ( bt.m_vecCentroid[axis]-CentroidMins[axis] )*scale ) );
+				AddBoundsToBounds( bt.m_vecMins, bt.m_vecMaxs, bins[b].m_vecMins, bins[b].m_vecMaxs );
+				bins[b].m_nNumTris++;
+			}
+
+			// sweep from the right to get the area and count of everything right of each split,
+			// then from the left to cost each split
+			float RightArea[BVH_NUM_BINS];
+			int RightCount[BVH_NUM_BINS];
+			Vector mins=bins[BVH_NUM_BINS-1].m_vecMins;
+			Vector maxs=bins[BVH_NUM_BINS-1].m_vecMaxs;
+			int count=0;
+			for(int b=BVH_NUM_BINS-1;b>0;b--)
+			{
+				AddBoundsToBounds( bins[b].m_vecMins, bins[b].m_vecMaxs, mins, maxs );
+				count+=bins[b].m_nNumTris;
+				RightArea[b]=count ? BoxSurfaceArea( mins, maxs ) : 0;
+				RightCount[b]=count;
+			}
+			mins=bins[0].m_vecMins;
+			maxs=bins[0].m_vecMaxs;
+			count=0;
+			for(int b=1;b<BVH_NUM_BINS;b++)
+			{
+				AddBoundsToBounds( bins[b-1].m_vecMins, bins[b-1].m_vecMaxs, mins, maxs );
+				count+=bins[b-1].m_nNumTris;
+				if ( ( count==0 ) || ( RightCount[b]==0 ) )
+					continue;
+				float cost=BVH_COST_OF_TRAVERSAL+BVH_COST_OF_INTERSECTION*ISA*
+					( BoxSurfaceArea( mins, maxs )*count+RightArea[b]*RightCount[b] );
+				if ( cost<best_cost )
+				{
+					best_cost=cost;
+					best_axis=axis;
+					best_split=b;
+				}
+			}
+		}
+	}
+	// stop if splitting costs more than intersecting everything, as long as it fits in a leaf
+	float cost_of_no_split=BVH_COST_OF_INTERSECTION*ntris;
+	if ( ( ntris<=BVH_MAX_LEAF_TRIS ) && ( cost_of_no_split<=best_cost ) )
+		return false;
+
+	int nleft=ntris/2;
+	if ( best_axis>=0 )
+	{
+		float scale=BVH_NUM_BINS*0.9999/( CentroidMaxs[best_axis]-CentroidMins[best_axis] );
+		int i=0,j=ntris-1;
+		while( i<=j )
+		{
+			float c=m_Triangles[tris[i]].m_vecCentroid[best_axis];
+			int b=min( BVH_NUM_BINS-1, (int) ( ( c-CentroidMins[best_axis] )*scale ) );
+			if ( b<best_split )
+				i++;
+			else
+			{
+				swap( tris[i], tris[j] );
+				j--;
+			}
+		}
+		if ( ( i>0 ) && ( i<ntris ) )
+			nleft=i;
+	}
+	// else all the centroids are in the same place or we're too deep, so there is nothing
+	// better to do than halving the list
+
+	int nchild=ThreadInterlockedExchangeAdd( &m_nNodesUsed, 2 );
+	Assert( nchild+2<=m_Nodes.Count() );
+	node.m_nLeftChild=nchild;
+
+	left.m_nNode=nchild;
+	left.m_nFirstTri=task.m_nFirstTri;
+	left.m_nNumTris=nleft;
+	left.m_nDepth=task.m_nDepth+1;
+	right.m_nNode=nchild+1;
+	right.m_nFirstTri=task.m_nFirstTri+nleft;
+	right.m_nNumTris=ntris-nleft;
+	right.m_nDepth=task.m_nDepth+1;
+	return true;
+}
+
+void CBVHBuilder::WriteOptimizedTree( void )
+{
+	m_pEnv->OptimizedBVH.RemoveAll();
+	m_pEnv->BVHTriangleIndexList.RemoveAll();
+	m_pEnv->BVHTriangleIndexList.EnsureCapacity( m_TriIndices.Count() );
+	if ( m_TriIndices.Count() )
+	{
+		m_pEnv->m_MinBound=m_Nodes[0].m_vecMins;
+		m_pEnv->m_MaxBound=m_Nodes[0].m_vecMaxs;
+	}
+	WriteNode( 0 );
+}
+
+int32 CBVHBuilder::WriteChild( int nBuildNode )
+{
+	BVHBuildNode_t const &bn=m_Nodes[nBuildNode];
+	if ( bn.m_nLeftChild>=0 )
+		return WriteNode( nBuildNode );
+	// leaves get their triangles laid out in the order they are written, so that neighboring
+	// leaves are near each other in memory
+	int32 first=m_pEnv->BVHTriangleIndexList.Count();
+	for(int t=0;t<bn.m_nNumTris;t++)
+		m_pEnv->BVHTriangleIndexList.AddToTail( m_TriIndices[bn.m_nFirstTri+t] );
+	return CacheOptimizedBVHNode::MakeLeaf( first, bn.m_nNumTris );
+}
+
+int CBVHBuilder::WriteNode( int nBuildNode )
+{
+	// pull the children of the binary node up until there are 4 of them, always opening
+	// the biggest one since it is the most likely to get hit
+	int children[BVH_NODE_WIDTH];
+	int nchildren=0;
+	if ( m_Nodes[nBuildNode].m_nLeftChild>=0 )
+	{
+		children[nchildren++]=m_Nodes[nBuildNode].m_nLeftChild;
+		children[nchildren++]=m_Nodes[nBuildNode].m_nLeftChild+1;
+	}
+	else if ( m_Nodes[nBuildNode].m_nNumTris )
+		children[nchildren++]=nBuildNode;					// the root is a leaf
+	while( nchildren<BVH_NODE_WIDTH )
+	{
+		int best=-1;
+		float best_area=-1;
+		for(int i=0;i<nchildren;i++)
+		{
+			BVHBuildNode_t const &bn=m_Nodes[children[i]];
+			if ( bn.m_nLeftChild<0 )
+				continue;
+			float area=BoxSurfaceArea( bn.m_vecMins, bn.m_vecMaxs );
+			if ( area>best_area )
+			{
+				best_area=area;
+				best=i;
+			}
+		}
+		if ( best<0 )
+			break;
+		int opened=children[best];
+		children[best]=m_Nodes[opened].m_nLeftChild;
+		children[nchildren++]=m_Nodes[opened].m_nLeftChild+1;
+	}
+
+	int nNode=m_pEnv->OptimizedBVH.AddToTail();
+	m_pEnv->OptimizedBVH[nNode].m_nNumChildren=nchildren;
+	for(int i=0;i<BVH_NODE_WIDTH;i++)
+	{
+		Vector mins( 1.0e23, 1.0e23, 1.0e23 );
+		Vector maxs( -1.0e23, -1.0e23, -1.0e23 );
+		int32 child=BVHNODE_LEAF;
+		if ( i<nchildren )
+		{
+			mins=m_Nodes[children[i]].m_vecMins;
+			maxs=m_Nodes[children[i]].m_vecMaxs;
+			child=WriteChild( children[i] );
+		}
+		// writing the child may have grown the node list
+		CacheOptimizedBVHNode &node=m_pEnv->OptimizedBVH[nNode];
+		for(int c=0;c<3;c++)
+		{
+			node.m_flMins[c][i]=mins[c];
+			node.m_flMaxs[c][i]=maxs[c];
+		}
+		node.m_nChildren[i]=child;
+	}
+	return nNode;
+}
+
+
+void RayTracingEnvironment::BuildBVH(void)
+{
+	CBVHBuilder builder( this );
+	builder.BuildBinaryTree();
+	builder.WriteOptimizedTree();
+}
+
+void RayTracingEnvironment::CopyBVHTriangles(void)
+{
+	// the leaves point at runs of this list, so tracing doesn't jump around OptimizedTriangleList
+	BVHTriangleList.SetCount( BVHTriangleIndexList.Count() );
+	for(int i=0;i<BVHTriangleIndexList.Count();i++)
+		BVHTriangleList[i]=OptimizedTriangleList[BVHTriangleIndexList[i]].m_Data.m_IntersectData;
+}
+
+
+typedef CUtlVector<FourRays, CUtlMemoryAligned<FourRays, 16> > FourRaysList_t;
+typedef CUtlVector<RayTracingResult, CUtlMemoryAligned<RayTracingResult, 16> > RayTracingResultList_t;
+
+static Vector RandomDirection( CUniformRandomStream &random )
+{
+	Vector dir;
+	do
+	{
+		dir.Init( random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ), random.RandomFloat( -1, 1 ) );
+	} while( ( dir.LengthSqr()>1 ) || ( dir.LengthSqr()<1.0e-4 ) );
+	VectorNormalize( dir );
+	return dir;
+}
+
+static double TimeTrace( RayTracingEnvironment *pEnv, FourRaysList_t const &rays, RayTracingResultList_t &results )
+{
+	double flStart=Plat_FloatTime();
+	for(int i=0;i<rays.Count();i++)
+		pEnv->Trace4Rays( rays[i], Four_Zeros, ReplicateX4( 1.0e23 ), &results[i] );
+	return Plat_FloatTime()-flStart;
+}
+
+void RayTracingEnvironment::BenchmarkAccelerationStructures( int nrays )
+{
+	double flStart=Plat_FloatTime();
+	BuildKDTree();
+	double flKDBuildTime=Plat_FloatTime()-flStart;
+
+	flStart=Plat_FloatTime();
+	BuildBVH();
+	double flBVHBuildTime=Plat_FloatTime()-flStart;
+
+	for(int i=0;i<OptimizedTriangleList.Count();i++)
+		OptimizedTriangleList[i].ChangeIntoIntersectionFormat();
+	CopyBVHTriangles();
+
+	printf( "%d triangles\n", OptimizedTriangleList.Count() );
+	printf( "kd-tree: %d nodes, built in %.2f seconds\n", OptimizedKDTree.Count(), flKDBuildTime );
+	printf( "bvh: %d nodes, built in %.2f seconds\n", OptimizedBVH.Count(), flBVHBuildTime );
+	if ( !OptimizedTriangleList.Count() )
+		return;
+
+	int npackets=max( 1, nrays/4 );
+	FourRaysList_t rays;
+	RayTracingResultList_t kdresults, bvhresults;
+	rays.SetCount( npackets );
+	kdresults.SetCount( npackets );
+	bvhresults.SetCount( npackets );
+
+	uint32 nSaveFlags=Flags;
+	CUniformRandomStream random;
+	for(int pass=0;pass<2;pass++)
+	{
+		// the first pass is rays going anywhere from anywhere. The second fires each packet from
+		// one point in nearly the same direction, like gathering light does
+		bool bCoherent=( pass==1 );
+		random.SetSeed( 1 + pass );
+		for(int p=0;p<npackets;p++)
+		{
+			Vector origin;
+			for(int c=0;c<3;c++)
+				origin[c]=random.RandomFloat( m_MinBound[c], m_MaxBound[c] );
+			Vector dir=RandomDirection( random );
+			for(int r=0;r<4;r++)
+			{
+				if ( !bCoherent )
+				{
+					for(int c=0;c<3;c++)
+						origin[c]=random.RandomFloat( m_MinBound[c], m_MaxBound[c] );
+					dir=RandomDirection( random );
+				}
+				Vector raydir=dir;
+				if ( bCoherent )
+				{
+					raydir+=0.05*RandomDirection( random );
+					VectorNormalize( raydir );
+				}
+				rays[p].origin.X(r)=origin.x;
+				rays[p].origin.Y(r)=origin.y;
+				rays[p].origin.Z(r)=origin.z;
+				rays[p].direction.X(r)=raydir.x;
+				rays[p].direction.Y(r)=raydir.y;
+				rays[p].direction.Z(r)=raydir.z;
+			}
+		}
+
+		Flags=nSaveFlags & ~RTE_FLAGS_BVH;
+		double flKDTime=TimeTrace( this, rays, kdresults );
+		Flags=nSaveFlags | RTE_FLAGS_BVH;
+		double flBVHTime=TimeTrace( this, rays, bvhresults );
+
+		// ids can legitimately differ where triangles share an edge, so only count the rays
+		// that stopped somewhere else
+		int nmismatches=0;
+		for(int p=0;p<npackets;p++)
+			for(int r=0;r<4;r++)
+			{
+				if ( kdresults[p].HitIds[r]==bvhresults[p].HitIds[r] )
+					continue;
+				if ( ( kdresults[p].HitIds[r]==-1 ) || ( bvhresults[p].HitIds[r]==-1 ) ||
+					 ( fabs( SubFloat( kdresults[p].HitDistance, r )-SubFloat( bvhresults[p].HitDistance, r ) )>0.01 ) )
+					nmismatches++;
+			}
+
+		printf( "%s rays: kd-tree %.0f rays/sec, bvh %.0f rays/sec, %d of %d results differ\n",
+				bCoherent ? "coherent" : "random",
+				( 4*npackets )/max( flKDTime, 1.0e-6 ), ( 4*npackets )/max( flBVHTime, 1.0e-6 ),
+				nmismatches, 4*npackets );
+	}
+	Flags=nSaveFlags;
+}
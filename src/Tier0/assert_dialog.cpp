@@ -69,6 +69,8 @@ static CDialogInitInfo g_Info;
 // -------------------------------------------------------------------------------- //
 
 #if defined(_WIN32) && !defined(STATIC_TIER0)
+extern void MemStd_OnThreadDetach();
+
 BOOL WINAPI DllMain(
   HINSTANCE hinstDLL,  // handle to the DLL module
   DWORD fdwReason,     // reason for calling function
@@ -76,6 +78,12 @@ BOOL WINAPI DllMain(
 )
 {
 	g_hTier0Instance = hinstDLL;
+
+	// hand the exiting thread's small block cache back to the shared pools
+	if ( fdwReason == DLL_THREAD_DETACH )
+	{
+		MemStd_OnThreadDetach();
+	}
 	return true;
 }
 #endif
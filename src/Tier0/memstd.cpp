@@ -21,6 +21,7 @@
 #endif
 
 #include <malloc.h>
+#include <new>
 #include <algorithm>
 #include "tier0/dbg.h"
 #include "tier0/memalloc.h"
@@ -87,6 +88,38 @@ IMemAlloc *g_pMemAlloc = &s_StdMemAlloc;
 IMemAlloc *g_pActualAlloc = &s_StdMemAlloc;
 #endif
 
+//-----------------------------------------------------------------------------
+// Thread exit notification for the small block heap's thread caches. Win32 DLL
+// builds get DLL_THREAD_DETACH in the tier0 DllMain. On Linux a thread specific
+// key's destructor runs as each thread that set it exits.
+//-----------------------------------------------------------------------------
+void MemStd_OnThreadDetach();
+
+#if defined(_LINUX)
+static pthread_key_t s_ThreadExitKey;
+static pthread_once_t s_ThreadExitKeyOnce = PTHREAD_ONCE_INIT;
+
+static void OnThreadExit( void * )
+{
+	MemStd_OnThreadDetach();
+}
+
+static void CreateThreadExitKey()
+{
+	pthread_key_create( &s_ThreadExitKey, OnThreadExit );
+}
+
+inline void WatchThreadExit()
+{
+	pthread_once( &s_ThreadExitKeyOnce, CreateThreadExitKey );
+	pthread_setspecific( s_ThreadExitKey, (void *)1 );
+}
+#else
+inline void WatchThreadExit()
+{
+}
+#endif
+
 #ifdef _WIN32
 //-----------------------------------------------------------------------------
 // Small block heap (multi-pool)
@@ -120,6 +153,13 @@ void CSmallBlockPool::Init( unsigned nBlockSize, byte *pBase, unsigned initialCo
 	m_pCommitLimit = m_pNextAlloc = m_pBase = pBase;
 	m_pAllocLimit = m_pBase + MAX_POOL_REGION;
 
+	m_nMagazineSize = SBH_MAGAZINE_BYTES / nBlockSize;
+	if ( m_nMagazineSize > SBH_MAX_MAGAZINE )
+		m_nMagazineSize = SBH_MAX_MAGAZINE;
+	else if ( m_nMagazineSize < 2 )
+		m_nMagazineSize = 2;
+	m_nDepot = 0;
+
 	if ( initialCommit )
 	{
 		initialCommit = MemAlign( initialCommit, PAGE_SIZE );
@@ -147,45 +187,57 @@ void *CSmallBlockPool::Alloc()
 	void *pResult = m_FreeList.Pop();
 	if ( !pResult )
 	{
-		int nBlockSize = m_nBlockSize;
-		byte *pCommitLimit;
-		byte *pNextAlloc;
-		for (;;)
+		int nBlocks;
+		pResult = AllocRun( 1, &nBlocks );
+	}
+	return pResult;
+}
+
+// Carves up to nWanted contiguous never-used blocks off the committed region,
+// committing more if it's exhausted.
+byte *CSmallBlockPool::AllocRun( int nWanted, int *pnBlocks )
+{
+	int nBlockSize = m_nBlockSize;
+	byte *pCommitLimit;
+	byte *pNextAlloc;
+	for (;;)
+	{
+		pCommitLimit = m_pCommitLimit;
+		pNextAlloc = m_pNextAlloc;
+		int nAvailable = ( pCommitLimit - pNextAlloc ) / nBlockSize;
+		if ( nAvailable > 0 )
 		{
-			pCommitLimit = m_pCommitLimit;
-			pNextAlloc = m_pNextAlloc;
-			if ( pNextAlloc + nBlockSize <= pCommitLimit )
+			int nBlocks = min( nWanted, nAvailable );
+			if ( m_pNextAlloc.AssignIf( pNextAlloc, pNextAlloc + nBlocks * nBlockSize ) )
 			{
-				if ( m_pNextAlloc.AssignIf( pNextAlloc, pNextAlloc + m_nBlockSize ) )
-				{
-					pResult = pNextAlloc;
-					break;
-				}
+				*pnBlocks = nBlocks;
+				return pNextAlloc;
 			}
-			else
+		}
+		else
+		{
+			AUTO_LOCK( m_CommitMutex );
+			if ( pCommitLimit == m_pCommitLimit )
 			{
-				AUTO_LOCK( m_CommitMutex );
-				if ( pCommitLimit == m_pCommitLimit )
+				if ( pCommitLimit + COMMIT_SIZE <= m_pAllocLimit )
 				{
-					if ( pCommitLimit + COMMIT_SIZE <= m_pAllocLimit )
-					{
-						if ( !VirtualAlloc( pCommitLimit, COMMIT_SIZE, VA_COMMIT_FLAGS, PAGE_READWRITE ) )
-						{
-							Assert( 0 );
-							return NULL;
-						}
-
-						m_pCommitLimit = pCommitLimit + COMMIT_SIZE;
-					}
-					else
+					if ( !VirtualAlloc( pCommitLimit, COMMIT_SIZE, VA_COMMIT_FLAGS, PAGE_READWRITE ) )
 					{
+						Assert( 0 );
+						*pnBlocks = 0;
 						return NULL;
 					}
+
+					m_pCommitLimit = pCommitLimit + COMMIT_SIZE;
+				}
+				else
+				{
+					*pnBlocks = 0;
+					return NULL;
 				}
 			}
 		}
 	}
-	return pResult;
 }
 
 void CSmallBlockPool::Free( void *p )
@@ -195,10 +247,11 @@ void CSmallBlockPool::Free( void *p )
 	m_FreeList.Push( p );
 }
 
-// Count the free blocks.  
+// Count the free blocks held by the pool, including parked magazines. Blocks
+// sitting in thread caches are counted by the heap.
 int CSmallBlockPool::CountFreeBlocks()
 {
-	return m_FreeList.Count();
+	return m_FreeList.Count() + CountCachedBlocks();
 }
 
 // Size of committed memory managed by this heap:
@@ -229,7 +282,7 @@ int CSmallBlockPool::Compact()
 	if ( m_FreeList.Count() )
 	{
 		int i;
-		int nFree = CountFreeBlocks();
+		int nFree = m_FreeList.Count();
 		FreeBlock_t **pSortArray = (FreeBlock_t **)malloc( nFree * sizeof(FreeBlock_t *) ); // can't use new because will reenter
 
 		if ( !pSortArray )
@@ -289,6 +342,115 @@ int CSmallBlockPool::Compact()
 	return nBytesFreed;
 }
 
+int CSmallBlockPool::GetMagazineSize()
+{
+	return m_nMagazineSize;
+}
+
+// Hands out a chain of up to one magazine of blocks, linked through Next.
+int CSmallBlockPool::AllocMagazine( TSLNodeBase_t **ppChain )
+{
+	{
+		AUTO_LOCK( m_DepotMutex );
+		if ( m_nDepot )
+		{
+			*ppChain = m_Depot[--m_nDepot];
+			return m_nMagazineSize;
+		}
+	}
+
+	// Free list blocks go one at a time: walking past the head of a lock free list
+	// can touch blocks other threads have already popped and reused. Whatever it
+	// can't cover comes off the allocation cursor in one bump.
+	TSLNodeBase_t *pChain = NULL;
+	int nBlocks;
+	for ( nBlocks = 0; nBlocks < m_nMagazineSize; nBlocks++ )
+	{
+		TSLNodeBase_t *pBlock = m_FreeList.Pop();
+		if ( !pBlock )
+			break;
+		pBlock->Next = pChain;
+		pChain = pBlock;
+	}
+
+	if ( nBlocks < m_nMagazineSize )
+	{
+		int nRun;
+		byte *pRun = AllocRun( m_nMagazineSize - nBlocks, &nRun );
+		for ( int i = nRun - 1; i >= 0; i-- )
+		{
+			TSLNodeBase_t *pBlock = (TSLNodeBase_t *)( pRun + i * m_nBlockSize );
+			pBlock->Next = pChain;
+			pChain = pBlock;
+		}
+		nBlocks += nRun;
+	}
+
+	*ppChain = pChain;
+	return nBlocks;
+}
+
+void CSmallBlockPool::FreeMagazine( TSLNodeBase_t *pChain, int nBlocks )
+{
+	if ( nBlocks == m_nMagazineSize )
+	{
+		AUTO_LOCK( m_DepotMutex );
+		if ( m_nDepot < SBH_DEPOT_SIZE )
+		{
+			m_Depot[m_nDepot++] = pChain;
+			return;
+		}
+	}
+
+	FreeChain( pChain );
+}
+
+// Returns a chain of cached blocks to the shared free list
+void CSmallBlockPool::FreeChain( TSLNodeBase_t *pChain )
+{
+	if ( !pChain )
+	{
+		return;
+	}
+
+	TSLNodeBase_t *pLast = pChain;
+	int nBlocks = 1;
+	while ( pLast->Next )
+	{
+		pLast = pLast->Next;
+		nBlocks++;
+	}
+	m_FreeList.PushChain( pChain, pLast, nBlocks );
+}
+
+void CSmallBlockPool::FlushDepot()
+{
+	FreeBlock_t *pDepot[SBH_DEPOT_SIZE];
+	int nDepot;
+	{
+		AUTO_LOCK( m_DepotMutex );
+		nDepot = m_nDepot;
+		memcpy( pDepot, m_Depot, nDepot * sizeof(FreeBlock_t *) );
+		m_nDepot = 0;
+	}
+
+	for ( int i = 0; i < nDepot; i++ )
+	{
+		FreeChain( pDepot[i] );
+	}
+}
+
+// Blocks parked in the depot. Blocks in thread caches are counted by the heap.
+int CSmallBlockPool::CountCachedBlocks()
+{
+	return m_nDepot * m_nMagazineSize;
+}
+
+int CSmallBlockPool::CountDepotMagazines()
+{
+	return m_nDepot;
+}
+
 
 //-----------------------------------------------------------------------------
 //
@@ -296,6 +458,10 @@ int CSmallBlockPool::Compact()
 #define GetInitialCommitForPool( i ) 0
 
 CSmallBlockHeap::CSmallBlockHeap()
+  :	m_pThreadCaches( NULL ),
+	m_nRetiredHits( 0 ),
+	m_nRetiredRefills( 0 ),
+	m_nRetiredReturns( 0 )
 {
 	if ( !UsingSBH() )
 	{
@@ -444,7 +610,7 @@ void *CSmallBlockHeap::Alloc( size_t nBytes )
 	Assert( ShouldUse( nBytes ) );
 	CSmallBlockPool *pPool = FindPool( nBytes );
 	
-	void *p = pPool->Alloc();
+	void *p = PoolAlloc( pPool );
 	if ( p )
 	{
 		return p;
@@ -452,7 +618,7 @@ void *CSmallBlockHeap::Alloc( size_t nBytes )
 
 	if ( s_StdMemAlloc.CallAllocFailHandler( nBytes ) >= nBytes )
 	{
-		p = pPool->Alloc();
+		p = PoolAlloc( pPool );
 		if ( p )
 		{
 			return p;
@@ -486,13 +652,13 @@ void *CSmallBlockHeap::Realloc( void *p, size_t nBytes )
 
 	if ( pNewPool )
 	{
-		pNewBlock = pNewPool->Alloc();
+		pNewBlock = PoolAlloc( pNewPool );
 
 		if ( !pNewBlock )
 		{
 			if ( s_StdMemAlloc.CallAllocFailHandler( nBytes ) >= nBytes )
 			{
-				pNewBlock = pNewPool->Alloc();
+				pNewBlock = PoolAlloc( pNewPool );
 			}
 		}
 	}
@@ -512,7 +678,7 @@ void *CSmallBlockHeap::Realloc( void *p, size_t nBytes )
 		memcpy( pNewBlock, p, nBytesCopy );
 	}
 
-	pOldPool->Free( p );
+	PoolFree( pOldPool, p );
 
 	return pNewBlock;
 }
@@ -520,7 +686,7 @@ void *CSmallBlockHeap::Realloc( void *p, size_t nBytes )
 void CSmallBlockHeap::Free( void *p )
 {
 	CSmallBlockPool *pPool = FindPool( p );
-	pPool->Free( p );
+	PoolFree( pPool, p );
 }
 
 size_t CSmallBlockHeap::GetSize( void *p )
@@ -533,6 +699,30 @@ void CSmallBlockHeap::DumpStats( FILE *pFile )
 {
 	bool bSpew = true;
 
+	// The pools see blocks handed to a thread cache as allocated; move the ones
+	// still sitting in the bins over to free/cached
+	int nThreadCaches = 0;
+	unsigned nHits = 0, nRefills = 0, nReturns = 0;
+	int nBinned[NUM_POOLS] = { 0 };
+	{
+		AUTO_LOCK( m_ThreadCacheMutex );
+		for ( CSmallBlockThreadCache *pCache = m_pThreadCaches; pCache; pCache = pCache->m_pNext )
+		{
+			AUTO_LOCK( pCache->m_Mutex );
+			nThreadCaches++;
+			nHits += pCache->m_nHits;
+			nRefills += pCache->m_nRefills;
+			nReturns += pCache->m_nReturns;
+			for ( int i = 0; i < NUM_POOLS; i++ )
+			{
+				nBinned[i] += pCache->m_Bins[i].m_nCount;
+			}
+		}
+		nHits += m_nRetiredHits;
+		nRefills += m_nRetiredRefills;
+		nReturns += m_nRetiredReturns;
+	}
+
 	if ( pFile )
 	{
 		for( int i = 0; i < NUM_POOLS; i++ )
@@ -541,11 +731,20 @@ void CSmallBlockHeap::DumpStats( FILE *pFile )
 			fprintf( pFile, "Pool %i: Size: %u Allocated: %i Free: %i Committed: %i CommittedSize: %i\n", 
 				i, 
 				m_Pools[i].GetBlockSize(), 
-				m_Pools[i].CountAllocatedBlocks(), 
-				m_Pools[i].CountFreeBlocks(),
+				m_Pools[i].CountAllocatedBlocks() - nBinned[i], 
+				m_Pools[i].CountFreeBlocks() + nBinned[i],
 				m_Pools[i].CountCommittedBlocks(), 
 				m_Pools[i].GetCommittedSize() );
 		}
+		for( int i = 0; i < NUM_POOLS; i++ )
+		{
+			fprintf( pFile, "Cache %i: Cached: %i Magazine: %i Depot: %i\n", 
+				i, 
+				m_Pools[i].CountCachedBlocks() + nBinned[i], 
+				m_Pools[i].GetMagazineSize(), 
+				m_Pools[i].CountDepotMagazines() );
+		}
+		fprintf( pFile, "ThreadCaches: %i Hits: %u Refills: %u Returns: %u\n", nThreadCaches, nHits, nRefills, nReturns );
 		bSpew = false;
 	}
 
@@ -553,29 +752,187 @@ void CSmallBlockHeap::DumpStats( FILE *pFile )
 	{
 		unsigned bytesCommitted = 0;
 		unsigned bytesAllocated = 0;
+		unsigned bytesCached = 0;
 
 		for( int i = 0; i < NUM_POOLS; i++ )
 		{
-			Msg( "Pool %i: (size: %u) blocks: allocated:%i free:%i committed:%i (committed size:%u kb)\n",i, m_Pools[i].GetBlockSize(),m_Pools[i].CountAllocatedBlocks(), m_Pools[i].CountFreeBlocks(),m_Pools[i].CountCommittedBlocks(), m_Pools[i].GetCommittedSize() / 1024);
+			int nAllocated = m_Pools[i].CountAllocatedBlocks() - nBinned[i];
+			int nCached = m_Pools[i].CountCachedBlocks() + nBinned[i];
+			Msg( "Pool %i: (size: %u) blocks: allocated:%i free:%i (cached:%i) committed:%i (committed size:%u kb)\n",i, m_Pools[i].GetBlockSize(),nAllocated, m_Pools[i].CountFreeBlocks() + nBinned[i], nCached, m_Pools[i].CountCommittedBlocks(), m_Pools[i].GetCommittedSize() / 1024);
 
 			bytesCommitted += m_Pools[i].GetCommittedSize();
-			bytesAllocated += ( m_Pools[i].CountAllocatedBlocks() * m_Pools[i].GetBlockSize() );
+			bytesAllocated += ( nAllocated * m_Pools[i].GetBlockSize() );
+			bytesCached += ( nCached * m_Pools[i].GetBlockSize() );
 		}
 
-		Msg( "Totals: Committed:%u kb Allocated:%u kb\n", bytesCommitted / 1024, bytesAllocated / 1024 );
+		Msg( "Totals: Committed:%u kb Allocated:%u kb Cached:%u kb\n", bytesCommitted / 1024, bytesAllocated / 1024, bytesCached / 1024 );
+		Msg( "Thread caches: %i hits:%u refills:%u returns:%u\n", nThreadCaches, nHits, nRefills, nReturns );
 	}
 }
 
 int CSmallBlockHeap::Compact()
 {
+	// Everything parked in thread caches and depots has to be back on the
+	// free lists, or the pools can't pull their high water marks down
+	{
+		AUTO_LOCK( m_ThreadCacheMutex );
+		for ( CSmallBlockThreadCache *pCache = m_pThreadCaches; pCache; pCache = pCache->m_pNext )
+		{
+			FlushThreadCache( pCache );
+		}
+	}
+
 	int nBytesFreed = 0;
 	for( int i = 0; i < NUM_POOLS; i++ )
 	{
+		m_Pools[i].FlushDepot();
 		nBytesFreed += m_Pools[i].Compact();
 	}
 	return nBytesFreed;
 }
 
+void CSmallBlockHeap::ReleaseThreadCache()
+{
+	CSmallBlockThreadCache *pCache = m_ThreadCache.Get();
+	if ( !pCache )
+	{
+		return;
+	}
+	m_ThreadCache.Set( NULL );
+
+	{
+		AUTO_LOCK( m_ThreadCacheMutex );
+		CSmallBlockThreadCache **ppCur = &m_pThreadCaches;
+		while ( *ppCur != pCache )
+		{
+			ppCur = &(*ppCur)->m_pNext;
+		}
+		*ppCur = pCache->m_pNext;
+
+		m_nRetiredHits += pCache->m_nHits;
+		m_nRetiredRefills += pCache->m_nRefills;
+		m_nRetiredReturns += pCache->m_nReturns;
+	}
+
+	FlushThreadCache( pCache );
+	pCache->~CSmallBlockThreadCache();
+	free( pCache );
+}
+
+void *CSmallBlockHeap::PoolAlloc( CSmallBlockPool *pPool )
+{
+#ifndef NO_SBH_THREAD_CACHE
+	CSmallBlockThreadCache *pCache = GetThreadCache();
+	if ( pCache )
+	{
+		AUTO_LOCK( pCache->m_Mutex );
+		CSmallBlockThreadCache::Bin_t &bin = pCache->m_Bins[pPool - m_Pools];
+		if ( bin.m_pHead )
+		{
+			pCache->m_nHits++;
+		}
+		else
+		{
+			pCache->m_nRefills++;
+			bin.m_nCount = pPool->AllocMagazine( &bin.m_pHead );
+			if ( !bin.m_pHead )
+			{
+				return NULL;
+			}
+		}
+
+		TSLNodeBase_t *pBlock = bin.m_pHead;
+		bin.m_pHead = pBlock->Next;
+		bin.m_nCount--;
+		return pBlock;
+	}
+#endif
+	return pPool->Alloc();
+}
+
+void CSmallBlockHeap::PoolFree( CSmallBlockPool *pPool, void *p )
+{
+	Assert( pPool->IsOwner( p ) );
+
+#ifndef NO_SBH_THREAD_CACHE
+	CSmallBlockThreadCache *pCache = GetThreadCache();
+	if ( pCache )
+	{
+		AUTO_LOCK( pCache->m_Mutex );
+		CSmallBlockThreadCache::Bin_t &bin = pCache->m_Bins[pPool - m_Pools];
+
+		// Keep up to two magazines. When both are full, the most recently freed
+		// (and most likely still in this core's cache) stays, the other goes back.
+		int nMagazine = pPool->GetMagazineSize();
+		if ( bin.m_nCount >= 2 * nMagazine )
+		{
+			TSLNodeBase_t *pLast = bin.m_pHead;
+			for ( int i = 1; i < nMagazine; i++ )
+			{
+				pLast = pLast->Next;
+			}
+
+			pPool->FreeMagazine( pLast->Next, bin.m_nCount - nMagazine );
+			pLast->Next = NULL;
+			bin.m_nCount = nMagazine;
+			pCache->m_nReturns++;
+		}
+
+		TSLNodeBase_t *pBlock = (TSLNodeBase_t *)p;
+		pBlock->Next = bin.m_pHead;
+		bin.m_pHead = pBlock;
+		bin.m_nCount++;
+		return;
+	}
+#endif
+	pPool->Free( p );
+}
+
+CSmallBlockThreadCache *CSmallBlockHeap::GetThreadCache()
+{
+	CSmallBlockThreadCache *pCache = m_ThreadCache.Get();
+	if ( pCache )
+	{
+		return pCache;
+	}
+
+	// Can't use new because will reenter
+	void *pMem = malloc( sizeof(CSmallBlockThreadCache) );
+	if ( !pMem )
+	{
+		return NULL;
+	}
+
+	pCache = new ( pMem ) CSmallBlockThreadCache;
+	memset( pCache->m_Bins, 0, sizeof(pCache->m_Bins) );
+	pCache->m_nHits = pCache->m_nRefills = pCache->m_nReturns = 0;
+
+	{
+		AUTO_LOCK( m_ThreadCacheMutex );
+		pCache->m_pNext = m_pThreadCaches;
+		m_pThreadCaches = pCache;
+	}
+
+	m_ThreadCache.Set( pCache );
+	WatchThreadExit();
+	return pCache;
+}
+
+void CSmallBlockHeap::FlushThreadCache( CSmallBlockThreadCache *pCache )
+{
+	AUTO_LOCK( pCache->m_Mutex );
+	for ( int i = 0; i < NUM_POOLS; i++ )
+	{
+		CSmallBlockThreadCache::Bin_t &bin = pCache->m_Bins[i];
+		if ( bin.m_pHead )
+		{
+			m_Pools[i].FreeChain( bin.m_pHead );
+			bin.m_pHead = NULL;
+			bin.m_nCount = 0;
+		}
+	}
+}
+
 CSmallBlockPool *CSmallBlockHeap::FindPool( size_t nBytes )
 {
 	return m_PoolLookup[(nBytes - 1) >> 2];
@@ -1284,3 +1641,13 @@ size_t CStdMemAlloc::MemoryAllocFailed()
 #endif
 
 #endif // STEAM
+
+//-----------------------------------------------------------------------------
+// Called by the tier0 DllMain, or the thread exit key on Linux, as each thread exits
+//-----------------------------------------------------------------------------
+void MemStd_OnThreadDetach()
+{
+#if !defined(STEAM) && !defined(NO_MALLOC_OVERRIDE) && !defined(_DEBUG) && !defined(USE_MEM_DEBUG) && defined(_WIN32)
+	s_StdMemAlloc.m_SmallBlockHeap.ReleaseThreadCache();
+#endif
+}
@@ -44,6 +44,13 @@
 #endif
 #define NUM_POOLS		42
 
+// Per-thread caching of small blocks. Blocks move between a thread's cache and
+// the shared pools a magazine (a chain of blocks) at a time, so the interlocked
+// free list heads are touched once per magazine instead of once per block.
+#define SBH_MAGAZINE_BYTES	2048
+#define SBH_MAX_MAGAZINE	32
+#define SBH_DEPOT_SIZE		16
+
 class CSmallBlockPool
 {
 public:
@@ -58,7 +65,17 @@ public:
 	int CountAllocatedBlocks();
 	int Compact();
 
+	// Magazine transfers for the thread caches
+	int GetMagazineSize();
+	int AllocMagazine( TSLNodeBase_t **ppChain );
+	void FreeMagazine( TSLNodeBase_t *pChain, int nBlocks );
+	void FreeChain( TSLNodeBase_t *pChain );
+	void FlushDepot();
+	int CountCachedBlocks();
+	int CountDepotMagazines();
+
 private:
+	byte *AllocRun( int nWanted, int *pnBlocks );
 
 	typedef TSLNodeBase_t FreeBlock_t;
 	class CFreeList : public CTSListBase
@@ -77,6 +94,33 @@ private:
 	byte *			m_pBase;
 
 	CThreadFastMutex m_CommitMutex;
+
+	// Full magazines parked between threads
+	int				m_nMagazineSize;
+	FreeBlock_t *	m_Depot[SBH_DEPOT_SIZE];
+	int				m_nDepot;
+	CThreadFastMutex m_DepotMutex;
+};
+
+
+class CSmallBlockThreadCache
+{
+public:
+	struct Bin_t
+	{
+		TSLNodeBase_t *	m_pHead;
+		int				m_nCount;
+	};
+
+	// Only contended when Compact() or thread exit drains the cache
+	CThreadFastMutex m_Mutex;
+	Bin_t			m_Bins[NUM_POOLS];
+
+	unsigned		m_nHits;
+	unsigned		m_nRefills;
+	unsigned		m_nReturns;
+
+	CSmallBlockThreadCache *m_pNext;
 };
 
 
@@ -93,14 +137,29 @@ public:
 	void DumpStats( FILE *pFile = NULL );
 	int Compact();
 
+	// Returns the calling thread's cached blocks to the pools
+	void ReleaseThreadCache();
+
 private:
 	CSmallBlockPool *FindPool( size_t nBytes );
 	CSmallBlockPool *FindPool( void *p );
 
+	void *PoolAlloc( CSmallBlockPool *pPool );
+	void PoolFree( CSmallBlockPool *pPool, void *p );
+	CSmallBlockThreadCache *GetThreadCache();
+	void FlushThreadCache( CSmallBlockThreadCache *pCache );
+
 	CSmallBlockPool *m_PoolLookup[MAX_SBH_BLOCK >> 2];
 	CSmallBlockPool m_Pools[NUM_POOLS];
 	byte *m_pBase;
 	byte *m_pLimit;
+
+	CThreadLocal<CSmallBlockThreadCache *> m_ThreadCache;
+	CSmallBlockThreadCache *m_pThreadCaches;
+	CThreadFastMutex m_ThreadCacheMutex;
+	unsigned m_nRetiredHits;
+	unsigned m_nRetiredRefills;
+	unsigned m_nRetiredReturns;
 };
 
 #ifdef USE_PHYSICAL_SMALL_BLOCK_HEAP
@@ -23,6 +23,7 @@
 #include "tier0/mem.h"
 #include "utlvector.h"
 #include "utlbuffer.h"
+#include "utlmap.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include <tier0/memdbgon.h>
@@ -35,6 +36,12 @@ static char s_pTokenBuf[KEYVALUES_TOKEN_SIZE];
 
 #define INTERNALWRITE( pData, len ) InternalWrite( filesystem, f, pBuf, pData, len )
 
+enum
+{
+	KV_ARENA_NODE	= 0x01,		// the node lives in an arena block
+	KV_ARENA_VALUE	= 0x02,		// m_sValue points into an arena block
+};
+
 
 // a simple class to keep track of a stack of valid parsed symbols
 const int MAX_ERROR_STACK = 64;
@@ -287,6 +294,7 @@ void KeyValues::Init()
 	m_pValue = NULL;
 	
 	m_bHasEscapeSequences = false;
+	m_nArenaFlags = 0;
 
 	// for future proof
 	memset( unused, 0, sizeof(unused) );
@@ -313,20 +321,17 @@ void KeyValues::RemoveEverything()
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		DeleteKey( dat );
 	}
 
 	for ( dat = m_pPeer; dat && dat != this; dat = datNext )
 	{
 		datNext = dat->m_pPeer;
 		dat->m_pPeer = NULL;
-		delete dat;
+		DeleteKey( dat );
 	}
 
-	delete [] m_sValue;
-	m_sValue = NULL;
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	FreeAllocatedValue();
 }
 
 //-----------------------------------------------------------------------------
@@ -1274,11 +1279,8 @@ void KeyValues::SetColor( const char *keyName, Color value)
 
 void KeyValues::SetStringValue( char const *strValue )
 {
-	// delete the old value
-	delete [] m_sValue;
-	// make sure we're not storing the WSTRING  - as we're converting over to STRING
-	delete [] m_wsValue;
-	m_wsValue = NULL;
+	// delete the old value, including the WSTRING - as we're converting over to STRING
+	FreeAllocatedValue();
 
 	if (!strValue)
 	{
@@ -1303,11 +1305,8 @@ void KeyValues::SetString( const char *keyName, const char *value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, including the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1332,11 +1331,8 @@ void KeyValues::SetWString( const char *keyName, const wchar_t *value )
 	KeyValues *dat = FindKey( keyName, true );
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_wsValue;
-		// make sure we're not storing the STRING  - as we're converting over to WSTRING
-		delete [] dat->m_sValue;
-		dat->m_sValue = NULL;
+		// delete the old value, including the STRING - as we're converting over to WSTRING
+		dat->FreeAllocatedValue();
 
 		if (!value)
 		{
@@ -1376,11 +1372,8 @@ void KeyValues::SetUint64( const char *keyName, uint64 value )
 
 	if ( dat )
 	{
-		// delete the old value
-		delete [] dat->m_sValue;
-		// make sure we're not storing the WSTRING  - as we're converting over to STRING
-		delete [] dat->m_wsValue;
-		dat->m_wsValue = NULL;
+		// delete the old value, including the WSTRING - as we're converting over to STRING
+		dat->FreeAllocatedValue();
 
 		dat->m_sValue = new char[sizeof(uint64)];
 		*((uint64 *)dat->m_sValue) = value;
@@ -1430,6 +1423,7 @@ void KeyValues::RecursiveCopyKeyValues( KeyValues& src )
 	if( !src.m_pSub )
 	{
 		m_iDataType = src.m_iDataType;
+		m_nArenaFlags &= ~KV_ARENA_VALUE;	// any value set below is our own
 		char buf[256];
 		switch( src.m_iDataType )
 		{
@@ -1646,7 +1640,7 @@ bool KeyValues::IsEmpty(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::Clear( void )
 {
-	delete m_pSub;
+	DeleteKey( m_pSub );
 	m_pSub = NULL;
 	m_iDataType = TYPE_NONE;
 }
@@ -1668,7 +1662,7 @@ KeyValues::types_t KeyValues::GetDataType(const char *keyName)
 //-----------------------------------------------------------------------------
 void KeyValues::deleteThis()
 {
-	delete this;
+	DeleteKey( this );
 }
 
 //-----------------------------------------------------------------------------
@@ -2055,11 +2049,7 @@ void KeyValues::RecursiveLoadFromBuffer( char const *resourceName, CUtlBuffer &b
 				break;
 			}
 			
-			if (dat->m_sValue)
-			{
-				delete[] dat->m_sValue;
-				dat->m_sValue = NULL;
-			}
+			dat->FreeAllocatedValue();
 
 			int len = Q_strlen( value );
 
@@ -2330,6 +2320,452 @@ bool KeyValues::ReadAsBinary( CUtlBuffer &buffer )
 	return buffer.IsValid();
 }
 
+//-----------------------------------------------------------------------------
+// Compiled KeyValues. Key names are stored once so loading looks each one up
+// once, nodes are flattened in pre-order so sub and peer links always point
+// forward, and names and values share one string pool that is copied as is.
+//-----------------------------------------------------------------------------
+#define KEYVALUES_COMPILED_ID		(('1'<<24)|('C'<<16)|('V'<<8)|('K'))
+#define KEYVALUES_COMPILED_VERSION	1
+
+struct KeyValuesCompiledHeader_t
+{
+	int		m_nId;
+	int		m_nVersion;
+	int		m_nNames;
+	int		m_nNodes;
+	int		m_nPoolSize;
+};
+
+struct KeyValuesCompiledNode_t
+{
+	int				m_nName;		// index into the name table
+	int				m_nSub;			// node index, -1 if none
+	int				m_nPeer;		// node index, -1 if none
+	unsigned char	m_nDataType;
+	unsigned char	m_bHasEscapeSequences;
+	unsigned short	m_nPad;
+	union
+	{
+		int				m_iValue;
+		float			m_flValue;
+		int				m_nValueOffset;	// TYPE_STRING and TYPE_UINT64, into the pool. -1 for a NULL string
+		unsigned char	m_Color[4];
+	};
+};
+
+struct KeyValuesCompilePending_t
+{
+	KeyValues	*m_pKeyValues;
+	int			m_nReferrer;	// node that links to this one, -1 for the first
+	bool		m_bSub;
+};
+
+// An arena block starts with this header, and each node in it is preceded by a pointer back to it
+struct KeyValuesArena_t
+{
+	int		m_nLiveNodes;
+};
+
+#define KEYVALUES_ARENA_HEADER_SIZE		ALIGN_VALUE( sizeof( KeyValuesArena_t ), 8 )
+#define KEYVALUES_ARENA_SLOT_SIZE		ALIGN_VALUE( sizeof( KeyValuesArena_t * ) + sizeof( KeyValues ), 8 )
+
+static inline KeyValues *GetKeyValuesArenaNode( byte *pBlock, int nNode )
+{
+	// node 0 is the key ReadAsCompiled was called on, the rest follow the header
+	byte *pSlot = pBlock + KEYVALUES_ARENA_HEADER_SIZE + ( nNode - 1 ) * KEYVALUES_ARENA_SLOT_SIZE;
+	return (KeyValues *)( pSlot + sizeof( KeyValuesArena_t * ) );
+}
+
+static inline KeyValuesArena_t *GetKeyValuesArena( const void *pNode )
+{
+	return *( (KeyValuesArena_t **)pNode - 1 );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Called for every arena node as it is deleted, the block goes with the last one
+//-----------------------------------------------------------------------------
+static void ReleaseKeyValuesArenaNode( void *pNode )
+{
+	KeyValuesArena_t *pArena = GetKeyValuesArena( pNode );
+	Assert( pArena->m_nLiveNodes > 0 );
+	if ( --pArena->m_nLiveNodes == 0 )
+	{
+		free( pArena );
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Destroys a key. Arena nodes are only destructed and given back to
+//			their block, everything else goes through operator delete.
+//-----------------------------------------------------------------------------
+void KeyValues::DeleteKey( KeyValues *pKey )
+{
+	if ( !pKey )
+		return;
+
+	// the flags have to be read while the key is still alive
+	if ( pKey->m_nArenaFlags & KV_ARENA_NODE )
+	{
+		pKey->~KeyValues();
+		ReleaseKeyValuesArenaNode( pKey );
+		return;
+	}
+
+	delete pKey;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Frees the string and wide string values. Strings in an arena go with the arena.
+//-----------------------------------------------------------------------------
+void KeyValues::FreeAllocatedValue()
+{
+	if ( !( m_nArenaFlags & KV_ARENA_VALUE ) )
+	{
+		delete [] m_sValue;
+	}
+	m_nArenaFlags &= ~KV_ARENA_VALUE;
+	m_sValue = NULL;
+
+	delete [] m_wsValue;
+	m_wsValue = NULL;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Writes this key and its peers in compiled form
+//-----------------------------------------------------------------------------
+bool KeyValues::WriteAsCompiled( CUtlBuffer &buffer )
+{
+	CUtlVector< KeyValuesCompiledNode_t > nodes;
+	CUtlVector< int > nameOffsets;
+	CUtlMap< int, int, int > nameIndices( DefLessFunc( int ) );
+	CUtlBuffer pool;
+
+	CUtlVector< KeyValuesCompilePending_t > pending;
+	KeyValuesCompilePending_t first = { this, -1, false };
+	pending.AddToTail( first );
+
+	while ( pending.Count() )
+	{
+		KeyValuesCompilePending_t current = pending.Tail();
+		pending.Remove( pending.Count() - 1 );
+
+		KeyValues *dat = current.m_pKeyValues;
+		if ( dat->m_pChain )
+			return false;
+
+		int nNode = nodes.AddToTail();
+		if ( current.m_nReferrer >= 0 )
+		{
+			if ( current.m_bSub )
+			{
+				nodes[current.m_nReferrer].m_nSub = nNode;
+			}
+			else
+			{
+				nodes[current.m_nReferrer].m_nPeer = nNode;
+			}
+		}
+
+		KeyValuesCompiledNode_t &node = nodes[nNode];
+		Q_memset( &node, 0, sizeof( node ) );
+		node.m_nSub = -1;
+		node.m_nPeer = -1;
+		node.m_nDataType = dat->m_iDataType;
+		node.m_bHasEscapeSequences = dat->m_bHasEscapeSequences;
+
+		int nName = nameIndices.Find( dat->m_iKeyName );
+		if ( nName == nameIndices.InvalidIndex() )
+		{
+			nName = nameIndices.Insert( dat->m_iKeyName, nameOffsets.Count() );
+			nameOffsets.AddToTail( pool.TellPut() );
+
+			const char *pName = dat->GetName();
+			pool.Put( pName, Q_strlen( pName ) + 1 );
+		}
+		node.m_nName = nameIndices[nName];
+
+		switch ( dat->m_iDataType )
+		{
+		case TYPE_NONE:
+			break;
+		case TYPE_STRING:
+			if ( dat->m_sValue )
+			{
+				node.m_nValueOffset = pool.TellPut();
+				pool.Put( dat->m_sValue, Q_strlen( dat->m_sValue ) + 1 );
+			}
+			else
+			{
+				node.m_nValueOffset = -1;
+			}
+			break;
+		case TYPE_INT:
+			node.m_iValue = dat->m_iValue;
+			break;
+		case TYPE_FLOAT:
+			node.m_flValue = dat->m_flValue;
+			break;
+		case TYPE_COLOR:
+			Q_memcpy( node.m_Color, dat->m_Color, sizeof( node.m_Color ) );
+			break;
+		case TYPE_UINT64:
+			while ( pool.TellPut() & 7 )
+			{
+				pool.PutUnsignedChar( 0 );
+			}
+			node.m_nValueOffset = pool.TellPut();
+			pool.Put( dat->m_sValue, sizeof( uint64 ) );
+			break;
+		default:
+			// pointers don't survive a trip through a file, and nothing parsed holds wide strings
+			return false;
+		}
+
+		// peers go on the stack first so a key's subkeys come straight after it
+		if ( dat->m_pPeer )
+		{
+			KeyValuesCompilePending_t peer = { dat->m_pPeer, nNode, false };
+			pending.AddToTail( peer );
+		}
+		if ( dat->m_pSub )
+		{
+			KeyValuesCompilePending_t sub = { dat->m_pSub, nNode, true };
+			pending.AddToTail( sub );
+		}
+	}
+
+	// lets the reader check every string is terminated with a single test
+	pool.PutUnsignedChar( 0 );
+
+	KeyValuesCompiledHeader_t header;
+	header.m_nId = KEYVALUES_COMPILED_ID;
+	header.m_nVersion = KEYVALUES_COMPILED_VERSION;
+	header.m_nNames = nameOffsets.Count();
+	header.m_nNodes = nodes.Count();
+	header.m_nPoolSize = pool.TellPut();
+
+	buffer.Put( &header, sizeof( header ) );
+	buffer.Put( nameOffsets.Base(), nameOffsets.Count() * sizeof( int ) );
+	buffer.Put( nodes.Base(), nodes.Count() * sizeof( KeyValuesCompiledNode_t ) );
+	buffer.Put( pool.Base(), pool.TellPut() );
+
+	return buffer.IsValid();
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Replaces this key and its peers with a compiled tree
+//-----------------------------------------------------------------------------
+bool KeyValues::ReadAsCompiled( const void *pData, int nSize )
+{
+	if ( nSize < (int)sizeof( KeyValuesCompiledHeader_t ) )
+		return false;
+
+	const KeyValuesCompiledHeader_t *pHeader = (const KeyValuesCompiledHeader_t *)pData;
+	if ( pHeader->m_nId != KEYVALUES_COMPILED_ID || pHeader->m_nVersion != KEYVALUES_COMPILED_VERSION ||
+		 pHeader->m_nNames <= 0 || pHeader->m_nNodes <= 0 || pHeader->m_nPoolSize <= 0 )
+		return false;
+
+	int64 nExpectedSize = (int64)sizeof( KeyValuesCompiledHeader_t ) + (int64)pHeader->m_nNames * sizeof( int ) +
+		(int64)pHeader->m_nNodes * sizeof( KeyValuesCompiledNode_t ) + pHeader->m_nPoolSize;
+	if ( nExpectedSize != nSize )
+		return false;
+
+	int nNames = pHeader->m_nNames;
+	int nNodes = pHeader->m_nNodes;
+	int nPoolSize = pHeader->m_nPoolSize;
+	const int *pNameOffsets = (const int *)( pHeader + 1 );
+	const KeyValuesCompiledNode_t *pNodes = (const KeyValuesCompiledNode_t *)( pNameOffsets + nNames );
+	const char *pPool = (const char *)( pNodes + nNodes );
+
+	// Check everything before touching this key so bad data never leaves half a tree behind.
+	// Links only point forward and every node but the first is linked to exactly once,
+	// which rules out cycles and shared nodes.
+	if ( pPool[nPoolSize - 1] != 0 )
+		return false;
+
+	for ( int i = 0; i < nNames; i++ )
+	{
+		if ( pNameOffsets[i] < 0 || pNameOffsets[i] >= nPoolSize )
+			return false;
+	}
+
+	CUtlVector< unsigned char > linked;
+	linked.SetCount( nNodes );
+	Q_memset( linked.Base(), 0, nNodes );
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const KeyValuesCompiledNode_t &node = pNodes[i];
+		if ( node.m_nName < 0 || node.m_nName >= nNames )
+			return false;
+
+		int links[2] = { node.m_nSub, node.m_nPeer };
+		for ( int j = 0; j < 2; j++ )
+		{
+			if ( links[j] == -1 )
+				continue;
+			if ( links[j] <= i || links[j] >= nNodes || linked[links[j]] )
+				return false;
+			linked[links[j]] = 1;
+		}
+
+		switch ( node.m_nDataType )
+		{
+		case TYPE_NONE:
+		case TYPE_INT:
+		case TYPE_FLOAT:
+		case TYPE_COLOR:
+			break;
+		case TYPE_STRING:
+			if ( node.m_nValueOffset < -1 || node.m_nValueOffset >= nPoolSize )
+				return false;
+			break;
+		case TYPE_UINT64:
+			if ( node.m_nValueOffset < 0 || ( node.m_nValueOffset & 7 ) || node.m_nValueOffset + (int)sizeof( uint64 ) > nPoolSize )
+				return false;
+			break;
+		default:
+			return false;
+		}
+	}
+
+	for ( int i = 1; i < nNodes; i++ )
+	{
+		if ( !linked[i] )
+			return false;
+	}
+
+	RemoveEverything();
+	m_pSub = NULL;
+	m_pPeer = NULL;
+
+	CUtlVector< int > symbols;
+	symbols.SetCount( nNames );
+	for ( int i = 0; i < nNames; i++ )
+	{
+		symbols[i] = KeyValuesSystem()->GetSymbolForString( pPool + pNameOffsets[i] );
+	}
+
+	// This key stays where it is, everything else goes into one block along with a copy of the pool
+	byte *pBlock = NULL;
+	char *pArenaPool = NULL;
+	if ( nNodes > 1 )
+	{
+		int nPoolStart = KEYVALUES_ARENA_HEADER_SIZE + ( nNodes - 1 ) * KEYVALUES_ARENA_SLOT_SIZE;
+		pBlock = (byte *)malloc( nPoolStart + nPoolSize );
+		( (KeyValuesArena_t *)pBlock )->m_nLiveNodes = nNodes - 1;
+
+		pArenaPool = (char *)pBlock + nPoolStart;
+		Q_memcpy( pArenaPool, pPool, nPoolSize );
+	}
+
+	for ( int i = 0; i < nNodes; i++ )
+	{
+		const KeyValuesCompiledNode_t &node = pNodes[i];
+
+		KeyValues *dat = this;
+		if ( i > 0 )
+		{
+			dat = GetKeyValuesArenaNode( pBlock, i );
+			*( (KeyValuesArena_t **)dat - 1 ) = (KeyValuesArena_t *)pBlock;
+			dat->Init();
+			dat->m_nArenaFlags = KV_ARENA_NODE;
+		}
+		else
+		{
+			m_pValue = NULL;
+		}
+
+		dat->m_iKeyName = symbols[node.m_nName];
+		dat->m_iDataType = node.m_nDataType;
+		dat->m_bHasEscapeSequences = node.m_bHasEscapeSequences;
+		dat->m_pSub = ( node.m_nSub != -1 ) ? GetKeyValuesArenaNode( pBlock, node.m_nSub ) : NULL;
+		dat->m_pPeer = ( node.m_nPeer != -1 ) ? GetKeyValuesArenaNode( pBlock, node.m_nPeer ) : NULL;
+
+		switch ( node.m_nDataType )
+		{
+		case TYPE_STRING:
+		case TYPE_UINT64:
+			if ( node.m_nValueOffset == -1 )
+				break;
+
+			if ( i > 0 )
+			{
+				dat->m_sValue = pArenaPool + node.m_nValueOffset;
+				dat->m_nArenaFlags |= KV_ARENA_VALUE;
+			}
+			else
+			{
+				int len = ( node.m_nDataType == TYPE_STRING ) ? Q_strlen( pPool + node.m_nValueOffset ) + 1 : sizeof( uint64 );
+				m_sValue = new char[len];
+				Q_memcpy( m_sValue, pPool + node.m_nValueOffset, len );
+			}
+			break;
+		case TYPE_INT:
+			dat->m_iValue = node.m_iValue;
+			break;
+		case TYPE_FLOAT:
+			dat->m_flValue = node.m_flValue;
+			break;
+		case TYPE_COLOR:
+			Q_memcpy( dat->m_Color, node.m_Color, sizeof( dat->m_Color ) );
+			break;
+		default:
+			break;
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Counts the heap blocks held by this key, its subkeys and its peers
+//-----------------------------------------------------------------------------
+int KeyValues::GetAllocationCount()
+{
+	CUtlVector< KeyValuesArena_t * > arenas;
+	CUtlVector< KeyValues * > pending;
+	pending.AddToTail( this );
+
+	int nCount = 0;
+	while ( pending.Count() )
+	{
+		KeyValues *dat = pending.Tail();
+		pending.Remove( pending.Count() - 1 );
+
+		if ( !( dat->m_nArenaFlags & KV_ARENA_NODE ) )
+		{
+			nCount++;
+		}
+		else if ( arenas.Find( GetKeyValuesArena( dat ) ) == arenas.InvalidIndex() )
+		{
+			arenas.AddToTail( GetKeyValuesArena( dat ) );
+			nCount++;
+		}
+
+		if ( dat->m_sValue && !( dat->m_nArenaFlags & KV_ARENA_VALUE ) )
+		{
+			nCount++;
+		}
+		if ( dat->m_wsValue )
+		{
+			nCount++;
+		}
+
+		if ( dat->m_pPeer )
+		{
+			pending.AddToTail( dat->m_pPeer );
+		}
+		if ( dat->m_pSub )
+		{
+			pending.AddToTail( dat->m_pSub );
+		}
+	}
+
+	return nCount;
+}
+
 #include "tier0/memdbgoff.h"
 
 //-----------------------------------------------------------------------------
@@ -0,0 +1,569 @@
+//========= Copyright  1996-2007, Valve Corporation, All rights reserved. ============//
+//
+//	LZFast Codec. Byte oriented LZ77 (LZ4 style sequences) with a single probe hash
+//	match finder.
+//
+//	The compressed stream is a series of sequences:
+//		token		high nibble = literal count, low nibble = match length - LZFAST_MINMATCH
+//					(a nibble of 15 is continued by bytes of 255 and a final byte < 255)
+//		literals
+//		offset		2 bytes little endian, back from the current output position
+//	The last sequence only has literals.
+//
+//=====================================================================================//
+
+#include <stdlib.h>
+#include "tier0/platform.h"
+#include "tier0/dbg.h"
+#include "tier1/lzfast.h"
+#include "tier1/checksum_crc.h"
+#include "tier1/utlvector.h"
+
+// memdbgon must be the last include file in a .cpp file!!!
+#include "tier0/memdbgon.h"
+
+#define LZFAST_MINMATCH		4
+#define LZFAST_LASTLITERALS	5		// the last bytes are always literals
+#define LZFAST_MFLIMIT		12		// no match can start in the last bytes
+#define LZFAST_SKIPSHIFT	6		// speed up when there's nothing to find
+
+// inputs larger than this go through the heap when a dictionary needs to be prepended
+#define LZFAST_MAX_STACK	( 128 * 1024 )
+
+static FORCEINLINE unsigned int LZFast_Read32( const unsigned char *p )
+{
+	return *(const unsigned int *)p;
+}
+
+static FORCEINLINE unsigned int LZFast_Hash( unsigned int nSequence )
+{
+	return ( nSequence * 2654435761U ) >> ( 32 - LZFAST_HASH_BITS );
+}
+
+//-----------------------------------------------------------------------------
+// Writes out a nibble overflow
+//-----------------------------------------------------------------------------
+static FORCEINLINE unsigned char *LZFast_WriteLength( unsigned char *pOutput, int nLength )
+{
+	while ( nLength >= 255 )
+	{
+		*pOutput++ = 255;
+		nLength -= 255;
+	}
+	*pOutput++ = (unsigned char)nLength;
+	return pOutput;
+}
+
+//-----------------------------------------------------------------------------
+// Reads a nibble overflow, returns false if it runs off the end of the input
+//-----------------------------------------------------------------------------
+static FORCEINLINE bool LZFast_ReadLength( const unsigned char *&pInput, const unsigned char *pInputEnd, unsigned int &nLength )
+{
+	unsigned int s;
+	do
+	{
+		if ( pInput >= pInputEnd )
+			return false;
+		s = *pInput++;
+		nLength += s;
+	} while ( s == 255 );
+
+	return true;
+}
+
+
+//-----------------------------------------------------------------------------
+// Dictionary
+//-----------------------------------------------------------------------------
+CLZFastDictionary::CLZFastDictionary()
+{
+	m_pData = NULL;
+	m_nSize = 0;
+	m_nId = 0;
+	m_pHashTable = NULL;
+}
+
+CLZFastDictionary::~CLZFastDictionary()
+{
+	Shutdown();
+}
+
+void CLZFastDictionary::Init( const unsigned char *pData, int nSize )
+{
+	Shutdown();
+
+	if ( !pData || nSize < LZFAST_MINMATCH )
+		return;
+
+	// only the tail is reachable
+	if ( nSize > LZFAST_MAX_DICTIONARY )
+	{
+		pData += nSize - LZFAST_MAX_DICTIONARY;
+		nSize = LZFAST_MAX_DICTIONARY;
+	}
+
+	m_pData = (unsigned char *)malloc( nSize );
+	memcpy( m_pData, pData, nSize );
+	m_nSize = nSize;
+
+	// never hand out an id of 0, that means 'no dictionary'
+	m_nId = CRC32_ProcessSingleBuffer( m_pData, m_nSize );
+	if ( m_nId == 0 )
+	{
+		m_nId = 1;
+	}
+
+	// hash the whole dictionary up front so compression can just copy the table
+	m_pHashTable = (int *)malloc( LZFAST_HASH_SIZE * sizeof( int ) );
+	for ( int i = 0; i < LZFAST_HASH_SIZE; i++ )
+	{
+		m_pHashTable[i] = -LZFAST_MAX_OFFSET - 1;
+	}
+	for ( int i = 0; i + LZFAST_MINMATCH <= m_nSize; i++ )
+	{
+		m_pHashTable[ LZFast_Hash( LZFast_Read32( m_pData + i ) ) ] = i;
+	}
+}
+
+void CLZFastDictionary::Shutdown()
+{
+	if ( m_pData )
+	{
+		free( m_pData );
+		m_pData = NULL;
+	}
+	if ( m_pHashTable )
+	{
+		free( m_pHashTable );
+		m_pHashTable = NULL;
+	}
+	m_nSize = 0;
+	m_nId = 0;
+}
+
+
+//-----------------------------------------------------------------------------
+// Dictionary training
+//-----------------------------------------------------------------------------
+#define LZFAST_TRAIN_HASH_BITS	16
+#define LZFAST_TRAIN_KEY		8		// bytes hashed to find repeats
+#define LZFAST_TRAIN_SEGMENT	32		// bytes copied into the dictionary per repeat
+
+struct LZFastSegment_t
+{
+	int m_nOffset;
+	int m_nLength;
+	int m_nScore;
+};
+
+static int __cdecl LZFastSegmentCompare( const LZFastSegment_t *pLeft, const LZFastSegment_t *pRight )
+{
+	if ( pLeft->m_nScore != pRight->m_nScore )
+		return ( pLeft->m_nScore < pRight->m_nScore ) ? -1 : 1;
+	return pLeft->m_nOffset - pRight->m_nOffset;
+}
+
+static FORCEINLINE unsigned int LZFast_TrainHash( const unsigned char *p )
+{
+	return ( LZFast_Read32( p ) * 2654435761U ^ LZFast_Read32( p + 4 ) * 2246822519U ) >> ( 32 - LZFAST_TRAIN_HASH_BITS );
+}
+
+int CLZFastDictionary::Train( const unsigned char *pSamples, const int *pSampleSizes, int nSamples, unsigned char *pDictionary, int nMaxSize )
+{
+	if ( nMaxSize > LZFAST_MAX_DICTIONARY )
+	{
+		nMaxSize = LZFAST_MAX_DICTIONARY;
+	}
+
+	// Count how many samples each key shows up in
+	const int nTableSize = 1 << LZFAST_TRAIN_HASH_BITS;
+	int *pCounts = (int *)malloc( nTableSize * sizeof( int ) );
+	int *pLastSample = (int *)malloc( nTableSize * sizeof( int ) );
+	memset( pCounts, 0, nTableSize * sizeof( int ) );
+	memset( pLastSample, 0xFF, nTableSize * sizeof( int ) );
+
+	int nOffset = 0;
+	for ( int i = 0; i < nSamples; nOffset += pSampleSizes[i], i++ )
+	{
+		for ( int j = 0; j + LZFAST_TRAIN_KEY <= pSampleSizes[i]; j++ )
+		{
+			unsigned int h = LZFast_TrainHash( pSamples + nOffset + j );
+			if ( pLastSample[h] != i )
+			{
+				pLastSample[h] = i;
+				pCounts[h]++;
+			}
+		}
+	}
+
+	// Keep the first occurrence of every key that repeats across samples
+	CUtlVector< LZFastSegment_t > segments;
+	nOffset = 0;
+	for ( int i = 0; i < nSamples; nOffset += pSampleSizes[i], i++ )
+	{
+		for ( int j = 0; j + LZFAST_TRAIN_KEY <= pSampleSizes[i]; j++ )
+		{
+			unsigned int h = LZFast_TrainHash( pSamples + nOffset + j );
+			if ( pCounts[h] < 2 )
+				continue;
+
+			LZFastSegment_t &segment = segments[ segments.AddToTail() ];
+			segment.m_nOffset = nOffset + j;
+			segment.m_nLength = min( LZFAST_TRAIN_SEGMENT, pSampleSizes[i] - j );
+			segment.m_nScore = pCounts[h] * segment.m_nLength;
+
+			// only once per key, and don't pick overlapping keys out of the same run
+			pCounts[h] = 0;
+			j += segment.m_nLength - 1;
+		}
+	}
+
+	free( pCounts );
+	free( pLastSample );
+
+	segments.Sort( LZFastSegmentCompare );
+
+	// Take the best segments; the most common ones go last so they're closest to the data
+	int nCount = 0;
+	int nSize = 0;
+	for ( int i = segments.Count(); --i >= 0; )
+	{
+		if ( nSize + segments[i].m_nLength > nMaxSize )
+			break;
+		nSize += segments[i].m_nLength;
+		nCount++;
+	}
+
+	int nDictionarySize = 0;
+	for ( int i = segments.Count() - nCount; i < segments.Count(); i++ )
+	{
+		memcpy( pDictionary + nDictionarySize, pSamples + segments[i].m_nOffset, segments[i].m_nLength );
+		nDictionarySize += segments[i].m_nLength;
+	}
+
+	return nDictionarySize;
+}
+
+
+//-----------------------------------------------------------------------------
+// Returns true if buffer is compressed.
+//-----------------------------------------------------------------------------
+bool CLZFast::IsCompressed( const unsigned char *pInput )
+{
+	const lzfast_header_t *pHeader = (const lzfast_header_t *)pInput;
+	if ( pHeader && pHeader->id == LZFAST_ID )
+	{
+		return true;
+	}
+
+	// unrecognized
+	return false;
+}
+
+//-----------------------------------------------------------------------------
+// Returns uncompressed size of compressed input buffer. Used for allocating output
+// buffer for decompression. Returns 0 if input buffer is not compressed.
+//-----------------------------------------------------------------------------
+unsigned int CLZFast::GetActualSize( const unsigned char *pInput )
+{
+	const lzfast_header_t *pHeader = (const lzfast_header_t *)pInput;
+	if ( pHeader && pHeader->id == LZFAST_ID )
+	{
+		return LittleLong( pHeader->actualSize );
+	}
+
+	// unrecognized
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Returns the id of the dictionary needed to uncompress the buffer, 0 if none
+//-----------------------------------------------------------------------------
+unsigned int CLZFast::GetDictionaryId( const unsigned char *pInput )
+{
+	const lzfast_header_t *pHeader = (const lzfast_header_t *)pInput;
+	if ( pHeader && pHeader->id == LZFAST_ID )
+	{
+		return LittleLong( pHeader->dictionaryId );
+	}
+
+	// unrecognized
+	return 0;
+}
+
+unsigned char *CLZFast::CompressNoAlloc( const unsigned char *pInput, int inputLength, unsigned char *pOutputBuf, unsigned int *pOutputSize, const CLZFastDictionary *pDictionary )
+{
+	if ( inputLength <= (int)sizeof( lzfast_header_t ) + LZFAST_MFLIMIT )
+	{
+		return NULL;
+	}
+
+	if ( pDictionary && !pDictionary->IsValid() )
+	{
+		pDictionary = NULL;
+	}
+
+	// the match finder works on one buffer, so the dictionary gets prepended to the input
+	int hashTable[LZFAST_HASH_SIZE];
+	const unsigned char *pBase = pInput;
+	int nStart = 0;
+	unsigned char *pHeapBuffer = NULL;
+	if ( pDictionary )
+	{
+		int nTotal = pDictionary->GetSize() + inputLength;
+		unsigned char *pJoined = ( nTotal <= LZFAST_MAX_STACK ) ? (unsigned char *)stackalloc( nTotal ) : ( pHeapBuffer = (unsigned char *)malloc( nTotal ) );
+		memcpy( pJoined, pDictionary->GetData(), pDictionary->GetSize() );
+		memcpy( pJoined + pDictionary->GetSize(), pInput, inputLength );
+
+		pBase = pJoined;
+		nStart = pDictionary->GetSize();
+		memcpy( hashTable, pDictionary->m_pHashTable, sizeof( hashTable ) );
+	}
+	else
+	{
+		for ( int i = 0; i < LZFAST_HASH_SIZE; i++ )
+		{
+			hashTable[i] = -LZFAST_MAX_OFFSET - 1;
+		}
+	}
+
+	// set the header
+	lzfast_header_t *pHeader = (lzfast_header_t *)pOutputBuf;
+	pHeader->id = LZFAST_ID;
+	pHeader->actualSize = LittleLong( inputLength );
+	pHeader->dictionaryId = LittleLong( pDictionary ? pDictionary->GetId() : 0 );
+
+	unsigned char *pOutput = pOutputBuf + sizeof( lzfast_header_t );
+	// prevent compression failure (inflation)
+	unsigned char *pOutputEnd = pOutputBuf + inputLength;
+
+	const int nEnd = nStart + inputLength;
+	const int nMatchFindLimit = nEnd - LZFAST_MFLIMIT;
+	const int nMatchLimit = nEnd - LZFAST_LASTLITERALS;
+	int nAnchor = nStart;
+	int nPos = nStart;
+	int nSearch = 1 << LZFAST_SKIPSHIFT;
+	bool bFailed = false;
+
+	while ( nPos < nMatchFindLimit )
+	{
+		unsigned int nSequence = LZFast_Read32( pBase + nPos );
+		unsigned int h = LZFast_Hash( nSequence );
+		int nRef = hashTable[h];
+		hashTable[h] = nPos;
+
+		if ( nPos - nRef > LZFAST_MAX_OFFSET || LZFast_Read32( pBase + nRef ) != nSequence )
+		{
+			nPos += nSearch++ >> LZFAST_SKIPSHIFT;
+			continue;
+		}
+		nSearch = 1 << LZFAST_SKIPSHIFT;
+
+		// catch up on literals that also match
+		while ( nPos > nAnchor && nRef > 0 && pBase[nPos - 1] == pBase[nRef - 1] )
+		{
+			nPos--;
+			nRef--;
+		}
+
+		int nMatchLength = LZFAST_MINMATCH;
+		while ( nPos + nMatchLength < nMatchLimit && pBase[nPos + nMatchLength] == pBase[nRef + nMatchLength] )
+		{
+			nMatchLength++;
+		}
+
+		// token + literals + offset + worst case length bytes
+		int nLiterals = nPos - nAnchor;
+		if ( pOutput + 1 + nLiterals + ( nLiterals / 255 ) + 1 + 2 + ( nMatchLength / 255 ) + 1 > pOutputEnd )
+		{
+			bFailed = true;
+			break;
+		}
+
+		unsigned char *pToken = pOutput++;
+		if ( nLiterals >= 15 )
+		{
+			*pToken = 15 << 4;
+			pOutput = LZFast_WriteLength( pOutput, nLiterals - 15 );
+		}
+		else
+		{
+			*pToken = nLiterals << 4;
+		}
+		memcpy( pOutput, pBase + nAnchor, nLiterals );
+		pOutput += nLiterals;
+
+		int nOffset = nPos - nRef;
+		*pOutput++ = nOffset & 0xFF;
+		*pOutput++ = nOffset >> 8;
+
+		int nLengthCode = nMatchLength - LZFAST_MINMATCH;
+		if ( nLengthCode >= 15 )
+		{
+			*pToken |= 15;
+			pOutput = LZFast_WriteLength( pOutput, nLengthCode - 15 );
+		}
+		else
+		{
+			*pToken |= nLengthCode;
+		}
+
+		nPos += nMatchLength;
+		nAnchor = nPos;
+
+		// the position right before the end of the match is a good bet for the next one
+		if ( nPos - 2 < nMatchFindLimit )
+		{
+			hashTable[ LZFast_Hash( LZFast_Read32( pBase + nPos - 2 ) ) ] = nPos - 2;
+		}
+	}
+
+	if ( !bFailed )
+	{
+		// the rest are literals
+		int nLiterals = nEnd - nAnchor;
+		if ( pOutput + 1 + nLiterals + ( nLiterals / 255 ) + 1 > pOutputEnd )
+		{
+			bFailed = true;
+		}
+		else
+		{
+			if ( nLiterals >= 15 )
+			{
+				*pOutput++ = 15 << 4;
+				pOutput = LZFast_WriteLength( pOutput, nLiterals - 15 );
+			}
+			else
+			{
+				*pOutput++ = nLiterals << 4;
+			}
+			memcpy( pOutput, pBase + nAnchor, nLiterals );
+			pOutput += nLiterals;
+		}
+	}
+
+	if ( pHeapBuffer )
+	{
+		free( pHeapBuffer );
+	}
+
+	if ( bFailed )
+	{
+		// compression is worse, abandon
+		return NULL;
+	}
+
+	*pOutputSize = pOutput - pOutputBuf;
+	return pOutputBuf;
+}
+
+//-----------------------------------------------------------------------------
+// Compress an input buffer. Caller must free output compressed buffer.
+// Returns NULL if compression failed (i.e. compression yielded worse results)
+//-----------------------------------------------------------------------------
+unsigned char* CLZFast::Compress( const unsigned char *pInput, int inputLength, unsigned int *pOutputSize, const CLZFastDictionary *pDictionary )
+{
+	unsigned char *pStart = (unsigned char *)malloc( inputLength );
+	unsigned char *pFinal = CompressNoAlloc( pInput, inputLength, pStart, pOutputSize, pDictionary );
+	if ( !pFinal )
+	{
+		free( pStart );
+		return NULL;
+	}
+
+	return pStart;
+}
+
+//-----------------------------------------------------------------------------
+// Uncompress a buffer, Returns the uncompressed size. Caller must provide an
+// adequate sized output buffer or memory corruption will occur.
+//-----------------------------------------------------------------------------
+unsigned int CLZFast::Uncompress( const unsigned char *pInput, int inputLength, unsigned char *pOutput, unsigned int outputLength, const CLZFastDictionary *pDictionary )
+{
+	if ( inputLength < (int)sizeof( lzfast_header_t ) || !IsCompressed( pInput ) )
+		return 0;
+
+	unsigned int nActualSize = GetActualSize( pInput );
+	if ( nActualSize > outputLength )
+		return 0;
+
+	unsigned int nDictionaryId = GetDictionaryId( pInput );
+	const unsigned char *pDictionaryData = NULL;
+	unsigned int nDictionarySize = 0;
+	if ( nDictionaryId != 0 )
+	{
+		if ( !pDictionary || pDictionary->GetId() != nDictionaryId )
+			return 0;
+
+		pDictionaryData = pDictionary->GetData();
+		nDictionarySize = pDictionary->GetSize();
+	}
+
+	const unsigned char *pIn = pInput + sizeof( lzfast_header_t );
+	const unsigned char *pInEnd = pInput + inputLength;
+	unsigned char *pOut = pOutput;
+	unsigned char *pOutEnd = pOutput + nActualSize;
+
+	for ( ;; )
+	{
+		if ( pIn >= pInEnd )
+			return 0;
+
+		unsigned int nToken = *pIn++;
+
+		unsigned int nLiterals = nToken >> 4;
+		if ( nLiterals == 15 && !LZFast_ReadLength( pIn, pInEnd, nLiterals ) )
+			return 0;
+
+		if ( nLiterals > (unsigned int)( pInEnd - pIn ) || nLiterals > (unsigned int)( pOutEnd - pOut ) )
+			return 0;
+
+		memcpy( pOut, pIn, nLiterals );
+		pIn += nLiterals;
+		pOut += nLiterals;
+
+		// the last sequence has no match
+		if ( pIn == pInEnd )
+			break;
+
+		if ( pInEnd - pIn < 2 )
+			return 0;
+
+		unsigned int nOffset = pIn[0] | ( pIn[1] << 8 );
+		pIn += 2;
+
+		unsigned int nMatchLength = nToken & 15;
+		if ( nMatchLength == 15 && !LZFast_ReadLength( pIn, pInEnd, nMatchLength ) )
+			return 0;
+		nMatchLength += LZFAST_MINMATCH;
+
+		if ( nOffset == 0 || nMatchLength > (unsigned int)( pOutEnd - pOut ) )
+			return 0;
+
+		unsigned int nProduced = pOut - pOutput;
+		if ( nOffset > nProduced )
+		{
+			// starts in the dictionary
+			unsigned int nBack = nOffset - nProduced;
+			if ( nBack > nDictionarySize )
+				return 0;
+
+			unsigned int nCopy = min( nBack, nMatchLength );
+			memcpy( pOut, pDictionaryData + nDictionarySize - nBack, nCopy );
+			pOut += nCopy;
+			nMatchLength -= nCopy;
+		}
+
+		// overlapping copy, can't use memcpy
+		const unsigned char *pMatch = pOut - nOffset;
+		while ( nMatchLength-- )
+		{
+			*pOut++ = *pMatch++;
+		}
+	}
+
+	if ( pOut != pOutEnd )
+		return 0;
+
+	return nActualSize;
+}
@@ -57,6 +57,8 @@ float		g_MaxDispPatchRadius = 1500.0f;			// Maximum radius allowed for displacem
 qboolean	g_bDumpPatches;
 bool	    bDumpNormals = false;
 bool		g_bDumpRtEnv = false;
+bool		g_bUseBVH = false;
+bool		g_bBenchmarkRtEnv = false;
 bool		bRed2Black = true;
 bool		g_bFastAmbient = false;
 bool        g_bNoSkyRecurse = false;
@@ -1997,6 +1999,21 @@ void MakeAllScales (void)
 #endif
 
 
+// Rough cost of lighting each face, so the threads start on the biggest lightmaps
+// instead of finding them at the end.
+static void GetFaceLightingCosts( CUtlVector<float> &costs )
+{
+	costs.SetCount( numfaces );
+	for ( int i = 0; i < numfaces; i++ )
+	{
+		dface_t *f = &g_pFaces[i];
+		costs[i] = 1.0f;
+		if ( !( texinfo[f->texinfo].flags & TEX_SPECIAL ) )
+			costs[i] += ( f->m_LightmapTextureSizeInLuxels[0] + 1 ) * ( f->m_LightmapTextureSizeInLuxels[1] + 1 );
+	}
+}
+
+
 bool RadWorld_Go()
 {
 	g_iCurFace = 0;
@@ -2026,6 +2043,9 @@ bool RadWorld_Go()
 	}
 	else 
 	{
+		CUtlVector<float> faceCosts;
+		GetFaceLightingCosts( faceCosts );
+		SetThreadWorkCosts( faceCosts.Base() );
 		RunThreadsOnIndividual (numfaces, true, BuildFacelights);
 	}
 
@@ -2081,7 +2101,12 @@ bool RadWorld_Go()
 		// blend bounced light into direct light and save
 		VMPI_SetCurrentStage( "FinalLightFace" );
 		if ( !g_bUseMPI || g_bMPIMaster )
+		{
+			CUtlVector<float> faceCosts;
+			GetFaceLightingCosts( faceCosts );
+			SetThreadWorkCosts( faceCosts.Base() );
 			RunThreadsOnIndividual (numfaces, true, FinalLightFace);
+		}
 		
 		// Distribute the lighting data to workers.
 		VMPI_DistributeLightData();
@@ -2254,12 +2279,23 @@ void VRAD_LoadBSP( char const *pFilename )
 	if ( g_bDumpRtEnv )
 		WriteRTEnv("trace.txt");
 
+	if ( g_bUseBVH )
+		g_RtEnv.Flags |= RTE_FLAGS_BVH;
+
 	// Build acceleration structure
-	printf ( "Setting up ray-trace acceleration structure... ");
-	float start = Plat_FloatTime();
-	g_RtEnv.SetupAccelerationStructure();
-	float end = Plat_FloatTime();
-	printf ( "Done (%.2f seconds)\n", end-start );
+	if ( g_bBenchmarkRtEnv )
+	{
+		printf ( "Benchmarking ray-trace acceleration structures...\n" );
+		g_RtEnv.BenchmarkAccelerationStructures( 1000000 );
+	}
+	else
+	{
+		printf ( "Setting up ray-trace acceleration structure... ");
+		float start = Plat_FloatTime();
+		g_RtEnv.SetupAccelerationStructure();
+		float end = Plat_FloatTime();
+		printf ( "Done (%.2f seconds)\n", end-start );
+	}
 
 #if 0  // To test only k-d build
 	exit(0);
@@ -2400,6 +2436,14 @@ int ParseCommandLine( int argc, char **argv, bool *onlydetail )
 		{
 			g_bDumpRtEnv = true;
 		}
+		else if ( !Q_stricmp( argv[i], "-bvh" ) )
+		{
+			g_bUseBVH = true;
+		}
+		else if ( !Q_stricmp( argv[i], "-rtbench" ) )
+		{
+			g_bBenchmarkRtEnv = true;
+		}
 		else if ( !Q_stricmp( argv[i], "-LargeDispSampleRadius" ) )
 		{
 			g_bLargeDispSampleRadius = true;
@@ -2791,6 +2835,10 @@ void PrintUsage( int argc, char **argv )
 		"  -dump           : Write debugging .txt files.\n"
 		"  -dumpnormals    : Write normals to debug files.\n"
 		"  -dumptrace      : Write ray-tracing environment to debug files.\n"
+		"  -bvh            : Trace rays against a bounding volume hierarchy instead of\n"
+		"                    a kd-tree.\n"
+		"  -rtbench        : Build both ray-tracing structures and print how long each\n"
+		"                    took to build and how fast each traces random rays.\n"
 		"  -threads        : Control the number of threads vbsp uses (defaults to the #\n"
 		"                    or processors on your machine).\n"
 		"  -lights <file>  : Load a lights file in addition to lights.rad and the\n"
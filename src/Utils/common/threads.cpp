@@ -13,14 +13,25 @@
 
 #define	USED
 
+#ifdef _WIN32
 #include <windows.h>
+#else
+#include <unistd.h>
+#endif
 #include "cmdlib.h"
 #define NO_THREAD_NAMES
 #include "threads.h"
 #include "pacifier.h"
+#include "tier0/threadtools.h"
+#include "utlvector.h"
 
 #define	MAX_THREADS	16
 
+// With cost estimates, each claim from the shared cursor takes at most 1/(this*numthreads) of
+// the work that's left, so chunks start big and shrink to single items as the work runs out.
+// Without them, items are claimed one at a time so they're started in order.
+#define WORK_CHUNK_DIVISOR	4
+
 
 class CRunThreadsData
 {
@@ -33,15 +44,179 @@ public:
 CRunThreadsData g_RunThreadsData[MAX_THREADS];
 
 
-int		dispatch;
+// The part of the work order a thread has claimed. Threads go through their own range front
+// to back, and once the shared cursor is used up, threads that run dry take the back half of
+// the biggest range left (only when the work was sorted by cost, the order doesn't matter then).
+struct ThreadWorkRange_t
+{
+	CThreadFastMutex m_Mutex;
+	int m_iNext;				// next position in the work order
+	int m_iEnd;
+	int m_nTaken;				// work items started, for the pacifier
+	double m_flStartTime;		// when the thread started and finished, for the busy/idle times
+	double m_flEndTime;
+	double m_flLockWait;		// time spent waiting in ThreadLock, counted as idle
+	char m_Pad[64];				// keep threads from sharing cache lines
+};
+
+ThreadWorkRange_t g_WorkRanges[MAX_TOOL_THREADS+1];
+CThreadLocalInt<> g_iToolThread;	// thread index + 1, 0 for threads we didn't start
+
 int		workcount;
+long volatile g_nWorkCursor;
+long volatile g_nThreadsRunning;
+CThreadEvent g_ThreadsDoneEvent;	// set by the last thread to finish
 qboolean		pacifier;
 
+const float *g_pWorkCosts;
+CUtlVector<int> g_WorkOrder;		// work item at each position. Empty if they're in order
+CUtlVector<double> g_WorkCostSums;	// cost of all the work before each position. Empty without costs
+
 qboolean	threaded;
 bool g_bLowPriorityThreads = false;
 
-HANDLE g_ThreadHandles[MAX_THREADS];
+ThreadHandle_t g_ThreadHandles[MAX_THREADS];
+
+
+void SetThreadWorkCosts( const float *pCosts )
+{
+	g_pWorkCosts = pCosts;
+}
+
+static int WorkCostCompare( const void *a, const void *b )
+{
+	int i = *(const int *)a;
+	int j = *(const int *)b;
+	if ( g_pWorkCosts[i] != g_pWorkCosts[j] )
+		return ( g_pWorkCosts[i] > g_pWorkCosts[j] ) ? -1 : 1;
+	return i - j;
+}
+
+static void InitThreadWork( void )
+{
+	g_nWorkCursor = 0;
+	for ( int i=0; i <= MAX_TOOL_THREADS; i++ )
+	{
+		g_WorkRanges[i].m_iNext = g_WorkRanges[i].m_iEnd = 0;
+		g_WorkRanges[i].m_nTaken = 0;
+		g_WorkRanges[i].m_flStartTime = g_WorkRanges[i].m_flEndTime = 0;
+		g_WorkRanges[i].m_flLockWait = 0;
+	}
+
+	g_WorkOrder.Purge();
+	g_WorkCostSums.Purge();
+	if ( !g_pWorkCosts )
+		return;
+
+	g_WorkOrder.SetCount( workcount );
+	for ( int i=0; i < workcount; i++ )
+		g_WorkOrder[i] = i;
+	qsort( g_WorkOrder.Base(), workcount, sizeof( int ), WorkCostCompare );
+
+	g_WorkCostSums.SetCount( workcount + 1 );
+	g_WorkCostSums[0] = 0;
+	for ( int i=0; i < workcount; i++ )
+	{
+		g_WorkCostSums[i+1] = g_WorkCostSums[i] + max( g_pWorkCosts[g_WorkOrder[i]], 0.0f );
+	}
+}
+
+static void ShutdownThreadWork( void )
+{
+	g_pWorkCosts = NULL;
+	g_WorkOrder.Purge();
+	g_WorkCostSums.Purge();
+}
+
+// Takes the next chunk off the shared cursor. Returns its start position, or -1 if there's
+// nothing left.
+static int ClaimThreadWork( int &iEnd )
+{
+	if ( !g_WorkCostSums.Count() )
+	{
+		// In order, so callers like vvis can count on the items before this one having
+		// been started
+		int iStart = ThreadInterlockedIncrement( &g_nWorkCursor ) - 1;
+		if ( iStart >= workcount )
+			return -1;
+		iEnd = iStart + 1;
+		return iStart;
+	}
+
+	int nThreads = max( numthreads, 1 );
+	for (;;)
+	{
+		int iStart = g_nWorkCursor;
+		if ( iStart >= workcount )
+			return -1;
+
+		// first position that takes in the target cost, and always at least one item
+		double flTarget = g_WorkCostSums[iStart] + ( g_WorkCostSums[workcount] - g_WorkCostSums[iStart] ) / ( WORK_CHUNK_DIVISOR * nThreads );
+		int lo = iStart + 1, hi = workcount;
+		while ( lo < hi )
+		{
+			int mid = ( lo + hi ) / 2;
+			if ( g_WorkCostSums[mid] >= flTarget )
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		int iNewEnd = lo;
+
+		if ( ThreadInterlockedAssignIf( &g_nWorkCursor, iNewEnd, iStart ) )
+		{
+			iEnd = iNewEnd;
+			return iStart;
+		}
+	}
+}
+
+// Takes the back half of the biggest range another thread hasn't got to yet.
+static bool StealThreadWork( int iThread )
+{
+	for (;;)
+	{
+		int iVictim = -1;
+		int nMost = 0;
+		for ( int i=0; i < numthreads; i++ )
+		{
+			int nLeft = g_WorkRanges[i].m_iEnd - g_WorkRanges[i].m_iNext;
+			if ( i != iThread && nLeft > nMost )
+			{
+				nMost = nLeft;
+				iVictim = i;
+			}
+		}
+		if ( iVictim == -1 )
+			return false;
+
+		int iFirst, iEnd;
+		{
+			ThreadWorkRange_t &victim = g_WorkRanges[iVictim];
+			AUTO_LOCK_FM( victim.m_Mutex );
+			int nLeft = victim.m_iEnd - victim.m_iNext;
+			if ( nLeft <= 0 )
+				continue;	// it got there first
+			iEnd = victim.m_iEnd;
+			iFirst = iEnd - ( nLeft + 1 ) / 2;
+			victim.m_iEnd = iFirst;
+		}
+
+		ThreadWorkRange_t &range = g_WorkRanges[iThread];
+		AUTO_LOCK_FM( range.m_Mutex );
+		range.m_iNext = iFirst;
+		range.m_iEnd = iEnd;
+		return true;
+	}
+}
 
+static int GetThreadWorkTaken( void )
+{
+	int nTaken = 0;
+	for ( int i=0; i <= MAX_TOOL_THREADS; i++ )
+		nTaken += g_WorkRanges[i].m_nTaken;
+	return nTaken;
+}
 
 
 /*
@@ -52,23 +227,36 @@ GetThreadWork
 */
 int	GetThreadWork (void)
 {
-	int	r;
+	int iThread = g_iToolThread - 1;
+	if ( iThread < 0 )
+		iThread = THREADINDEX_MAIN;
+	ThreadWorkRange_t &range = g_WorkRanges[iThread];
 
-	ThreadLock ();
-
-	if (dispatch == workcount)
+	for (;;)
 	{
-		ThreadUnlock ();
-		return -1;
-	}
-
-	UpdatePacifier( (float)dispatch / workcount );
-
-	r = dispatch;
-	dispatch++;
-	ThreadUnlock ();
+		{
+			AUTO_LOCK_FM( range.m_Mutex );
+			if ( range.m_iNext < range.m_iEnd )
+			{
+				int iPos = range.m_iNext++;
+				range.m_nTaken++;
+				return g_WorkOrder.Count() ? g_WorkOrder[iPos] : iPos;
+			}
+		}
 
-	return r;
+		int iEnd;
+		int iStart = ClaimThreadWork( iEnd );
+		if ( iStart != -1 )
+		{
+			AUTO_LOCK_FM( range.m_Mutex );
+			range.m_iNext = iStart;
+			range.m_iEnd = iEnd;
+		}
+		else if ( !g_WorkCostSums.Count() || !StealThreadWork( iThread ) )
+		{
+			return -1;
+		}
+	}
 }
 
 
@@ -101,41 +289,32 @@ void RunThreadsOnIndividual (int workcnt, qboolean showpacifier, ThreadWorkerFn
 /*
 ===================================================================
 
-WIN32
+THREADS
 
 ===================================================================
 */
 
 int		numthreads = -1;
-CRITICAL_SECTION		crit;
+CThreadMutex	crit;
 static int enter;
 
 
-class CCritInit
-{
-public:
-	CCritInit()
-	{
-		InitializeCriticalSection (&crit);
-	}
-} g_CritInit;
-
-
 
 void SetLowPriority()
 {
+#ifdef _WIN32
 	SetPriorityClass( GetCurrentProcess(), IDLE_PRIORITY_CLASS );
+#else
+	nice( 19 );
+#endif
 }
 
 
 void ThreadSetDefault (void)
 {
-	SYSTEM_INFO info;
-
 	if (numthreads == -1)	// not set manually
 	{
-		GetSystemInfo (&info);
-		numthreads = info.dwNumberOfProcessors;
+		numthreads = GetCPUInformation().m_nLogicalProcessors;
 		if (numthreads < 1 || numthreads > 32)
 			numthreads = 1;
 	}
@@ -148,7 +327,15 @@ void ThreadLock (void)
 {
 	if (!threaded)
 		return;
-	EnterCriticalSection (&crit);
+	if ( !crit.TryLock() )
+	{
+		// only time the waits, so the uncontended case stays cheap
+		int iThread = g_iToolThread - 1;
+		double flStart = Plat_FloatTime();
+		crit.Lock();
+		if ( iThread >= 0 )
+			g_WorkRanges[iThread].m_flLockWait += Plat_FloatTime() - flStart;
+	}
 	if (enter)
 		Error ("Recursive ThreadLock\n");
 	enter = 1;
@@ -161,15 +348,23 @@ void ThreadUnlock (void)
 	if (!enter)
 		Error ("ThreadUnlock without lock\n");
 	enter = 0;
-	LeaveCriticalSection (&crit);
+	crit.Unlock();
 }
 
 
 // This runs in the thread and dispatches a RunThreadsFn call.
-DWORD WINAPI InternalRunThreadsFn( LPVOID pParameter )
+unsigned InternalRunThreadsFn( void *pParameter )
 {
 	CRunThreadsData *pData = (CRunThreadsData*)pParameter;
+	ThreadWorkRange_t &range = g_WorkRanges[pData->m_iThread];
+
+	g_iToolThread = pData->m_iThread + 1;
+	range.m_flStartTime = Plat_FloatTime();
 	pData->m_Fn( pData->m_iThread, pData->m_pUserData );
+	range.m_flEndTime = Plat_FloatTime();
+
+	if ( ThreadInterlockedDecrement( &g_nThreadsRunning ) == 0 )
+		g_ThreadsDoneEvent.Set();
 	return 0;
 }
 
@@ -182,42 +377,57 @@ void RunThreads_Start( RunThreadsFn fn, void *pUserData, ERunThreadsPriority ePr
 	if ( numthreads > MAX_TOOL_THREADS )
 		numthreads = MAX_TOOL_THREADS;
 
+	g_nThreadsRunning = numthreads;
+	g_ThreadsDoneEvent.Reset();
 	for ( int i=0; i < numthreads ;i++ )
 	{
 		g_RunThreadsData[i].m_iThread = i;
 		g_RunThreadsData[i].m_pUserData = pUserData;
 		g_RunThreadsData[i].m_Fn = fn;
 
-		DWORD dwDummy;
-		g_ThreadHandles[i] = CreateThread(
-		   NULL,	// LPSECURITY_ATTRIBUTES lpsa,
-		   0,		// DWORD cbStack,
-		   InternalRunThreadsFn,	// LPTHREAD_START_ROUTINE lpStartAddr,
-		   &g_RunThreadsData[i],	// LPVOID lpvThreadParm,
-		   0,			// DWORD fdwCreate,
-		   &dwDummy );
+		g_ThreadHandles[i] = CreateSimpleThread( InternalRunThreadsFn, &g_RunThreadsData[i] );
 
+#ifdef _WIN32
 		if ( ePriority == k_eRunThreadsPriority_UseGlobalState )
 		{
 			if( g_bLowPriorityThreads )
-				SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
+				ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_LOWEST );
 		}
 		else if ( ePriority == k_eRunThreadsPriority_Idle )
 		{
-			SetThreadPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
+			ThreadSetPriority( g_ThreadHandles[i], THREAD_PRIORITY_IDLE );
 		}
+#endif
 	}
 }
 
 
 void RunThreads_End()
 {
-	WaitForMultipleObjects( numthreads, g_ThreadHandles, TRUE, INFINITE );
 	for ( int i=0; i < numthreads; i++ )
-		CloseHandle( g_ThreadHandles[i] );
+	{
+		ThreadJoin( g_ThreadHandles[i] );
+		ReleaseThreadHandle( g_ThreadHandles[i] );
+	}
 
 	threaded = false;
 }
+
+
+// How long each thread was working versus waiting for the others to finish
+static void PrintThreadTimes( double flStart, double flEnd )
+{
+	if ( numthreads < 2 )
+		return;
+
+	printf( "%-20s busy/idle:", "" );
+	for ( int i=0; i < numthreads; i++ )
+	{
+		double flBusy = g_WorkRanges[i].m_flEndTime - g_WorkRanges[i].m_flStartTime - g_WorkRanges[i].m_flLockWait;
+		printf( " %.1f/%.1f", flBusy, max( 0.0, ( flEnd - flStart ) - flBusy ) );
+	}
+	printf( "\n" );
+}
 	
 
 /*
@@ -227,11 +437,11 @@ RunThreadsOn
 */
 void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData )
 {
-	int		start, end;
+	double	start, end;
 
 	start = Plat_FloatTime();
-	dispatch = 0;
 	workcount = workcnt;
+	InitThreadWork();
 	StartPacifier("");
 	pacifier = showpacifier;
 
@@ -243,6 +453,15 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 
 	
 	RunThreads_Start( fn, pUserData );
+
+	// The pacifier is only drawn from here, so the workers never wait on it. The wait returns
+	// as soon as the last thread is done, the timeout is just for the pacifier.
+	while ( !g_ThreadsDoneEvent.Wait( 50 ) )
+	{
+		if ( workcount )
+			UpdatePacifier( (float)GetThreadWorkTaken() / workcount );
+	}
+
 	RunThreads_End();
 
 
@@ -250,8 +469,9 @@ void RunThreadsOn( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pU
 	if (pacifier)
 	{
 		EndPacifier(false);
-		printf (" (%i)\n", end-start);
+		printf (" (%i)\n", (int)(end-start));
+		PrintThreadTimes( start, end );
 	}
-}
-
 
+	ShutdownThreadWork();
+}
@@ -45,6 +45,12 @@ void SetLowPriority();
 void ThreadSetDefault (void);
 int	GetThreadWork (void);
 
+// Gives a cost estimate for each work item of the next RunThreadsOn/RunThreadsOnIndividual.
+// The most expensive items are then handed out first, in chunks of similar cost. Without
+// costs, items are handed out one at a time in order, for callers that depend on it.
+// pCosts must stay valid until that run returns.
+void SetThreadWorkCosts( const float *pCosts );
+
 void RunThreadsOnIndividual ( int workcnt, qboolean showpacifier, ThreadWorkerFn fn );
 
 void RunThreadsOn ( int workcnt, qboolean showpacifier, RunThreadsFn fn, void *pUserData=NULL );
@@ -166,6 +166,42 @@ private:
 
 #pragma pack(pop)
 
+//-----------------------------------------------------------------------------
+// Per worker queue used by the work stealing scheduler. Jobs are pushed to the
+// queue of the submitting worker (or round robin from outside the pool) and
+// workers that run dry steal from the others, so nothing takes a shared lock
+// or toggles an event on every push and pop.
+//-----------------------------------------------------------------------------
+
+class ALIGN16 CJobStealQueue
+{
+public:
+	int Count()
+	{
+		return m_queues[JP_LOW].Count() + m_queues[JP_NORMAL].Count() + m_queues[JP_HIGH].Count();
+	}
+
+	int Count( JobPriority_t priority )
+	{
+		return m_queues[priority].Count();
+	}
+
+	void Push( CJob *pJob )
+	{
+		pJob->AddRef();
+		m_queues[pJob->GetPriority()].PushItem( pJob );
+	}
+
+	bool Pop( JobPriority_t priority, CJob **ppJob )
+	{
+		// Count() is a plain read, skip the interlocked pop on empty queues
+		return ( m_queues[priority].Count() && m_queues[priority].PopItem( ppJob ) );
+	}
+
+private:
+	CTSQueue<CJob *>	m_queues[JP_HIGH + 1];
+};
+
 //-----------------------------------------------------------------------------
 //
 // CThreadPool
@@ -245,6 +281,13 @@ private:
 	CJob *PeekJob();
 	CJob *GetDummyJob();
 
+	//-----------------------------------------------------
+	// Work stealing scheduler
+	//-----------------------------------------------------
+	void PushStealJob( CJob * );
+	bool PopStealJob( int iThread, CJob **ppJob );
+	void WakeSleepingThread( int iPreferred );
+
 	//-----------------------------------------------------
 	// Thread functions
 	//-----------------------------------------------------
@@ -261,6 +304,11 @@ private:
 	CThreadFastMutex		m_SuspendMutex;
 	int						m_nSuspend;
 	CInterlockedInt			m_nJobs;
+
+	bool					m_bWorkStealing;
+	CInterlockedInt			m_nStealJobs;		// jobs in the per worker queues
+	CInterlockedInt			m_nSleepingThreads;
+	CInterlockedInt			m_iNextStealQueue;
 };
 
 //-----------------------------------------------------------------------------
@@ -289,6 +337,11 @@ public:
 		{
 			startParams.nThreads = nThreads;
 		}
+
+		if ( CommandLine()->FindParm( "-workstealing" ) )
+		{
+			startParams.bWorkStealing = true;
+		}
 		return CThreadPool::Start( startParams );
 	}
 
@@ -301,16 +354,29 @@ public:
 
 //-----------------------------------------------------------------------------
 
+static CThreadLocalPtr<CJobThread> g_pCurJobThread;
+
 class CJobThread : public CWorkerThread
 {
 public:
 	CJobThread( CThreadPool *pOwner, int iThread ) : 
 		m_SharedQueue( pOwner->m_SharedQueue ),
 		m_pOwner( pOwner ),
-		m_iThread( iThread )
+		m_iThread( iThread ),
+		m_bSleeping( 0 )
 	{
 	}
 
+	CThreadPool *GetOwner()
+	{
+		return m_pOwner;
+	}
+
+	int GetIndex()
+	{
+		return m_iThread;
+	}
+
 	CThreadEvent &GetIdleEvent()
 	{
 		return m_IdleEvent;
@@ -321,6 +387,24 @@ public:
 		return m_DirectQueue;
 	}
 
+	CJobStealQueue &AccessStealQueue()
+	{
+		return m_StealQueue;
+	}
+
+	// Called by the thread that queued work while this thread was asleep
+	bool TryWake()
+	{
+		if ( !ThreadInterlockedAssignIf( &m_bSleeping, 0, 1 ) )
+		{
+			return false;
+		}
+
+		m_pOwner->m_nSleepingThreads--;
+		m_WakeEvent.Set();
+		return true;
+	}
+
 private:
 	unsigned Wait( int nHandles, HANDLE *pHandles )
 	{
@@ -338,6 +422,13 @@ private:
 
 	int Run()
 	{
+		g_pCurJobThread = this;
+
+		if ( m_pOwner->m_bWorkStealing )
+		{
+			return RunStealing();
+		}
+
 		enum Event_t
 		{
 			CALL_FROM_MASTER,
@@ -417,11 +508,141 @@ private:
 		return 0;
 	}
 
+	enum
+	{
+		STEAL_SPIN_COUNT = 2000,	// ThreadPause()s before an idle worker goes to sleep
+	};
+
+	bool HandleCall( bool *pbExit )
+	{
+		if ( !PeekCall() )
+		{
+			return false;
+		}
+
+		switch ( GetCallParam() )
+		{
+		case TPM_EXIT:
+			Reply( true );
+			*pbExit = true;
+			break;
+
+		case TPM_SUSPEND:
+			Reply( true );
+			Suspend();
+			break;
+
+		default:
+			AssertMsg( 0, "Unknown call to thread" );
+			Reply( false );
+			break;
+		}
+		return true;
+	}
+
+	int RunStealing()
+	{
+		enum Event_t
+		{
+			CALL_FROM_MASTER,
+			WAKE,
+			DIRECT_QUEUE,
+
+			NUM_EVENTS
+		};
+
+		bool	 bExit = false;
+		bool	 bBusy = false;
+		int		 nSpins = 0;
+		HANDLE	 waitHandles[NUM_EVENTS];
+
+		waitHandles[CALL_FROM_MASTER]	= GetCallHandle();
+		waitHandles[WAKE]				= m_WakeEvent;
+		waitHandles[DIRECT_QUEUE] 		= m_DirectQueue.GetEventHandle();
+
+		m_pOwner->m_nIdleThreads++;
+		m_IdleEvent.Set();
+		while ( !bExit )
+		{
+			CJob *pJob;
+			if ( m_DirectQueue.Pop( &pJob ) || m_pOwner->PopStealJob( m_iThread, &pJob ) )
+			{
+				if ( !bBusy )
+				{
+					m_IdleEvent.Reset();
+					m_pOwner->m_nIdleThreads--;
+					bBusy = true;
+				}
+				ServiceJobAndRelease( pJob, m_iThread );
+				m_pOwner->m_nJobs--;
+				nSpins = 0;
+
+				HandleCall( &bExit );
+				continue;
+			}
+
+			// Spin a little first, fine grained work usually arrives in bursts
+			if ( nSpins++ < STEAL_SPIN_COUNT )
+			{
+				ThreadPause();
+				continue;
+			}
+			nSpins = 0;
+
+			if ( bBusy )
+			{
+				m_pOwner->m_nIdleThreads++;
+				m_IdleEvent.Set();
+				bBusy = false;
+			}
+
+			if ( HandleCall( &bExit ) )
+			{
+				continue;
+			}
+
+			// Announce we're going to sleep, then check again so a push that
+			// raced with us can't be missed
+			m_bSleeping = 1;
+			m_pOwner->m_nSleepingThreads++;
+			if ( m_pOwner->m_nStealJobs > 0 || m_DirectQueue.Count() )
+			{
+				if ( ThreadInterlockedAssignIf( &m_bSleeping, 0, 1 ) )
+				{
+					m_pOwner->m_nSleepingThreads--;
+				}
+				continue;
+			}
+
+			if ( Wait( ARRAYSIZE(waitHandles), waitHandles ) == WAIT_FAILED )
+			{
+				break;
+			}
+
+			if ( ThreadInterlockedAssignIf( &m_bSleeping, 0, 1 ) )
+			{
+				m_pOwner->m_nSleepingThreads--;
+			}
+
+			HandleCall( &bExit );
+		}
+
+		if ( !bBusy )
+		{
+			m_pOwner->m_nIdleThreads--;
+		}
+		m_IdleEvent.Reset();
+		return 0;
+	}
+
 	CJobQueue			m_DirectQueue;
 	CJobQueue &			m_SharedQueue;
+	CJobStealQueue		m_StealQueue;
 	CThreadPool *		m_pOwner;
 	CThreadManualEvent	m_IdleEvent;
+	CThreadEvent		m_WakeEvent;
 	int					m_iThread;
+	volatile long		m_bSleeping;
 };
 
 //-----------------------------------------------------------------------------
@@ -438,7 +659,11 @@ IThreadPool *g_pThreadPool = &g_ThreadPool;
 CThreadPool::CThreadPool() :
 	m_nIdleThreads( 0 ),
 	m_nJobs( 0 ),
-	m_nSuspend( 0 )
+	m_nSuspend( 0 ),
+	m_bWorkStealing( false ),
+	m_nStealJobs( 0 ),
+	m_nSleepingThreads( 0 ),
+	m_iNextStealQueue( 0 )
 {
 }
 
@@ -546,7 +771,7 @@ int CThreadPool::YieldWait( CThreadEvent *pEvents, int nEvents, bool bWaitAll, u
 	CJob *pJob;
 	while ( ( result = ThreadWaitForEvents( nEvents, pEvents, bWaitAll, 0 ) ) == WAIT_TIMEOUT )
 	{
-		if ( m_SharedQueue.Pop( &pJob ) )
+		if ( m_SharedQueue.Pop( &pJob ) || PopStealJob( -1, &pJob ) )
 		{
 			ServiceJobAndRelease( pJob );
 			m_nJobs--;
@@ -653,6 +878,11 @@ void CThreadPool::InsertJobInQueue( CJob *pJob )
 		int iThread = pJob->GetServiceThread();
 		if ( iThread == -1 || !m_Threads.IsValidIndex( iThread ) )
 		{
+			if ( m_bWorkStealing )
+			{
+				PushStealJob( pJob );
+				return;
+			}
 			pQueue = &m_SharedQueue;
 		}
 		else
@@ -668,6 +898,89 @@ void CThreadPool::InsertJobInQueue( CJob *pJob )
 	m_nJobs -= pQueue->Push( pJob );
 }
 
+//---------------------------------------------------------
+// Work stealing: queue on the submitting worker if there is
+// one, otherwise spread the jobs over all workers
+//---------------------------------------------------------
+
+void CThreadPool::PushStealJob( CJob *pJob )
+{
+	int iQueue;
+	CJobThread *pCurThread = g_pCurJobThread;
+	if ( pCurThread && pCurThread->GetOwner() == this )
+	{
+		iQueue = pCurThread->GetIndex();
+	}
+	else
+	{
+		iQueue = (unsigned)( m_iNextStealQueue++ ) % (unsigned)m_Threads.Count();
+	}
+
+	m_Threads[iQueue]->AccessStealQueue().Push( pJob );
+	m_nStealJobs++;
+
+	if ( m_nSleepingThreads > 0 )
+	{
+		WakeSleepingThread( iQueue );
+	}
+}
+
+//---------------------------------------------------------
+// Takes the highest priority job available, from our own
+// queue first. iThread is -1 for threads outside the pool.
+//---------------------------------------------------------
+
+bool CThreadPool::PopStealJob( int iThread, CJob **ppJob )
+{
+	if ( m_nStealJobs <= 0 )
+	{
+		return false;
+	}
+
+	int nThreads = m_Threads.Count();
+	int iFirstVictim = ( iThread == -1 ) ? 0 : iThread + 1;
+
+	for ( int iPriority = JP_HIGH; iPriority >= JP_LOW; --iPriority )
+	{
+		if ( iThread != -1 && m_Threads[iThread]->AccessStealQueue().Pop( (JobPriority_t)iPriority, ppJob ) )
+		{
+			m_nStealJobs--;
+			return true;
+		}
+
+		for ( int i = 0; i < nThreads; i++ )
+		{
+			int iVictim = ( iFirstVictim + i ) % nThreads;
+			if ( iVictim == iThread )
+			{
+				continue;
+			}
+
+			if ( m_Threads[iVictim]->AccessStealQueue().Pop( (JobPriority_t)iPriority, ppJob ) )
+			{
+				m_nStealJobs--;
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
+//---------------------------------------------------------
+
+void CThreadPool::WakeSleepingThread( int iPreferred )
+{
+	int nThreads = m_Threads.Count();
+	for ( int i = 0; i < nThreads; i++ )
+	{
+		if ( m_Threads[( iPreferred + i ) % nThreads]->TryWake() )
+		{
+			return;
+		}
+	}
+}
+
 //---------------------------------------------------------
 // Add an function object to the queue (master thread)
 //---------------------------------------------------------
@@ -701,7 +1014,14 @@ void CThreadPool::ChangePriority( CJob *pJob, JobPriority_t priority )
 	if ( pJob->GetPriority() < priority )
 	{
 		pJob->SetPriority( priority );
-		m_SharedQueue.Push( pJob );
+		if ( m_bWorkStealing && m_Threads.Count() )
+		{
+			PushStealJob( pJob );
+		}
+		else
+		{
+			m_SharedQueue.Push( pJob );
+		}
 	}
 	else
 	{
@@ -775,6 +1095,33 @@ int CThreadPool::ExecuteToPriority( JobPriority_t iToPriority, JobFilter_t pfnFi
 			m_nJobs--;
 			nExecuted++;
 		}
+
+		for ( i = 0; m_bWorkStealing && i < m_Threads.Count(); i++ )
+		{
+			CJobStealQueue &queue = m_Threads[i]->AccessStealQueue();
+			while ( queue.Pop( (JobPriority_t)iCurPriority, &pJob ) )
+			{
+				m_nStealJobs--;
+				if ( pfnFilter && !(*pfnFilter)( pJob ) )
+				{
+					if ( pJob->CanExecute() )
+					{
+						jobsToPutBack.EnsureCapacity( nJobsTotal );
+						jobsToPutBack.AddToTail( pJob );
+					}
+					else
+					{
+						m_nJobs--;
+						pJob->Release(); // see above
+					}
+					continue;
+				}
+
+				ServiceJobAndRelease( pJob );
+				m_nJobs--;
+				nExecuted++;
+			}
+		}
 	}
 
 	for ( i = 0; i < jobsToPutBack.Count(); i++ )
@@ -815,9 +1162,20 @@ int CThreadPool::AbortAll()
 			iAborted++;
 		}
 
+		CJobStealQueue &stealQueue = m_Threads[i]->AccessStealQueue();
+		for ( int iPriority = JP_HIGH; iPriority >= JP_LOW; --iPriority )
+		{
+			while ( stealQueue.Pop( (JobPriority_t)iPriority, &pJob ) )
+			{
+				pJob->Abort();
+				pJob->Release();
+				iAborted++;
+			}
+		}
 	}
 
 	m_nJobs = 0;
+	m_nStealJobs = 0;
 
 	ResumeExecution();
 
@@ -901,6 +1259,10 @@ bool CThreadPool::Start( const ThreadPoolStartParams_t &startParams, const char
 
 	//--------------------------------------------------------
 
+	m_bWorkStealing = startParams.bWorkStealing;
+	m_nStealJobs = 0;
+	m_nSleepingThreads = 0;
+
 	m_Threads.EnsureCapacity( nThreads );
 	m_IdleEvents.EnsureCapacity( nThreads );
 
@@ -993,7 +1355,23 @@ bool CThreadPool::Stop( int timeout )
 		}
 	}
 
+	for ( int i = 0; i < m_Threads.Count(); ++i )
+	{
+		CJob *pJob;
+		CJobStealQueue &queue = m_Threads[i]->AccessStealQueue();
+		for ( int iPriority = JP_HIGH; iPriority >= JP_LOW; --iPriority )
+		{
+			while ( queue.Pop( (JobPriority_t)iPriority, &pJob ) )
+			{
+				pJob->Abort();
+				pJob->Release();
+			}
+		}
+	}
+
 	m_nJobs = 0;
+	m_nStealJobs = 0;
+	m_nSleepingThreads = 0;
 	m_SharedQueue.Flush();
 	m_nIdleThreads = 0;
 	m_Threads.RemoveAll();
@@ -1264,6 +1642,94 @@ void TestForcedExecute()
 	Msg( "TestForcedExecute DONE\n" );
 }
 
+//-----------------------------------------------------------------------------
+// Scheduler comparison: thousands of tiny jobs and a ParallelProcess() fan out,
+// which is what PackEntities_Normal and the bone setup jobs look like
+//-----------------------------------------------------------------------------
+
+class CTinyJob : public CJob
+{
+public:
+	virtual JobStatus_t DoExecute()
+	{
+		for ( int i = 0; i < 64; i++ )
+		{
+			m_flResult += sqrtf( (float)( i + m_nSeed ) );
+		}
+		if ( ++m_nCount == g_nTotalToComplete )
+			g_done.Set();
+		return 0;
+	}
+
+	static CInterlockedInt m_nCount;
+	float m_flResult;
+	int m_nSeed;
+};
+CInterlockedInt CTinyJob::m_nCount;
+
+void TinyItem( int &item )
+{
+	float flResult = 0;
+	for ( int i = 0; i < 64; i++ )
+	{
+		flResult += sqrtf( (float)( i + item ) );
+	}
+	item = (int)flResult;
+}
+
+void TestScheduler( bool bWorkStealing, int nThreads )
+{
+	const int nJobs = 20000;
+	const int nItems = 100000;
+
+	ThreadPoolStartParams_t params;
+	params.nThreads = nThreads;
+	params.fDistribute = TRS_TRUE;
+	params.bWorkStealing = bWorkStealing;
+	g_pTestThreadPool->Start( params, "Tst" );
+
+	CTinyJob *pJobs = new CTinyJob[nJobs];
+	CTinyJob::m_nCount = 0;
+	g_nTotalToComplete = nJobs;
+
+	CFastTimer jobTimer;
+	jobTimer.Start();
+	for ( int j = 0; j < nJobs; j++ )
+	{
+		pJobs[j].SetFlags( JF_QUEUE );
+		pJobs[j].m_nSeed = j;
+		pJobs[j].m_flResult = 0;
+		g_pTestThreadPool->AddJob( &pJobs[j] );
+	}
+	g_done.Wait();
+	jobTimer.End();
+
+	int *pItems = new int[nItems];
+	for ( int j = 0; j < nItems; j++ )
+	{
+		pItems[j] = j;
+	}
+
+	CParallelProcessor<int, CFuncJobItemProcessor<int> > processor;
+	processor.m_ItemProcessor.Init( &TinyItem, NULL, NULL );
+
+	CFastTimer parallelTimer;
+	parallelTimer.Start();
+	processor.Run( pItems, nItems, INT_MAX, g_pTestThreadPool );
+	parallelTimer.End();
+
+	g_pTestThreadPool->Stop();
+	g_done.Reset();
+
+	Msg( "ThreadPoolTest:         %-13s %2d threads -- %d jobs in %7.2fms (%.3fus/job), %d items in %7.2fms\n",
+		bWorkStealing ? "work stealing" : "shared queue", nThreads,
+		nJobs, jobTimer.GetDuration().GetMillisecondsF(), jobTimer.GetDuration().GetMillisecondsF() * 1000.0f / nJobs,
+		nItems, parallelTimer.GetDuration().GetMillisecondsF() );
+
+	delete [] pItems;
+	delete [] pJobs;
+}
+
 } // namespace ThreadPoolTest
 
 void RunThreadPoolTests()
@@ -1343,4 +1809,28 @@ void RunThreadPoolTests()
 	ThreadPoolTest::TestForcedExecute();
 }
 
+void RunThreadPoolSchedulerTests()
+{
+	CThreadPool pool;
+	ThreadPoolTest::g_pTestThreadPool = &pool;
+
+	const CPUInformation &ci = GetCPUInformation();
+	int nMaxThreads = min( (int)TP_MAX_POOL_THREADS, max( (int)ci.m_nLogicalProcessors, 1 ) );
+
+	Msg( "ThreadPoolTest: Scheduler comparison (%d logical processors)\n", ci.m_nLogicalProcessors );
+	for ( int nThreads = 1; ; nThreads *= 2 )
+	{
+		if ( nThreads > nMaxThreads )
+		{
+			nThreads = nMaxThreads;
+		}
+
+		ThreadPoolTest::TestScheduler( false, nThreads );
+		ThreadPoolTest::TestScheduler( true, nThreads );
+
+		if ( nThreads == nMaxThreads )
+			break;
+	}
+}
+
 #endif // _LINUX
@@ -482,3 +482,23 @@ static void DumpParticleStats_f( void )
 
 static ConCommand cl_dump_particle_stats( "cl_dump_particle_stats", DumpParticleStats_f, "dump particle profiling info to particle_profile.csv") ;
 
+static void ParticleBenchmark_f( const CCommand &args )
+{
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: cl_particle_benchmark <system> [collections] [frames] [.pcf file]\n" );
+		return;
+	}
+
+	if ( args.ArgC() > 4 )
+	{
+		g_pParticleSystemMgr->ReadParticleConfigFile( args[4], false );
+	}
+
+	int nCollections = ( args.ArgC() > 2 ) ? clamp( atoi( args[2] ), 1, 4096 ) : 64;
+	int nFrames = ( args.ArgC() > 3 ) ? clamp( atoi( args[3] ), 1, 100000 ) : 300;
+	g_pParticleSystemMgr->BenchmarkParticleSystem( args[1], nCollections, nFrames, 1.0f / 30.0f );
+}
+
+static ConCommand cl_particle_benchmark( "cl_particle_benchmark", ParticleBenchmark_f, "simulate many copies of a particle system without rendering and report the cost of each operator", FCVAR_CHEAT );
+
@@ -15,6 +15,9 @@
 
 extern CTimedEventMgr g_NetworkPropertyEventMgr;
 
+// Source of PVS info serials, 0 is never handed out
+static unsigned int s_nNextPVSInfoSerial = 1;
+
 
 //-----------------------------------------------------------------------------
 // Save/load
@@ -65,6 +68,7 @@ void CServerNetworkProperty::Init( CBaseEntity *pEntity )
 //	m_pTransmitProxy = NULL;
 	m_bPendingStateChange = false;
 	m_PVSInfo.m_nClusterCount = 0;
+	m_nPVSInfoSerial = s_nNextPVSInfoSerial++;
 	m_TimerEvent.Init( &g_NetworkPropertyEventMgr, this );
 }
 
@@ -143,7 +147,23 @@ void CServerNetworkProperty::RecomputePVSInformation()
 	if ( m_pPev && ( ( m_pPev->m_fStateFlags & FL_EDICT_DIRTY_PVS_INFORMATION ) != 0 ) )
 	{
 		m_pPev->m_fStateFlags &= ~FL_EDICT_DIRTY_PVS_INFORMATION;
+
+		// Most moves stay within the same leaves, only bump the serial when they don't
+		PVSInfo_t oldInfo = m_PVSInfo;
+		unsigned short pOldClusters[MAX_ENT_CLUSTERS];
+		if ( oldInfo.m_nClusterCount > 0 )
+		{
+			memcpy( pOldClusters, m_PVSInfo.m_pClusters, oldInfo.m_nClusterCount * sizeof(unsigned short) );
+		}
+
 		engine->BuildEntityClusterList( edict(), &m_PVSInfo );
+
+		if ( m_PVSInfo.m_nHeadNode != oldInfo.m_nHeadNode || m_PVSInfo.m_nClusterCount != oldInfo.m_nClusterCount ||
+			 m_PVSInfo.m_nAreaNum != oldInfo.m_nAreaNum || m_PVSInfo.m_nAreaNum2 != oldInfo.m_nAreaNum2 ||
+			 ( m_PVSInfo.m_nClusterCount > 0 && memcmp( pOldClusters, m_PVSInfo.m_pClusters, m_PVSInfo.m_nClusterCount * sizeof(unsigned short) ) ) )
+		{
+			m_nPVSInfoSerial = s_nNextPVSInfoSerial++;
+		}
 	}
 }
 
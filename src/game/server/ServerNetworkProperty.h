@@ -101,6 +101,10 @@ public:
 	// Recomputes PVS information
 	void RecomputePVSInformation();
 
+	// Changes whenever the PVS information does (new clusters, areas or headnode).
+	// Never repeats, so it also tells entities apart. Used to cache IsInPVS results.
+	unsigned int GetPVSInfoSerial() const;
+
 private:
 	// Detaches the edict.. should only be called by CBaseNetworkable's destructor.
 	void DetachEdict();
@@ -114,6 +118,7 @@ private:
 	// CBaseTransmitProxy *m_pTransmitProxy;
 	edict_t	*m_pPev;
 	PVSInfo_t m_PVSInfo;
+	unsigned int m_nPVSInfoSerial;
 	ServerClass *m_pServerClass;
 
 	// NOTE: This state is 'owned' by the entity. It's only copied here
@@ -254,5 +259,10 @@ inline int CServerNetworkProperty::AreaNum() const
 	return m_PVSInfo.m_nAreaNum;
 }
 
+inline unsigned int CServerNetworkProperty::GetPVSInfoSerial() const
+{
+	return m_nPVSInfoSerial;
+}
+
 
 #endif // SERVERNETWORKPROPERTY_H
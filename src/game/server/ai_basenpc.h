@@ -1273,6 +1273,10 @@ public:
 	// NPCs can override this to tweak with how costly particular movements are
 	virtual	bool		MovementCost( int moveType, const Vector &vecStart, const Vector &vecEnd, float *pCost );
 
+	// Node routes are shared between NPCs of the same class, hull and capabilities. NPCs 
+	// whose MovementCost, IsUnusableNode or IsJumpLegal depend on their own state must opt out
+	virtual bool		CanShareNodeRoutes()	{ return true; }
+
 	// Turns a directional vector into a yaw value that points down that vector.
 	float				VecToYaw( const Vector &vecDir );
 
@@ -15,6 +15,7 @@
 #include "ai_link.h"
 #include "ai_network.h"
 #include "ai_networkmanager.h"
+#include "ai_pathfinder.h"
 #include "saverestore_utlvector.h"
 #include "editor_sendcommand.h"
 #include "bitstring.h"
@@ -152,6 +153,8 @@ void CAI_DynamicLinkController::InputSetAllowed( inputdata_t &inputdata )
 		}
 		m_ControlledLinks[i]->m_strAllowUse = m_strAllowUse;
 	}
+
+	CAI_Pathfinder::InvalidateRouteCache();
 }
 
 void CAI_DynamicLinkController::InputSetInvert( inputdata_t &inputdata )
@@ -167,6 +170,8 @@ void CAI_DynamicLinkController::InputSetInvert( inputdata_t &inputdata )
 		}
 		m_ControlledLinks[i]->m_bInvertAllow = m_bInvertAllow;
 	}
+
+	CAI_Pathfinder::InvalidateRouteCache();
 }
 
 //-----------------------------------------------------------------------------
@@ -229,6 +234,7 @@ void CAI_DynamicLink::InitDynamicLinks(void)
 		return;
 
 	gm_bInitialized = true;
+	CAI_Pathfinder::InvalidateRouteCache();
 
 	bool bUpdateZones = false;
 
@@ -331,6 +337,8 @@ void CAI_DynamicLink::InitDynamicLinks(void)
 //------------------------------------------------------------------------------
 void CAI_DynamicLink::ResetDynamicLinks(void)
 {
+	CAI_Pathfinder::InvalidateRouteCache();
+
 	CAI_DynamicLink* pDynamicLink = CAI_DynamicLink::m_pAllDynamicLinks;
 
 	while (pDynamicLink)
@@ -494,6 +502,7 @@ void CAI_DynamicLink::SetLinkState(void)
 			{
 				pLink->m_LinkInfo &= ~bits_LINK_OFF;
 			}
+			CAI_Pathfinder::InvalidateRouteCache();
 		}
 		else
 		{
@@ -557,6 +566,8 @@ CAI_DynamicLink::CAI_DynamicLink(void)
 //-----------------------------------------------------------------------------
 CAI_DynamicLink::~CAI_DynamicLink(void) {
 
+	CAI_Pathfinder::InvalidateRouteCache();
+
 	// ----------------------------------------------
 	//  Remove from linked list of all dynamic links
 	// ----------------------------------------------
@@ -683,6 +694,8 @@ void CAI_RadialLinkController::ModifyNodeLinks( bool bMakeStale )
 
 	VPROF_BUDGET("ModifyLinks", "ModifyLinks");
 
+	CAI_Pathfinder::InvalidateRouteCache();
+
 	const float MinDistCareSq = Square( ai_radial_max_link_dist.GetFloat() + 0.1 );
 
 	for ( int i = 0; i < nNodes; i++ )
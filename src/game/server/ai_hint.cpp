@@ -13,6 +13,7 @@
 #include "ai_node.h"
 #include "ai_basenpc.h"
 #include "ai_networkmanager.h"
+#include "ai_pathfinder.h"
 #include "ndebugoverlay.h"
 #include "animation.h"
 #include "tier1/strtools.h"
@@ -1513,6 +1514,7 @@ void CAI_Hint::OnRestore()
 		m_NodeData.vecPosition = pNode->GetOrigin();
 		Teleport( &m_NodeData.vecPosition, NULL, NULL );
 		pNode->SetHint( this );
+		CAI_Pathfinder::InvalidateRouteCache();
 	}
 }
 
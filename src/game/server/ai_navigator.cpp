@@ -3516,6 +3516,11 @@ bool CAI_Navigator::MarkCurWaypointFailedLink( void )
 		}
 	}
 
+	if ( didMark )
+	{
+		CAI_Pathfinder::InvalidateRouteCache();
+	}
+
 	return didMark;
 }
 
@@ -14,6 +14,7 @@
 #include "ai_basenpc.h"
 #include "ai_link.h"
 #include "ai_navigator.h"
+#include "ai_pathfinder.h"
 #include "world.h"
 #include "ai_moveprobe.h"
 
@@ -126,6 +127,8 @@ CAI_Network::CAI_Network()
 
 CAI_Network::~CAI_Network()
 {
+	CAI_Pathfinder::InvalidateRouteCache();
+
 #ifdef AI_NODE_TREE
 	if ( m_pNodeTree )
 	{
@@ -21,6 +21,10 @@
 #include "ai_dynamiclink.h"
 #include "ai_hint.h"
 #include "bitstring.h"
+#include "utlmap.h"
+#include "utllinkedlist.h"
+#include "vstdlib/random.h"
+#include "tier0/fasttimer.h"
 
 //@todo: bad dependency!
 #include "ai_navigator.h"
@@ -46,6 +50,324 @@ BEGIN_SIMPLE_DATADESC( CAI_Pathfinder )
 
 END_DATADESC()
 
+ConVar ai_route_cache( "ai_route_cache", "1", 0, "Share node routes between NPCs of the same class, hull and capabilities" );
+
+//-----------------------------------------------------------------------------
+// Search state for FindBestPath. Searches never nest, so one set of arrays is
+// shared by every pathfinder. The arrays are only grown, never cleared: a node's
+// G/H/F/parent mean something only once Visit() has stamped it for the current
+// search.
+//-----------------------------------------------------------------------------
+
+class CAI_PathfindState
+{
+public:
+	CAI_PathfindState()
+	 :	m_nNodes( 0 ),
+		m_iSearch( 0 ),
+		m_nOpen( 0 ),
+		m_pG( NULL ),
+		m_pH( NULL ),
+		m_pF( NULL ),
+		m_pParent( NULL ),
+		m_pStamp( NULL ),
+		m_pHeap( NULL ),
+		m_pHeapIndex( NULL )
+	{
+	}
+
+	~CAI_PathfindState()
+	{
+		Free();
+	}
+
+	void Begin( int nNodes )
+	{
+		if ( nNodes > m_nNodes )
+		{
+			Free();
+			m_pG			= new float[nNodes];
+			m_pH			= new float[nNodes];
+			m_pF			= new float[nNodes];
+			m_pParent		= new int[nNodes];
+			m_pStamp		= new unsigned[nNodes];
+			m_pHeap			= new int[nNodes];
+			m_pHeapIndex	= new int[nNodes];
+			m_nNodes		= nNodes;
+
+			memset( m_pStamp, 0, nNodes * sizeof(unsigned) );
+			m_iSearch = 0;
+		}
+
+		if ( ++m_iSearch == 0 )
+		{
+			memset( m_pStamp, 0, m_nNodes * sizeof(unsigned) );
+			m_iSearch = 1;
+		}
+		m_nOpen = 0;
+	}
+
+	bool IsVisited( int iNode ) const	{ return ( m_pStamp[iNode] == m_iSearch ); }
+
+	void Visit( int iNode )
+	{
+		if ( !IsVisited( iNode ) )
+		{
+			m_pStamp[iNode] = m_iSearch;
+			m_pHeapIndex[iNode] = -1;
+		}
+	}
+
+	// The open set is a binary heap on (F, node ID) that knows where each node sits,
+	// so a node whose F drops is moved up in place. Ties go to the lowest node ID,
+	// the node CAI_Network::FindBSSmallest would pick, so routes don't change.
+	bool IsOpenEmpty() const			{ return ( m_nOpen == 0 ); }
+
+	void Open( int iNode )
+	{
+		Assert( IsVisited( iNode ) );
+
+		int iPos = m_pHeapIndex[iNode];
+		if ( iPos < 0 )
+		{
+			iPos = m_nOpen++;
+		}
+		SiftUp( iNode, iPos );
+	}
+
+	int PopSmallest()
+	{
+		Assert( m_nOpen > 0 );
+
+		int iNode = m_pHeap[0];
+		m_pHeapIndex[iNode] = -1;
+		if ( --m_nOpen > 0 )
+		{
+			SiftDown( m_pHeap[m_nOpen], 0 );
+		}
+		return iNode;
+	}
+
+	float	*m_pG;
+	float	*m_pH;
+	float	*m_pF;
+	int		*m_pParent;
+
+private:
+	bool IsLess( int iNodeA, int iNodeB ) const
+	{
+		return ( m_pF[iNodeA] < m_pF[iNodeB] || ( m_pF[iNodeA] == m_pF[iNodeB] && iNodeA < iNodeB ) );
+	}
+
+	void Place( int iNode, int iPos )
+	{
+		m_pHeap[iPos] = iNode;
+		m_pHeapIndex[iNode] = iPos;
+	}
+
+	void SiftUp( int iNode, int iPos )
+	{
+		while ( iPos > 0 )
+		{
+			int iParentPos = ( iPos - 1 ) >> 1;
+			if ( !IsLess( iNode, m_pHeap[iParentPos] ) )
+				break;
+			Place( m_pHeap[iParentPos], iPos );
+			iPos = iParentPos;
+		}
+		Place( iNode, iPos );
+	}
+
+	void SiftDown( int iNode, int iPos )
+	{
+		for ( ;; )
+		{
+			int iChildPos = iPos * 2 + 1;
+			if ( iChildPos >= m_nOpen )
+				break;
+			if ( iChildPos + 1 < m_nOpen && IsLess( m_pHeap[iChildPos + 1], m_pHeap[iChildPos] ) )
+				iChildPos++;
+			if ( !IsLess( m_pHeap[iChildPos], iNode ) )
+				break;
+			Place( m_pHeap[iChildPos], iPos );
+			iPos = iChildPos;
+		}
+		Place( iNode, iPos );
+	}
+
+	void Free()
+	{
+		delete [] m_pG;
+		delete [] m_pH;
+		delete [] m_pF;
+		delete [] m_pParent;
+		delete [] m_pStamp;
+		delete [] m_pHeap;
+		delete [] m_pHeapIndex;
+		m_pG = m_pH = m_pF = NULL;
+		m_pParent = m_pHeap = m_pHeapIndex = NULL;
+		m_pStamp = NULL;
+		m_nNodes = 0;
+	}
+
+	int			m_nNodes;
+	unsigned	m_iSearch;
+	int			m_nOpen;
+	unsigned	*m_pStamp;
+	int			*m_pHeap;
+	int			*m_pHeapIndex;
+};
+
+static CAI_PathfindState g_AIPathfindState;
+
+//-----------------------------------------------------------------------------
+// Node routes shared between NPCs. A route only depends on the ends, the hull,
+// the movement capabilities, the NPC's class (for its IsUnusableNode, IsJumpLegal
+// and MovementCost) and, if it is limited to it, its hint group. Searches that
+// touched anything else (names, node locks, stale links) aren't stored, and NPCs
+// that answer those questions from their own state opt out with
+// CanShareNodeRoutes(). Anything that changes the network bumps the generation,
+// which retires every stored route. Failed searches are stored as well, they are
+// the most expensive ones.
+//-----------------------------------------------------------------------------
+
+#define AI_ROUTE_CACHE_SIZE			256
+#define AI_ROUTE_CACHE_MAX_NODES	128
+
+struct AI_RouteCacheKey_t
+{
+	int			startID;
+	int			endID;
+	int			hull;
+	int			moveCaps;
+	string_t	iClassname;
+	string_t	iHintGroup;		// NULL_STRING unless the NPC is limited to its hint group
+};
+
+static bool RouteCacheKeyLessFunc( const AI_RouteCacheKey_t &lhs, const AI_RouteCacheKey_t &rhs )
+{
+	if ( lhs.startID != rhs.startID )
+		return ( lhs.startID < rhs.startID );
+	if ( lhs.endID != rhs.endID )
+		return ( lhs.endID < rhs.endID );
+	if ( lhs.hull != rhs.hull )
+		return ( lhs.hull < rhs.hull );
+	if ( lhs.moveCaps != rhs.moveCaps )
+		return ( lhs.moveCaps < rhs.moveCaps );
+	if ( lhs.iClassname != rhs.iClassname )
+		return ( STRING( lhs.iClassname ) < STRING( rhs.iClassname ) );
+	return ( STRING( lhs.iHintGroup ) < STRING( rhs.iHintGroup ) );
+}
+
+struct AI_RouteCacheEntry_t
+{
+	AI_RouteCacheKey_t	key;
+	unsigned			iGeneration;
+	int					nNodes;		// 0 if there is no route
+	int					nodes[AI_ROUTE_CACHE_MAX_NODES];
+};
+
+class CAI_RouteCache
+{
+public:
+	CAI_RouteCache()
+	 :	m_Map( 0, 0, RouteCacheKeyLessFunc ),
+		m_iGeneration( 0 ),
+		m_nHits( 0 ),
+		m_nMisses( 0 )
+	{
+	}
+
+	void Invalidate()
+	{
+		m_iGeneration++;
+	}
+
+	const AI_RouteCacheEntry_t *Find( const AI_RouteCacheKey_t &key )
+	{
+		unsigned short iMap = m_Map.Find( key );
+		if ( iMap == m_Map.InvalidIndex() )
+		{
+			m_nMisses++;
+			return NULL;
+		}
+
+		unsigned short iEntry = m_Map[iMap];
+		if ( m_Entries[iEntry].iGeneration != m_iGeneration )
+		{
+			m_Map.RemoveAt( iMap );
+			m_Entries.Free( iEntry );
+			m_nMisses++;
+			return NULL;
+		}
+
+		// Most recently used at the head
+		m_Entries.Unlink( iEntry );
+		m_Entries.LinkToHead( iEntry );
+		m_nHits++;
+		return &m_Entries[iEntry];
+	}
+
+	void Add( const AI_RouteCacheKey_t &key, AI_Waypoint_t *pRoute )
+	{
+		int nNodes = 0;
+		for ( AI_Waypoint_t *pWaypoint = pRoute; pWaypoint; pWaypoint = pWaypoint->GetNext() )
+		{
+			if ( ++nNodes > AI_ROUTE_CACHE_MAX_NODES )
+				return;
+		}
+
+		unsigned short iEntry;
+		unsigned short iMap = m_Map.Find( key );
+		if ( iMap != m_Map.InvalidIndex() )
+		{
+			iEntry = m_Map[iMap];
+			m_Entries.Unlink( iEntry );
+		}
+		else
+		{
+			if ( m_Entries.Count() >= AI_ROUTE_CACHE_SIZE )
+			{
+				iEntry = m_Entries.Tail();
+				m_Entries.Unlink( iEntry );
+				m_Map.Remove( m_Entries[iEntry].key );
+			}
+			else
+			{
+				iEntry = m_Entries.Alloc();
+			}
+			m_Map.Insert( key, iEntry );
+		}
+		m_Entries.LinkToHead( iEntry );
+
+		AI_RouteCacheEntry_t &entry = m_Entries[iEntry];
+		entry.key = key;
+		entry.iGeneration = m_iGeneration;
+		entry.nNodes = 0;
+		for ( AI_Waypoint_t *pWaypoint = pRoute; pWaypoint; pWaypoint = pWaypoint->GetNext() )
+		{
+			entry.nodes[entry.nNodes++] = pWaypoint->iNodeID;
+		}
+	}
+
+	int GetHits() const		{ return m_nHits; }
+	int GetMisses() const	{ return m_nMisses; }
+
+private:
+	CUtlMap<AI_RouteCacheKey_t, unsigned short, unsigned short>	m_Map;
+	CUtlLinkedList<AI_RouteCacheEntry_t, unsigned short>			m_Entries;
+	unsigned	m_iGeneration;
+	int			m_nHits;
+	int			m_nMisses;
+};
+
+static CAI_RouteCache g_AIRouteCache;
+
+void CAI_Pathfinder::InvalidateRouteCache()
+{
+	g_AIRouteCache.Invalidate();
+}
+
 //-----------------------------------------------------------------------------
 // Compute move type bits to nav type
 //-----------------------------------------------------------------------------
@@ -249,6 +571,7 @@ bool CAI_Pathfinder::IsLinkStillStale(int moveType, CAI_Link *nodeLink)
 		GetNetwork()->GetNode(nodeLink->m_iDestID)->GetPosition(GetHullType()), moveType))
 	{
 		nodeLink->m_LinkInfo &= ~bits_LINK_STALE_SUGGESTED;
+		InvalidateRouteCache();
 		return false;
 	}
 
@@ -287,6 +610,136 @@ AI_Waypoint_t *CAI_Pathfinder::FindBestPath(int startID, int endID)
 	m_nPerfStatPB++;
 #endif
 
+	bool bShareRoute = ( ai_route_cache.GetBool() && GetOuter()->CanShareNodeRoutes() );
+
+	AI_RouteCacheKey_t key;
+	if ( bShareRoute )
+	{
+		key.startID		= startID;
+		key.endID		= endID;
+		key.hull		= GetHullType();
+		key.moveCaps	= ( CapabilitiesGet() & AI_MOVE_TYPE_BITS );
+		key.iClassname	= GetOuter()->m_iClassname;
+		key.iHintGroup	= GetOuter()->IsLimitingHintGroups() ? GetOuter()->GetHintGroup() : NULL_STRING;
+
+		const AI_RouteCacheEntry_t *pEntry = g_AIRouteCache.Find( key );
+		if ( pEntry )
+		{
+			if ( !pEntry->nNodes )
+				return NULL;
+
+			// Chain the stored nodes back up as parents and build fresh waypoints
+			g_AIPathfindState.Begin( GetNetwork()->NumNodes() );
+			int *nodeP = g_AIPathfindState.m_pParent;
+			nodeP[pEntry->nodes[0]] = NO_NODE;
+			for ( int i = 1; i < pEntry->nNodes; i++ )
+			{
+				nodeP[pEntry->nodes[i]] = pEntry->nodes[i - 1];
+			}
+			return MakeRouteFromParents( nodeP, pEntry->nodes[pEntry->nNodes - 1] );
+		}
+	}
+
+	m_bRouteNotShareable = false;
+
+	AI_Waypoint_t *pRoute = SearchBestPath( startID, endID );
+
+	if ( bShareRoute && !m_bRouteNotShareable )
+	{
+		g_AIRouteCache.Add( key, pRoute );
+	}
+
+	return pRoute;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: A* over the node graph, with the open set kept in a heap
+//-----------------------------------------------------------------------------
+
+AI_Waypoint_t *CAI_Pathfinder::SearchBestPath(int startID, int endID) 
+{
+	int nNodes = GetNetwork()->NumNodes();
+	CAI_Node **pAInode = GetNetwork()->AccessNodes();
+
+	CAI_PathfindState &state = g_AIPathfindState;
+	state.Begin( nNodes );
+
+	float* nodeG = state.m_pG;
+	float* nodeH = state.m_pH;
+	float* nodeF = state.m_pF;
+	int*   nodeP = state.m_pParent;		// Node parent 
+
+	// ------------- INITIALIZE ------------------------
+	const Vector &vEnd = pAInode[endID]->GetPosition(GetHullType());
+
+	state.Visit( startID );
+	nodeG[startID] = 0;
+	nodeP[startID] = NO_NODE;
+	nodeH[startID] = 0.1*(pAInode[startID]->GetPosition(GetHullType())-vEnd).Length(); // Don't want to over estimate
+	nodeF[startID] = nodeG[startID] + nodeH[startID];
+
+	state.Open( startID );
+
+	// --------------- FIND BEST PATH ------------------
+	while ( !state.IsOpenEmpty() ) 
+	{
+		int smallestID = state.PopSmallest();
+
+		CAI_Node *pSmallestNode = pAInode[smallestID];
+		
+		if (GetOuter()->IsUnusableNode(smallestID, pSmallestNode->GetHint()))
+			continue;
+
+		if (smallestID == endID) 
+		{
+			return MakeRouteFromParents(nodeP, endID);
+		}
+
+		const Vector &r1 = pSmallestNode->GetPosition(GetHullType());
+
+		for (int link=0; link < pSmallestNode->NumLinks();link++) 
+		{
+			CAI_Link *nodeLink = pSmallestNode->GetLinkByIndex(link);
+			
+			if (!IsLinkUsable(nodeLink,smallestID))
+				continue;
+
+			// FIXME: the cost function should take into account Node costs (danger, flanking, etc).
+			int moveType = nodeLink->m_iAcceptedMoveTypes[GetHullType()] & CapabilitiesGet();
+			int testID	 = nodeLink->DestNodeID(smallestID);
+
+			Vector vecStart = r1;
+			Vector vecEnd = pAInode[testID]->GetPosition(GetHullType());
+			float dist   = GetOuter()->GetNavigator()->MovementCost( moveType, vecStart, vecEnd ); // MovementCost takes ref parameters!!
+
+			if ( dist == FLT_MAX )
+				continue;
+
+			float new_g  = nodeG[smallestID] + dist;
+
+			if ( !state.IsVisited(testID) || (new_g < nodeG[testID]) ) 
+			{
+				state.Visit( testID );
+				nodeP[testID] = smallestID;
+				nodeG[testID] = new_g;
+				nodeH[testID] = (pAInode[testID]->GetPosition(GetHullType())-vEnd).Length();
+				nodeF[testID] = nodeG[testID] + nodeH[testID];
+
+				state.Open( testID );
+			}
+		}
+	}
+
+	return NULL;   
+}
+
+//-----------------------------------------------------------------------------
+
+AI_Waypoint_t *CAI_Pathfinder::FindBestPathLinear(int startID, int endID) 
+{
+	if ( !GetNetwork()->NumNodes() )
+		return NULL;
+
 	int nNodes = GetNetwork()->NumNodes();
 	CAI_Node **pAInode = GetNetwork()->AccessNodes();
 
@@ -604,6 +1057,9 @@ bool CAI_Pathfinder::IsLinkUsable(CAI_Link *pLink, int startID)
 		if ( !pDynamicLink || pDynamicLink->m_strAllowUse == NULL_STRING )
 			return false;
 
+		// Depends on who is asking
+		m_bRouteNotShareable = true;
+
 		const char *pszAllowUse = STRING( pDynamicLink->m_strAllowUse );
 		if ( pDynamicLink->m_bInvertAllow )
 		{
@@ -645,6 +1101,7 @@ bool CAI_Pathfinder::IsLinkUsable(CAI_Link *pLink, int startID)
 				 pEndHint->HintType() == HINT_JUMP_OVERRIDE &&
 				 ( ( ( pStartHint->GetSpawnFlags() | pEndHint->GetSpawnFlags() ) & SF_ALLOW_JUMP_UP ) || pStartHint->GetAbsOrigin().z > pEndHint->GetAbsOrigin().z ) )
 			{
+				m_bRouteNotShareable = true;
 				if ( !pStartNode->IsLocked() )
 				{
 					if ( pStartHint->GetTargetNode() == -1 || pStartHint->GetTargetNode() == endID )
@@ -686,6 +1143,7 @@ bool CAI_Pathfinder::IsLinkUsable(CAI_Link *pLink, int startID)
 	// --------------------------------------------------------------------------
 	if (pLink->m_LinkInfo & bits_LINK_STALE_SUGGESTED)
 	{
+		m_bRouteNotShareable = true;
 		if (IsLinkStillStale(moveType, pLink))
 		{
 			return false;
@@ -2133,3 +2591,119 @@ void CAI_Pathfinder::CTriDebugOverlay::AddTriOverlayLine(const Vector &origin, c
 }
 
 //-----------------------------------------------------------------------------
+//-----------------------------------------------------------------------------
+// ai_pathfind_bench [npc] [routes]: runs random node to node routes on the loaded
+// graph through FindBestPath and through the original linear scan search, checks
+// they agree and reports routes per second. The named NPC (or the first one with
+// a pathfinder) supplies the hull, capabilities and costs.
+//-----------------------------------------------------------------------------
+
+static bool AI_RoutesMatch( AI_Waypoint_t *pRouteA, AI_Waypoint_t *pRouteB )
+{
+	while ( pRouteA && pRouteB )
+	{
+		if ( pRouteA->iNodeID != pRouteB->iNodeID || pRouteA->NavType() != pRouteB->NavType() )
+			return false;
+		pRouteA = pRouteA->GetNext();
+		pRouteB = pRouteB->GetNext();
+	}
+	return ( pRouteA == pRouteB );
+}
+
+static double AI_TimeRoutes( CAI_Pathfinder *pPathfinder, const CUtlVector<int> &ends, bool bLinear )
+{
+	CFastTimer timer;
+	timer.Start();
+	for ( int i = 0; i < ends.Count(); i += 2 )
+	{
+		pPathfinder->SetIgnoreBadLinks();
+		AI_Waypoint_t *pRoute = bLinear ? pPathfinder->FindBestPathLinear( ends[i], ends[i + 1] ) : pPathfinder->FindBestPath( ends[i], ends[i + 1] );
+		DeleteAll( pRoute );
+	}
+	timer.End();
+	return timer.GetDuration().GetSeconds();
+}
+
+static void CC_AI_PathfindBench( const CCommand &args )
+{
+	if ( !g_pBigAINet || !g_pBigAINet->NumNodes() )
+	{
+		Msg( "No node graph loaded\n" );
+		return;
+	}
+
+	CAI_BaseNPC *pNPC = NULL;
+	CAI_BaseNPC **ppAIs = g_AI_Manager.AccessAIs();
+	for ( int i = 0; i < g_AI_Manager.NumAIs(); i++ )
+	{
+		if ( !ppAIs[i]->GetPathfinder() )
+			continue;
+
+		if ( args.ArgC() < 2 || ppAIs[i]->NameMatches( args[1] ) || ppAIs[i]->ClassMatches( args[1] ) )
+		{
+			pNPC = ppAIs[i];
+			break;
+		}
+	}
+
+	if ( !pNPC )
+	{
+		Msg( "No NPC to route with\n" );
+		return;
+	}
+
+	int nRoutes = ( args.ArgC() > 2 ) ? max( atoi( args[2] ), 1 ) : 500;
+	int nNodes = g_pBigAINet->NumNodes();
+
+	CUtlVector<int> ends;
+	ends.SetCount( nRoutes * 2 );
+
+	CUniformRandomStream random;
+	random.SetSeed( 0 );
+	for ( int i = 0; i < ends.Count(); i++ )
+	{
+		ends[i] = random.RandomInt( 0, nNodes - 1 );
+	}
+
+	CAI_Pathfinder *pPathfinder = pNPC->GetPathfinder();
+	bool bRouteCache = ai_route_cache.GetBool();
+
+	// Stale links are skipped throughout: checking them traces and is throttled per
+	// frame, which would make the two searches see different graphs
+	ai_route_cache.SetValue( 0 );
+
+	int nFound = 0;
+	int nMismatched = 0;
+	for ( int i = 0; i < ends.Count(); i += 2 )
+	{
+		pPathfinder->SetIgnoreBadLinks();
+		AI_Waypoint_t *pLinear = pPathfinder->FindBestPathLinear( ends[i], ends[i + 1] );
+		pPathfinder->SetIgnoreBadLinks();
+		AI_Waypoint_t *pHeap = pPathfinder->FindBestPath( ends[i], ends[i + 1] );
+
+		if ( pLinear )
+			nFound++;
+		if ( !AI_RoutesMatch( pLinear, pHeap ) )
+			nMismatched++;
+
+		DeleteAll( pLinear );
+		DeleteAll( pHeap );
+	}
+
+	double flLinear = AI_TimeRoutes( pPathfinder, ends, true );
+	double flHeap = AI_TimeRoutes( pPathfinder, ends, false );
+
+	// Once to fill the cache, then timed
+	ai_route_cache.SetValue( 1 );
+	CAI_Pathfinder::InvalidateRouteCache();
+	AI_TimeRoutes( pPathfinder, ends, false );
+	double flCached = AI_TimeRoutes( pPathfinder, ends, false );
+
+	ai_route_cache.SetValue( bRouteCache ? 1 : 0 );
+
+	Msg( "%d nodes, %d routes (%d found) as %s, %d mismatched\n", nNodes, nRoutes, nFound, pNPC->GetDebugName(), nMismatched );
+	Msg( "  linear: %8.0f routes/s\n", nRoutes / max( flLinear, 1e-6 ) );
+	Msg( "  heap:   %8.0f routes/s\n", nRoutes / max( flHeap, 1e-6 ) );
+	Msg( "  cached: %8.0f routes/s%s\n", nRoutes / max( flCached, 1e-6 ), pNPC->CanShareNodeRoutes() ? "" : " (NPC doesn't share routes)" );
+}
+static ConCommand ai_pathfind_bench( "ai_pathfind_bench", CC_AI_PathfindBench, "Compares node route search speed against the original search. Arguments: [npc name or class] [routes]", FCVAR_CHEAT );
@@ -51,6 +51,7 @@ public:
 	CAI_Pathfinder( CAI_BaseNPC *pOuter )
 	 :	CAI_Component(pOuter),
 		m_flLastStaleLinkCheckTime( 0 ),
+		m_bRouteNotShareable( false ),
 		m_pNetwork( NULL )
 	{
 	}
@@ -65,6 +66,13 @@ public:
 	AI_Waypoint_t*	FindBestPath		(int startID, int endID);
 	AI_Waypoint_t*	FindShortRandomPath	(int startID, float minPathLength, const Vector &vDirection = vec3_origin);
 
+	// The original linear scan search, kept as the baseline for ai_pathfind_bench
+	AI_Waypoint_t*	FindBestPathLinear	(int startID, int endID);
+
+	// Call when anything FindBestPath reads off the network changes (link state, stale 
+	// links, hint groups) so shared routes get rebuilt
+	static void		InvalidateRouteCache();
+
 	// --------------------------------
 
 	bool			IsLinkUsable(CAI_Link *pLink, int startID);
@@ -117,6 +125,7 @@ private:
 	//---------------------------------
 	
 	AI_Waypoint_t*	MakeRouteFromParents(int *parentArray, int endID);
+	AI_Waypoint_t*	SearchBestPath(int startID, int endID);
 	AI_Waypoint_t*	CreateNodeWaypoint( Hull_t hullType, int nodeID, int nodeFlags = 0 );
 	
 	AI_Waypoint_t*	BuildRouteThroughPoints( Vector *vecPoints, int nNumPoints, int nDirection, int nStartIndex, int nEndIndex, Navigation_t navType, CBaseEntity *pTarget );
@@ -187,6 +196,7 @@ private:
 	
 	float m_flLastStaleLinkCheckTime;	// Last time I check for a stale link
 	bool m_bIgnoreStaleLinks;
+	bool m_bRouteNotShareable;			// Set by IsLinkUsable when the result depended on this NPC or on time
 
 	//---------------------------------
 	
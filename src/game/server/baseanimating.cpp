@@ -26,6 +26,8 @@
 #include "physics_prop_ragdoll.h"
 #include "datacache/idatacache.h"
 #include "smoke_trail.h"
+#include "filesystem.h"
+#include "tier1/utlstring.h"
 
 // memdbgon must be the last include file in a .cpp file!!!
 #include "tier0/memdbgon.h"
@@ -3528,3 +3530,224 @@ bool CBaseAnimating::IsSequenceLooping( CStudioHdr *pStudioHdr, int iSequence )
 {
 	return (::GetSequenceFlags( pStudioHdr, iSequence ) & STUDIO_LOOPING) != 0;
 }
+
+
+static void FindModels( const char *pDir, CUtlVector< CUtlString > &models )
+{
+	char szSearch[MAX_PATH];
+	Q_snprintf( szSearch, sizeof( szSearch ), "%s/*", pDir );
+
+	FileFindHandle_t findHandle;
+	const char *pName = filesystem->FindFirstEx( szSearch, "GAME", &findHandle );
+	while ( pName )
+	{
+		if ( pName[0] != '.' )
+		{
+			char szPath[MAX_PATH];
+			Q_snprintf( szPath, sizeof( szPath ), "%s/%s", pDir, pName );
+
+			const char *pExtension = Q_GetFileExtension( pName );
+			if ( filesystem->FindIsDirectory( findHandle ) )
+			{
+				FindModels( szPath, models );
+			}
+			else if ( pExtension && !Q_stricmp( pExtension, "mdl" ) )
+			{
+				models.AddToTail( CUtlString( szPath ) );
+			}
+		}
+		pName = filesystem->FindNext( findHandle );
+	}
+	filesystem->FindClose( findHandle );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Runs CalcPose over every sequence of the shipped models, once with
+//			the scalar animation decode and once with the SIMD one, and reports
+//			the time each took and how far apart the poses came out.
+//-----------------------------------------------------------------------------
+CON_COMMAND( anim_simd_bench, "Time CalcPose on every sequence of every model with and without anim_simd: anim_simd_bench [model name filter]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	const char *pFilter = ( args.ArgC() > 1 ) ? args[1] : NULL;
+
+	CUtlVector< CUtlString > models;
+	FindModels( "models", models );
+
+	// off the pose parameter grid so blended sequences take the 3-way blend
+	float poseParameter[MAXSTUDIOPOSEPARAM];
+	for ( int i = 0; i < MAXSTUDIOPOSEPARAM; i++ )
+	{
+		poseParameter[i] = 0.37f;
+	}
+	static const float s_flCycles[] = { 0.0f, 0.33f, 0.71f };
+
+	Vector pos[2][MAXSTUDIOBONES];
+	Quaternion q[2][MAXSTUDIOBONES];
+	double flTime[2] = { 0.0, 0.0 };
+	float flMaxPosError = 0.0f;
+	float flMaxQuatError = 0.0f;
+	int nModels = 0;
+	int nPoses = 0;
+
+	MDLCACHE_CRITICAL_SECTION();
+
+	for ( int i = 0; i < models.Count(); i++ )
+	{
+		if ( pFilter && !Q_stristr( models[i].Get(), pFilter ) )
+			continue;
+
+		MDLHandle_t hModel = mdlcache->FindMDL( models[i].Get() );
+		if ( hModel == MDLHANDLE_INVALID )
+			continue;
+
+		studiohdr_t *pRenderHdr = mdlcache->IsErrorModel( hModel ) ? NULL : mdlcache->GetStudioHdr( hModel );
+		if ( pRenderHdr && pRenderHdr->numbones > 0 )
+		{
+			CStudioHdr studioHdr( pRenderHdr, mdlcache );
+			nModels++;
+
+			for ( int iSequence = 0; iSequence < studioHdr.GetNumSeq(); iSequence++ )
+			{
+				for ( int iCycle = 0; iCycle < ARRAYSIZE( s_flCycles ); iCycle++ )
+				{
+					// alternate which path goes first so neither one always gets the warm cache
+					for ( int nRun = 0; nRun < 2; nRun++ )
+					{
+						int nPath = ( nRun + nPoses ) & 1;
+						Studio_SetAnimSIMDOverride( nPath );
+
+						double flStart = Plat_FloatTime();
+						InitPose( &studioHdr, pos[nPath], q[nPath], BONE_USED_BY_ANYTHING );
+						CalcPose( &studioHdr, NULL, pos[nPath], q[nPath], iSequence, s_flCycles[iCycle], poseParameter, BONE_USED_BY_ANYTHING );
+						flTime[nPath] += Plat_FloatTime() - flStart;
+					}
+					nPoses++;
+
+					for ( int iBone = 0; iBone < studioHdr.numbones(); iBone++ )
+					{
+						for ( int k = 0; k < 3; k++ )
+						{
+							flMaxPosError = max( flMaxPosError, fabs( pos[0][iBone][k] - pos[1][iBone][k] ) );
+						}
+
+						// q and -q are the same rotation
+						float flError = 0.0f, flFlippedError = 0.0f;
+						for ( int k = 0; k < 4; k++ )
+						{
+							flError = max( flError, fabs( q[0][iBone][k] - q[1][iBone][k] ) );
+							flFlippedError = max( flFlippedError, fabs( q[0][iBone][k] + q[1][iBone][k] ) );
+						}
+						flMaxQuatError = max( flMaxQuatError, min( flError, flFlippedError ) );
+					}
+				}
+			}
+		}
+
+		mdlcache->Release( hModel );
+	}
+
+	Studio_SetAnimSIMDOverride( -1 );
+
+	if ( !nPoses )
+	{
+		Msg( "anim_simd_bench: no models found\n" );
+		return;
+	}
+
+	Msg( "anim_simd_bench: %d models, %d poses\n", nModels, nPoses );
+	Msg( "  scalar: %.2f us/pose\n", flTime[0] * 1000000.0 / nPoses );
+	Msg( "  simd:   %.2f us/pose (%.2fx)\n", flTime[1] * 1000000.0 / nPoses, flTime[1] > 0.0 ? flTime[0] / flTime[1] : 0.0 );
+	Msg( "  max difference: position %g, quaternion %g\n", flMaxPosError, flMaxQuatError );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Stress test for the shared pose cache. Spawns a crowd of animated
+//			props in a handful of lockstep groups and times their bone setup
+//			with and without anim_posecache.
+//-----------------------------------------------------------------------------
+CON_COMMAND( anim_posecache_bench, "Time SetupBones on a crowd of animated models with and without anim_posecache: anim_posecache_bench <model> [count] [groups] [frames]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	if ( args.ArgC() < 2 )
+	{
+		Msg( "Usage: anim_posecache_bench <model> [count] [groups] [frames]\n" );
+		return;
+	}
+
+	const char *pModelName = args[1];
+	int nCount = ( args.ArgC() > 2 ) ? clamp( atoi( args[2] ), 1, 2048 ) : 300;
+	int nGroups = ( args.ArgC() > 3 ) ? clamp( atoi( args[3] ), 1, nCount ) : 8;
+	int nFrames = ( args.ArgC() > 4 ) ? clamp( atoi( args[4] ), 1, 10000 ) : 100;
+
+	CUtlVector< CBaseAnimating * > crowd;
+	for ( int i = 0; i < nCount; i++ )
+	{
+		CBaseAnimating *pProp = dynamic_cast< CBaseAnimating * >( CreateEntityByName( "prop_dynamic_override" ) );
+		if ( !pProp )
+			break;
+
+		pProp->KeyValue( "model", pModelName );
+		pProp->KeyValue( "solid", "0" );
+		pProp->SetAbsOrigin( Vector( ( i % 32 ) * 64.0f, ( i / 32 ) * 64.0f, 0.0f ) );
+		DispatchSpawn( pProp );
+		crowd.AddToTail( pProp );
+	}
+
+	CStudioHdr *pStudioHdr = crowd.Count() ? crowd[0]->GetModelPtr() : NULL;
+	if ( !pStudioHdr || !pStudioHdr->GetNumSeq() || !pStudioHdr->numbones() )
+	{
+		Msg( "anim_posecache_bench: %s isn't an animated model\n", pModelName );
+		for ( int i = 0; i < crowd.Count(); i++ )
+		{
+			UTIL_Remove( crowd[i] );
+		}
+		return;
+	}
+
+	// each group plays its own sequence, every member at the same cycle
+	for ( int i = 0; i < crowd.Count(); i++ )
+	{
+		crowd[i]->ResetSequence( ( i % nGroups ) % pStudioHdr->GetNumSeq() );
+	}
+
+	matrix3x4_t bones[MAXSTUDIOBONES];
+	double flTime[2] = { 0.0, 0.0 };
+	int nHits = 0, nMisses = 0;
+
+	for ( int nPath = 0; nPath < 2; nPath++ )
+	{
+		Studio_SetPoseCacheOverride( nPath );
+		Studio_FlushPoseCache();
+
+		double flStart = Plat_FloatTime();
+		for ( int iFrame = 0; iFrame < nFrames; iFrame++ )
+		{
+			float flCycle = (float)iFrame / nFrames;
+			for ( int i = 0; i < crowd.Count(); i++ )
+			{
+				crowd[i]->SetCycle( flCycle );
+				crowd[i]->SetupBones( bones, BONE_USED_BY_ANYTHING );
+			}
+		}
+		flTime[nPath] = Plat_FloatTime() - flStart;
+	}
+
+	Studio_GetPoseCacheStats( nHits, nMisses );
+	Studio_SetPoseCacheOverride( -1 );
+
+	for ( int i = 0; i < crowd.Count(); i++ )
+	{
+		UTIL_Remove( crowd[i] );
+	}
+
+	int nSetups = crowd.Count() * nFrames;
+	Msg( "anim_posecache_bench: %d x %s, %d groups, %d frames\n", crowd.Count(), pModelName, nGroups, nFrames );
+	Msg( "  uncached: %.2f us/setup\n", flTime[0] * 1000000.0 / nSetups );
+	Msg( "  cached:   %.2f us/setup (%.2fx)\n", flTime[1] * 1000000.0 / nSetups, flTime[1] > 0.0 ? flTime[0] / flTime[1] : 0.0 );
+	Msg( "  pose cache: %d hits, %d misses (%.1f%%)\n", nHits, nMisses, ( nHits + nMisses ) ? 100.0f * nHits / ( nHits + nMisses ) : 0.0f );
+}
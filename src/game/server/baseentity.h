@@ -1859,6 +1859,7 @@ inline string_t CBaseEntity::GetEntityName()
 inline void CBaseEntity::SetName( string_t newName )
 {
 	m_iName = newName;
+	gEntList.UpdateFindIndex( this );
 }
 
 
@@ -2382,6 +2383,7 @@ inline CBaseEntity *CBaseEntity::GetBaseEntity()
 inline void CBaseEntity::SetModelName( string_t name )
 {
 	m_ModelName = name;
+	gEntList.UpdateFindIndex( this );
 	DispatchUpdateTransmitState();
 }
 
@@ -617,9 +617,11 @@ DEFINE_FIXEDSIZE_ALLOCATOR( EventQueuePrioritizedEvent_t, 128, CMemoryPool::GROW
 CEventQueue g_EventQueue;
 
 CEventQueue::CEventQueue()
+ :	m_CallerIndex( 0, 0, DefLessFunc( int ) ),
+	m_TargetIndex( 0, 0, DefLessFunc( int ) )
 {
-	m_Events.m_flFireTime = -FLT_MAX;
-	m_Events.m_pNext = NULL;
+	m_iNextSequence = 0;
+	m_pServicingEvent = NULL;
 
 	Init();
 }
@@ -733,27 +735,32 @@ void CEventQueue::Init( void )
 void CEventQueue::Clear( void )
 {
 	// delete all the events in the queue
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-	
-	while ( pe != NULL )
+	for ( int i = 0; i < m_Heap.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
-		delete pe;
-		pe = next;
+		EventQueuePrioritizedEvent_t *pe = m_Heap[i];
+		pe->m_iHeapIndex = -1;
+		if ( pe != m_pServicingEvent )
+		{
+			delete pe;
+		}
 	}
 
-	m_Events.m_pNext = NULL;
+	m_Heap.RemoveAll();
+	m_CallerIndex.RemoveAll();
+	m_TargetIndex.RemoveAll();
+	m_iNextSequence = 0;
 }
 
 void CEventQueue::Dump( void )
 {
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetEventsInOrder( events );
 
 	Msg("Dumping event queue. Current time is: %.2f\n", gpGlobals->curtime );
 
-	while ( pe != NULL )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
-		EventQueuePrioritizedEvent_t *next = pe->m_pNext;
+		EventQueuePrioritizedEvent_t *pe = events[i];
 
 		Msg("   (%.2f) Target: '%s', Input: '%s', Parameter '%s'. Activator: '%s', Caller '%s'.  \n", 
 			pe->m_flFireTime, 
@@ -762,8 +769,6 @@ void CEventQueue::Dump( void )
 			pe->m_VariantValue.String(),
 			pe->m_pActivator ? pe->m_pActivator->GetDebugName() : "None", 
 			pe->m_pCaller ? pe->m_pCaller->GetDebugName() : "None"  );
-
-		pe = next;
 	}
 
 	Msg("Finished dump.\n");
@@ -817,43 +822,186 @@ void CEventQueue::AddEvent( CBaseEntity *target, const char *action, float fireD
 
 
 //-----------------------------------------------------------------------------
-// Purpose: private function, adds an event into the list
-// Input  : *newEvent - the (already built) event to add
+// Purpose: heap order; earlier fire time first, then first in first out
 //-----------------------------------------------------------------------------
-void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+bool CEventQueue::IsEarlier( const EventQueuePrioritizedEvent_t *pA, const EventQueuePrioritizedEvent_t *pB )
 {
-	// loop through the actions looking for a place to insert
-	EventQueuePrioritizedEvent_t *pe;
-	for ( pe = &m_Events; pe->m_pNext != NULL; pe = pe->m_pNext )
+	if ( pA->m_flFireTime != pB->m_flFireTime )
+		return ( pA->m_flFireTime < pB->m_flFireTime );
+	return ( pA->m_iSequence < pB->m_iSequence );
+}
+
+void CEventQueue::HeapPlace( EventQueuePrioritizedEvent_t *pe, int i )
+{
+	m_Heap[i] = pe;
+	pe->m_iHeapIndex = i;
+}
+
+void CEventQueue::HeapSiftUp( EventQueuePrioritizedEvent_t *pe, int i )
+{
+	while ( i > 0 )
 	{
-		if ( pe->m_pNext->m_flFireTime > newEvent->m_flFireTime )
-		{
+		int parent = ( i - 1 ) >> 1;
+		if ( !IsEarlier( pe, m_Heap[parent] ) )
 			break;
+		HeapPlace( m_Heap[parent], i );
+		i = parent;
+	}
+	HeapPlace( pe, i );
+}
+
+void CEventQueue::HeapSiftDown( EventQueuePrioritizedEvent_t *pe, int i )
+{
+	int count = m_Heap.Count();
+	while ( 1 )
+	{
+		int child = i * 2 + 1;
+		if ( child >= count )
+			break;
+		if ( child + 1 < count && IsEarlier( m_Heap[child + 1], m_Heap[child] ) )
+			child++;
+		if ( !IsEarlier( m_Heap[child], pe ) )
+			break;
+		HeapPlace( m_Heap[child], i );
+		i = child;
+	}
+	HeapPlace( pe, i );
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: pushes an event onto the head of an entity's chain in a caller or target index
+//-----------------------------------------------------------------------------
+static void LinkEventIndex( CUtlMap<int, EventQueuePrioritizedEvent_t *> &index, const EHANDLE &hEntity, EventQueuePrioritizedEvent_t *pe,
+	EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev )
+{
+	pe->*pNext = NULL;
+	pe->*pPrev = NULL;
+
+	if ( !hEntity.IsValid() )
+		return;
+
+	unsigned short i = index.Find( hEntity.ToInt() );
+	if ( i == index.InvalidIndex() )
+	{
+		index.Insert( hEntity.ToInt(), pe );
+		return;
+	}
+
+	EventQueuePrioritizedEvent_t *pHead = index[i];
+	pe->*pNext = pHead;
+	pHead->*pPrev = pe;
+	index[i] = pe;
+}
+
+static void UnlinkEventIndex( CUtlMap<int, EventQueuePrioritizedEvent_t *> &index, const EHANDLE &hEntity, EventQueuePrioritizedEvent_t *pe,
+	EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pNext, EventQueuePrioritizedEvent_t *EventQueuePrioritizedEvent_t::*pPrev )
+{
+	if ( !hEntity.IsValid() )
+		return;
+
+	if ( pe->*pNext )
+	{
+		(pe->*pNext)->*pPrev = pe->*pPrev;
+	}
+
+	if ( pe->*pPrev )
+	{
+		(pe->*pPrev)->*pNext = pe->*pNext;
+	}
+	else
+	{
+		// head of the chain
+		unsigned short i = index.Find( hEntity.ToInt() );
+		Assert( i != index.InvalidIndex() && index[i] == pe );
+		if ( pe->*pNext )
+		{
+			index[i] = pe->*pNext;
+		}
+		else
+		{
+			index.RemoveAt( i );
 		}
 	}
 
-	Assert( pe );
+	pe->*pNext = NULL;
+	pe->*pPrev = NULL;
+}
 
-	// insert
-	newEvent->m_pNext = pe->m_pNext;
-	newEvent->m_pPrev = pe;
-	pe->m_pNext = newEvent;
-	if ( newEvent->m_pNext )
+//-----------------------------------------------------------------------------
+// Purpose: private function, adds an event into the queue
+// Input  : *newEvent - the (already built) event to add
+//-----------------------------------------------------------------------------
+void CEventQueue::AddEvent( EventQueuePrioritizedEvent_t *newEvent )
+{
+	if ( m_Heap.Count() == 0 )
 	{
-		newEvent->m_pNext->m_pPrev = newEvent;
+		m_iNextSequence = 0;
 	}
+	newEvent->m_iSequence = m_iNextSequence++;
+
+	HeapSiftUp( newEvent, m_Heap.AddToTail() );
+
+	LinkEventIndex( m_CallerIndex, newEvent->m_pCaller, newEvent, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	LinkEventIndex( m_TargetIndex, newEvent->m_pEntTarget, newEvent, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
 }
 
 void CEventQueue::RemoveEvent( EventQueuePrioritizedEvent_t *pe )
 {
-	Assert( pe->m_pPrev );
-	pe->m_pPrev->m_pNext = pe->m_pNext;
-	if ( pe->m_pNext )
+	int i = pe->m_iHeapIndex;
+	Assert( i >= 0 && i < m_Heap.Count() && m_Heap[i] == pe );
+
+	UnlinkEventIndex( m_CallerIndex, pe->m_pCaller, pe, &EventQueuePrioritizedEvent_t::m_pNextByCaller, &EventQueuePrioritizedEvent_t::m_pPrevByCaller );
+	UnlinkEventIndex( m_TargetIndex, pe->m_pEntTarget, pe, &EventQueuePrioritizedEvent_t::m_pNextByTarget, &EventQueuePrioritizedEvent_t::m_pPrevByTarget );
+
+	pe->m_iHeapIndex = -1;
+
+	// move the last event into the hole and restore the heap around it
+	EventQueuePrioritizedEvent_t *pLast = m_Heap.Tail();
+	m_Heap.RemoveMultiple( m_Heap.Count() - 1, 1 );
+	if ( pLast != pe )
+	{
+		if ( i > 0 && IsEarlier( pLast, m_Heap[( i - 1 ) >> 1] ) )
+		{
+			HeapSiftUp( pLast, i );
+		}
+		else
+		{
+			HeapSiftDown( pLast, i );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: removes and frees an event, unless it is being fired right now, in
+//			which case ServiceEvents frees it once the inputs return
+//-----------------------------------------------------------------------------
+void CEventQueue::DeleteEvent( EventQueuePrioritizedEvent_t *pe )
+{
+	RemoveEvent( pe );
+	if ( pe != m_pServicingEvent )
 	{
-		pe->m_pNext->m_pPrev = pe->m_pPrev;
+		delete pe;
 	}
 }
 
+static int __cdecl CompareEventOrder( EventQueuePrioritizedEvent_t * const *ppA, EventQueuePrioritizedEvent_t * const *ppB )
+{
+	if ( (*ppA)->m_flFireTime != (*ppB)->m_flFireTime )
+		return ( (*ppA)->m_flFireTime < (*ppB)->m_flFireTime ) ? -1 : 1;
+	if ( (*ppA)->m_iSequence != (*ppB)->m_iSequence )
+		return ( (*ppA)->m_iSequence < (*ppB)->m_iSequence ) ? -1 : 1;
+	return 0;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: the queued events in the order they will fire
+//-----------------------------------------------------------------------------
+void CEventQueue::GetEventsInOrder( CUtlVector<EventQueuePrioritizedEvent_t *> &events )
+{
+	events.CopyArray( m_Heap.Base(), m_Heap.Count() );
+	events.Sort( CompareEventOrder );
+}
+
 
 //-----------------------------------------------------------------------------
 // Purpose: fires off any events in the queue who's fire time is (or before) the present time
@@ -865,12 +1013,14 @@ void CEventQueue::ServiceEvents( void )
 		return;
 	}
 
-	EventQueuePrioritizedEvent_t *pe = m_Events.m_pNext;
-
-	while ( pe != NULL && pe->m_flFireTime <= gpGlobals->curtime )
+	while ( m_Heap.Count() && m_Heap[0]->m_flFireTime <= gpGlobals->curtime )
 	{
 		MDLCACHE_CRITICAL_SECTION();
 
+		// the event stays queued while it fires, so it is still pending to anyone asking
+		EventQueuePrioritizedEvent_t *pe = m_Heap[0];
+		m_pServicingEvent = pe;
+
 		bool targetFound = false;
 
 		// find the targets
@@ -934,8 +1084,13 @@ void CEventQueue::ServiceEvents( void )
 			ADD_DEBUG_HISTORY( HISTORY_ENTITY_IO, szBuffer );
 		}
 
-		// remove the event from the list (remembering that the queue may have been added to)
-		RemoveEvent( pe );
+		// remove the event from the queue (remembering that the queue may have been added to,
+		// and that the inputs may have cancelled this very event)
+		m_pServicingEvent = NULL;
+		if ( pe->m_iHeapIndex != -1 )
+		{
+			RemoveEvent( pe );
+		}
 		delete pe;
 
 		//
@@ -948,9 +1103,6 @@ void CEventQueue::ServiceEvents( void )
 				break;
 			}
 		}
-
-		// restart the list (to catch any new items have probably been added to the queue)
-		pe = m_Events.m_pNext;	
 	}
 }
 
@@ -975,30 +1127,21 @@ void CEventQueue::CancelEvents( CBaseEntity *pCaller )
 	if (!pCaller)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	// Every event chained under the caller's handle matches
+	unsigned short i = m_CallerIndex.Find( pCaller->GetRefEHandle().ToInt() );
+	if ( i == m_CallerIndex.InvalidIndex() )
+		return;
+
+	EventQueuePrioritizedEvent_t *pCur = m_CallerIndex[i];
 
 	while (pCur != NULL)
 	{
-		bool bDelete = false;
-		if (pCur->m_pCaller == pCaller)
-		{
-			// Pointers match; make sure everything else matches.
-			if (!stricmp(STRING(pCur->m_pCaller->GetEntityName()), STRING(pCaller->GetEntityName())) &&
-				!stricmp(pCur->m_pCaller->GetClassname(), pCaller->GetClassname()))
-			{
-				// Found a matching event; delete it from the queue.
-				bDelete = true;
-			}
-		}
+		Assert( pCur->m_pCaller == pCaller );
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByCaller;
 
-		if (bDelete)
-		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
-		}
+		DeleteEvent( pCurSave );
 	}
 }
 
@@ -1013,27 +1156,29 @@ void CEventQueue::CancelEventOn( CBaseEntity *pTarget, const char *sInputName )
 	if (!pTarget)
 		return;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
+	unsigned short i = m_TargetIndex.Find( pTarget->GetRefEHandle().ToInt() );
+	if ( i == m_TargetIndex.InvalidIndex() )
+		return;
+
+	EventQueuePrioritizedEvent_t *pCur = m_TargetIndex[i];
 
 	while (pCur != NULL)
 	{
+		Assert( pCur->m_pEntTarget == pTarget );
+
 		bool bDelete = false;
-		if (pCur->m_pEntTarget == pTarget)
+		if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
 		{
-			if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
-			{
-				// Found a matching event; delete it from the queue.
-				bDelete = true;
-			}
+			// Found a matching event; delete it from the queue.
+			bDelete = true;
 		}
 
 		EventQueuePrioritizedEvent_t *pCurSave = pCur;
-		pCur = pCur->m_pNext;
+		pCur = pCur->m_pNextByTarget;
 
 		if (bDelete)
 		{
-			RemoveEvent( pCurSave );
-			delete pCurSave;
+			DeleteEvent( pCurSave );
 		}
 	}
 }
@@ -1048,20 +1193,17 @@ bool CEventQueue::HasEventPending( CBaseEntity *pTarget, const char *sInputName
 	if (!pTarget)
 		return false;
 
-	EventQueuePrioritizedEvent_t *pCur = m_Events.m_pNext;
-
-	while (pCur != NULL)
-	{
-		if (pCur->m_pEntTarget == pTarget)
-		{
-			if ( !sInputName )
-				return true;
+	unsigned short i = m_TargetIndex.Find( pTarget->GetRefEHandle().ToInt() );
+	if ( i == m_TargetIndex.InvalidIndex() )
+		return false;
 
-			if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
-				return true;
-		}
+	if ( !sInputName )
+		return true;
 
-		pCur = pCur->m_pNext;
+	for ( EventQueuePrioritizedEvent_t *pCur = m_TargetIndex[i]; pCur != NULL; pCur = pCur->m_pNextByTarget )
+	{
+		if ( !Q_strncmp( STRING(pCur->m_iTargetInput), sInputName, strlen(sInputName) ) )
+			return true;
 	}
 
 	return false;
@@ -1079,7 +1221,7 @@ void ServiceEventQueue( void )
 // save data description for the event queue
 BEGIN_SIMPLE_DATADESC( CEventQueue )
 	// These are saved explicitly in CEventQueue::Save below
-	// DEFINE_FIELD( m_Events, EventQueuePrioritizedEvent_t ),
+	// DEFINE_FIELD( m_Heap, EventQueuePrioritizedEvent_t ),
 
 	DEFINE_FIELD( m_iListCount, FIELD_INTEGER ),	// this value is only used during save/restore
 END_DATADESC()
@@ -1096,29 +1238,31 @@ BEGIN_SIMPLE_DATADESC( EventQueuePrioritizedEvent_t )
 	DEFINE_FIELD( m_iOutputID, FIELD_INTEGER ),
 	DEFINE_CUSTOM_FIELD( m_VariantValue, variantFuncs ),
 
-//	DEFINE_FIELD( m_pNext, FIELD_??? ),
-//	DEFINE_FIELD( m_pPrev, FIELD_??? ),
+//	DEFINE_FIELD( m_iSequence, FIELD_INTEGER ),		// implied by the save order
+//	DEFINE_FIELD( m_iHeapIndex, FIELD_INTEGER ),
+//	DEFINE_FIELD( m_pNextByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByCaller, FIELD_??? ),
+//	DEFINE_FIELD( m_pNextByTarget, FIELD_??? ),
+//	DEFINE_FIELD( m_pPrevByTarget, FIELD_??? ),
 END_DATADESC()
 
 
 int CEventQueue::Save( ISave &save )
 {
-	// count the number of items in the queue
-	EventQueuePrioritizedEvent_t *pe;
+	// saved in firing order, so restoring them one by one keeps ties in order
+	CUtlVector<EventQueuePrioritizedEvent_t *> events;
+	GetEventsInOrder( events );
 
-	m_iListCount = 0;
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
-	{
-		m_iListCount++;
-	}
+	m_iListCount = events.Count();
 
 	// save that value out to disk, so we know how many to restore
 	if ( !save.WriteFields( "EventQueue", this, NULL, m_DataMap.dataDesc, m_DataMap.dataNumFields ) )
 		return 0;
 	
 	// cycle through all the events, saving them all
-	for ( pe = m_Events.m_pNext; pe != NULL; pe = pe->m_pNext )
+	for ( int i = 0; i < events.Count(); i++ )
 	{
+		EventQueuePrioritizedEvent_t *pe = events[i];
 		if ( !save.WriteFields( "PEvent", pe, NULL, pe->m_DataMap.dataDesc, pe->m_DataMap.dataNumFields ) )
 			return 0;
 	}
@@ -17,6 +17,8 @@
 #include "ai_initutils.h"
 #include "globalstate.h"
 #include "datacache/imdlcache.h"
+#include "tier1/generichash.h"
+#include "tier0/fasttimer.h"
 
 #ifdef HL2_DLL
 #include "npc_playercompanion.h"
@@ -28,6 +30,8 @@
 CBaseEntity *FindPickerEntity( CBasePlayer *pPlayer );
 void SceneManager_ClientActive( CBasePlayer *player );
 
+ConVar ent_find_hashed( "ent_find_hashed", "1", 0, "Use the hashed name, classname and model indices in the entity list searches." );
+
 static CUtlVector<IServerNetworkable*> g_DeleteList;
 
 CGlobalEntityList gEntList;
@@ -327,6 +331,154 @@ CGlobalEntityList::CGlobalEntityList()
 {
 	m_iHighestEnt = m_iNumEnts = m_iNumEdicts = 0;
 	m_bClearingEntities = false;
+	ClearFindIndex();
+}
+
+
+//-----------------------------------------------------------------------------
+// Find index. Names are matched case insensitively so they are hashed that way too.
+//-----------------------------------------------------------------------------
+static inline int FindKeyBucket( const char *pszKey )
+{
+	return HashStringCaselessConventional( pszKey ) & ( ENTITY_FIND_HASH_BUCKETS - 1 );
+}
+
+// Wildcards match by prefix and an empty query matches unnamed entities,
+// neither of which a hash lookup can answer
+static inline bool IsHashableQuery( const char *pszQuery )
+{
+	return ( pszQuery[0] != 0 && !strchr( pszQuery, '*' ) && ent_find_hashed.GetBool() );
+}
+
+void CGlobalEntityList::ClearFindIndex()
+{
+	for ( int i = 0; i < NUM_FIND_INDICES; i++ )
+	{
+		for ( int j = 0; j < NUM_ENT_ENTRIES; j++ )
+		{
+			EntityFindLink_t &link = m_FindLinks[i][j];
+			link.iKey = NULL_STRING;
+			link.bucket = link.next = link.prev = -1;
+		}
+
+		for ( int j = 0; j < ENTITY_FIND_HASH_BUCKETS; j++ )
+		{
+			m_FindBuckets[i][j].head = m_FindBuckets[i][j].tail = -1;
+		}
+	}
+
+	memset( m_EntityOrder, 0, sizeof( m_EntityOrder ) );
+	m_iNextEntityOrder = 0;
+}
+
+void CGlobalEntityList::FileFindKey( int iIndex, int iEntry, string_t iKey )
+{
+	UnfileFindKey( iIndex, iEntry );
+
+	EntityFindLink_t &link = m_FindLinks[iIndex][iEntry];
+	link.iKey = iKey;
+	if ( iKey == NULL_STRING )
+		return;
+
+	int bucket = FindKeyBucket( STRING( iKey ) );
+	EntityFindBucket_t &chain = m_FindBuckets[iIndex][bucket];
+
+	// Keep the chain in list order. Keys mostly get set right after the entity
+	// is created, so the spot is nearly always at the tail.
+	int iAfter = chain.tail;
+	while ( iAfter != -1 && m_EntityOrder[iAfter] > m_EntityOrder[iEntry] )
+	{
+		iAfter = m_FindLinks[iIndex][iAfter].prev;
+	}
+
+	link.bucket = bucket;
+	link.prev = iAfter;
+	link.next = ( iAfter != -1 ) ? m_FindLinks[iIndex][iAfter].next : chain.head;
+
+	if ( link.prev != -1 )
+		m_FindLinks[iIndex][link.prev].next = iEntry;
+	else
+		chain.head = iEntry;
+
+	if ( link.next != -1 )
+		m_FindLinks[iIndex][link.next].prev = iEntry;
+	else
+		chain.tail = iEntry;
+}
+
+void CGlobalEntityList::UnfileFindKey( int iIndex, int iEntry )
+{
+	EntityFindLink_t &link = m_FindLinks[iIndex][iEntry];
+	if ( link.bucket != -1 )
+	{
+		EntityFindBucket_t &chain = m_FindBuckets[iIndex][link.bucket];
+
+		if ( link.prev != -1 )
+			m_FindLinks[iIndex][link.prev].next = link.next;
+		else
+			chain.head = link.next;
+
+		if ( link.next != -1 )
+			m_FindLinks[iIndex][link.next].prev = link.prev;
+		else
+			chain.tail = link.prev;
+	}
+
+	link.iKey = NULL_STRING;
+	link.bucket = link.next = link.prev = -1;
+}
+
+void CGlobalEntityList::UpdateFindIndex( CBaseEntity *pEntity )
+{
+	// Entities that aren't in the list yet get filed by OnAddEntity
+	const CBaseHandle &hEntity = pEntity->GetRefEHandle();
+	if ( !hEntity.IsValid() )
+		return;
+
+	int iEntry = hEntity.GetEntryIndex();
+	if ( GetEntInfoPtrByIndex( iEntry )->m_pEntity != pEntity )
+		return;
+
+	string_t keys[NUM_FIND_INDICES];
+	keys[FIND_INDEX_NAME] = pEntity->GetEntityName();
+	keys[FIND_INDEX_CLASSNAME] = pEntity->m_iClassname;
+	keys[FIND_INDEX_MODEL] = pEntity->GetModelName();
+
+	for ( int i = 0; i < NUM_FIND_INDICES; i++ )
+	{
+		if ( m_FindLinks[i][iEntry].iKey != keys[i] )
+		{
+			FileFindKey( i, iEntry, keys[i] );
+		}
+	}
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Returns the first entry in the key's bucket that comes after
+//			pStartEntity in the entity list, or -1.
+//-----------------------------------------------------------------------------
+int CGlobalEntityList::FirstFindCandidate( int iIndex, const char *pszKey, CBaseEntity *pStartEntity )
+{
+	int bucket = FindKeyBucket( pszKey );
+	int iEntry = m_FindBuckets[iIndex][bucket].head;
+	if ( !pStartEntity )
+		return iEntry;
+
+	int iStart = pStartEntity->GetRefEHandle().GetEntryIndex();
+	if ( m_FindLinks[iIndex][iStart].bucket == bucket )
+		return m_FindLinks[iIndex][iStart].next;
+
+	// The start entity was renamed (or never matched); skip to where it sits in the list
+	while ( iEntry != -1 && m_EntityOrder[iEntry] <= m_EntityOrder[iStart] )
+	{
+		iEntry = m_FindLinks[iIndex][iEntry].next;
+	}
+	return iEntry;
+}
+
+CBaseEntity *CGlobalEntityList::FindCandidateEntity( int iEntry ) const
+{
+	return (CBaseEntity *)GetEntInfoPtrByIndex( iEntry )->m_pEntity;
 }
 
 
@@ -523,6 +675,18 @@ bool CGlobalEntityList::IsEntityPtr( void *pTest )
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName )
 {
+	if ( IsHashableQuery( szName ) )
+	{
+		for ( int i = FirstFindCandidate( FIND_INDEX_CLASSNAME, szName, pStartEntity ); i != -1; i = NextFindCandidate( FIND_INDEX_CLASSNAME, i ) )
+		{
+			CBaseEntity *pEntity = FindCandidateEntity( i );
+			if ( pEntity->ClassMatches(szName) )
+				return pEntity;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -632,6 +796,23 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 
 		return NULL;
 	}
+
+	if ( IsHashableQuery( szName ) )
+	{
+		for ( int i = FirstFindCandidate( FIND_INDEX_NAME, szName, pStartEntity ); i != -1; i = NextFindCandidate( FIND_INDEX_NAME, i ) )
+		{
+			CBaseEntity *ent = FindCandidateEntity( i );
+			if ( ent->NameMatches( szName ) )
+			{
+				if ( pFilter && !pFilter->ShouldFindEntity(ent) )
+					continue;
+
+				return ent;
+			}
+		}
+
+		return NULL;
+	}
 	
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
@@ -666,6 +847,21 @@ CBaseEntity *CGlobalEntityList::FindEntityByName( CBaseEntity *pStartEntity, con
 //-----------------------------------------------------------------------------
 CBaseEntity *CGlobalEntityList::FindEntityByModel( CBaseEntity *pStartEntity, const char *szModelName )
 {
+	if ( szModelName && IsHashableQuery( szModelName ) )
+	{
+		for ( int i = FirstFindCandidate( FIND_INDEX_MODEL, szModelName, pStartEntity ); i != -1; i = NextFindCandidate( FIND_INDEX_MODEL, i ) )
+		{
+			CBaseEntity *ent = FindCandidateEntity( i );
+			if ( !ent->edict() )
+				continue;
+
+			if ( FStrEq( STRING(ent->GetModelName()), szModelName ) )
+				return ent;
+		}
+
+		return NULL;
+	}
+
 	const CEntInfo *pInfo = pStartEntity ? GetEntInfoPtr( pStartEntity->GetRefEHandle() )->m_pNext : FirstEntInfo();
 
 	for ( ;pInfo; pInfo = pInfo->m_pNext )
@@ -1101,6 +1297,10 @@ void CGlobalEntityList::OnAddEntity( IHandleEntity *pEnt, CBaseHandle handle )
 	CBaseEntity *pBaseEnt = static_cast<IServerUnknown*>(pEnt)->GetBaseEntity();
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts++;
+
+	// The entity went on the end of the active list
+	m_EntityOrder[i] = m_iNextEntityOrder++;
+	UpdateFindIndex( pBaseEnt );
 	
 	// NOTE: Must be a CBaseEntity on server
 	Assert( pBaseEnt );
@@ -1134,6 +1334,12 @@ void CGlobalEntityList::OnRemoveEntity( IHandleEntity *pEnt, CBaseHandle handle
 	if ( pBaseEnt->edict() )
 		m_iNumEdicts--;
 
+	int iEntry = handle.GetEntryIndex();
+	for ( int i = 0; i < NUM_FIND_INDICES; i++ )
+	{
+		UnfileFindKey( i, iEntry );
+	}
+
 	m_iNumEnts--;
 }
 
@@ -1154,6 +1360,8 @@ void CGlobalEntityList::NotifySpawn( CBaseEntity *pEnt )
 	if ( !pEnt )
 		return;
 
+	UpdateFindIndex( pEnt );
+
 	//DevMsg(2,"Deleted %s\n", pBaseEnt->GetClassname() );
 	for ( int i = m_entityListeners.Count()-1; i >= 0; i-- )
 	{
@@ -1635,3 +1843,128 @@ CON_COMMAND(report_simthinklist, "Lists all simulating/thinking entities")
 	list.ReportEntityList();
 }
 
+
+//-----------------------------------------------------------------------------
+// Times the name, classname and model searches with and without the hash
+// indices over the strings actually used in the current map
+//-----------------------------------------------------------------------------
+enum
+{
+	ENT_FIND_BENCH_NAME = 0,
+	ENT_FIND_BENCH_CLASSNAME,
+	ENT_FIND_BENCH_MODEL,
+
+	ENT_FIND_BENCH_COUNT
+};
+
+static const char *s_pszEntFindBenchKinds[ENT_FIND_BENCH_COUNT] = { "name", "classname", "model" };
+
+static int RunEntFindQueries( int nKind, const CUtlVector<string_t> &queries, CUtlVector<CBaseEntity *> *pResults )
+{
+	int nFound = 0;
+	for ( int i = 0; i < queries.Count(); i++ )
+	{
+		const char *pszQuery = STRING( queries[i] );
+		CBaseEntity *pEntity = NULL;
+		for ( ;; )
+		{
+			switch ( nKind )
+			{
+			case ENT_FIND_BENCH_NAME:		pEntity = gEntList.FindEntityByName( pEntity, pszQuery ); break;
+			case ENT_FIND_BENCH_CLASSNAME:	pEntity = gEntList.FindEntityByClassname( pEntity, pszQuery ); break;
+			default:						pEntity = gEntList.FindEntityByModel( pEntity, pszQuery ); break;
+			}
+
+			if ( !pEntity )
+				break;
+
+			nFound++;
+			if ( pResults )
+			{
+				pResults->AddToTail( pEntity );
+			}
+		}
+
+		if ( pResults )
+		{
+			pResults->AddToTail( NULL );
+		}
+	}
+	return nFound;
+}
+
+CON_COMMAND_F( ent_find_bench, "Benchmarks the hashed entity searches against the entity list walk. Arguments: [passes]", FCVAR_CHEAT )
+{
+	int nPasses = ( args.ArgC() > 1 ) ? max( 1, atoi( args[1] ) ) : 100;
+
+	CUtlVector<string_t> queries[ENT_FIND_BENCH_COUNT];
+	for ( CBaseEntity *pEntity = gEntList.FirstEnt(); pEntity; pEntity = gEntList.NextEnt( pEntity ) )
+	{
+		string_t keys[ENT_FIND_BENCH_COUNT];
+		keys[ENT_FIND_BENCH_NAME] = pEntity->GetEntityName();
+		keys[ENT_FIND_BENCH_CLASSNAME] = pEntity->m_iClassname;
+		keys[ENT_FIND_BENCH_MODEL] = pEntity->edict() ? pEntity->GetModelName() : NULL_STRING;
+
+		for ( int i = 0; i < ENT_FIND_BENCH_COUNT; i++ )
+		{
+			// '!' names are procedural and never reach either search
+			if ( keys[i] == NULL_STRING || STRING( keys[i] )[0] == '!' )
+				continue;
+
+			if ( queries[i].Find( keys[i] ) == -1 )
+			{
+				queries[i].AddToTail( keys[i] );
+			}
+		}
+	}
+
+	bool bWasHashed = ent_find_hashed.GetBool();
+
+	for ( int i = 0; i < ENT_FIND_BENCH_COUNT; i++ )
+	{
+		if ( !queries[i].Count() )
+			continue;
+
+		CUtlVector<CBaseEntity *> hashedResults, linearResults;
+		ent_find_hashed.SetValue( 1 );
+		RunEntFindQueries( i, queries[i], &hashedResults );
+		ent_find_hashed.SetValue( 0 );
+		RunEntFindQueries( i, queries[i], &linearResults );
+
+		bool bMatch = ( hashedResults.Count() == linearResults.Count() );
+		for ( int j = 0; bMatch && j < hashedResults.Count(); j++ )
+		{
+			bMatch = ( hashedResults[j] == linearResults[j] );
+		}
+
+		CFastTimer timer;
+		int nFound = 0;
+
+		ent_find_hashed.SetValue( 1 );
+		timer.Start();
+		for ( int j = 0; j < nPasses; j++ )
+		{
+			nFound += RunEntFindQueries( i, queries[i], NULL );
+		}
+		timer.End();
+		float flHashed = timer.GetDuration().GetMillisecondsF();
+
+		ent_find_hashed.SetValue( 0 );
+		timer.Start();
+		for ( int j = 0; j < nPasses; j++ )
+		{
+			nFound += RunEntFindQueries( i, queries[i], NULL );
+		}
+		timer.End();
+		float flLinear = timer.GetDuration().GetMillisecondsF();
+
+		int nLookups = queries[i].Count() * nPasses;
+		Msg( "%-10s %4d keys, %6d matches: hashed %8.3f ms (%.2f us/search), list walk %8.3f ms (%.2f us/search), %.1fx%s\n",
+			s_pszEntFindBenchKinds[i], queries[i].Count(), nFound / ( 2 * nPasses ),
+			flHashed, flHashed * 1000.0f / nLookups, flLinear, flLinear * 1000.0f / nLookups,
+			( flHashed > 0.0f ) ? flLinear / flHashed : 0.0f,
+			bMatch ? "" : "  RESULTS DIFFER!" );
+	}
+
+	ent_find_hashed.SetValue( bWasHashed ? 1 : 0 );
+}
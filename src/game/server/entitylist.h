@@ -70,6 +70,8 @@ public:
 // Purpose: a global list of all the entities in the game.  All iteration through
 //			entities is done through this object.
 //-----------------------------------------------------------------------------
+#define ENTITY_FIND_HASH_BUCKETS	1024
+
 class CGlobalEntityList : public CBaseEntityList
 {
 public:
@@ -81,6 +83,44 @@ private:
 	bool m_bClearingEntities;
 	CUtlVector<IEntityListener *>	m_entityListeners;
 
+	// Hash indices for the Find* functions. Entities whose targetname, classname or
+	// model hash (case insensitively) to the same bucket are chained in entity list
+	// order, so a search can pick up after pStartEntity just like the list walk does.
+	enum
+	{
+		FIND_INDEX_NAME = 0,
+		FIND_INDEX_CLASSNAME,
+		FIND_INDEX_MODEL,
+
+		NUM_FIND_INDICES
+	};
+
+	struct EntityFindLink_t
+	{
+		string_t	iKey;		// the string this entity is filed under
+		short		bucket;		// -1 if not filed
+		short		next;		// entry indices
+		short		prev;
+	};
+
+	struct EntityFindBucket_t
+	{
+		short		head;
+		short		tail;
+	};
+
+	EntityFindLink_t	m_FindLinks[NUM_FIND_INDICES][NUM_ENT_ENTRIES];
+	EntityFindBucket_t	m_FindBuckets[NUM_FIND_INDICES][ENTITY_FIND_HASH_BUCKETS];
+	unsigned int		m_EntityOrder[NUM_ENT_ENTRIES];	// when each entry joined the active list
+	unsigned int		m_iNextEntityOrder;
+
+	void	ClearFindIndex();
+	void	FileFindKey( int iIndex, int iEntry, string_t iKey );
+	void	UnfileFindKey( int iIndex, int iEntry );
+	int		FirstFindCandidate( int iIndex, const char *pszKey, CBaseEntity *pStartEntity );
+	int		NextFindCandidate( int iIndex, int iEntry ) const	{ return m_FindLinks[iIndex][iEntry].next; }
+	CBaseEntity *FindCandidateEntity( int iEntry ) const;
+
 public:
 	IServerNetworkable* GetServerNetworkable( CBaseHandle hEnt ) const;
 	CBaseNetworkable* GetBaseNetworkable( CBaseHandle hEnt ) const;
@@ -134,6 +174,9 @@ public:
 		return NULL;
 	}
 
+	// refiles the entity in the name/classname/model indices after any of them changed
+	void UpdateFindIndex( CBaseEntity *pEntity );
+
 	// search functions
 	bool		 IsEntityPtr( void *pTest );
 	CBaseEntity *FindEntityByClassname( CBaseEntity *pStartEntity, const char *szName );
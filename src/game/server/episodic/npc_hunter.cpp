@@ -1295,6 +1295,7 @@ public:
 	bool			OverrideMoveFacing( const AILocalMoveGoal_t &move, float flInterval );
 	float			MaxYawSpeed();
 	bool			IsJumpLegal(const Vector &startPos, const Vector &apex, const Vector &endPos) const;
+	bool			CanShareNodeRoutes()	{ return false; }
 	float			GetJumpGravity() const		{ return 3.0f; }
 	bool			ShouldProbeCollideAgainstEntity( CBaseEntity *pEntity );
 	void            TaskFail( AI_TaskFailureCode_t code );
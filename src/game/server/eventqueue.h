@@ -6,6 +6,11 @@
 //
 //			The queue is serviced once per server frame.
 //
+//			Events are kept in a binary heap ordered by fire time, then by the
+//			order they were added in, so events due at the same time fire first
+//			in first out. Events with a caller or a direct target are also chained
+//			per entity so cancels only visit the events they match.
+//
 //=============================================================================//
 
 #ifndef EVENTQUEUE_H
@@ -15,6 +20,8 @@
 #endif
 
 #include "mempool.h"
+#include "utlvector.h"
+#include "utlmap.h"
 
 struct EventQueuePrioritizedEvent_t
 {
@@ -28,8 +35,14 @@ struct EventQueuePrioritizedEvent_t
 
 	variant_t m_VariantValue;	// variable-type parameter
 
-	EventQueuePrioritizedEvent_t *m_pNext;
-	EventQueuePrioritizedEvent_t *m_pPrev;
+	unsigned int m_iSequence;	// order of insertion, breaks fire time ties
+	int m_iHeapIndex;			// position in the queue's heap, -1 if not queued
+
+	// other events from the same caller / to the same direct target
+	EventQueuePrioritizedEvent_t *m_pNextByCaller;
+	EventQueuePrioritizedEvent_t *m_pPrevByCaller;
+	EventQueuePrioritizedEvent_t *m_pNextByTarget;
+	EventQueuePrioritizedEvent_t *m_pPrevByTarget;
 
 	DECLARE_SIMPLE_DATADESC();
 
@@ -68,11 +81,24 @@ public:
 
 private:
 
+	typedef CUtlMap<int, EventQueuePrioritizedEvent_t *> EventIndex_t;
+
 	void AddEvent( EventQueuePrioritizedEvent_t *event );
 	void RemoveEvent( EventQueuePrioritizedEvent_t *pe );
+	void DeleteEvent( EventQueuePrioritizedEvent_t *pe );
+	void GetEventsInOrder( CUtlVector<EventQueuePrioritizedEvent_t *> &events );
+
+	static bool IsEarlier( const EventQueuePrioritizedEvent_t *pA, const EventQueuePrioritizedEvent_t *pB );
+	void HeapPlace( EventQueuePrioritizedEvent_t *pe, int i );
+	void HeapSiftUp( EventQueuePrioritizedEvent_t *pe, int i );
+	void HeapSiftDown( EventQueuePrioritizedEvent_t *pe, int i );
 
 	DECLARE_SIMPLE_DATADESC();
-	EventQueuePrioritizedEvent_t m_Events;
+	CUtlVector<EventQueuePrioritizedEvent_t *> m_Heap;
+	EventIndex_t m_CallerIndex;		// entity handle -> most recent event from that caller
+	EventIndex_t m_TargetIndex;		// entity handle -> most recent event to that direct target
+	unsigned int m_iNextSequence;
+	EventQueuePrioritizedEvent_t *m_pServicingEvent;	// the event being fired, deleted by ServiceEvents
 	int m_iListCount;
 };
 
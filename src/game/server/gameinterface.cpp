@@ -82,6 +82,7 @@
 #include "hl2orange.spa.h"
 #include "particle_parse.h"
 #include "tier3/tier3.h"
+#include "tier1/generichash.h"
 
 #ifdef CSTRIKE_DLL // BOTPORT: TODO: move these ifdefs out
 #include "bot/bot.h"
@@ -149,8 +150,11 @@ static ConVar s_UseNetworkVars( "UseNetworkVars", "1", FCVAR_CHEAT, "For profili
 #endif
 
 extern ConVar sv_noclipduringpause;
+extern void PurgeTransmitPVSCache();
 ConVar sv_massreport( "sv_massreport", "0" );
 ConVar sv_force_transmit_ents( "sv_force_transmit_ents", "0", FCVAR_CHEAT | FCVAR_DEVELOPMENTONLY, "Will transmit all entities to client, regardless of PVS conditions (will still skip based on transmit flags, however)." );
+ConVar sv_checktransmit_threadsafe( "sv_checktransmit_threadsafe", "0", 0, "Allow the engine to run CheckTransmit for several clients in parallel. Only enable once every ShouldTransmit override in this game is free of side effects." );
+ConVar sv_transmit_pvscache( "sv_transmit_pvscache", "1", 0, "Share entity PVS results between clients and ticks that see the same clusters, areas and area portal state." );
 
 ConVar sv_autosave( "sv_autosave", "1", 0, "Set to 1 to autosave game on level transition. Does not affect autosave triggers." );
 ConVar *sv_maxreplay = NULL;
@@ -1195,6 +1199,7 @@ void CServerGameDLL::LevelShutdown( void )
 	CSoundEnt::ShutdownSoundEnt();
 
 	gEntList.Clear();
+	PurgeTransmitPVSCache();
 
 	IGameSystem::LevelShutdownPostEntityAllSystems();
 
@@ -2003,6 +2008,7 @@ public:
 	virtual edict_t*		BaseEntityToEdict( CBaseEntity *pEnt );
 	virtual CBaseEntity*	EdictToBaseEntity( edict_t *pEdict );
 	virtual void			CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned short *pEdictIndices, int nEdicts );
+	virtual bool			PrepareParallelCheckTransmit( const unsigned short *pEdictIndices, int nEdicts );
 };
 EXPOSE_SINGLE_INTERFACE(CServerGameEnts, IServerGameEnts, INTERFACEVERSION_SERVERGAMEENTS);
 
@@ -2052,6 +2058,159 @@ CBaseEntity* CServerGameEnts::EdictToBaseEntity( edict_t *pEdict )
 }
 
 
+//-----------------------------------------------------------------------------
+// Entity PVS results for one view of the map: one PVS, set of networked areas
+// and area portal state. Every client with that view shares the entry, and it
+// carries over from tick to tick. A result is reused while the entity's PVS
+// info serial is the one it was computed for, so an entity is only tested
+// again once it moves into other leaves or areas.
+//-----------------------------------------------------------------------------
+class CTransmitPVSCacheEntry
+{
+public:
+	bool	Matches( unsigned int nHash, const CCheckTransmitInfo *pInfo ) const;
+	void	Init( unsigned int nHash, const CCheckTransmitInfo *pInfo );
+	bool	IsInPVS( int iEdict, CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo );
+
+	CThreadFastMutex	m_Mutex;			// held by the CheckTransmit using the entry
+	int					m_nLastUsedTick;
+
+private:
+	unsigned int		m_nHash;
+	int					m_nPVSSize;
+	int					m_nAreasNetworked;
+	int					m_nMapAreas;
+	byte				m_PVS[PAD_NUMBER( MAX_MAP_CLUSTERS,8 ) / 8];
+	int					m_Areas[MAX_WORLD_AREAS];
+	byte				m_AreaFloodNums[MAX_MAP_AREAS];
+
+	unsigned int		m_PVSInfoSerial[MAX_EDICTS];	// serial each result is for, 0 if none
+	CBitVec<MAX_EDICTS>	m_InPVS;
+};
+
+static unsigned int HashTransmitView( const CCheckTransmitInfo *pInfo )
+{
+	unsigned int nHash = HashBlock( pInfo->m_PVS, pInfo->m_nPVSSize );
+	nHash = nHash * 31 + HashBlock( pInfo->m_Areas, pInfo->m_AreasNetworked * sizeof( pInfo->m_Areas[0] ) );
+	nHash = nHash * 31 + HashBlock( pInfo->m_AreaFloodNums, pInfo->m_nMapAreas );
+	return nHash;
+}
+
+bool CTransmitPVSCacheEntry::Matches( unsigned int nHash, const CCheckTransmitInfo *pInfo ) const
+{
+	return m_nHash == nHash &&
+		m_nPVSSize == pInfo->m_nPVSSize &&
+		m_nAreasNetworked == pInfo->m_AreasNetworked &&
+		m_nMapAreas == pInfo->m_nMapAreas &&
+		!memcmp( m_Areas, pInfo->m_Areas, m_nAreasNetworked * sizeof( m_Areas[0] ) ) &&
+		!memcmp( m_AreaFloodNums, pInfo->m_AreaFloodNums, m_nMapAreas ) &&
+		!memcmp( m_PVS, pInfo->m_PVS, m_nPVSSize );
+}
+
+void CTransmitPVSCacheEntry::Init( unsigned int nHash, const CCheckTransmitInfo *pInfo )
+{
+	m_nHash = nHash;
+	m_nPVSSize = pInfo->m_nPVSSize;
+	m_nAreasNetworked = pInfo->m_AreasNetworked;
+	m_nMapAreas = pInfo->m_nMapAreas;
+	memcpy( m_PVS, pInfo->m_PVS, m_nPVSSize );
+	memcpy( m_Areas, pInfo->m_Areas, m_nAreasNetworked * sizeof( m_Areas[0] ) );
+	memcpy( m_AreaFloodNums, pInfo->m_AreaFloodNums, m_nMapAreas );
+
+	memset( m_PVSInfoSerial, 0, sizeof( m_PVSInfoSerial ) );
+	m_InPVS.ClearAll();
+}
+
+inline bool CTransmitPVSCacheEntry::IsInPVS( int iEdict, CServerNetworkProperty *pNetProp, const CCheckTransmitInfo *pInfo )
+{
+	unsigned int nSerial = pNetProp->GetPVSInfoSerial();
+	if ( m_PVSInfoSerial[iEdict] != nSerial )
+	{
+		m_PVSInfoSerial[iEdict] = nSerial;
+		m_InPVS.Set( iEdict, pNetProp->IsInPVS( pInfo ) );
+	}
+	return m_InPVS.IsBitSet( iEdict );
+}
+
+class CTransmitPVSCache
+{
+public:
+	~CTransmitPVSCache()	{ Purge(); }
+
+	// Returns the entry for this client's view with its mutex held, or NULL
+	CTransmitPVSCacheEntry *Acquire( const CCheckTransmitInfo *pInfo );
+	void	Release( CTransmitPVSCacheEntry *pEntry )	{ pEntry->m_Mutex.Unlock(); }
+
+	void	Purge()		{ m_Entries.PurgeAndDeleteElements(); }
+	int		Count()		{ return m_Entries.Count(); }
+
+private:
+	CThreadFastMutex m_Mutex;
+	CUtlVector< CTransmitPVSCacheEntry * > m_Entries;
+};
+
+static CTransmitPVSCache g_TransmitPVSCache;
+
+void PurgeTransmitPVSCache()
+{
+	g_TransmitPVSCache.Purge();
+}
+
+CTransmitPVSCacheEntry *CTransmitPVSCache::Acquire( const CCheckTransmitInfo *pInfo )
+{
+	unsigned int nHash = HashTransmitView( pInfo );
+	int nTick = gpGlobals->tickcount;
+
+	CTransmitPVSCacheEntry *pEntry = NULL;
+	{
+		AUTO_LOCK( m_Mutex );
+
+		CTransmitPVSCacheEntry *pOldest = NULL;
+		for ( int i = 0; i < m_Entries.Count(); i++ )
+		{
+			CTransmitPVSCacheEntry *pCheck = m_Entries[i];
+			if ( pCheck->Matches( nHash, pInfo ) )
+			{
+				pEntry = pCheck;
+				break;
+			}
+
+			// entries used this tick may be in use on another thread
+			if ( pCheck->m_nLastUsedTick != nTick && ( !pOldest || pCheck->m_nLastUsedTick < pOldest->m_nLastUsedTick ) )
+			{
+				pOldest = pCheck;
+			}
+		}
+
+		if ( !pEntry )
+		{
+			// Every client uses one entry a tick, so with one more entry than clients
+			// there's always one that wasn't used this tick
+			if ( m_Entries.Count() <= gpGlobals->maxClients )
+			{
+				pEntry = new CTransmitPVSCacheEntry;
+				m_Entries.AddToTail( pEntry );
+			}
+			else if ( pOldest )
+			{
+				pEntry = pOldest;
+			}
+			else
+			{
+				return NULL;
+			}
+
+			pEntry->Init( nHash, pInfo );
+		}
+
+		pEntry->m_nLastUsedTick = nTick;
+	}
+
+	pEntry->m_Mutex.Lock();
+	return pEntry;
+}
+
+
 /* Yuck.. ideally this would be in CServerNetworkProperty's header, but it requires CBaseEntity and
 // inlining it gives a nice speedup.
 inline void CServerNetworkProperty::CheckTransmit( CCheckTransmitInfo *pInfo )
@@ -2094,6 +2253,18 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 	Assert( bIsHLTV == ( pInfo->m_pTransmitAlways != NULL) );
 #endif
 
+	// HLTV doesn't cull against the PVS, so it has no use for the cache
+	CTransmitPVSCacheEntry *pPVSCache = NULL;
+	if ( sv_transmit_pvscache.GetBool() )
+	{
+#ifndef _X360
+		if ( !bIsHLTV )
+#endif
+		{
+			pPVSCache = g_TransmitPVSCache.Acquire( pInfo );
+		}
+	}
+
 	for ( int i=0; i < nEdicts; i++ )
 	{
 		int iEdict = pEdictIndices[i];
@@ -2188,7 +2359,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			continue;
 		}
 
-		bool bInPVS = netProp->IsInPVS( pInfo );
+		bool bInPVS = pPVSCache ? pPVSCache->IsInPVS( iEdict, netProp, pInfo ) : netProp->IsInPVS( pInfo );
 		if ( bInPVS || sv_force_transmit_ents.GetBool() )
 		{
 			// only send if entity is in PVS
@@ -2243,7 +2414,7 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 			{
 				// Check pvs
 				check->RecomputePVSInformation();
-				bool bMoveParentInPVS = check->IsInPVS( pInfo );
+				bool bMoveParentInPVS = pPVSCache ? pPVSCache->IsInPVS( checkIndex, check, pInfo ) : check->IsInPVS( pInfo );
 				if ( bMoveParentInPVS )
 				{
 					orig->SetTransmit( pInfo, true );
@@ -2256,9 +2427,121 @@ void CServerGameEnts::CheckTransmit( CCheckTransmitInfo *pInfo, const unsigned s
 		}
 	}
 
+	if ( pPVSCache )
+	{
+		g_TransmitPVSCache.Release( pPVSCache );
+	}
+
 //	Msg("A:%i, N:%i, F: %i, P: %i\n", always, dontSend, fullCheck, PVS );
 }
 
+//-----------------------------------------------------------------------------
+// Purpose: Runs on the main thread before CheckTransmit. CheckTransmit lazily
+//			rebuilds PVS info through AreaNum()/IsInPVS(), which would race if
+//			several clients were checked at once, so bring it up to date here.
+//-----------------------------------------------------------------------------
+bool CServerGameEnts::PrepareParallelCheckTransmit( const unsigned short *pEdictIndices, int nEdicts )
+{
+	if ( !sv_checktransmit_threadsafe.GetBool() )
+		return false;
+
+	edict_t *pBaseEdict = engine->PEntityOfEntIndex( 0 );
+
+	for ( int i=0; i < nEdicts; i++ )
+	{
+		edict_t *pEdict = &pBaseEdict[ pEdictIndices[i] ];
+		int nFlags = pEdict->m_fStateFlags & (FL_EDICT_DONTSEND|FL_EDICT_ALWAYS|FL_EDICT_PVSCHECK|FL_EDICT_FULLCHECK);
+		if ( nFlags & (FL_EDICT_DONTSEND|FL_EDICT_ALWAYS) )
+			continue;
+
+		CServerNetworkProperty *netProp = static_cast<CServerNetworkProperty*>( pEdict->GetNetworkable() );
+		while ( netProp )
+		{
+			netProp->RecomputePVSInformation();
+			netProp = netProp->GetNetworkParent();
+		}
+	}
+
+	return true;
+}
+
+//-----------------------------------------------------------------------------
+// Purpose: Times CheckTransmit for a full server's worth of clients, with and
+//			without the PVS cache. The clients take the views of the players in
+//			the game in turn, so connect a few and spread them around the map.
+//-----------------------------------------------------------------------------
+CON_COMMAND( sv_checktransmit_bench, "Time CheckTransmit per client with and without the PVS cache: sv_checktransmit_bench [clients=64] [ticks=100]" )
+{
+	if ( !UTIL_IsCommandIssuedByServerAdmin() )
+		return;
+
+	int nClients = ( args.ArgC() > 1 ) ? max( atoi( args[1] ), 1 ) : 64;
+	int nTicks = ( args.ArgC() > 2 ) ? max( atoi( args[2] ), 1 ) : 100;
+
+	CUtlVector< CCheckTransmitInfo > views;
+	for ( int i = 1; i <= gpGlobals->maxClients; i++ )
+	{
+		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
+		if ( !pPlayer || pPlayer->IsHLTV() )
+			continue;
+
+		const CCheckTransmitInfo *pPrev = engine->GetPrevCheckTransmitInfo( pPlayer->edict() );
+		if ( !pPrev || !pPrev->m_nPVSSize )
+			continue;
+
+		int iView = views.AddToTail( *pPrev );
+		views[iView].m_pClientEnt = pPlayer->edict();
+		views[iView].m_pTransmitAlways = NULL;
+	}
+
+	if ( !views.Count() )
+	{
+		Msg( "sv_checktransmit_bench: no players with a transmit state yet\n" );
+		return;
+	}
+
+	CUtlVector< unsigned short > edictIndices;
+	edict_t *pBaseEdict = engine->PEntityOfEntIndex( 0 );
+	for ( int i = 0; i < gpGlobals->maxEntities; i++ )
+	{
+		if ( !pBaseEdict[i].IsFree() && pBaseEdict[i].GetNetworkable() )
+		{
+			edictIndices.AddToTail( i );
+		}
+	}
+
+	CServerGameEnts gameEnts;
+	CBitVec<MAX_EDICTS> transmitEdict;
+	double flTime[2];
+	int nOldCache = sv_transmit_pvscache.GetInt();
+
+	for ( int nPass = 0; nPass < 2; nPass++ )
+	{
+		sv_transmit_pvscache.SetValue( nPass );
+		g_TransmitPVSCache.Purge();
+
+		double flStart = Plat_FloatTime();
+		for ( int nTick = 0; nTick < nTicks; nTick++ )
+		{
+			for ( int nClient = 0; nClient < nClients; nClient++ )
+			{
+				CCheckTransmitInfo *pInfo = &views[ nClient % views.Count() ];
+				transmitEdict.ClearAll();
+				pInfo->m_pTransmitEdict = &transmitEdict;
+				gameEnts.CheckTransmit( pInfo, edictIndices.Base(), edictIndices.Count() );
+			}
+		}
+		flTime[nPass] = Plat_FloatTime() - flStart;
+	}
+
+	sv_transmit_pvscache.SetValue( nOldCache );
+
+	double flCalls = (double)nClients * nTicks;
+	Msg( "sv_checktransmit_bench: %d clients on %d views, %d entities, %d ticks\n", nClients, views.Count(), edictIndices.Count(), nTicks );
+	Msg( "  uncached: %.2f us/client\n", flTime[0] * 1000000.0 / flCalls );
+	Msg( "  cached:   %.2f us/client (%d views cached)\n", flTime[1] * 1000000.0 / flCalls, g_TransmitPVSCache.Count() );
+}
+
 
 CServerGameClients g_ServerGameClients;
 EXPOSE_SINGLE_INTERFACE_GLOBALVAR(CServerGameClients, IServerGameClients, INTERFACEVERSION_SERVERGAMECLIENTS, g_ServerGameClients );
@@ -211,6 +211,7 @@ private:
 	void	LockJumpNode( void );
 
 	bool	IsUnusableNode(int iNodeID, CAI_Hint *pHint);
+	bool	CanShareNodeRoutes()	{ return false; }
 
 	bool	OnObstructionPreSteer( AILocalMoveGoal_t *pMoveGoal, float distClear, AIMoveResult_t *pResult );
 	
@@ -246,6 +246,7 @@ public:
 
 	bool IsJumpLegal(const Vector &startPos, const Vector &apex, const Vector &endPos) const;
 	bool MovementCost( int moveType, const Vector &vecStart, const Vector &vecEnd, float *pCost );
+	bool CanShareNodeRoutes()	{ return false; } // IsJumpLegal() remembers the jump distance
 	bool ShouldFailNav( bool bMovementFailed );
 
 	int	SelectFailSchedule( int failedSchedule, int failedTask, AI_TaskFailureCode_t taskFailCode );
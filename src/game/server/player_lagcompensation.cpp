@@ -36,6 +36,7 @@ ConVar sv_lagflushbonecache( "sv_lagflushbonecache", "1", FCVAR_DEVELOPMENTONLY,
 ConVar sv_showlagcompensation( "sv_showlagcompensation", "0", FCVAR_CHEAT, "Show lag compensated hitboxes whenever a player is lag compensated." );
 
 ConVar sv_unlag_fixstuck( "sv_unlag_fixstuck", "0", FCVAR_DEVELOPMENTONLY, "Disallow backtracking a player for lag compensation if it will cause them to become stuck" );
+ConVar sv_unlag_stats( "sv_unlag_stats", "0", FCVAR_DEVELOPMENTONLY, "Show how many players lag compensation considered and how many it moved back each frame" );
 
 //-----------------------------------------------------------------------------
 // Purpose: 
@@ -164,6 +165,128 @@ static void RestorePlayerTo( CBasePlayer *pPlayer, const Vector &vWantedPos )
 }
 
 
+//-----------------------------------------------------------------------------
+// Purpose: A player's history, oldest to newest, in a ring buffer. The fields
+// a backtrack searches and interpolates are kept in arrays of their own, the
+// animation state that's only needed for players that really get moved back
+// sits in a separate block.
+//-----------------------------------------------------------------------------
+#define LAG_COMPENSATION_MAX_RECORDS	128		// Power of two, holds sv_maxunlag at 100+ ticks a second
+
+struct LagAnimationRecord
+{
+	LayerRecord				m_layerRecords[MAX_LAYER_RECORDS];
+	int						m_masterSequence;
+	float					m_masterCycle;
+};
+
+class CLagTrack
+{
+public:
+	CLagTrack()
+	{
+		Clear();
+	}
+
+	void Clear()
+	{
+		m_nFirst = 0;
+		m_nCount = 0;
+		m_nAdded = 0;
+		m_nLastBreak = -1;
+	}
+
+	int Count() const
+	{
+		return m_nCount;
+	}
+
+	// Slot of the i'th record, 0 is the oldest
+	int Slot( int i ) const
+	{
+		return ( m_nFirst + i ) & ( LAG_COMPENSATION_MAX_RECORDS - 1 );
+	}
+
+	int NewestSlot() const
+	{
+		return Slot( m_nCount - 1 );
+	}
+
+	// Sequence number of the i'th record, counting from the first record ever added
+	int Sequence( int i ) const
+	{
+		return m_nAdded - m_nCount + i;
+	}
+
+	void RemoveOldest()
+	{
+		Assert( m_nCount > 0 );
+		m_nFirst = Slot( 1 );
+		--m_nCount;
+	}
+
+	// Makes room for a record newer than all the others and returns its slot
+	int AddNewest()
+	{
+		if ( m_nCount == LAG_COMPENSATION_MAX_RECORDS )
+		{
+			RemoveOldest();
+		}
+		++m_nCount;
+		++m_nAdded;
+		return NewestSlot();
+	}
+
+	// Returns the newest record at or before flTargetTime, or the oldest record if they're all newer
+	int FindRecord( float flTargetTime ) const
+	{
+		int nLow = 0;
+		int nHigh = m_nCount - 1;
+		while ( nLow < nHigh )
+		{
+			int nMid = ( nLow + nHigh + 1 ) >> 1;
+			if ( m_flSimulationTime[ Slot( nMid ) ] <= flTargetTime )
+			{
+				nLow = nMid;
+			}
+			else
+			{
+				nHigh = nMid - 1;
+			}
+		}
+		return nLow;
+	}
+
+	float					m_flSimulationTime[LAG_COMPENSATION_MAX_RECORDS];
+	Vector					m_vecOrigin[LAG_COMPENSATION_MAX_RECORDS];
+	QAngle					m_vecAngles[LAG_COMPENSATION_MAX_RECORDS];
+	Vector					m_vecMins[LAG_COMPENSATION_MAX_RECORDS];
+	Vector					m_vecMaxs[LAG_COMPENSATION_MAX_RECORDS];
+	LagAnimationRecord		m_Animation[LAG_COMPENSATION_MAX_RECORDS];
+
+	int						m_nFirst;
+	int						m_nCount;
+	int						m_nAdded;
+
+	// Sequence number of the newest record a backtrack can't reach, because the
+	// player was dead or had teleported from there to the next record
+	int						m_nLastBreak;
+};
+
+//-----------------------------------------------------------------------------
+// Purpose: Where a player will be moved back to, worked out by FindTarget
+//-----------------------------------------------------------------------------
+struct LagTarget
+{
+	int						m_iRecord;		// Slot of the record at or before the target time
+	int						m_iPrevRecord;	// Slot of the next newer record, -1 if there isn't one
+	float					m_flFrac;		// Between m_iRecord and m_iPrevRecord
+	Vector					m_vecOrigin;
+	QAngle					m_vecAngles;
+	Vector					m_vecMins;
+	Vector					m_vecMaxs;
+};
+
 //-----------------------------------------------------------------------------
 // Purpose: 
 //-----------------------------------------------------------------------------
@@ -172,6 +295,8 @@ class CLagCompensationManager : public CAutoGameSystemPerFrame, public ILagCompe
 public:
 	CLagCompensationManager( char const *name ) : CAutoGameSystemPerFrame( name )
 	{
+		m_nConsidered = 0;
+		m_nRestored = 0;
 	}
 
 	// IServerSystem stuff
@@ -195,16 +320,18 @@ public:
 	void			FinishLagCompensation( CBasePlayer *player );
 
 private:
+	bool			FindTarget( CBasePlayer *pPlayer, float flTargetTime, LagTarget *pTarget );
 	void			BacktrackPlayer( CBasePlayer *player, float flTargetTime );
+	void			BacktrackPlayerToTarget( CBasePlayer *pPlayer, const LagTarget &target, float flTargetTime );
 
 	void ClearHistory()
 	{
 		for ( int i=0; i<MAX_PLAYERS; i++ )
-			m_PlayerTrack[i].Purge();
+			m_PlayerTrack[i].Clear();
 	}
 
 	// keep a list of lag records for each player
-	CUtlFixedLinkedList< LagRecord >	m_PlayerTrack[ MAX_PLAYERS ];
+	CLagTrack				m_PlayerTrack[ MAX_PLAYERS ];
 
 	// Scratchpad for determining what needs to be restored
 	CBitVec<MAX_PLAYERS>	m_RestorePlayer;
@@ -214,6 +341,11 @@ private:
 	LagRecord				m_ChangeData[ MAX_PLAYERS ];	// player data where we moved him back
 
 	CBasePlayer				*m_pCurrentPlayer;	// The player we are doing lag compensation for
+	float					m_flTargetTime;
+
+	// How many players we looked at and how many actually had to be moved, this frame
+	int						m_nConsidered;
+	int						m_nRestored;
 };
 
 static CLagCompensationManager g_LagCompensationManager( "CLagCompensationManager" );
@@ -225,6 +357,13 @@ ILagCompensationManager *lagcompensation = &g_LagCompensationManager;
 //-----------------------------------------------------------------------------
 void CLagCompensationManager::FrameUpdatePostEntityThink()
 {
+	if ( m_nConsidered && sv_unlag_stats.GetBool() )
+	{
+		engine->Con_NPrintf( 0, "Lag compensation: %d players considered, %d restored", m_nConsidered, m_nRestored );
+	}
+	m_nConsidered = 0;
+	m_nRestored = 0;
+
 	if ( (gpGlobals->maxClients <= 1) || !sv_unlag.GetBool() )
 	{
 		ClearHistory();
@@ -241,70 +380,70 @@ void CLagCompensationManager::FrameUpdatePostEntityThink()
 	{
 		CBasePlayer *pPlayer = UTIL_PlayerByIndex( i );
 
-		CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[i-1];
+		CLagTrack *track = &m_PlayerTrack[i-1];
 
 		if ( !pPlayer )
 		{
-			track->RemoveAll();
+			track->Clear();
 			continue;
 		}
 
-		Assert( track->Count() < 1000 ); // insanity check
-
 		// remove tail records that are too old
-		int tailIndex = track->Tail();
-		while ( track->IsValidIndex( tailIndex ) )
+		while ( track->Count() > 0 )
 		{
-			LagRecord &tail = track->Element( tailIndex );
-
 			// if tail is within limits, stop
-			if ( tail.m_flSimulationTime >= flDeadtime )
+			if ( track->m_flSimulationTime[ track->Slot( 0 ) ] >= flDeadtime )
 				break;
 			
-			// remove tail, get new tail
-			track->Remove( tailIndex );
-			tailIndex = track->Tail();
+			track->RemoveOldest();
 		}
 
 		// check if head has same simulation time
+		int iPrev = -1;
 		if ( track->Count() > 0 )
 		{
-			LagRecord &head = track->Element( track->Head() );
+			iPrev = track->NewestSlot();
 
 			// check if player changed simulation time since last time updated
-			if ( head.m_flSimulationTime >= pPlayer->GetSimulationTime() )
+			if ( track->m_flSimulationTime[iPrev] >= pPlayer->GetSimulationTime() )
 				continue; // don't add new entry for same or older time
 		}
 
 		// add new record to player track
-		LagRecord &record = track->Element( track->AddToHead() );
+		int iRecord = track->AddNewest();
+
+		track->m_flSimulationTime[iRecord]	= pPlayer->GetSimulationTime();
+		track->m_vecAngles[iRecord]			= pPlayer->GetLocalAngles();
+		track->m_vecOrigin[iRecord]			= pPlayer->GetLocalOrigin();
+		track->m_vecMaxs[iRecord]			= pPlayer->WorldAlignMaxs();
+		track->m_vecMins[iRecord]			= pPlayer->WorldAlignMins();
 
-		record.m_fFlags = 0;
-		if ( pPlayer->IsAlive() )
+		// Remember where a backtrack has to stop
+		int nSequence = track->Sequence( track->Count() - 1 );
+		if ( !pPlayer->IsAlive() )
 		{
-			record.m_fFlags |= LC_ALIVE;
+			track->m_nLastBreak = nSequence;
+		}
+		else if ( ( iPrev != -1 ) && ( track->m_vecOrigin[iRecord] - track->m_vecOrigin[iPrev] ).LengthSqr() > LAG_COMPENSATION_TELEPORTED_DISTANCE_SQR )
+		{
+			track->m_nLastBreak = max( track->m_nLastBreak, nSequence - 1 );
 		}
 
-		record.m_flSimulationTime	= pPlayer->GetSimulationTime();
-		record.m_vecAngles			= pPlayer->GetLocalAngles();
-		record.m_vecOrigin			= pPlayer->GetLocalOrigin();
-		record.m_vecMaxs			= pPlayer->WorldAlignMaxs();
-		record.m_vecMins			= pPlayer->WorldAlignMins();
-
+		LagAnimationRecord &animation = track->m_Animation[iRecord];
 		int layerCount = pPlayer->GetNumAnimOverlays();
 		for( int layerIndex = 0; layerIndex < layerCount; ++layerIndex )
 		{
 			CAnimationLayer *currentLayer = pPlayer->GetAnimOverlay(layerIndex);
 			if( currentLayer )
 			{
-				record.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
-				record.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
-				record.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
-				record.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
+				animation.m_layerRecords[layerIndex].m_cycle = currentLayer->m_flCycle;
+				animation.m_layerRecords[layerIndex].m_order = currentLayer->m_nOrder;
+				animation.m_layerRecords[layerIndex].m_sequence = currentLayer->m_nSequence;
+				animation.m_layerRecords[layerIndex].m_weight = currentLayer->m_flWeight;
 			}
 		}
-		record.m_masterSequence = pPlayer->GetSequence();
-		record.m_masterCycle = pPlayer->GetCycle();
+		animation.m_masterSequence = pPlayer->GetSequence();
+		animation.m_masterCycle = pPlayer->GetCycle();
 	}
 }
 
@@ -327,8 +466,6 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 
 	// NOTE: Put this here so that it won't show up in single player mode.
 	VPROF_BUDGET( "StartLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING );
-	Q_memset( m_RestoreData, 0, sizeof( m_RestoreData ) );
-	Q_memset( m_ChangeData, 0, sizeof( m_ChangeData ) );
 
 	// Get true latency
 
@@ -364,6 +501,8 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		// DevMsg("StartLagCompensation: delta too big (%.3f)\n", deltaTime );
 		targettick = gpGlobals->tickcount - TIME_TO_TICKS( correct );
 	}
+
+	m_flTargetTime = TICKS_TO_TIME( targettick );
 	
 	// Iterate all active players
 	const CBitVec<MAX_EDICTS> *pEntityTransmitBits = engine->GetEntityTransmitBitsForClient( player->entindex() - 1 );
@@ -386,108 +525,106 @@ void CLagCompensationManager::StartLagCompensation( CBasePlayer *player, CUserCm
 		if ( !player->WantsLagCompensationOnEntity( pPlayer, cmd, pEntityTransmitBits ) )
 			continue;
 
+		++m_nConsidered;
+
 		// Move other player back in time
-		BacktrackPlayer( pPlayer, TICKS_TO_TIME( targettick ) );
+		BacktrackPlayer( pPlayer, m_flTargetTime );
 	}
 }
 
-void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+//-----------------------------------------------------------------------------
+// Purpose: Works out where to move a player back to, returns false if there's
+// no usable history
+//-----------------------------------------------------------------------------
+bool CLagCompensationManager::FindTarget( CBasePlayer *pPlayer, float flTargetTime, LagTarget *pTarget )
 {
-	Vector org, mins, maxs;
-	QAngle ang;
-
-	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
 	int pl_index = pPlayer->entindex() - 1;
 
 	// get track history of this player
-	CUtlFixedLinkedList< LagRecord > *track = &m_PlayerTrack[ pl_index ];
+	const CLagTrack *track = &m_PlayerTrack[ pl_index ];
 
 	// check if we have at leat one entry
 	if ( track->Count() <= 0 )
-		return;
+		return false;
 
-	int curr = track->Head();
+	int nRecord = track->FindRecord( flTargetTime );
 
-	LagRecord *prevRecord = NULL;
-	LagRecord *record = NULL;
+	// Walking back from the newest record would have run into a death or a teleport
+	if ( track->m_nLastBreak >= track->Sequence( nRecord ) )
+		return false;
 
-	Vector prevOrg = pPlayer->GetLocalOrigin();
-	
-	// Walk context looking for any invalidating event
-	while( track->IsValidIndex(curr) )
+	int iNewest = track->NewestSlot();
+	Vector delta = track->m_vecOrigin[iNewest] - pPlayer->GetLocalOrigin();
+	if ( delta.LengthSqr() > LAG_COMPENSATION_TELEPORTED_DISTANCE_SQR )
 	{
-		// remember last record
-		prevRecord = record;
-
-		// get next record
-		record = &track->Element( curr );
-
-		if ( !(record->m_fFlags & LC_ALIVE) )
-		{
-			// player most be alive, lost track
-			return;
-		}
-
-		Vector delta = record->m_vecOrigin - prevOrg;
-		if ( delta.LengthSqr() > LAG_COMPENSATION_TELEPORTED_DISTANCE_SQR )
-		{
-			// lost track, too much difference
-			return; 
-		}
-
-		// did we find a context smaller than target time ?
-		if ( record->m_flSimulationTime <= flTargetTime )
-			break; // hurra, stop
-
-		prevOrg = record->m_vecOrigin;
-
-		// go one step back
-		curr = track->Next( curr );
+		// lost track, too much difference
+		return false; 
 	}
 
-	Assert( record );
-
-	if ( !record )
-	{
-		if ( sv_unlag_debug.GetBool() )
-		{
-			DevMsg( "No valid positions in history for BacktrackPlayer client ( %s )\n", pPlayer->GetPlayerName() );
-		}
-
-		return; // that should never happen
-	}
+	int iRecord = track->Slot( nRecord );
+	int iPrevRecord = ( nRecord + 1 < track->Count() ) ? track->Slot( nRecord + 1 ) : -1;
+	pTarget->m_iRecord = iRecord;
+	pTarget->m_iPrevRecord = iPrevRecord;
+	pTarget->m_flFrac = 0.0f;
 
-	float frac = 0.0f;
-	if ( prevRecord && 
-		 (record->m_flSimulationTime < flTargetTime) &&
-		 (record->m_flSimulationTime < prevRecord->m_flSimulationTime) )
+	if ( ( iPrevRecord != -1 ) && 
+		 (track->m_flSimulationTime[iRecord] < flTargetTime) &&
+		 (track->m_flSimulationTime[iRecord] < track->m_flSimulationTime[iPrevRecord]) )
 	{
 		// we didn't find the exact time but have a valid previous record
 		// so interpolate between these two records;
 
-		Assert( prevRecord->m_flSimulationTime > record->m_flSimulationTime );
-		Assert( flTargetTime < prevRecord->m_flSimulationTime );
+		Assert( track->m_flSimulationTime[iPrevRecord] > track->m_flSimulationTime[iRecord] );
+		Assert( flTargetTime < track->m_flSimulationTime[iPrevRecord] );
 
 		// calc fraction between both records
-		frac = ( flTargetTime - record->m_flSimulationTime ) / 
-			( prevRecord->m_flSimulationTime - record->m_flSimulationTime );
+		float frac = ( flTargetTime - track->m_flSimulationTime[iRecord] ) / 
+			( track->m_flSimulationTime[iPrevRecord] - track->m_flSimulationTime[iRecord] );
 
 		Assert( frac > 0 && frac < 1 ); // should never extrapolate
 
-		ang  = Lerp( frac, record->m_vecAngles, prevRecord->m_vecAngles );
-		org  = Lerp( frac, record->m_vecOrigin, prevRecord->m_vecOrigin  );
-		mins = Lerp( frac, record->m_vecMins, prevRecord->m_vecMins  );
-		maxs = Lerp( frac, record->m_vecMaxs, prevRecord->m_vecMaxs );
+		pTarget->m_flFrac = frac;
+		pTarget->m_vecAngles = Lerp( frac, track->m_vecAngles[iRecord], track->m_vecAngles[iPrevRecord] );
+		pTarget->m_vecOrigin = Lerp( frac, track->m_vecOrigin[iRecord], track->m_vecOrigin[iPrevRecord] );
+		pTarget->m_vecMins = Lerp( frac, track->m_vecMins[iRecord], track->m_vecMins[iPrevRecord] );
+		pTarget->m_vecMaxs = Lerp( frac, track->m_vecMaxs[iRecord], track->m_vecMaxs[iPrevRecord] );
 	}
 	else
 	{
 		// we found the exact record or no other record to interpolate with
 		// just copy these values since they are the best we have
-		ang  = record->m_vecAngles;
-		org  = record->m_vecOrigin;
-		mins = record->m_vecMins;
-		maxs = record->m_vecMaxs;
+		pTarget->m_vecAngles = track->m_vecAngles[iRecord];
+		pTarget->m_vecOrigin = track->m_vecOrigin[iRecord];
+		pTarget->m_vecMins = track->m_vecMins[iRecord];
+		pTarget->m_vecMaxs = track->m_vecMaxs[iRecord];
+	}
+
+	return true;
+}
+
+void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTargetTime )
+{
+	LagTarget target;
+	if ( FindTarget( pPlayer, flTargetTime, &target ) )
+	{
+		BacktrackPlayerToTarget( pPlayer, target, flTargetTime );
 	}
+}
+
+void CLagCompensationManager::BacktrackPlayerToTarget( CBasePlayer *pPlayer, const LagTarget &target, float flTargetTime )
+{
+	VPROF_BUDGET( "BacktrackPlayer", "CLagCompensationManager" );
+	int pl_index = pPlayer->entindex() - 1;
+
+	const CLagTrack *track = &m_PlayerTrack[ pl_index ];
+	const LagAnimationRecord *record = &track->m_Animation[ target.m_iRecord ];
+	const LagAnimationRecord *prevRecord = ( target.m_iPrevRecord != -1 ) ? &track->m_Animation[ target.m_iPrevRecord ] : NULL;
+	float frac = target.m_flFrac;
+
+	Vector org = target.m_vecOrigin;
+	QAngle ang = target.m_vecAngles;
+	Vector mins = target.m_vecMins;
+	Vector maxs = target.m_vecMaxs;
 
 	// See if this is still a valid position for us to teleport to
 	if ( sv_unlag_fixstuck.GetBool() )
@@ -507,7 +644,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			{
 				// If we haven't backtracked this player, do it now
 				// this deliberately ignores WantsLagCompensationOnEntity.
-				if ( !m_RestorePlayer.Get( pHitPlayer->entindex() - 1 ) )
+				int hit_index = pHitPlayer->entindex() - 1;
+				if ( !m_RestorePlayer.Get( hit_index ) )
 				{
 					// prevent recursion - save a copy of m_RestorePlayer,
 					// pretend that this player is off-limits
@@ -552,6 +690,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	int flags = 0;
 	LagRecord *restore = &m_RestoreData[ pl_index ];
 	LagRecord *change  = &m_ChangeData[ pl_index ];
+	Q_memset( restore, 0, sizeof( *restore ) );
+	Q_memset( change, 0, sizeof( *change ) );
 
 	QAngle angdiff = pPlayer->GetLocalAngles() - ang;
 	Vector orgdiff = pPlayer->GetLocalOrigin() - org;
@@ -645,8 +785,8 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 			bool interpolated = false;
 			if( (frac > 0.0f)  &&  interpolationAllowed )
 			{
-				LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
-				LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
+				const LayerRecord &recordsLayerRecord = record->m_layerRecords[layerIndex];
+				const LayerRecord &prevRecordsLayerRecord = prevRecord->m_layerRecords[layerIndex];
 				if( (recordsLayerRecord.m_order == prevRecordsLayerRecord.m_order)
 					&& (recordsLayerRecord.m_sequence == prevRecordsLayerRecord.m_sequence)
 					)
@@ -695,6 +835,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 	m_bNeedToRestore = true;  // we changed at least one player
 	restore->m_fFlags = flags; // we need to restore these flags
 	change->m_fFlags = flags; // we have changed these flags
+	++m_nRestored;
 
 	if( sv_showlagcompensation.GetInt() == 1 )
 	{
@@ -706,6 +847,7 @@ void CLagCompensationManager::BacktrackPlayer( CBasePlayer *pPlayer, float flTar
 void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 {
 	VPROF_BUDGET_FLAGS( "FinishLagCompensation", VPROF_BUDGETGROUP_OTHER_NETWORKING, BUDGETFLAG_CLIENT|BUDGETFLAG_SERVER );
+
 	if ( !m_bNeedToRestore )
 		return; // no player was changed at all
 
@@ -797,4 +939,3 @@ void CLagCompensationManager::FinishLagCompensation( CBasePlayer *player )
 	}
 }
 
-
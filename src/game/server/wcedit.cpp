@@ -22,6 +22,7 @@
 #include "ai_node.h"
 #include "ai_dynamiclink.h"
 #include "ai_networkmanager.h"
+#include "ai_pathfinder.h"
 #include "ndebugoverlay.h"
 #include "editor_sendcommand.h"
 #include "movevars_shared.h"
@@ -400,6 +401,7 @@ void NWCEdit::CreateAILink( CBasePlayer* pPlayer )
 		{
 			// Don't actually destroy the dynamic link while editing.  Just mark the link
 			pAILink->m_LinkInfo &= ~bits_LINK_OFF;
+			CAI_Pathfinder::InvalidateRouteCache();
 
 			CAI_DynamicLink* pDynamicLink = CAI_DynamicLink::GetDynamicLink(pAILink->m_iSrcID, pAILink->m_iDestID);
 			UTIL_Remove(pDynamicLink);
@@ -442,6 +444,7 @@ void NWCEdit::DestroyAILink( CBasePlayer *pPlayer )
 			pNewLink->m_nDestID			= pAILink->m_iDestID;
 			pNewLink->m_nLinkState		= LINK_OFF;
 			pAILink->m_LinkInfo |= bits_LINK_OFF;
+			CAI_Pathfinder::InvalidateRouteCache();
 		}
 	}
 }
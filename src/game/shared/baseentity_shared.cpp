@@ -418,6 +418,7 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 	if ( FStrEq( szKeyName, "targetname" ) )
 	{
 		m_iName = AllocPooledString( szValue );
+		gEntList.UpdateFindIndex( this );
 		return true;
 	}
 
@@ -427,7 +428,11 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 		for ( datamap_t *dmap = GetDataDescMap(); dmap != NULL; dmap = dmap->baseMap )
 		{
 			if ( ::ParseKeyvalue(this, dmap->dataDesc, dmap->dataNumFields, szKeyName, szValue) )
+			{
+				// "classname" and "model" are datadesc keys
+				gEntList.UpdateFindIndex( this );
 				return true;
+			}
 		}
 	}
 	else
@@ -458,6 +463,7 @@ bool CBaseEntity::KeyValue( const char *szKeyName, const char *szValue )
 				if ( printKeyHits )
 					Msg( "(%s) key: %-16s value: %s\n", debugName, szKeyName, szValue );
 				
+				gEntList.UpdateFindIndex( this );
 				return true;
 			}
 		}